@@ -6,24 +6,69 @@
 /*
  * Internal backend interface.
  *
- * These functions are per-handle dispatchers (backend.c): a handheld whose
- * device string starts with "emu:" is a running emiu2 emulator instance,
- * reached over a local socket (backend-emu.c, compiled on every platform);
- * anything else goes to the platform backend, of which exactly one is
- * compiled in, selected at configure time (see MIUCHIZ_USE_LIBUSB in
- * libmiuchiz-usb.h and CMakeLists.txt):
+ * These functions are per-handle dispatchers (backend.c). Each handheld is
+ * reached through a transport, a struct MiuchizBackend, chosen once by the
+ * prefix of its device string and kept in handheld->backend:
  *
- *   - backend-libusb.c   libusb transport (required on macOS, optional on Linux)
- *   - backend-linux.c    native /dev/sd* SCSI block device
- *   - backend-windows.c  Win32 \\.\X: volume handle
+ *   - "emu:"  a running emiu2 emulator instance, reached over a local socket
+ *             (backend-emu.c, compiled on every platform)
+ *   - "img:"  a flash image file served from memory (backend-img.c, likewise
+ *             always compiled)
+ *   - anything else goes to the platform backend, of which exactly one is
+ *     compiled in, selected at configure time (see MIUCHIZ_USE_LIBUSB in
+ *     libmiuchiz-usb.h and CMakeLists.txt):
+ *       - backend-libusb.c   libusb transport (required on macOS, optional on Linux)
+ *       - backend-linux.c    native /dev/sd* SCSI block device
+ *       - backend-windows.c  Win32 \\.\X: volume handle
  *
- * The platform-independent core in libmiuchiz-usb.c talks to a device
- * exclusively through these functions, so it contains no per-OS #ifdefs.
- * miuchiz_backend_enumerate returns real and emulated handhelds together.
+ * Further transports (test doubles, decorators) are added at runtime with
+ * miuchiz_backend_register. The platform-independent core in
+ * libmiuchiz-usb.c talks to a device exclusively through these functions,
+ * so it contains no per-OS #ifdefs. miuchiz_backend_enumerate returns real
+ * and emulated handhelds together.
  */
 
+/*
+ * A transport. Each operation behaves as the miuchiz_backend_* function of
+ * the same name; the optional ones may be NULL. A transport keeps whatever
+ * per-handle state it needs in handheld->transport.
+ */
+struct MiuchizBackend {
+    const char* name;
+    const char* prefix; /* device strings this transport serves; NULL for the platform */
+    void (*open)(struct Handheld* handheld);
+    void (*close)(struct Handheld* handheld);
+    ssize_t (*read)(struct Handheld* handheld, void* buf, size_t n);
+    ssize_t (*write)(struct Handheld* handheld, const void* buf, size_t n);
+    off_t (*seek)(struct Handheld* handheld, off_t offset);
+    /* Optional: without it, devices are identified by their contents. */
+    size_t (*identity)(struct Handheld* handheld, void* buf, size_t n);
+    /* Optional: without it, the transport keeps no counters. */
+    int (*transport_stats)(struct Handheld* handheld, struct MiuchizTransportStats* stats);
+    /* Optional: without it, the transport never reattaches. */
+    unsigned int (*generation)(struct Handheld* handheld);
+    /* Optional: without it, the transport's devices exist only when named. */
+    int (*enumerate)(struct Handheld*** handhelds);
+};
+
+/**
+ * Adds a transport for device strings starting with backend->prefix, ahead
+ * of any registered before it (so a later registration can stand in for a
+ * built-in one). Register before opening the handhelds it should serve.
+ * @param backend The transport; must outlive every handle it serves.
+ * @return 0 on success, -1 when the registry is full or prefix is NULL.
+ */
+int miuchiz_backend_register(const struct MiuchizBackend* backend);
+
 /**
- * Opens handheld->device, storing the opened object in handheld->fd.
+ * The transport that serves a device string.
+ * @return The registered transport for its prefix, else the platform's.
+ */
+const struct MiuchizBackend* miuchiz_backend_for(const char* device);
+
+/**
+ * Chooses handheld->backend and opens handheld->device through it, storing
+ * the opened object in handheld->fd (platform) or handheld->transport.
  * @return handheld->fd. The fd is left in a "closed" state on failure.
  */
 fp_t miuchiz_backend_open(struct Handheld* handheld);
@@ -51,6 +96,34 @@ ssize_t miuchiz_backend_write(struct Handheld* handheld, const void* buf, size_t
  */
 off_t miuchiz_backend_seek(struct Handheld* handheld, off_t offset);
 
+/**
+ * Copies a stable, transport-provided identity for the open device (e.g. an
+ * emulator instance's hello identity) into buf, truncated to n bytes.
+ * @return The identity's full length, or 0 when the transport has none and
+ *         the device must be identified by its contents instead.
+ */
+size_t miuchiz_backend_identity(struct Handheld* handheld, void* buf, size_t n);
+
+/**
+ * Copies the transport's traffic counters for the open device into stats.
+ * @return 0 on success, -1 when the transport keeps none.
+ */
+int miuchiz_backend_transport_stats(struct Handheld* handheld, struct MiuchizTransportStats* stats);
+
+/**
+ * How many times the transport has transparently replaced the device's
+ * connection (an emulator reattached after a detach or restart). A change
+ * across a multi-command sequence means the device started over partway.
+ * @return The count; always 0 for transports that never reattach.
+ */
+unsigned int miuchiz_backend_generation(struct Handheld* handheld);
+
+/**
+ * Whether a device string names a handheld that discovery never finds and
+ * that exists only by being named (a flash image, "img:...").
+ */
+int miuchiz_backend_is_named_only(const char* device);
+
 /**
  * Discovers every connected handheld candidate on the system.
  * @param handhelds Receives a freshly allocated, NULL-terminated array.
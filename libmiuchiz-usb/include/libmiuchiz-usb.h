@@ -66,6 +66,9 @@
 #define MIUCHIZ_SECTOR_DATA_WRITE (0x33)
 #define MIUCHIZ_PAGE_SIZE (0x1000)
 #define MIUCHIZ_PAGE_COUNT (0x200)
+#define MIUCHIZ_SAVE_PAGE (0x1FF)   /* holds firmware version, character and creditz */
+#define MIUCHIZ_OTP_SIZE (0x4000)   /* sector 0 exposes the OTP, rotated, at this size */
+#define MIUCHIZ_FINGERPRINT_LENGTH (16) /* hex digits, excluding the NUL */
 
 /* Error codes returned by the sector/page functions below. On failure they
  * return one of these (all negative); on success they return a non-negative
@@ -78,14 +81,44 @@
                                       * the macOS removable-volume privacy gate). Distinct
                                       * from "no device present", which is not an error. */
 
+struct MiuchizBackend;
+
 struct Handheld {
     char* device;
     fp_t fd;
-    /* Emulator transport state (owned by the library): non-NULL only while
-     * an "emu:" handheld - a running emiu2 emulator instance reached over a
-     * local socket - is open. Real-hardware handhelds keep their state in
-     * fd. */
-    void* emu;
+    /* The transport the device string selected (see backend.h) and its
+     * per-handle state, both owned by the library: the state of an "emu:"
+     * handheld - a running emiu2 emulator instance reached over a local
+     * socket - or an "img:" one - a flash dump served from memory. Real
+     * hardware keeps its state in fd. */
+    const struct MiuchizBackend* backend;
+    void* transport;
+    /* Cached miuchiz_handheld_fingerprint result; empty until first asked. */
+    char fingerprint[MIUCHIZ_FINGERPRINT_LENGTH + 1];
+};
+
+/* What the library remembers about a physical handheld between sessions,
+ * keyed by its fingerprint (see miuchiz_handheld_identity). */
+struct HandheldIdentity {
+    char fingerprint[MIUCHIZ_FINGERPRINT_LENGTH + 1];
+    uint16_t firmware_version; /* major version word from the save page */
+    uint8_t character;         /* unit id from the save page */
+    uint64_t updated;          /* Unix time the record last changed */
+    int has_save_page;         /* whether save_page holds a copy */
+    unsigned char save_page[MIUCHIZ_PAGE_SIZE]; /* last-known MIUCHIZ_SAVE_PAGE */
+};
+
+/* Traffic counters a handheld's transport keeps while it is open (see
+ * miuchiz_handheld_transport_stats). */
+struct MiuchizTransportStats {
+    uint64_t transactions;   /* USB transactions issued */
+    uint64_t send_calls;     /* send syscalls */
+    uint64_t recv_calls;     /* receive syscalls */
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t naks;           /* "not ready, ask again" answers from the device */
+    uint64_t nak_wait_us;    /* time from a first NAK until the device answered */
+    uint64_t reattaches;     /* lost connections transparently replaced */
 };
 
 /** 
@@ -125,6 +158,17 @@ void miuchiz_handheld_close(struct Handheld* handheld);
  */
 int miuchiz_handheld_create_all(struct Handheld*** handhelds);
 
+/** 
+ *Opens the handhelds a device option could refer to.
+ *@param handhelds A Handheld***, that is, a pointer to which an array of Handheld pointers will be placed.
+ *@param device The device, fingerprint or NULL a user asked for.
+ *@return As miuchiz_handheld_create_all.
+ *@note When device names a flash image ("img:path"), which no search finds,
+ *      the array holds just that image, provided it opens as a handheld.
+ *      Otherwise this is miuchiz_handheld_create_all.
+ */
+int miuchiz_handheld_create_all_for(struct Handheld*** handhelds, const char* device);
+
 /** 
  *Closes and frees an array of handhelds from miuchiz_handheld_create_all.
  *@param handhelds The Handheld** filled by miuchiz_handheld_create_all.
@@ -195,6 +239,126 @@ int miuchiz_handheld_read_page(struct Handheld* handheld, int page, void* buf, s
  */
 int miuchiz_handheld_write_page(struct Handheld* handheld, int page, const void* buf, size_t nbuf);
 
+/**
+ *Computes a fingerprint that identifies the physical handheld across replugs,
+ *unlike its device string. Emulators are identified by their instance
+ *identity; real handhelds by a hash of the OTP exposed through sector 0.
+ *The result is cached on the handle, so only the first call touches the device.
+ *@param handheld A Handheld* to identify.
+ *@param buf Receives MIUCHIZ_FINGERPRINT_LENGTH lowercase hex digits and a NUL.
+ *@param nbuf The size of buf.
+ *@return 0 on success.
+ *        MIUCHIZ_ERROR_TOO_SMALL if buf cannot hold the fingerprint.
+ *        MIUCHIZ_ERROR_IO if the OTP could not be read.
+ */
+int miuchiz_handheld_fingerprint(struct Handheld* handheld, char* buf, size_t nbuf);
+
+/**
+ *Checks whether a -d style device specification names a handheld: either its
+ *device string or its fingerprint.
+ *@param handheld A Handheld* to test.
+ *@param spec A device string or a fingerprint.
+ *@return 1 if spec names handheld, 0 otherwise.
+ */
+int miuchiz_handheld_matches(struct Handheld* handheld, const char* spec);
+
+/**
+ *Gets the cached identity record of a handheld, creating or refreshing it from
+ *the save page when needed. Records persist in the library's cache directory.
+ *@param handheld A Handheld* to identify.
+ *@param identity Receives the record.
+ *@param refresh Non-zero to re-read the save page even if a record is cached.
+ *               The record is only rewritten if the save page changed.
+ *@return 0 on success, or MIUCHIZ_ERROR_IO if the device could not be read.
+ *@note Failing to persist the record is not an error; it is logged.
+ */
+int miuchiz_handheld_identity(struct Handheld* handheld, struct HandheldIdentity* identity, int refresh);
+
+/**
+ *Loads a cached identity record without touching any device.
+ *@param fingerprint The fingerprint of the handheld.
+ *@param identity Receives the record.
+ *@return 0 on success, -1 if no valid record is cached.
+ */
+int miuchiz_identity_load(const char* fingerprint, struct HandheldIdentity* identity);
+
+/**
+ *Persists an identity record, replacing any previous record for its fingerprint.
+ *@param identity The record to store.
+ *@return 0 on success, -1 on failure.
+ */
+int miuchiz_identity_store(const struct HandheldIdentity* identity);
+
+/* What the library last knew a physical handheld's flash to hold, as the
+ * SHA-256 of each page last written to it or read from it, keyed by its
+ * fingerprint (see miuchiz_flash_state_open). */
+struct FlashState;
+
+/**
+ *Opens the last-known flash state of a handheld, starting one with every page
+ *unknown if none is cached. States persist in the library's cache directory,
+ *and each page's record is updated in place on its own: a record torn by a
+ *crash reads back as unknown, never as a wrong hash.
+ *@param fingerprint The fingerprint of the handheld.
+ *@return The state, or NULL if it cannot be opened or created.
+ *@note Close with miuchiz_flash_state_close.
+ */
+struct FlashState* miuchiz_flash_state_open(const char* fingerprint);
+
+/**
+ *Gets what a page was last known to hold.
+ *@param state An open state.
+ *@param page The page (0x0000 ~ 0x01FF).
+ *@param hash Receives the SHA-256 of the page, if it is known.
+ *@return 1 if it is known, 0 if not.
+ */
+int miuchiz_flash_state_get(struct FlashState* state, int page, unsigned char* hash);
+
+/**
+ *Records what a page holds, or forgets it. A page about to be written is
+ *forgotten first, and the state flushed, so a write that never finishes
+ *leaves the page unknown.
+ *@param state An open state.
+ *@param page The page (0x0000 ~ 0x01FF).
+ *@param hash The SHA-256 of the page, or NULL to forget it.
+ *@return 0 on success, -1 on failure.
+ */
+int miuchiz_flash_state_set(struct FlashState* state, int page, const unsigned char* hash);
+
+/**
+ *Writes the records set since the last flush through to the disk, so they
+ *outlive the process and the machine going down. Nothing is written if
+ *nothing changed.
+ *@return 0 on success, -1 on failure.
+ */
+int miuchiz_flash_state_flush(struct FlashState* state);
+
+/**
+ *Flushes and closes a state. NULL is ignored.
+ */
+void miuchiz_flash_state_close(struct FlashState* state);
+
+/**
+ *Resolves an application's directory under the shared Miuchiz Reborn storage
+ *policy, the one the library keeps its own state by, and creates it.
+ *@param category "config", "data", "cache", "state" or "runtime".
+ *@param app The application's name, e.g. "miuchiz".
+ *@param buf Receives the path.
+ *@param nbuf The size of buf.
+ *@return 0 on success, -1 if there is no usable location or it cannot be created.
+ */
+int miuchiz_app_dir(const char* category, const char* app, char* buf, size_t nbuf);
+
+/**
+ *Gets the traffic counters of a handheld's transport since it was opened.
+ *Only the emulator transport keeps them; the block-device and libusb
+ *backends hand each transfer to the OS whole.
+ *@param handheld An open Handheld*.
+ *@param stats Receives the counters.
+ *@return 0 on success, -1 if the transport keeps no counters.
+ */
+int miuchiz_handheld_transport_stats(struct Handheld* handheld, struct MiuchizTransportStats* stats);
+
 /** 
  *Rounds n up to the nearest multiple of alignment.
  *@param n Number to be rounded.
@@ -224,6 +388,23 @@ long miuchiz_page_alignment(void);
  */
 void miuchiz_set_logging(int enabled);
 
+/**
+ *Injects faults into the traffic of every handheld opened or discovered from
+ *now on, to exercise and time the recovery paths. The spec is a
+ *comma-separated list of key=value pairs: "read", "write" and "seek" are the
+ *chances that an operation fails; "short" that a transfer comes up a sector
+ *short; "csw" that a transfer completes but reports failure; "stale" that a
+ *read is answered with the previous read's data under the wrong tag, and so
+ *also reports failure; "detach" that the device drops off
+ *for "detach_ms" milliseconds (default 200). "latency" adds microseconds to
+ *every operation and "seed" makes a run repeatable. Overrides MIUCHIZ_FAULTS,
+ *which takes the same spec.
+ *@param spec The faults to inject, e.g. "read=0.01,detach=0.001", or NULL to
+ *            stop injecting into handhelds opened later.
+ *@return 0 on success, -1 if the spec is malformed (the previous one stays).
+ */
+int miuchiz_set_faults(const char* spec);
+
 /**
  *Parses a 32-bit little-endian HCD-encoded integer from 4 bytes.
  *@param bytes Pointer to 4 bytes in little-endian order.
@@ -0,0 +1,29 @@
+#ifndef MIUCHIZ_LIBMIUCHIZ_SHA256_H
+#define MIUCHIZ_LIBMIUCHIZ_SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MIUCHIZ_SHA256_SIZE (32)
+
+/* Incremental SHA-256 (FIPS 180-4). Used wherever flash contents or device
+ * identity need a stable digest: fingerprints, page hashes, manifests. */
+struct Sha256 {
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t nblock;
+};
+
+void miuchiz_sha256_init(struct Sha256* ctx);
+void miuchiz_sha256_update(struct Sha256* ctx, const void* data, size_t n);
+void miuchiz_sha256_final(struct Sha256* ctx, unsigned char digest[MIUCHIZ_SHA256_SIZE]);
+
+/* One-shot convenience wrapper. */
+void miuchiz_sha256(const void* data, size_t n, unsigned char digest[MIUCHIZ_SHA256_SIZE]);
+
+/* Writes the first nbytes of a digest as lowercase hex plus a NUL into buf,
+ * which must hold at least 2 * nbytes + 1 characters. */
+void miuchiz_hex_encode(const unsigned char* bytes, size_t nbytes, char* buf);
+
+#endif
@@ -1,2 +1,6 @@
 /* Sleeps for at least the given number of milliseconds. */
-void miuchiz_sleep_ms(unsigned int ms);
\ No newline at end of file
+void miuchiz_sleep_ms(unsigned int ms);
+
+/* Sleeps for at least the given number of microseconds (rounded up to whole
+ * milliseconds on Windows). */
+void miuchiz_sleep_us(unsigned int us);
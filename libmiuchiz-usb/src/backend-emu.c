@@ -19,13 +19,35 @@
  *              on the bus (its USB block is off - never brought up, or torn
  *              down by an eject); it is a final answer, never retried.
  *
+ * That is protocol 3: one transaction per <=64-byte USB packet, as on the
+ * wire. Protocol 4 lifts the packet limit, and is negotiated rather than
+ * announced so that either side may still be a v3 peer: a hello with flags
+ * bit1 set offers it, and the host takes it up with a request to endpoint
+ * 0xFF (the transport itself) before any other:
+ *   upgrade  : Setup, data = version:u16le(4)  max_transfer:u32le
+ *   answer   : Data, version:u16le  max_transfer:u32le (the version now
+ *              spoken and the agreed limit); anything else leaves the
+ *              connection at 3.
+ * In protocol 4 a bulk transaction carries a whole transfer of up to
+ * max_transfer bytes. An OUT is answered Ack (all taken), Nak (none), or Data
+ * taken:u32le (the rest is to be sent again). An IN carries wanted:u32le and
+ * is answered with at most that many bytes of whole packets, ending early
+ * after a short packet or when the device has nothing more staged (Nak when
+ * it has nothing at all).
+ *
  * On top of those raw transactions this file implements the same USB Mass
  * Storage Bulk-Only Transport + SCSI the libusb backend implements on real
  * hardware, so everything above the backend seam behaves identically.
+ *
+ * A connection whose device detaches or whose stream drops (the cable was
+ * toggled, emiu2 was restarted) is reattached on the next command, to the
+ * same emulator wherever it now publishes its endpoint; see "Reattaching".
  */
 
 #include "libmiuchiz-usb.h"
 #include "backend-internal.h"
+#include "paths.h"
+#include "timer.h"
 #include "log.h"
 
 #include <stdio.h>
@@ -37,23 +59,62 @@
     #include <ws2tcpip.h>
     #include <windows.h>
     typedef SOCKET emu_sock_t;
+    typedef WSAPOLLFD emu_pollfd_t;
     #define EMU_INVALID_SOCKET INVALID_SOCKET
+    #define EMU_ERR_IN_PROGRESS WSAEWOULDBLOCK
+    #define EMU_ERR_WOULD_BLOCK WSAEWOULDBLOCK
+    #define EMU_ERR_REFUSED WSAECONNREFUSED
     #define emu_close_socket closesocket
+    #define emu_poll(fds, n, timeout_ms) WSAPoll((fds), (ULONG)(n), (timeout_ms))
+    static int emu_socket_error(void) {
+        return WSAGetLastError();
+    }
+    static int emu_set_blocking(emu_sock_t sock, int blocking) {
+        u_long nonblocking = blocking ? 0 : 1;
+        return ioctlsocket(sock, FIONBIO, &nonblocking) == 0 ? 0 : -1;
+    }
     static void emu_sleep_us(unsigned int usecs) {
         Sleep((usecs + 999) / 1000);
     }
 #else
     #include <sys/socket.h>
+    #include <sys/uio.h>
     #include <sys/un.h>
     #include <netinet/in.h>
     #include <netinet/tcp.h>
     #include <arpa/inet.h>
     #include <unistd.h>
     #include <errno.h>
+    #include <fcntl.h>
+    #include <poll.h>
     #include <dirent.h>
     typedef int emu_sock_t;
+    typedef struct pollfd emu_pollfd_t;
     #define EMU_INVALID_SOCKET (-1)
+    #define EMU_ERR_IN_PROGRESS EINPROGRESS
+    #define EMU_ERR_WOULD_BLOCK EAGAIN
+    #define EMU_ERR_REFUSED ECONNREFUSED
     #define emu_close_socket close
+    #define emu_poll(fds, n, timeout_ms) poll((fds), (nfds_t)(n), (timeout_ms))
+    /* A send on a connection the emulator dropped must fail, not raise
+     * SIGPIPE; where there is no per-send flag, emu_handheld_new sets
+     * SO_NOSIGPIPE instead. */
+    #if defined(MSG_NOSIGNAL)
+        #define EMU_SEND_FLAGS MSG_NOSIGNAL
+    #else
+        #define EMU_SEND_FLAGS 0
+    #endif
+    static int emu_socket_error(void) {
+        return errno == EWOULDBLOCK ? EAGAIN : errno;
+    }
+    static int emu_set_blocking(emu_sock_t sock, int blocking) {
+        int flags = fcntl(sock, F_GETFL, 0);
+        if (flags < 0) {
+            return -1;
+        }
+        flags = blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK);
+        return fcntl(sock, F_SETFL, flags) == 0 ? 0 : -1;
+    }
     static void emu_sleep_us(unsigned int usecs) {
         usleep(usecs);
     }
@@ -62,12 +123,18 @@
 #define EMU_DEVICE_PREFIX "emu:"
 
 #define EMU_HELLO_MAGIC "EMIU2USB"
-#define EMU_PROTOCOL_VERSION (3)
+#define EMU_PROTOCOL_VERSION (3) /* what every hello speaks */
+#define EMU_PROTOCOL_AGGREGATE (4) /* negotiated; whole transfers per transaction */
+#define EMU_HELLO_HEADER_SIZE (15) /* through identity_len */
+#define EMU_IDENTITY_MAX (4096)
 
 /* Hello flags bit: the emulator's USB cable is plugged in. The emulator owns
  * that state (the player toggles it); when it is clear, nothing is on the bus
  * and the endpoint closes right after the hello. */
 #define EMU_HELLO_FLAG_PLUGGED (0x01)
+/* Hello flags bit: the emulator can switch the connection to
+ * EMU_PROTOCOL_AGGREGATE. */
+#define EMU_HELLO_FLAG_UPGRADE (0x02)
 
 /* Transaction tokens. */
 #define EMU_TOKEN_SETUP (0)
@@ -84,18 +151,53 @@
 
 /* Endpoint numbers on the emulated device (0 = control, 1 = bulk). */
 #define EMU_ENDPOINT_BULK (1)
-
-/* The device services one transaction per ~1 ms; a NAK means "not staged yet,
- * ask again". The budget bounds how long one logical transfer step may stall.
- * (A device that is off the bus answers Detached, not NAK, so dead devices
- * fail immediately rather than through this budget.) */
-#define EMU_NAK_RETRIES (2000)
-#define EMU_NAK_WAIT_US (500)
-
-/* Bulk packets on this device are at most 64 bytes; responses larger than a
- * sector mean the peer is not speaking our protocol. */
+/* Not a device endpoint: requests to it address the emulator's transport. */
+#define EMU_ENDPOINT_TRANSPORT (0xFF)
+
+/* A NAK means "not staged yet, ask again"; the emulated firmware gets to it
+ * within about a millisecond. Rather than a fixed sleep per NAK, a stretch
+ * of NAKs is waited out adaptively: the first EMU_NAK_SPIN retries go out
+ * at once (the round trip is the wait), then one sleep runs up to the
+ * NAK-to-ready time recently seen on the connection, and past that, sleeps
+ * grow exponentially from a fraction of it, EMU_NAK_WAIT_MAX_US at most per
+ * step. The budget bounds how long one stretch may last. (A device that is
+ * off the bus answers Detached, not NAK, so dead devices fail immediately
+ * rather than through this budget.) */
+#define EMU_NAK_SPIN (2)
+#define EMU_NAK_WAIT_MIN_US (50)
+#define EMU_NAK_WAIT_MAX_US (2000)
+#define EMU_NAK_READY_DEFAULT_US (500) /* until a stretch has been seen */
+#define EMU_NAK_BUDGET_US (1000000)
+
+/* Bulk packets on this device are at most 64 bytes; under protocol 3,
+ * responses larger than a sector mean the peer is not speaking our protocol.
+ * Under protocol 4 a transaction may move up to the negotiated transfer size,
+ * of which the host offers EMU_TRANSFER_MAX (a page read, sector data and
+ * CSW, is well under it). */
 #define EMU_BULK_MAX (64)
 #define EMU_MAX_RESPONSE (512)
+#define EMU_TRANSFER_MAX (32768)
+
+/* Requests kept in flight on the stream (see "Pipelined Bulk-Only Transport"
+ * below). MIUCHIZ_EMU_WINDOW overrides the default, down to 1 for plain
+ * stop-and-wait. */
+#define EMU_WINDOW_DEFAULT (16)
+#define EMU_WINDOW_MAX (32)
+
+/* Responses are parsed out of a per-connection receive buffer filled by
+ * large recv()s, so a burst of pipelined responses costs one syscall rather
+ * than two or three each; it holds at least one maximal response. Requests
+ * are queued and sent in one gathered send per burst (header and payload of
+ * every request, without copying). */
+#define EMU_RECV_BUFFER (2 * EMU_TRANSFER_MAX)
+#define EMU_SEND_CHUNKS (2 * EMU_WINDOW_MAX)
+#define EMU_REQUEST_HEADER_SIZE (6)
+
+/* How long a lost connection keeps being looked for before commands fail;
+ * MIUCHIZ_EMU_REATTACH_MS overrides it (0 disables reattaching). Discovery
+ * is rerun every EMU_REATTACH_POLL_MS meanwhile. */
+#define EMU_REATTACH_DEFAULT_MS (10000)
+#define EMU_REATTACH_POLL_MS (100)
 
 /* Socket receive/send timeout. Generous: a live emulator answers every
  * transaction within a few ms; only a stopped one runs into this. */
@@ -104,17 +206,40 @@
 #define CBW_SIZE (31)
 #define CSW_SIZE (13)
 
+struct EmuChunk {
+    const void* data;
+    size_t len;
+};
+
 struct EmuHandheld {
     emu_sock_t sock;
     uint32_t current_sector;
     uint32_t cbw_tag;
+    char* identity; /* from the hello; stable across reconnects */
+    size_t window;  /* pipeline depth; 1 = stop-and-wait */
+    int version;    /* protocol spoken on the connection */
+    size_t transfer_max; /* bytes one bulk transaction may move */
+    size_t max_response; /* largest Data payload accepted */
+    int lost;       /* detached or disconnected; reattach before the next command */
+    struct Utimer lost_timer; /* since the connection was lost */
+    unsigned int generation; /* reattachments so far */
+    uint32_t nak_ready_us; /* smoothed NAK-to-ready time of past stretches */
+
+    /* Requests queued for the next gathered send. Payload chunks point into
+     * the caller's buffers, which outlive the command that queued them. */
+    unsigned char headers[EMU_WINDOW_MAX][EMU_REQUEST_HEADER_SIZE];
+    size_t nheaders;
+    struct EmuChunk chunks[EMU_SEND_CHUNKS];
+    size_t nchunks;
+
+    /* Received bytes not yet parsed: rbuf[rpos..rlen). */
+    unsigned char rbuf[EMU_RECV_BUFFER];
+    size_t rpos;
+    size_t rlen;
+
+    struct MiuchizTransportStats stats;
 };
 
-int miuchiz_emu_is(const struct Handheld* handheld) {
-    return handheld->device != NULL
-        && strncmp(handheld->device, EMU_DEVICE_PREFIX, strlen(EMU_DEVICE_PREFIX)) == 0;
-}
-
 static void ensure_sockets_init(void) {
 #if defined(_WIN32)
     static int initialized = 0;
@@ -140,19 +265,6 @@ static void emu_set_timeouts(emu_sock_t sock) {
 #endif
 }
 
-static int emu_send_all(emu_sock_t sock, const void* buf, size_t n) {
-    const char* p = buf;
-    while (n > 0) {
-        ssize_t sent = send(sock, p, n, 0);
-        if (sent <= 0) {
-            return -1;
-        }
-        p += sent;
-        n -= sent;
-    }
-    return 0;
-}
-
 static int emu_recv_all(emu_sock_t sock, void* buf, size_t n) {
     char* p = buf;
     while (n > 0) {
@@ -166,256 +278,670 @@ static int emu_recv_all(emu_sock_t sock, void* buf, size_t n) {
     return 0;
 }
 
-/* Reads the endpoint's hello. Returns 0 when it identifies a compatible
- * emulator (setting *plugged from the cable flag), -1 otherwise. */
-static int emu_read_hello(emu_sock_t sock, int* plugged) {
-    unsigned char header[11];
-    if (emu_recv_all(sock, header, sizeof(header)) < 0) {
-        return -1;
+/* Parses a hello from the start of buf. Returns the hello's length once it
+ * is complete and identifies a compatible emulator (setting *flags from its
+ * EMU_HELLO_FLAG_* bits and, when `identity_out` is non-NULL, *identity_out
+ * to a malloc'd copy of the identity string), 0 while more bytes are needed,
+ * or -1 when it identifies something else. */
+static long emu_parse_hello(const unsigned char* buf, size_t len, unsigned char* flags, char** identity_out) {
+    if (len < EMU_HELLO_HEADER_SIZE) {
+        return 0;
     }
-    if (memcmp(header, EMU_HELLO_MAGIC, 8) != 0) {
+    if (memcmp(buf, EMU_HELLO_MAGIC, 8) != 0) {
         miuchiz_log("libmiuchiz: endpoint is not an emiu2 emulator (bad hello)\n");
         return -1;
     }
-    uint16_t version = miuchiz_le16_read(header + 8);
+    uint16_t version = miuchiz_le16_read(buf + 8);
     if (version != EMU_PROTOCOL_VERSION) {
         miuchiz_log("libmiuchiz: emulator endpoint protocol version %u not supported\n", version);
         return -1;
     }
-    if (plugged != NULL) {
-        *plugged = (header[10] & EMU_HELLO_FLAG_PLUGGED) != 0;
-    }
-    unsigned char lenbuf[4];
-    if (emu_recv_all(sock, lenbuf, sizeof(lenbuf)) < 0) {
+    uint32_t identity_len = miuchiz_le32_read(buf + 11);
+    if (identity_len > EMU_IDENTITY_MAX) {
         return -1;
     }
-    uint32_t identity_len = miuchiz_le32_read(lenbuf);
-    if (identity_len > 4096) {
-        return -1;
+    if (len < EMU_HELLO_HEADER_SIZE + identity_len) {
+        return 0;
     }
-    char identity[4097];
-    if (emu_recv_all(sock, identity, identity_len) < 0) {
-        return -1;
+
+    if (flags != NULL) {
+        *flags = buf[10];
     }
+    char identity[EMU_IDENTITY_MAX + 1];
+    memcpy(identity, buf + EMU_HELLO_HEADER_SIZE, identity_len);
     identity[identity_len] = '\0';
     miuchiz_log("libmiuchiz: emulator endpoint identity: \"%s\"\n", identity);
-    return 0;
+    if (identity_out != NULL) {
+        *identity_out = strdup(identity);
+    }
+    return (long)(EMU_HELLO_HEADER_SIZE + identity_len);
 }
 
-/* Connects to the endpoint behind a discovery file. Returns the connected
- * socket, or EMU_INVALID_SOCKET. `refused` (optional) is set to 1 when the
- * endpoint actively refused - the mark of a stale file. */
-static emu_sock_t emu_connect_path(const char* path, int* refused) {
-    if (refused != NULL) {
-        *refused = 0;
+/* Reads the endpoint's hello from a blocking socket. Returns 0 when it
+ * identifies a compatible emulator (see emu_parse_hello), -1 otherwise. */
+static int emu_read_hello(emu_sock_t sock, unsigned char* flags, char** identity_out) {
+    unsigned char hello[EMU_HELLO_HEADER_SIZE + EMU_IDENTITY_MAX];
+    if (emu_recv_all(sock, hello, EMU_HELLO_HEADER_SIZE) < 0) {
+        return -1;
     }
-    ensure_sockets_init();
+    long parsed = emu_parse_hello(hello, EMU_HELLO_HEADER_SIZE, flags, identity_out);
+    if (parsed == 0) {
+        uint32_t identity_len = miuchiz_le32_read(hello + 11);
+        if (emu_recv_all(sock, hello + EMU_HELLO_HEADER_SIZE, identity_len) < 0) {
+            return -1;
+        }
+        parsed = emu_parse_hello(hello, EMU_HELLO_HEADER_SIZE + identity_len, flags, identity_out);
+    }
+    return parsed > 0 ? 0 : -1;
+}
+
+/* Where the emulator behind an endpoint file listens. */
+struct EmuAddress {
+    struct sockaddr_storage addr;
+    socklen_t len;
+    int family;
+};
 
+/* Resolves an endpoint file (a Unix socket, or a "<pid>.port" file holding a
+ * loopback TCP port). Returns 0, or -1 if it is not a usable endpoint. */
+static int emu_endpoint_address(const char* path, struct EmuAddress* address) {
+    memset(address, 0, sizeof(*address));
     const char* ext = strrchr(path, '.');
     if (ext == NULL) {
-        return EMU_INVALID_SOCKET;
+        return -1;
     }
 
 #if !defined(_WIN32)
     if (strcmp(ext, ".sock") == 0) {
-        struct sockaddr_un addr;
-        if (strlen(path) >= sizeof(addr.sun_path)) {
-            return EMU_INVALID_SOCKET;
-        }
-        emu_sock_t sock = socket(AF_UNIX, SOCK_STREAM, 0);
-        if (sock == EMU_INVALID_SOCKET) {
-            return EMU_INVALID_SOCKET;
-        }
-        memset(&addr, 0, sizeof(addr));
-        addr.sun_family = AF_UNIX;
-        strcpy(addr.sun_path, path);
-        if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-            if (refused != NULL && errno == ECONNREFUSED) {
-                *refused = 1;
-            }
-            emu_close_socket(sock);
-            return EMU_INVALID_SOCKET;
+        struct sockaddr_un* addr = (struct sockaddr_un*)&address->addr;
+        if (strlen(path) >= sizeof(addr->sun_path)) {
+            return -1;
         }
-        emu_set_timeouts(sock);
-        return sock;
+        addr->sun_family = AF_UNIX;
+        strcpy(addr->sun_path, path);
+        address->len = sizeof(*addr);
+        address->family = AF_UNIX;
+        return 0;
     }
 #endif
 
     if (strcmp(ext, ".port") == 0) {
         FILE* f = fopen(path, "r");
         if (f == NULL) {
-            return EMU_INVALID_SOCKET;
+            return -1;
         }
         unsigned int port = 0;
         int parsed = fscanf(f, "%u", &port);
         fclose(f);
         if (parsed != 1 || port == 0 || port > 65535) {
-            return EMU_INVALID_SOCKET;
-        }
-
-        emu_sock_t sock = socket(AF_INET, SOCK_STREAM, 0);
-        if (sock == EMU_INVALID_SOCKET) {
-            return EMU_INVALID_SOCKET;
-        }
-        struct sockaddr_in addr;
-        memset(&addr, 0, sizeof(addr));
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons((unsigned short)port);
-        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-        if (connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-            if (refused != NULL) {
-                /* A dead port on loopback answers RST, i.e. refused. */
-                *refused = 1;
-            }
-            emu_close_socket(sock);
-            return EMU_INVALID_SOCKET;
+            return -1;
         }
+        struct sockaddr_in* addr = (struct sockaddr_in*)&address->addr;
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons((unsigned short)port);
+        addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address->len = sizeof(*addr);
+        address->family = AF_INET;
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Applies the options every connected emulator socket gets. */
+static void emu_configure_socket(emu_sock_t sock, int family) {
+    if (family == AF_INET) {
         int nodelay = 1;
         setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
-        emu_set_timeouts(sock);
-        return sock;
     }
+    emu_set_timeouts(sock);
+}
 
-    return EMU_INVALID_SOCKET;
+/* Connects to the endpoint behind a discovery file. Returns the connected
+ * socket, or EMU_INVALID_SOCKET. */
+static emu_sock_t emu_connect_path(const char* path) {
+    ensure_sockets_init();
+    struct EmuAddress address;
+    if (emu_endpoint_address(path, &address) < 0) {
+        return EMU_INVALID_SOCKET;
+    }
+    emu_sock_t sock = socket(address.family, SOCK_STREAM, 0);
+    if (sock == EMU_INVALID_SOCKET) {
+        return EMU_INVALID_SOCKET;
+    }
+    if (connect(sock, (struct sockaddr*)&address.addr, address.len) < 0) {
+        emu_close_socket(sock);
+        return EMU_INVALID_SOCKET;
+    }
+    emu_configure_socket(sock, address.family);
+    return sock;
 }
 
 /* ---------------------------------------------------------------------------
  * Raw transactions.
  * ------------------------------------------------------------------------ */
 
-/* Issues one transaction. For EMU_RESP_DATA, up to `nresp` bytes are stored in
- * `resp` and `*resp_len` receives the payload length. Returns the response
- * kind, or EMU_RESP_ERROR on a transport failure. */
-static int emu_transact(struct EmuHandheld* emu,
-                        unsigned char endpoint,
-                        unsigned char token,
-                        const void* data,
-                        size_t ndata,
-                        void* resp,
-                        size_t nresp,
-                        size_t* resp_len) {
-    unsigned char header[6];
+/* Queues one transaction request for the next emu_flush. At most
+ * EMU_WINDOW_MAX requests may be queued between flushes. */
+static void emu_queue_request(struct EmuHandheld* emu,
+                              unsigned char endpoint,
+                              unsigned char token,
+                              const void* data,
+                              size_t ndata) {
+    unsigned char* header = emu->headers[emu->nheaders++];
     header[0] = endpoint;
     header[1] = token;
     miuchiz_le32_write(header + 2, (uint32_t)ndata);
-    if (emu_send_all(emu->sock, header, sizeof(header)) < 0) {
-        return EMU_RESP_ERROR;
+    emu->chunks[emu->nchunks].data = header;
+    emu->chunks[emu->nchunks].len = EMU_REQUEST_HEADER_SIZE;
+    emu->nchunks++;
+    if (ndata > 0) {
+        emu->chunks[emu->nchunks].data = data;
+        emu->chunks[emu->nchunks].len = ndata;
+        emu->nchunks++;
     }
-    if (ndata > 0 && emu_send_all(emu->sock, data, ndata) < 0) {
-        return EMU_RESP_ERROR;
+    emu->stats.transactions++;
+}
+
+/* Sends every queued request with as few gathered sends as the socket
+ * allows (normally one). Returns 0, or -1 on a transport failure. */
+static int emu_flush(struct EmuHandheld* emu) {
+    size_t first = 0; /* first chunk not yet fully sent */
+    size_t skip = 0;  /* bytes of it already sent */
+    while (first < emu->nchunks) {
+        size_t n = emu->nchunks - first;
+    #if defined(_WIN32)
+        WSABUF bufs[EMU_SEND_CHUNKS];
+        for (size_t i = 0; i < n; i++) {
+            const struct EmuChunk* chunk = &emu->chunks[first + i];
+            size_t offset = i == 0 ? skip : 0;
+            bufs[i].buf = (char*)chunk->data + offset;
+            bufs[i].len = (ULONG)(chunk->len - offset);
+        }
+        DWORD sent_dword = 0;
+        int failed = WSASend(emu->sock, bufs, (DWORD)n, &sent_dword, 0, NULL, NULL) != 0;
+        ssize_t sent = failed ? -1 : (ssize_t)sent_dword;
+    #else
+        struct iovec iov[EMU_SEND_CHUNKS];
+        for (size_t i = 0; i < n; i++) {
+            const struct EmuChunk* chunk = &emu->chunks[first + i];
+            size_t offset = i == 0 ? skip : 0;
+            iov[i].iov_base = (char*)chunk->data + offset;
+            iov[i].iov_len = chunk->len - offset;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t sent = sendmsg(emu->sock, &msg, EMU_SEND_FLAGS);
+    #endif
+        emu->stats.send_calls++;
+        if (sent <= 0) {
+            emu->nheaders = 0;
+            emu->nchunks = 0;
+            return -1;
+        }
+        emu->stats.bytes_sent += (uint64_t)sent;
+
+        size_t left = (size_t)sent;
+        while (left > 0) {
+            size_t remaining = emu->chunks[first].len - skip;
+            if (left < remaining) {
+                skip += left;
+                break;
+            }
+            left -= remaining;
+            first++;
+            skip = 0;
+        }
+    }
+    emu->nheaders = 0;
+    emu->nchunks = 0;
+    return 0;
+}
+
+/* Makes `need` unparsed bytes available at emu->rbuf + emu->rpos, taking
+ * whatever else the socket already has along with them. Returns 0, or -1 on
+ * a transport failure. */
+static int emu_recv_fill(struct EmuHandheld* emu, size_t need) {
+    if (emu->rlen - emu->rpos >= need) {
+        return 0;
     }
+    if (emu->rpos > 0) {
+        memmove(emu->rbuf, emu->rbuf + emu->rpos, emu->rlen - emu->rpos);
+        emu->rlen -= emu->rpos;
+        emu->rpos = 0;
+    }
+    while (emu->rlen < need) {
+        ssize_t got = recv(emu->sock, (char*)emu->rbuf + emu->rlen,
+                           (int)(sizeof(emu->rbuf) - emu->rlen), 0);
+        emu->stats.recv_calls++;
+        if (got <= 0) {
+            return -1;
+        }
+        emu->stats.bytes_received += (uint64_t)got;
+        emu->rlen += (size_t)got;
+    }
+    return 0;
+}
+
+/* Whether a whole response is already buffered, i.e. emu_recv_response
+ * would not need to touch the socket. */
+static int emu_response_buffered(const struct EmuHandheld* emu) {
+    size_t avail = emu->rlen - emu->rpos;
+    if (avail < 1) {
+        return 0;
+    }
+    if (emu->rbuf[emu->rpos] != EMU_RESP_DATA) {
+        return 1;
+    }
+    return avail >= 5 && avail - 5 >= miuchiz_le32_read(emu->rbuf + emu->rpos + 1);
+}
 
-    unsigned char kind;
-    if (emu_recv_all(emu->sock, &kind, 1) < 0) {
+/* Receives the response to the oldest outstanding request. For
+ * EMU_RESP_DATA, `*data` and `*data_len` receive the payload, in place in the
+ * receive buffer: it is valid until the next receive. Returns the response
+ * kind, or EMU_RESP_ERROR on a transport failure. */
+static int emu_recv_response(struct EmuHandheld* emu, const unsigned char** data, size_t* data_len) {
+    if (emu_recv_fill(emu, 1) < 0) {
         return EMU_RESP_ERROR;
     }
+    unsigned char kind = emu->rbuf[emu->rpos];
     if (kind != EMU_RESP_DATA) {
+        emu->rpos++;
         return kind <= EMU_RESP_DETACHED ? kind : EMU_RESP_ERROR;
     }
 
-    unsigned char lenbuf[4];
-    if (emu_recv_all(emu->sock, lenbuf, sizeof(lenbuf)) < 0) {
+    if (emu_recv_fill(emu, 5) < 0) {
         return EMU_RESP_ERROR;
     }
-    uint32_t len = miuchiz_le32_read(lenbuf);
-    if (len > EMU_MAX_RESPONSE) {
+    uint32_t len = miuchiz_le32_read(emu->rbuf + emu->rpos + 1);
+    if (len > emu->max_response) {
         miuchiz_log("libmiuchiz: oversized emulator response (%u bytes)\n", len);
         return EMU_RESP_ERROR;
     }
-    unsigned char payload[EMU_MAX_RESPONSE];
-    if (emu_recv_all(emu->sock, payload, len) < 0) {
+    if (emu_recv_fill(emu, 5 + len) < 0) {
         return EMU_RESP_ERROR;
     }
-    size_t copy = len;
-    if (copy > nresp) {
-        copy = nresp;
-    }
-    if (resp != NULL) {
-        memcpy(resp, payload, copy);
-    }
-    if (resp_len != NULL) {
-        *resp_len = len;
-    }
+    *data = emu->rbuf + emu->rpos + 5;
+    *data_len = len;
+    emu->rpos += 5 + len;
     return EMU_RESP_DATA;
 }
 
-/* Like emu_transact, but retries while the device NAKs (the firmware hasn't
- * staged the buffer yet - real hosts poll exactly the same way). */
-static int emu_transact_retry(struct EmuHandheld* emu,
-                              unsigned char endpoint,
-                              unsigned char token,
-                              const void* data,
-                              size_t ndata,
-                              void* resp,
-                              size_t nresp,
-                              size_t* resp_len) {
-    for (int attempt = 0; attempt < EMU_NAK_RETRIES; attempt++) {
-        int kind = emu_transact(emu, endpoint, token, data, ndata, resp, nresp, resp_len);
-        if (kind != EMU_RESP_NAK) {
-            return kind;
-        }
-        emu_sleep_us(EMU_NAK_WAIT_US);
+/* Offers EMU_PROTOCOL_AGGREGATE to an emulator whose hello allowed it. Its
+ * answer goes to emu_take_upgrade before anything else is sent. Returns 0, or
+ * -1 on a transport failure. */
+static int emu_offer_upgrade(struct EmuHandheld* emu) {
+    unsigned char offer[6];
+    miuchiz_le16_write(offer, EMU_PROTOCOL_AGGREGATE);
+    miuchiz_le32_write(offer + 2, EMU_TRANSFER_MAX);
+    emu_queue_request(emu, EMU_ENDPOINT_TRANSPORT, EMU_TOKEN_SETUP, offer, sizeof(offer));
+    return emu_flush(emu);
+}
+
+/* Applies the answer to an upgrade offer. A refusal of any kind leaves the
+ * connection at protocol 3. Returns 0, or -1 when the answer agrees to terms
+ * that were not offered. */
+static int emu_take_upgrade(struct EmuHandheld* emu, int kind, const unsigned char* data, size_t len) {
+    if (kind != EMU_RESP_DATA || len < 6 || miuchiz_le16_read(data) != EMU_PROTOCOL_AGGREGATE) {
+        miuchiz_log("libmiuchiz: emulator stays at protocol %d\n", emu->version);
+        return kind == EMU_RESP_ERROR ? -1 : 0;
     }
-    miuchiz_log("libmiuchiz: emulator NAK retry budget exhausted\n");
-    return EMU_RESP_NAK;
+    uint32_t transfer_max = miuchiz_le32_read(data + 2) / EMU_BULK_MAX * EMU_BULK_MAX;
+    if (transfer_max < EMU_BULK_MAX || transfer_max > EMU_TRANSFER_MAX) {
+        miuchiz_log("libmiuchiz: emulator agreed to a %u-byte transfer limit\n", miuchiz_le32_read(data + 2));
+        return -1;
+    }
+    emu->version = EMU_PROTOCOL_AGGREGATE;
+    emu->transfer_max = transfer_max;
+    emu->max_response = transfer_max;
+    return 0;
 }
 
 /* ---------------------------------------------------------------------------
- * USB Mass Storage Bulk-Only Transport over the transaction seam. Mirrors the
- * libusb backend's scsi_bulk_read/scsi_bulk_write, with libusb bulk transfers
- * replaced by sequences of <=64-byte transactions.
+ * Pipelined Bulk-Only Transport.
+ *
+ * A SCSI command is a fixed sequence of bulk phases - CBW out, data in or
+ * out, CSW in - each a run of <=64-byte transactions. Mirrors the libusb
+ * backend's scsi_bulk_read/scsi_bulk_write, but rather than paying a socket
+ * round trip per transaction, up to emu->window requests are kept in flight;
+ * the emulator answers strictly in order, so responses are matched to
+ * requests by position.
+ *
+ * That is only safe while the device keeps up. An OUT packet NAKed after its
+ * successors were already sent could let them land out of order, so the
+ * first NAK or STALL drops the command to stop-and-wait: nothing more is
+ * issued until the stream drains, then sending resumes at the first byte the
+ * device has not taken. If a later packet had in fact been accepted, the data
+ * is already out of order: the transfer is still completed byte for byte, so
+ * the device stays in step for the next command, but the command fails (the
+ * page layer retries it) and the handle stays at stop-and-wait from then on.
+ * IN tokens are interchangeable ("the next packet, please"): a NAKed one
+ * yields nothing and is simply reissued, and never more are issued than the
+ * remaining IN phases can consume, so a token cannot read past the CSW.
+ *
+ * Under protocol 4 the same engine runs with transactions of up to
+ * emu->transfer_max bytes: an OUT carries as much of its phase as fits, and
+ * an IN token asks for as many packets as the IN phases still want, so a page
+ * read is the CBW and a single IN, answered with sector data and CSW
+ * together. An OUT the device took only part of is handled like a NAK past
+ * the bytes it took.
  * ------------------------------------------------------------------------ */
 
-static int emu_bulk_out(struct EmuHandheld* emu, const void* buf, size_t n) {
-    const unsigned char* p = buf;
-    while (n > 0) {
-        size_t chunk = n < EMU_BULK_MAX ? n : EMU_BULK_MAX;
-        int kind = emu_transact_retry(emu, EMU_ENDPOINT_BULK, EMU_TOKEN_OUT,
-                                      p, chunk, NULL, 0, NULL);
-        if (kind == EMU_RESP_DETACHED) {
-            miuchiz_log("libmiuchiz: bulk OUT failed: device detached (off the bus)\n");
-            return -1;
+struct EmuPhase {
+    int token;          /* EMU_TOKEN_OUT or EMU_TOKEN_IN */
+    unsigned char* buf; /* OUT: source; IN: destination */
+    size_t len;
+    size_t done;        /* bytes acknowledged (OUT) or received (IN) */
+    int ended;          /* IN: a short packet, or len bytes, arrived */
+};
+
+struct EmuInflight {
+    int token;
+    size_t phase;  /* OUT: the phase the data belongs to */
+    size_t offset; /* OUT: the data's offset within that phase */
+    size_t len;    /* OUT: bytes sent; IN: bytes asked for (whole packets) */
+    unsigned char wanted[4]; /* IN under protocol 4: the request payload */
+};
+
+/* Moves an OUT cursor to the next byte still to be sent, skipping finished
+ * OUT phases. */
+static void emu_out_settle(const struct EmuPhase* phases, size_t nphases, size_t* phase, size_t* offset) {
+    while (*phase < nphases && phases[*phase].token == EMU_TOKEN_OUT
+           && *offset >= phases[*phase].len) {
+        (*phase)++;
+        *offset = 0;
+    }
+}
+
+/* How many more IN packets the unfinished IN phases can take. */
+static size_t emu_in_packets_needed(const struct EmuPhase* phases, size_t nphases) {
+    size_t needed = 0;
+    for (size_t i = 0; i < nphases; i++) {
+        if (phases[i].token == EMU_TOKEN_IN && !phases[i].ended) {
+            needed += (phases[i].len - phases[i].done + EMU_BULK_MAX - 1) / EMU_BULK_MAX;
         }
-        if (kind != EMU_RESP_ACK) {
-            miuchiz_log("libmiuchiz: bulk OUT not accepted (kind %d)\n", kind);
-            return -1;
+    }
+    return needed;
+}
+
+/* Hands received IN data - whole packets, the last possibly short - to the
+ * unfinished IN phases in order. A short packet ends the phase it lands in,
+ * as does filling it; a packet that overruns its phase is cut off there, as
+ * a host controller would. Returns 0, or -1 when no phase wants the data. */
+static int emu_deliver_in(struct EmuPhase* phases, size_t nphases, const unsigned char* data, size_t len) {
+    int short_end = len % EMU_BULK_MAX != 0 || len == 0;
+    size_t pos = 0;
+    for (size_t i = 0; i < nphases; i++) {
+        struct EmuPhase* phase = &phases[i];
+        if (phase->token != EMU_TOKEN_IN || phase->ended) {
+            continue;
+        }
+        size_t copy = len - pos;
+        if (copy > phase->len - phase->done) {
+            copy = phase->len - phase->done;
+        }
+        memcpy(phase->buf + phase->done, data + pos, copy);
+        phase->done += copy;
+        pos += copy;
+        if (phase->done == phase->len || (pos == len && short_end)) {
+            phase->ended = 1;
+        }
+        /* The next phase starts with the next packet. */
+        pos = (pos + EMU_BULK_MAX - 1) / EMU_BULK_MAX * EMU_BULK_MAX;
+        if (pos >= len) {
+            return 0;
         }
-        p += chunk;
-        n -= chunk;
     }
-    return 0;
+    return -1;
 }
 
-/* Reads up to `n` bytes from the bulk-IN endpoint. A short packet ends the
- * transfer (the device may supply less than asked). Returns the byte count,
- * or -1. */
-static ssize_t emu_bulk_in(struct EmuHandheld* emu, void* buf, size_t n) {
-    unsigned char* p = buf;
-    size_t total = 0;
-    while (total < n) {
-        unsigned char packet[EMU_MAX_RESPONSE];
-        size_t packet_len = 0;
-        int kind = emu_transact_retry(emu, EMU_ENDPOINT_BULK, EMU_TOKEN_IN,
-                                      NULL, 0, packet, sizeof(packet), &packet_len);
-        if (kind == EMU_RESP_DETACHED) {
-            miuchiz_log("libmiuchiz: bulk IN failed: device detached (off the bus)\n");
-            return -1;
+static int emu_phases_complete(const struct EmuPhase* phases, size_t nphases) {
+    for (size_t i = 0; i < nphases; i++) {
+        if (phases[i].token == EMU_TOKEN_OUT ? phases[i].done < phases[i].len : !phases[i].ended) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* A run of consecutive NAKs. */
+struct EmuNakStretch {
+    int naks;
+    int sleeps;           /* sleeps taken past the expected ready time */
+    uint64_t last_nak_us; /* when the latest NAK arrived, from the first */
+    struct Utimer timer;  /* started at the first NAK */
+};
+
+/* Waits before re-asking, after a NAK with nothing else in flight. */
+static void emu_nak_wait(struct EmuHandheld* emu, struct EmuNakStretch* stretch) {
+    if (stretch->naks <= EMU_NAK_SPIN) {
+        return;
+    }
+    uint64_t wait;
+    if (stretch->last_nak_us + EMU_NAK_WAIT_MIN_US < emu->nak_ready_us) {
+        wait = emu->nak_ready_us - stretch->last_nak_us;
+    }
+    else {
+        wait = (uint64_t)(emu->nak_ready_us / 4) << (stretch->sleeps < 16 ? stretch->sleeps : 16);
+        stretch->sleeps++;
+    }
+    if (wait < EMU_NAK_WAIT_MIN_US) {
+        wait = EMU_NAK_WAIT_MIN_US;
+    }
+    if (wait > EMU_NAK_WAIT_MAX_US) {
+        wait = EMU_NAK_WAIT_MAX_US;
+    }
+    emu_sleep_us((unsigned int)wait);
+}
+
+/* Closes a stretch of NAKs the device has now answered past. The device
+ * became ready somewhere between the last NAK and this answer; the midpoint
+ * is folded into the connection's estimate (an exponential moving average,
+ * so one slow stretch does not dominate). */
+static void emu_nak_stretch_end(struct EmuHandheld* emu, struct EmuNakStretch* stretch) {
+    miuchiz_utimer_end(&stretch->timer);
+    uint64_t elapsed = miuchiz_utimer_elapsed(&stretch->timer);
+    emu->stats.nak_wait_us += elapsed;
+    uint64_t ready = (stretch->last_nak_us + elapsed) / 2;
+    if (ready > EMU_NAK_BUDGET_US) {
+        ready = EMU_NAK_BUDGET_US;
+    }
+    emu->nak_ready_us = (uint32_t)((3 * (uint64_t)emu->nak_ready_us + ready) / 4);
+    stretch->naks = 0;
+    stretch->sleeps = 0;
+}
+
+/* Marks the connection lost, for the next command to reattach. */
+static void emu_lose(struct EmuHandheld* emu) {
+    if (!emu->lost) {
+        emu->lost = 1;
+        miuchiz_utimer_start(&emu->lost_timer);
+    }
+}
+
+/* Runs one command's phases, which must be all OUT phases followed by all IN
+ * phases. Returns 0 once every OUT byte is acknowledged and every IN phase
+ * has ended, -1 on failure. */
+static int emu_run_phases(struct EmuHandheld* emu, struct EmuPhase* phases, size_t nphases) {
+    struct EmuInflight inflight[EMU_WINDOW_MAX];
+    size_t head = 0;
+    size_t count = 0;
+    size_t window = emu->window;
+
+    size_t out_phase = 0;   /* next OUT packet to issue */
+    size_t out_offset = 0;
+    size_t taken_phase = 0; /* next OUT byte the device will take */
+    size_t taken_offset = 0;
+    int rewind = 0;         /* an OUT packet was NAKed; resend once drained */
+    int reordered = 0;      /* OUT data landed out of order */
+    size_t in_packets = 0;  /* IN packets asked for in flight */
+    struct EmuNakStretch stretch = { 0 };
+    int failed = 0;         /* draining the stream before returning -1 */
+
+    for (;;) {
+        /* Top the window up only once the responses already received are
+         * consumed, so each burst costs one send and one receive. */
+        int refill = count == 0 || !emu_response_buffered(emu);
+        while (refill && !failed && !rewind && count < window) {
+            emu_out_settle(phases, nphases, &out_phase, &out_offset);
+            struct EmuInflight* slot = &inflight[(head + count) % EMU_WINDOW_MAX];
+            if (out_phase < nphases && phases[out_phase].token == EMU_TOKEN_OUT) {
+                size_t chunk = phases[out_phase].len - out_offset;
+                if (chunk > emu->transfer_max) {
+                    chunk = emu->transfer_max;
+                }
+                emu_queue_request(emu, EMU_ENDPOINT_BULK, EMU_TOKEN_OUT,
+                                  phases[out_phase].buf + out_offset, chunk);
+                slot->token = EMU_TOKEN_OUT;
+                slot->phase = out_phase;
+                slot->offset = out_offset;
+                slot->len = chunk;
+                out_offset += chunk;
+            }
+            else if (in_packets < emu_in_packets_needed(phases, nphases)) {
+                size_t packets = 1;
+                if (emu->version >= EMU_PROTOCOL_AGGREGATE) {
+                    packets = emu_in_packets_needed(phases, nphases) - in_packets;
+                    if (packets > emu->transfer_max / EMU_BULK_MAX) {
+                        packets = emu->transfer_max / EMU_BULK_MAX;
+                    }
+                    miuchiz_le32_write(slot->wanted, (uint32_t)(packets * EMU_BULK_MAX));
+                    emu_queue_request(emu, EMU_ENDPOINT_BULK, EMU_TOKEN_IN, slot->wanted, sizeof(slot->wanted));
+                }
+                else {
+                    emu_queue_request(emu, EMU_ENDPOINT_BULK, EMU_TOKEN_IN, NULL, 0);
+                }
+                slot->token = EMU_TOKEN_IN;
+                slot->len = packets * EMU_BULK_MAX;
+                in_packets += packets;
+            }
+            else {
+                break;
+            }
+            count++;
         }
-        if (kind != EMU_RESP_DATA) {
-            miuchiz_log("libmiuchiz: bulk IN failed (kind %d)\n", kind);
+        if (emu_flush(emu) < 0) {
+            emu_lose(emu);
             return -1;
         }
-        size_t copy = packet_len;
-        if (copy > n - total) {
-            copy = n - total;
+
+        if (count == 0) {
+            if (failed) {
+                return -1;
+            }
+            if (rewind) {
+                out_phase = taken_phase;
+                out_offset = taken_offset;
+                rewind = 0;
+                continue;
+            }
+            if (reordered) {
+                emu->window = 1;
+                return -1;
+            }
+            return emu_phases_complete(phases, nphases) ? 0 : -1;
         }
-        memcpy(p + total, packet, copy);
-        total += copy;
-        if (packet_len < EMU_BULK_MAX) {
-            break;
+
+        struct EmuInflight request = inflight[head];
+        head = (head + 1) % EMU_WINDOW_MAX;
+        count--;
+
+        const unsigned char* data = NULL;
+        size_t data_len = 0;
+        int kind = emu_recv_response(emu, &data, &data_len);
+        if (kind == EMU_RESP_ERROR) {
+            emu_lose(emu);
+            return -1; /* the stream itself is gone; nothing left to drain */
+        }
+        if (request.token == EMU_TOKEN_IN) {
+            in_packets -= request.len / EMU_BULK_MAX;
+        }
+        if (failed) {
+            continue;
+        }
+
+        if (kind == EMU_RESP_NAK) {
+            window = 1;
+            if (request.token == EMU_TOKEN_OUT) {
+                rewind = 1;
+            }
+            emu->stats.naks++;
+            if (stretch.naks++ == 0) {
+                miuchiz_utimer_start(&stretch.timer);
+            }
+            miuchiz_utimer_end(&stretch.timer);
+            stretch.last_nak_us = miuchiz_utimer_elapsed(&stretch.timer);
+            if (stretch.last_nak_us >= EMU_NAK_BUDGET_US) {
+                miuchiz_log("libmiuchiz: emulator NAK retry budget exhausted\n");
+                failed = 1;
+            }
+            else if (count == 0) {
+                /* Nothing else in flight to wait on. */
+                emu_nak_wait(emu, &stretch);
+            }
+            continue;
+        }
+
+        if (kind == EMU_RESP_DETACHED) {
+            miuchiz_log("libmiuchiz: bulk %s failed: device detached (off the bus)\n",
+                        request.token == EMU_TOKEN_OUT ? "OUT" : "IN");
+            emu_lose(emu);
+            failed = 1;
+            continue;
+        }
+
+        if (request.token == EMU_TOKEN_OUT) {
+            size_t taken = request.len;
+            if (kind == EMU_RESP_DATA && emu->version >= EMU_PROTOCOL_AGGREGATE
+                && data_len == 4 && miuchiz_le32_read(data) < request.len) {
+                /* Taken in part: the rest goes again, as after a NAK. */
+                taken = miuchiz_le32_read(data);
+                window = 1;
+                rewind = 1;
+            }
+            else if (kind != EMU_RESP_ACK) {
+                miuchiz_log("libmiuchiz: bulk OUT not accepted (kind %d)\n", kind);
+                window = 1;
+                failed = 1;
+                continue;
+            }
+            emu_out_settle(phases, nphases, &taken_phase, &taken_offset);
+            if (request.phase != taken_phase || request.offset != taken_offset) {
+                if (!reordered) {
+                    miuchiz_log("libmiuchiz: emulator accepted OUT data past a NAKed packet; "
+                                "falling back to stop-and-wait\n");
+                }
+                reordered = 1;
+            }
+            /* The device has taken `taken` more bytes, whichever ones. */
+            size_t take = taken;
+            if (taken_phase < nphases && take > phases[taken_phase].len - taken_offset) {
+                take = phases[taken_phase].len - taken_offset;
+            }
+            if (taken_phase < nphases) {
+                taken_offset += take;
+                phases[taken_phase].done = taken_offset;
+            }
+        }
+        else {
+            if (kind != EMU_RESP_DATA) {
+                miuchiz_log("libmiuchiz: bulk IN failed (kind %d)\n", kind);
+                window = 1;
+                failed = 1;
+                continue;
+            }
+            if (rewind || emu_deliver_in(phases, nphases, data, data_len) < 0) {
+                miuchiz_log("libmiuchiz: unexpected bulk IN data; stream out of sync\n");
+                failed = 1;
+                continue;
+            }
+        }
+        if (stretch.naks > 0) {
+            emu_nak_stretch_end(emu, &stretch);
         }
     }
-    return (ssize_t)total;
 }
 
 static void emu_build_cbw(unsigned char* cbw,
@@ -434,13 +960,11 @@ static void emu_build_cbw(unsigned char* cbw,
     memcpy(cbw + 15, cdb, ncdb);
 }
 
-/* Reads and validates the Command Status Wrapper. Returns 0 when the command
- * passed, -1 otherwise. */
-static int emu_check_csw(struct EmuHandheld* emu, uint32_t expected_tag) {
-    unsigned char csw[CSW_SIZE];
-    ssize_t got = emu_bulk_in(emu, csw, sizeof(csw));
-    if (got != CSW_SIZE) {
-        miuchiz_log("libmiuchiz: short CSW (%zd bytes)\n", got);
+/* Validates the Command Status Wrapper. Returns 0 when the command passed,
+ * -1 otherwise. */
+static int emu_check_csw(const unsigned char* csw, size_t len, uint32_t expected_tag) {
+    if (len != CSW_SIZE) {
+        miuchiz_log("libmiuchiz: short CSW (%zu bytes)\n", len);
         return -1;
     }
     if (memcmp(csw, "USBS", 4) != 0) {
@@ -470,18 +994,20 @@ static ssize_t emu_scsi_read(struct EmuHandheld* emu, uint32_t sector, void* buf
     };
     unsigned char cbw[CBW_SIZE];
     emu_build_cbw(cbw, tag, (uint32_t)n, 1, cdb, sizeof(cdb));
+    unsigned char csw[CSW_SIZE];
 
-    if (emu_bulk_out(emu, cbw, sizeof(cbw)) < 0) {
-        return -1;
-    }
-    ssize_t got = emu_bulk_in(emu, buf, n);
-    if (got < 0) {
+    struct EmuPhase phases[3] = {
+        { EMU_TOKEN_OUT, cbw, sizeof(cbw), 0, 0 },
+        { EMU_TOKEN_IN, buf, n, 0, 0 },
+        { EMU_TOKEN_IN, csw, sizeof(csw), 0, 0 },
+    };
+    if (emu_run_phases(emu, phases, 3) < 0) {
         return -1;
     }
-    if (emu_check_csw(emu, tag) < 0) {
+    if (emu_check_csw(csw, phases[2].done, tag) < 0) {
         return -1;
     }
-    return got;
+    return (ssize_t)phases[1].done;
 }
 
 static ssize_t emu_scsi_write(struct EmuHandheld* emu, uint32_t sector, const void* buf, size_t n) {
@@ -496,14 +1022,17 @@ static ssize_t emu_scsi_write(struct EmuHandheld* emu, uint32_t sector, const vo
     };
     unsigned char cbw[CBW_SIZE];
     emu_build_cbw(cbw, tag, (uint32_t)n, 0, cdb, sizeof(cdb));
+    unsigned char csw[CSW_SIZE];
 
-    if (emu_bulk_out(emu, cbw, sizeof(cbw)) < 0) {
-        return -1;
-    }
-    if (emu_bulk_out(emu, buf, n) < 0) {
+    struct EmuPhase phases[3] = {
+        { EMU_TOKEN_OUT, cbw, sizeof(cbw), 0, 0 },
+        { EMU_TOKEN_OUT, (unsigned char*)buf, n, 0, 0 },
+        { EMU_TOKEN_IN, csw, sizeof(csw), 0, 0 },
+    };
+    if (emu_run_phases(emu, phases, 3) < 0) {
         return -1;
     }
-    if (emu_check_csw(emu, tag) < 0) {
+    if (emu_check_csw(csw, phases[2].done, tag) < 0) {
         return -1;
     }
     return (ssize_t)n;
@@ -513,66 +1042,137 @@ static ssize_t emu_scsi_write(struct EmuHandheld* emu, uint32_t sector, const vo
  * The backend interface.
  * ------------------------------------------------------------------------ */
 
-void miuchiz_emu_open(struct Handheld* handheld) {
-    handheld->emu = NULL;
+/* Wraps a connected socket (past its hello) in fresh transport state. */
+static struct EmuHandheld* emu_handheld_new(emu_sock_t sock) {
+    struct EmuHandheld* emu = calloc(1, sizeof(struct EmuHandheld));
+    if (emu == NULL) {
+        return NULL;
+    }
+    emu->sock = sock;
+#if defined(SO_NOSIGPIPE)
+    int nosigpipe = 1;
+    setsockopt(sock, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+#endif
+    emu->window = EMU_WINDOW_DEFAULT;
+    emu->version = EMU_PROTOCOL_VERSION;
+    emu->transfer_max = EMU_BULK_MAX;
+    emu->max_response = EMU_MAX_RESPONSE;
+    emu->nak_ready_us = EMU_NAK_READY_DEFAULT_US;
+    const char* window = getenv("MIUCHIZ_EMU_WINDOW");
+    if (window != NULL && atoi(window) > 0) {
+        emu->window = atoi(window) < EMU_WINDOW_MAX ? (size_t)atoi(window) : EMU_WINDOW_MAX;
+    }
+    return emu;
+}
+
+static void emu_handheld_free(struct EmuHandheld* emu) {
+    emu_close_socket(emu->sock);
+    free(emu->identity);
+    free(emu);
+}
+
+static void emu_open(struct Handheld* handheld) {
+    handheld->transport = NULL;
 
     const char* path = handheld->device + strlen(EMU_DEVICE_PREFIX);
-    emu_sock_t sock = emu_connect_path(path, NULL);
+    emu_sock_t sock = emu_connect_path(path);
     if (sock == EMU_INVALID_SOCKET) {
         return;
     }
-    int plugged = 0;
-    if (emu_read_hello(sock, &plugged) < 0) {
+    unsigned char flags = 0;
+    char* identity = NULL;
+    if (emu_read_hello(sock, &flags, &identity) < 0) {
         emu_close_socket(sock);
         return;
     }
-    if (!plugged) {
+    if (!(flags & EMU_HELLO_FLAG_PLUGGED)) {
         /* The emulator is running but its USB cable is unplugged - like a
          * real handheld sitting next to the PC. The endpoint has already
          * closed; do not treat it as an attached device. */
         miuchiz_log("libmiuchiz: emulator at %s has its USB cable unplugged\n",
                     handheld->device);
+        free(identity);
         emu_close_socket(sock);
         return;
     }
 
-    struct EmuHandheld* emu = malloc(sizeof(struct EmuHandheld));
-    emu->sock = sock;
-    emu->current_sector = 0;
-    emu->cbw_tag = 0;
-    handheld->emu = emu;
+    struct EmuHandheld* emu = emu_handheld_new(sock);
+    if (emu == NULL) {
+        free(identity);
+        emu_close_socket(sock);
+        return;
+    }
+    emu->identity = identity;
+    if (flags & EMU_HELLO_FLAG_UPGRADE) {
+        const unsigned char* answer = NULL;
+        size_t answer_len = 0;
+        int kind = emu_offer_upgrade(emu) < 0 ? EMU_RESP_ERROR
+                 : emu_recv_response(emu, &answer, &answer_len);
+        if (emu_take_upgrade(emu, kind, answer, answer_len) < 0) {
+            emu_handheld_free(emu);
+            return;
+        }
+    }
+    handheld->transport = emu;
 }
 
-void miuchiz_emu_close(struct Handheld* handheld) {
-    struct EmuHandheld* emu = handheld->emu;
+static void emu_close(struct Handheld* handheld) {
+    struct EmuHandheld* emu = handheld->transport;
     if (emu != NULL) {
-        emu_close_socket(emu->sock);
-        free(emu);
-        handheld->emu = NULL;
+        emu_handheld_free(emu);
+        handheld->transport = NULL;
+    }
+}
+
+static size_t emu_identity(struct Handheld* handheld, void* buf, size_t n) {
+    struct EmuHandheld* emu = handheld->transport;
+    if (emu == NULL || emu->identity == NULL || emu->identity[0] == '\0') {
+        return 0;
     }
+    size_t len = strlen(emu->identity);
+    memcpy(buf, emu->identity, len < n ? len : n);
+    return len;
 }
 
-ssize_t miuchiz_emu_read(struct Handheld* handheld, void* buf, size_t n) {
-    struct EmuHandheld* emu = handheld->emu;
+static int emu_transport_stats(struct Handheld* handheld, struct MiuchizTransportStats* stats) {
+    struct EmuHandheld* emu = handheld->transport;
     if (emu == NULL) {
         return -1;
     }
+    *stats = emu->stats;
+    return 0;
+}
+
+static unsigned int emu_generation(struct Handheld* handheld) {
+    struct EmuHandheld* emu = handheld->transport;
+    return emu != NULL ? emu->generation : 0;
+}
+
+static int emu_reattach(struct Handheld* handheld);
+
+static ssize_t emu_read(struct Handheld* handheld, void* buf, size_t n) {
+    struct EmuHandheld* emu = handheld->transport;
+    if (emu == NULL || (emu->lost && emu_reattach(handheld) < 0)) {
+        return -1;
+    }
+    emu = handheld->transport;
     return emu_scsi_read(emu, emu->current_sector, buf, n);
 }
 
-ssize_t miuchiz_emu_write(struct Handheld* handheld, const void* buf, size_t n) {
-    struct EmuHandheld* emu = handheld->emu;
-    if (emu == NULL) {
+static ssize_t emu_write(struct Handheld* handheld, const void* buf, size_t n) {
+    struct EmuHandheld* emu = handheld->transport;
+    if (emu == NULL || (emu->lost && emu_reattach(handheld) < 0)) {
         return -1;
     }
+    emu = handheld->transport;
     /* No pacing sleep here: the misbehave-when-rushed workaround in the
      * platform backends is a physical-device quirk; the emulated firmware is
      * already throttled by the transaction seam itself. */
     return emu_scsi_write(emu, emu->current_sector, buf, n);
 }
 
-off_t miuchiz_emu_seek(struct Handheld* handheld, off_t offset) {
-    struct EmuHandheld* emu = handheld->emu;
+static off_t emu_seek(struct Handheld* handheld, off_t offset) {
+    struct EmuHandheld* emu = handheld->transport;
     if (emu == NULL) {
         return -1;
     }
@@ -580,89 +1180,35 @@ off_t miuchiz_emu_seek(struct Handheld* handheld, off_t offset) {
     return 0;
 }
 
+const struct MiuchizBackend miuchiz_emu_backend = {
+    .name = "emu",
+    .prefix = EMU_DEVICE_PREFIX,
+    .open = emu_open,
+    .close = emu_close,
+    .read = emu_read,
+    .write = emu_write,
+    .seek = emu_seek,
+    .identity = emu_identity,
+    .transport_stats = emu_transport_stats,
+    .generation = emu_generation,
+    .enumerate = miuchiz_emu_enumerate,
+};
+
 /* ---------------------------------------------------------------------------
  * Discovery.
  * ------------------------------------------------------------------------ */
 
-/* Mirrors the *runtime* category of the Miuchiz Reborn storage-location
- * policy. The authoritative implementation is the miuchiz-reborn-paths Rust
- * crate; its test-vectors.txt is the shared conformance suite (vendored under
- * tests/ and run by the paths-conformance test - keep all three in sync).
- *
- *   MIUCHIZ_REBORN_HOME set  ->  <home>/runtime/<app>
- *   else the OS runtime dir  ->  <runtime>/<umbrella>/<app>
- *        (only Linux has one: $XDG_RUNTIME_DIR, absolute paths only)
- *   else the system temp dir ->  <temp>/<umbrella>/<app>
- *
- * The umbrella is "Miuchiz Reborn" on Windows/macOS and "miuchiz-reborn"
- * elsewhere. Returns 0 on success, -1 on failure. */
-int miuchiz_emu_runtime_dir(const char* app, char* buf, size_t bufn) {
-    const char* home = getenv("MIUCHIZ_REBORN_HOME");
-    if (home != NULL && home[0] != '\0') {
-        int n = snprintf(buf, bufn, "%s/runtime/%s", home, app);
-        return (n > 0 && (size_t)n < bufn) ? 0 : -1;
-    }
-
-    /* Base directory joins must tolerate a trailing separator on the env
-     * value (macOS $TMPDIR famously has one) the way path joins do. */
-    char base[1024];
-
-#if defined(_WIN32)
-    DWORD len = GetTempPathA(sizeof(base), base);
-    if (len == 0 || len >= sizeof(base)) {
-        return -1;
-    }
-    while (len > 1 && (base[len - 1] == '\\' || base[len - 1] == '/')) {
-        base[--len] = '\0';
-    }
-    int n = snprintf(buf, bufn, "%s\\Miuchiz Reborn\\%s", base, app);
-    return (n > 0 && (size_t)n < bufn) ? 0 : -1;
-#else
-    const char* root = NULL;
-    const char* umbrella = NULL;
-
-    #if defined(__APPLE__)
-        umbrella = "Miuchiz Reborn";
-    #else
-        umbrella = "miuchiz-reborn";
-        const char* xdg = getenv("XDG_RUNTIME_DIR");
-        if (xdg != NULL && xdg[0] == '/') {
-            root = xdg;
-        }
-    #endif
-
-    if (root == NULL) {
-        root = getenv("TMPDIR");
-        if (root == NULL || root[0] == '\0') {
-            root = "/tmp";
-        }
-    }
-
-    size_t len = strlen(root);
-    if (len >= sizeof(base)) {
-        return -1;
-    }
-    strcpy(base, root);
-    while (len > 1 && base[len - 1] == '/') {
-        base[--len] = '\0';
-    }
-
-    int n = snprintf(buf, bufn, "%s/%s/%s", base, umbrella, app);
-    return (n > 0 && (size_t)n < bufn) ? 0 : -1;
-#endif
-}
-
 /* The directory emulators publish USB endpoints in: emiu2's runtime
- * directory per the shared policy above, with EMIU2_USB_DIR as a narrower,
- * higher-priority override of just this directory (both matched by emiu2's
- * endpoint_dir()). Returns 0 on success. */
+ * directory per the shared Miuchiz Reborn policy (paths.c), with
+ * EMIU2_USB_DIR as a narrower, higher-priority override of just this
+ * directory (both matched by emiu2's endpoint_dir()). Returns 0 on success. */
 int miuchiz_emu_endpoint_dir(char* buf, size_t bufn) {
     const char* override = getenv("EMIU2_USB_DIR");
     if (override != NULL && override[0] != '\0') {
         int n = snprintf(buf, bufn, "%s", override);
         return (n > 0 && (size_t)n < bufn) ? 0 : -1;
     }
-    return miuchiz_emu_runtime_dir("emiu2", buf, bufn);
+    return miuchiz_reborn_dir("runtime", "emiu2", buf, bufn);
 }
 
 static int emu_is_endpoint_file(const char* name) {
@@ -677,57 +1223,378 @@ static int emu_is_endpoint_file(const char* name) {
 #endif
 }
 
-/* Considers one endpoint file: verifies the emulator behind it, appends it to
- * the result list or prunes/skips it. */
-static void emu_consider_endpoint(const char* dir_path,
-                                  const char* name,
-                                  struct Handheld*** handhelds,
-                                  int* count,
-                                  int* capacity) {
-    if (!emu_is_endpoint_file(name)) {
+/* Discovery probes every endpoint file at once: non-blocking connects, then
+ * on each connection the hello and a sector-0 read (what
+ * miuchiz_handheld_is_handheld checks), all driven by one poll loop under a
+ * single deadline. A healthy emulator is verified within about a round trip;
+ * a stale file, whose emulator is gone, is recognized by the refused connect
+ * itself and pruned; a wedged emulator costs at most the deadline, however
+ * many there are. A verified connection is upgraded to protocol 4 where the
+ * hello offers it and becomes the handheld's, so it is not connected twice. */
+#define EMU_DISCOVERY_TIMEOUT_MS (1500)
+
+/* Where Miuchiz Sync looks for the handheld's signature within sector 0. */
+#define EMU_SIGNATURE_OFFSET (43)
+#define EMU_SIGNATURE "SITRONIXTM"
+
+enum EmuProbeState {
+    EMU_PROBE_CONNECTING,
+    EMU_PROBE_HELLO,
+    EMU_PROBE_VERIFY,
+    EMU_PROBE_UPGRADE, /* verified; awaiting the answer to the upgrade offer */
+    EMU_PROBE_FOUND,   /* a handheld in USB mode; the connection is kept */
+    EMU_PROBE_SKIPPED, /* not a usable handheld right now */
+    EMU_PROBE_STALE,   /* nothing listens: the endpoint file is pruned */
+};
+
+struct EmuProbe {
+    char* device;
+    enum EmuProbeState state;
+    struct EmuHandheld* emu;
+    int family;
+    unsigned char hello_flags;
+
+    /* The sector-0 READ(10): a CBW, then IN packets for the sector and the
+     * CSW. A NAKed CBW or IN token is simply asked again a tick later; OUT
+     * data never follows the CBW, so nothing can land out of order. */
+    unsigned char cbw[CBW_SIZE];
+    unsigned char sector[MIUCHIZ_SECTOR_SIZE];
+    unsigned char csw[CSW_SIZE];
+    struct EmuPhase phases[2];
+    int cbw_acked;
+    int cbw_inflight;   /* the burst in flight leads with the CBW */
+    size_t in_inflight; /* IN tokens awaiting answers */
+    int naked;          /* the last burst met a NAK; re-ask after a tick */
+};
+
+static void emu_probe_finish(struct EmuProbe* probe, enum EmuProbeState state) {
+    probe->state = state;
+    if (state != EMU_PROBE_FOUND && probe->emu != NULL) {
+        emu_handheld_free(probe->emu);
+        probe->emu = NULL;
+    }
+}
+
+/* Starts the non-blocking connect. */
+static void emu_probe_start(struct EmuProbe* probe) {
+    const char* path = probe->device + strlen(EMU_DEVICE_PREFIX);
+    struct EmuAddress address;
+    if (emu_endpoint_address(path, &address) < 0) {
+        emu_probe_finish(probe, EMU_PROBE_SKIPPED);
+        return;
+    }
+    emu_sock_t sock = socket(address.family, SOCK_STREAM, 0);
+    if (sock == EMU_INVALID_SOCKET) {
+        emu_probe_finish(probe, EMU_PROBE_SKIPPED);
+        return;
+    }
+    probe->emu = emu_handheld_new(sock);
+    if (probe->emu == NULL) {
+        emu_close_socket(sock);
+        emu_probe_finish(probe, EMU_PROBE_SKIPPED);
+        return;
+    }
+    probe->family = address.family;
+    if (emu_set_blocking(sock, 0) < 0) {
+        emu_probe_finish(probe, EMU_PROBE_SKIPPED);
+        return;
+    }
+
+    if (connect(sock, (struct sockaddr*)&address.addr, address.len) == 0) {
+        probe->state = EMU_PROBE_HELLO;
+        return;
+    }
+    int err = emu_socket_error();
+    if (err == EMU_ERR_IN_PROGRESS) {
+        probe->state = EMU_PROBE_CONNECTING;
+    }
+    else {
+        /* A Unix socket whose emulator is gone refuses on the spot; anything
+         * else (a full backlog, a vanished file) is just skipped this time. */
+        emu_probe_finish(probe, err == EMU_ERR_REFUSED ? EMU_PROBE_STALE : EMU_PROBE_SKIPPED);
+    }
+}
+
+/* Sends the next burst of the sector-0 read: the CBW until it is taken, and
+ * as many IN tokens as packets are still wanted. After a NAK, a single
+ * request asks whether the device is ready before a full burst follows. */
+static void emu_probe_issue(struct EmuProbe* probe) {
+    struct EmuHandheld* emu = probe->emu;
+    size_t limit = probe->naked ? 1 : emu->window;
+    if (!probe->cbw_acked) {
+        emu_queue_request(emu, EMU_ENDPOINT_BULK, EMU_TOKEN_OUT, probe->cbw, sizeof(probe->cbw));
+        probe->cbw_inflight = 1;
+    }
+    size_t needed = emu_in_packets_needed(probe->phases, 2);
+    for (size_t i = 0; i < needed && i + probe->cbw_inflight < limit; i++) {
+        emu_queue_request(emu, EMU_ENDPOINT_BULK, EMU_TOKEN_IN, NULL, 0);
+        probe->in_inflight++;
+    }
+    probe->naked = 0;
+    /* A fresh connection's send buffer takes the whole burst at once. */
+    if (emu_flush(emu) < 0) {
+        emu_probe_finish(probe, EMU_PROBE_SKIPPED);
+    }
+}
+
+static void emu_probe_hello(struct EmuProbe* probe) {
+    struct EmuHandheld* emu = probe->emu;
+    char* identity = NULL;
+    long hello_len = emu_parse_hello(emu->rbuf, emu->rlen, &probe->hello_flags, &identity);
+    if (hello_len == 0) {
+        return;
+    }
+    if (hello_len < 0) {
+        emu_probe_finish(probe, EMU_PROBE_SKIPPED);
+        return;
+    }
+    emu->identity = identity;
+    emu->rpos = (size_t)hello_len;
+    if (!(probe->hello_flags & EMU_HELLO_FLAG_PLUGGED)) {
+        miuchiz_log("libmiuchiz: emulator at %s has its USB cable unplugged\n", probe->device);
+        emu_probe_finish(probe, EMU_PROBE_SKIPPED);
+        return;
+    }
+
+    uint32_t tag = ++emu->cbw_tag;
+    unsigned char cdb[10] = { 0x28, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x00 }; /* READ(10) sector 0 */
+    emu_build_cbw(probe->cbw, tag, MIUCHIZ_SECTOR_SIZE, 1, cdb, sizeof(cdb));
+    struct EmuPhase sector = { EMU_TOKEN_IN, probe->sector, sizeof(probe->sector), 0, 0 };
+    struct EmuPhase csw = { EMU_TOKEN_IN, probe->csw, sizeof(probe->csw), 0, 0 };
+    probe->phases[0] = sector;
+    probe->phases[1] = csw;
+    probe->state = EMU_PROBE_VERIFY;
+    emu_probe_issue(probe);
+}
+
+/* Consumes the buffered answers to the sector-0 read. */
+static void emu_probe_verify(struct EmuProbe* probe) {
+    struct EmuHandheld* emu = probe->emu;
+    while ((probe->cbw_inflight || probe->in_inflight > 0) && emu_response_buffered(emu)) {
+        const unsigned char* data = NULL;
+        size_t data_len = 0;
+        int kind = emu_recv_response(emu, &data, &data_len);
+        if (kind == EMU_RESP_NAK) {
+            emu->stats.naks++;
+            probe->naked = 1;
+        }
+        else if (probe->cbw_inflight && kind == EMU_RESP_ACK) {
+            probe->cbw_acked = 1;
+        }
+        else if (probe->cbw_inflight || kind != EMU_RESP_DATA || !probe->cbw_acked
+                 || emu_deliver_in(probe->phases, 2, data, data_len) < 0) {
+            /* Detached, stalled or out of step: not a usable handheld. */
+            emu_probe_finish(probe, EMU_PROBE_SKIPPED);
+            return;
+        }
+        if (probe->cbw_inflight) {
+            probe->cbw_inflight = 0;
+        }
+        else {
+            probe->in_inflight--;
+        }
+    }
+
+    if (emu_phases_complete(probe->phases, 2)) {
+        if (emu_check_csw(probe->csw, probe->phases[1].done, emu->cbw_tag) == 0
+            && probe->phases[0].done == MIUCHIZ_SECTOR_SIZE
+            && memcmp(probe->sector + EMU_SIGNATURE_OFFSET, EMU_SIGNATURE, strlen(EMU_SIGNATURE)) == 0) {
+            if (!(probe->hello_flags & EMU_HELLO_FLAG_UPGRADE)) {
+                emu_probe_finish(probe, EMU_PROBE_FOUND);
+            }
+            else if (emu_offer_upgrade(emu) == 0) {
+                probe->state = EMU_PROBE_UPGRADE;
+            }
+            else {
+                emu_probe_finish(probe, EMU_PROBE_SKIPPED);
+            }
+        }
+        else {
+            /* Present but not answering as a handheld - an emulator whose
+             * device is not in its USB ("Please Connect to PC") mode. */
+            miuchiz_log("libmiuchiz: emulator at %s is not in USB mode; skipping\n", probe->device);
+            emu_probe_finish(probe, EMU_PROBE_SKIPPED);
+        }
+    }
+    else if (!probe->cbw_inflight && probe->in_inflight == 0 && !probe->naked) {
+        emu_probe_issue(probe);
+    }
+}
+
+/* Takes the answer to the upgrade offer once it is buffered. */
+static void emu_probe_upgrade(struct EmuProbe* probe) {
+    struct EmuHandheld* emu = probe->emu;
+    if (!emu_response_buffered(emu)) {
         return;
     }
+    const unsigned char* data = NULL;
+    size_t data_len = 0;
+    int kind = emu_recv_response(emu, &data, &data_len);
+    emu_probe_finish(probe, emu_take_upgrade(emu, kind, data, data_len) == 0 ? EMU_PROBE_FOUND : EMU_PROBE_SKIPPED);
+}
+
+/* Handles poll readiness on a probe's socket. */
+static void emu_probe_ready(struct EmuProbe* probe, short revents) {
+    struct EmuHandheld* emu = probe->emu;
 
-    char device[2048];
-    snprintf(device, sizeof(device), "%s%s/%s", EMU_DEVICE_PREFIX, dir_path, name);
-    const char* path = device + strlen(EMU_DEVICE_PREFIX);
+    if (probe->state == EMU_PROBE_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(emu->sock, SOL_SOCKET, SO_ERROR, (char*)&err, &len) < 0) {
+            err = -1;
+        }
+        if (err == 0 && (revents & POLLOUT)) {
+            probe->state = EMU_PROBE_HELLO;
+        }
+        else if (err != 0 || (revents & (POLLERR | POLLHUP))) {
+            /* A dead loopback port answers RST, i.e. refused. */
+            emu_probe_finish(probe, err == EMU_ERR_REFUSED ? EMU_PROBE_STALE : EMU_PROBE_SKIPPED);
+        }
+        return;
+    }
 
-    struct Handheld* candidate = miuchiz_handheld_create(device);
-    if (candidate->emu == NULL) {
-        /* Could not attach. If the endpoint actively refuses, its emulator is
-         * gone - prune the corpse. (A busy cable or a hello failure just gets
-         * skipped.) */
-        int refused = 0;
-        emu_sock_t probe = emu_connect_path(path, &refused);
-        if (probe != EMU_INVALID_SOCKET) {
-            emu_close_socket(probe);
+    if (emu->rpos > 0) {
+        memmove(emu->rbuf, emu->rbuf + emu->rpos, emu->rlen - emu->rpos);
+        emu->rlen -= emu->rpos;
+        emu->rpos = 0;
+    }
+    ssize_t got = recv(emu->sock, (char*)emu->rbuf + emu->rlen, (int)(sizeof(emu->rbuf) - emu->rlen), 0);
+    emu->stats.recv_calls++;
+    if (got < 0 && emu_socket_error() == EMU_ERR_WOULD_BLOCK) {
+        return;
+    }
+    if (got > 0) {
+        emu->stats.bytes_received += (uint64_t)got;
+        emu->rlen += (size_t)got;
+        if (probe->state == EMU_PROBE_HELLO) {
+            emu_probe_hello(probe);
         }
-        else if (refused) {
-            remove(path);
+        if (probe->state == EMU_PROBE_VERIFY) {
+            emu_probe_verify(probe);
+        }
+        if (probe->state == EMU_PROBE_UPGRADE) {
+            emu_probe_upgrade(probe);
         }
-        miuchiz_handheld_destroy(candidate);
         return;
     }
+    /* Closed (an unplugged emulator hangs up after its hello) or failed. */
+    if (probe->state == EMU_PROBE_HELLO) {
+        emu_probe_hello(probe);
+    }
+    if (probe->state < EMU_PROBE_FOUND) {
+        emu_probe_finish(probe, EMU_PROBE_SKIPPED);
+    }
+}
 
-    if (miuchiz_handheld_is_handheld(candidate)) {
-        if (*count + 1 >= *capacity) {
-            *capacity = *capacity == 0 ? 8 : *capacity * 2;
-            *handhelds = realloc(*handhelds, *capacity * sizeof(struct Handheld*));
+/* Runs every probe to a verdict or to the deadline. */
+static void emu_probe_all(struct EmuProbe* probes, size_t nprobes) {
+    emu_pollfd_t* fds = malloc((nprobes > 0 ? nprobes : 1) * sizeof(*fds));
+    size_t* owners = malloc((nprobes > 0 ? nprobes : 1) * sizeof(*owners));
+    if (fds == NULL || owners == NULL) {
+        for (size_t i = 0; i < nprobes; i++) {
+            emu_probe_finish(&probes[i], EMU_PROBE_SKIPPED);
         }
-        (*handhelds)[(*count)++] = candidate;
-        (*handhelds)[*count] = NULL;
+        free(fds);
+        free(owners);
+        return;
     }
-    else {
-        /* Present but not answering as a handheld - an emulator whose device
-         * is not in its USB ("Please Connect to PC") mode. */
-        miuchiz_log("libmiuchiz: emulator at %s is not in USB mode; skipping\n", device);
-        miuchiz_handheld_destroy(candidate);
+
+    for (size_t i = 0; i < nprobes; i++) {
+        emu_probe_start(&probes[i]);
+    }
+
+    struct Utimer clock;
+    miuchiz_utimer_start(&clock);
+    for (;;) {
+        size_t nfds = 0;
+        int retrying = 0;
+        for (size_t i = 0; i < nprobes; i++) {
+            struct EmuProbe* probe = &probes[i];
+            if (probe->state >= EMU_PROBE_FOUND) {
+                continue;
+            }
+            if (probe->state == EMU_PROBE_VERIFY && probe->naked
+                && !probe->cbw_inflight && probe->in_inflight == 0) {
+                retrying = 1;
+            }
+            fds[nfds].fd = probe->emu->sock;
+            fds[nfds].events = probe->state == EMU_PROBE_CONNECTING ? POLLOUT : POLLIN;
+            fds[nfds].revents = 0;
+            owners[nfds++] = i;
+        }
+        if (nfds == 0) {
+            break;
+        }
+
+        miuchiz_utimer_end(&clock);
+        uint64_t elapsed_ms = miuchiz_utimer_elapsed(&clock) / 1000;
+        if (elapsed_ms >= EMU_DISCOVERY_TIMEOUT_MS) {
+            break;
+        }
+        /* The device services a transaction about once a millisecond: a NAKed
+         * probe asks again on the next tick. */
+        int timeout_ms = retrying ? 1 : (int)(EMU_DISCOVERY_TIMEOUT_MS - elapsed_ms);
+        int ready = emu_poll(fds, nfds, timeout_ms);
+        if (ready < 0) {
+            break;
+        }
+        for (size_t k = 0; k < nfds; k++) {
+            if (fds[k].revents != 0) {
+                emu_probe_ready(&probes[owners[k]], fds[k].revents);
+            }
+        }
+        for (size_t i = 0; i < nprobes; i++) {
+            struct EmuProbe* probe = &probes[i];
+            if (probe->state == EMU_PROBE_VERIFY && probe->naked
+                && !probe->cbw_inflight && probe->in_inflight == 0) {
+                emu_probe_issue(probe);
+            }
+        }
     }
+
+    for (size_t i = 0; i < nprobes; i++) {
+        if (probes[i].state < EMU_PROBE_FOUND) {
+            miuchiz_log("libmiuchiz: emulator at %s did not answer within %d ms; skipping\n",
+                        probes[i].device, EMU_DISCOVERY_TIMEOUT_MS);
+            emu_probe_finish(&probes[i], EMU_PROBE_SKIPPED);
+        }
+    }
+    free(fds);
+    free(owners);
+}
+
+/* Appends an endpoint file's device string to the probe list. */
+static void emu_add_probe(const char* dir_path,
+                          const char* name,
+                          struct EmuProbe** probes,
+                          size_t* nprobes,
+                          size_t* capacity) {
+    if (!emu_is_endpoint_file(name)) {
+        return;
+    }
+    if (*nprobes == *capacity) {
+        size_t grown = *capacity == 0 ? 8 : *capacity * 2;
+        struct EmuProbe* larger = realloc(*probes, grown * sizeof(struct EmuProbe));
+        if (larger == NULL) {
+            return;
+        }
+        *probes = larger;
+        *capacity = grown;
+    }
+    size_t device_len = strlen(EMU_DEVICE_PREFIX) + strlen(dir_path) + 1 + strlen(name) + 1;
+    char* device = malloc(device_len);
+    if (device == NULL) {
+        return;
+    }
+    snprintf(device, device_len, "%s%s/%s", EMU_DEVICE_PREFIX, dir_path, name);
+
+    struct EmuProbe* probe = &(*probes)[(*nprobes)++];
+    memset(probe, 0, sizeof(*probe));
+    probe->device = device;
+    probe->state = EMU_PROBE_SKIPPED;
 }
 
 int miuchiz_emu_enumerate(struct Handheld*** handhelds) {
-    int count = 0;
-    int capacity = 0;
     *handhelds = NULL;
 
     char dirs[1][1024];
@@ -736,6 +1603,9 @@ int miuchiz_emu_enumerate(struct Handheld*** handhelds) {
     }
     int ndirs = 1;
 
+    struct EmuProbe* probes = NULL;
+    size_t nprobes = 0;
+    size_t capacity = 0;
     for (int d = 0; d < ndirs; d++) {
 #if defined(_WIN32)
         char pattern[560];
@@ -746,7 +1616,7 @@ int miuchiz_emu_enumerate(struct Handheld*** handhelds) {
             continue;
         }
         do {
-            emu_consider_endpoint(dirs[d], find.cFileName, handhelds, &count, &capacity);
+            emu_add_probe(dirs[d], find.cFileName, &probes, &nprobes, &capacity);
         } while (FindNextFileA(search, &find));
         FindClose(search);
 #else
@@ -756,11 +1626,138 @@ int miuchiz_emu_enumerate(struct Handheld*** handhelds) {
         }
         struct dirent* entry;
         while ((entry = readdir(dir)) != NULL) {
-            emu_consider_endpoint(dirs[d], entry->d_name, handhelds, &count, &capacity);
+            emu_add_probe(dirs[d], entry->d_name, &probes, &nprobes, &capacity);
         }
         closedir(dir);
 #endif
     }
+    if (nprobes == 0) {
+        free(probes);
+        return 0;
+    }
+
+    ensure_sockets_init();
+    emu_probe_all(probes, nprobes);
+
+    int count = 0;
+    *handhelds = calloc(nprobes + 1, sizeof(struct Handheld*));
+    for (size_t i = 0; i < nprobes; i++) {
+        struct EmuProbe* probe = &probes[i];
+        if (probe->state == EMU_PROBE_STALE) {
+            remove(probe->device + strlen(EMU_DEVICE_PREFIX));
+        }
+        if (probe->state == EMU_PROBE_FOUND && *handhelds != NULL) {
+            /* Hand the verified connection to the handheld, back in the
+             * blocking mode the transport runs in. */
+            struct Handheld* handheld = calloc(1, sizeof(struct Handheld));
+            if (handheld != NULL && emu_set_blocking(probe->emu->sock, 1) == 0) {
+                emu_configure_socket(probe->emu->sock, probe->family);
+                handheld->device = probe->device;
+                handheld->backend = &miuchiz_emu_backend;
+                handheld->transport = probe->emu;
+                probe->device = NULL;
+                probe->emu = NULL;
+                (*handhelds)[count++] = handheld;
+            }
+            else {
+                free(handheld);
+            }
+        }
+        if (probe->emu != NULL) {
+            emu_handheld_free(probe->emu);
+        }
+        free(probe->device);
+    }
+    free(probes);
 
+    if (count == 0) {
+        free(*handhelds);
+        *handhelds = NULL;
+    }
     return count;
 }
+
+/* ---------------------------------------------------------------------------
+ * Reattaching.
+ *
+ * A lost connection is replaced rather than given up on: discovery is rerun
+ * until it turns up the same emulator - the one with the lost connection's
+ * identity, at whichever endpoint it now publishes (a restarted emiu2 comes
+ * back under a new pid), or at the same endpoint when it has no identity -
+ * verified in USB mode like any discovered handheld. The connection is
+ * swapped in under the same handle and its generation bumped, which tells
+ * the page layer that the device's command interface started over, so the
+ * interrupted page is redone rather than finished against a fresh device.
+ * ------------------------------------------------------------------------ */
+
+/* The reattach budget in milliseconds. */
+static long emu_reattach_budget_ms(void) {
+    const char* budget = getenv("MIUCHIZ_EMU_REATTACH_MS");
+    if (budget != NULL && budget[0] != '\0') {
+        long ms = atol(budget);
+        return ms > 0 ? ms : 0;
+    }
+    return EMU_REATTACH_DEFAULT_MS;
+}
+
+/* Whether a discovered emulator is the one `lost` was connected to. */
+static int emu_same_emulator(const struct EmuHandheld* lost, const char* lost_device,
+                             const struct Handheld* found) {
+    const struct EmuHandheld* emu = found->transport;
+    if (lost->identity != NULL && lost->identity[0] != '\0') {
+        return emu->identity != NULL && strcmp(emu->identity, lost->identity) == 0;
+    }
+    return strcmp(found->device, lost_device) == 0;
+}
+
+/* Replaces the handheld's lost connection with a fresh one to the same
+ * emulator, looking until the budget since the loss is spent; past it, each
+ * command looks once more. Returns 0, or -1 when it is not found (the
+ * handle stays lost). */
+static int emu_reattach(struct Handheld* handheld) {
+    struct EmuHandheld* lost = handheld->transport;
+    long budget_ms = emu_reattach_budget_ms();
+    if (budget_ms == 0) {
+        return -1;
+    }
+    miuchiz_log("libmiuchiz: lost the emulator at %s; reattaching\n", handheld->device);
+
+    for (;;) {
+        struct Handheld** found = NULL;
+        int count = miuchiz_emu_enumerate(&found);
+        struct Handheld* match = NULL;
+        for (int i = 0; i < count; i++) {
+            if (match == NULL && emu_same_emulator(lost, handheld->device, found[i])) {
+                match = found[i];
+                continue;
+            }
+            emu_close(found[i]);
+            free(found[i]->device);
+            free(found[i]);
+        }
+        free(found);
+
+        if (match != NULL) {
+            struct EmuHandheld* emu = match->transport;
+            emu->current_sector = lost->current_sector;
+            emu->nak_ready_us = lost->nak_ready_us;
+            emu->stats = lost->stats;
+            emu->stats.reattaches++;
+            emu->generation = lost->generation + 1;
+            emu_handheld_free(lost);
+            free(handheld->device);
+            handheld->device = match->device;
+            handheld->transport = emu;
+            free(match);
+            miuchiz_log("libmiuchiz: reattached to the emulator at %s\n", handheld->device);
+            return 0;
+        }
+
+        miuchiz_utimer_end(&lost->lost_timer);
+        if (miuchiz_utimer_elapsed(&lost->lost_timer) / 1000 >= (uint64_t)budget_ms) {
+            miuchiz_log("libmiuchiz: emulator did not come back within %ld ms\n", budget_ms);
+            return -1;
+        }
+        emu_sleep_us(EMU_REATTACH_POLL_MS * 1000);
+    }
+}
@@ -0,0 +1,376 @@
+/*
+ * Fault injection at the backend seam, so the retry and recovery paths
+ * above it (the page layer's attempts, the tools' retry loops) are
+ * exercised and their cost can be measured at a chosen fault rate.
+ *
+ * Configured with miuchiz_set_faults, or MIUCHIZ_FAULTS in the environment,
+ * as comma-separated key=value pairs; every handheld opened or discovered
+ * while a spec is set is wrapped in a decorator that injects, per
+ * operation:
+ *
+ *   read=P, write=P, seek=P  the operation fails (EIO) without reaching the
+ *                            device
+ *   short=P                  a read or write reaches the device but reports
+ *                            a sector less than it moved
+ *   csw=P                    a read or write reaches the device but its
+ *                            status comes back bad (a corrupted CSW), so it
+ *                            reports failure
+ *   stale=P                  a read is answered with the previous read's
+ *                            data, as when the transport loses track of
+ *                            command tags; the status then carries the
+ *                            wrong tag, so it reports failure as csw does
+ *   detach=P                 the device drops off the bus: every operation
+ *                            fails (ENODEV) for detach_ms=MS (default 200),
+ *                            after which the device is back and counted as
+ *                            reattached (miuchiz_backend_generation)
+ *   latency=US               every operation takes this much longer
+ *   seed=N                   seeds the random choices (default 1), so a
+ *                            run can be repeated
+ *
+ * P is a probability from 0 to 1.
+ */
+
+#include "libmiuchiz-usb.h"
+#include "backend-internal.h"
+#include "timer.h"
+#include "sleep.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define FAULT_DETACH_DEFAULT_MS (200)
+
+struct FaultSpec {
+    double read;
+    double write;
+    double seek;
+    double short_transfer;
+    double csw;
+    double stale;
+    double detach;
+    unsigned int detach_ms;
+    unsigned int latency_us;
+    uint32_t seed;
+};
+
+struct FaultHandheld {
+    const struct MiuchizBackend* inner;
+    void* inner_transport;
+    struct FaultSpec spec;
+    uint32_t rng;
+    unsigned char* last_read; /* the previous read's data, for stale answers */
+    size_t last_read_len;
+    int detached;
+    struct Utimer detached_timer;
+    unsigned int reattaches;
+    uint64_t injected;
+};
+
+static struct FaultSpec faults;
+static int faults_set = 0;
+static int faults_from_environment = 0;
+static unsigned int faulted_handles = 0;
+
+static const struct MiuchizBackend fault_backend;
+
+static int fault_parse(const char* text, struct FaultSpec* spec) {
+    memset(spec, 0, sizeof(*spec));
+    spec->detach_ms = FAULT_DETACH_DEFAULT_MS;
+    spec->seed = 1;
+
+    char* copy = strdup(text);
+    if (copy == NULL) {
+        return -1;
+    }
+    int result = 0;
+    for (char* pair = strtok(copy, ","); pair != NULL && result == 0; pair = strtok(NULL, ",")) {
+        char* value = strchr(pair, '=');
+        if (value == NULL) {
+            result = -1;
+            break;
+        }
+        *value++ = '\0';
+        char* end;
+        double number = strtod(value, &end);
+        if (end == value || *end != '\0' || number < 0.0) {
+            result = -1;
+        }
+        else if (strcmp(pair, "read") == 0) {
+            spec->read = number;
+        }
+        else if (strcmp(pair, "write") == 0) {
+            spec->write = number;
+        }
+        else if (strcmp(pair, "seek") == 0) {
+            spec->seek = number;
+        }
+        else if (strcmp(pair, "short") == 0) {
+            spec->short_transfer = number;
+        }
+        else if (strcmp(pair, "csw") == 0) {
+            spec->csw = number;
+        }
+        else if (strcmp(pair, "stale") == 0) {
+            spec->stale = number;
+        }
+        else if (strcmp(pair, "detach") == 0) {
+            spec->detach = number;
+        }
+        else if (strcmp(pair, "detach_ms") == 0) {
+            spec->detach_ms = (unsigned int)number;
+        }
+        else if (strcmp(pair, "latency") == 0) {
+            spec->latency_us = (unsigned int)number;
+        }
+        else if (strcmp(pair, "seed") == 0) {
+            spec->seed = (uint32_t)number;
+        }
+        else {
+            result = -1;
+        }
+        if (result == 0 && number > 1.0 && strcmp(pair, "detach_ms") != 0
+            && strcmp(pair, "latency") != 0 && strcmp(pair, "seed") != 0) {
+            result = -1; /* probabilities only */
+        }
+    }
+    free(copy);
+    return result;
+}
+
+int miuchiz_set_faults(const char* spec) {
+    faults_from_environment = 1; /* an explicit setting outranks it */
+    if (spec == NULL || spec[0] == '\0') {
+        faults_set = 0;
+        return 0;
+    }
+    struct FaultSpec parsed;
+    if (fault_parse(spec, &parsed) != 0) {
+        return -1;
+    }
+    faults = parsed;
+    faults_set = 1;
+    return 0;
+}
+
+/* xorshift32: deterministic per seed. Returns a number in [0, 1). */
+static double fault_random(struct FaultHandheld* fault) {
+    fault->rng ^= fault->rng << 13;
+    fault->rng ^= fault->rng >> 17;
+    fault->rng ^= fault->rng << 5;
+    return (fault->rng >> 8) / (double)(1u << 24);
+}
+
+static int fault_roll(struct FaultHandheld* fault, double probability) {
+    if (probability <= 0.0 || fault_random(fault) >= probability) {
+        return 0;
+    }
+    fault->injected++;
+    return 1;
+}
+
+/* The handheld as its own transport sees it, for the span of one call. */
+static struct FaultHandheld* fault_enter(struct Handheld* handheld) {
+    struct FaultHandheld* fault = handheld->transport;
+    handheld->backend = fault->inner;
+    handheld->transport = fault->inner_transport;
+    return fault;
+}
+
+static void fault_leave(struct Handheld* handheld, struct FaultHandheld* fault) {
+    fault->inner = handheld->backend;
+    fault->inner_transport = handheld->transport;
+    handheld->backend = &fault_backend;
+    handheld->transport = fault;
+}
+
+/* What every operation goes through first: latency, and the device being
+ * (or going) off the bus. Returns 0 to go ahead, -1 (errno set) to fail. */
+static int fault_before(struct FaultHandheld* fault) {
+    if (fault->spec.latency_us > 0) {
+        miuchiz_sleep_us(fault->spec.latency_us);
+    }
+    if (!fault->detached && fault_roll(fault, fault->spec.detach)) {
+        fault->detached = 1;
+        miuchiz_utimer_start(&fault->detached_timer);
+    }
+    if (fault->detached) {
+        miuchiz_utimer_end(&fault->detached_timer);
+        if (miuchiz_utimer_elapsed(&fault->detached_timer) / 1000 < fault->spec.detach_ms) {
+            errno = ENODEV;
+            return -1;
+        }
+        fault->detached = 0;
+        fault->reattaches++;
+    }
+    return 0;
+}
+
+static void fault_open(struct Handheld* handheld) {
+    struct FaultHandheld* fault = fault_enter(handheld);
+    fault->inner->open(handheld);
+    fault_leave(handheld, fault);
+}
+
+static void fault_close(struct Handheld* handheld) {
+    struct FaultHandheld* fault = fault_enter(handheld);
+    fault->inner->close(handheld);
+    if (fault->injected > 0) {
+        miuchiz_log("libmiuchiz: injected %llu faults into %s\n",
+                    (unsigned long long)fault->injected, handheld->device);
+    }
+    free(fault->last_read);
+    free(fault);
+    /* The handle is left with its own transport, closed. */
+}
+
+static ssize_t fault_read(struct Handheld* handheld, void* buf, size_t n) {
+    struct FaultHandheld* fault = handheld->transport;
+    if (fault_before(fault) < 0) {
+        return -1;
+    }
+    if (fault_roll(fault, fault->spec.read)) {
+        errno = EIO;
+        return -1;
+    }
+
+    fault_enter(handheld);
+    ssize_t result = fault->inner->read(handheld, buf, n);
+    fault_leave(handheld, fault);
+    if (result <= 0) {
+        return result;
+    }
+
+    if (fault->last_read != NULL && fault->last_read_len == n && fault_roll(fault, fault->spec.stale)) {
+        memcpy(buf, fault->last_read, n);
+        errno = EIO;
+        return -1;
+    }
+    unsigned char* last = realloc(fault->last_read, n);
+    if (last != NULL) {
+        memcpy(last, buf, n);
+        fault->last_read = last;
+        fault->last_read_len = n;
+    }
+
+    if (fault_roll(fault, fault->spec.csw)) {
+        errno = EIO;
+        return -1;
+    }
+    if (result > MIUCHIZ_SECTOR_SIZE && fault_roll(fault, fault->spec.short_transfer)) {
+        return result - MIUCHIZ_SECTOR_SIZE;
+    }
+    return result;
+}
+
+static ssize_t fault_write(struct Handheld* handheld, const void* buf, size_t n) {
+    struct FaultHandheld* fault = handheld->transport;
+    if (fault_before(fault) < 0) {
+        return -1;
+    }
+    if (fault_roll(fault, fault->spec.write)) {
+        errno = EIO;
+        return -1;
+    }
+
+    fault_enter(handheld);
+    ssize_t result = fault->inner->write(handheld, buf, n);
+    fault_leave(handheld, fault);
+    if (result <= 0) {
+        return result;
+    }
+
+    if (fault_roll(fault, fault->spec.csw)) {
+        errno = EIO;
+        return -1;
+    }
+    if (result >= MIUCHIZ_SECTOR_SIZE && fault_roll(fault, fault->spec.short_transfer)) {
+        return result - MIUCHIZ_SECTOR_SIZE;
+    }
+    return result;
+}
+
+static off_t fault_seek(struct Handheld* handheld, off_t offset) {
+    struct FaultHandheld* fault = handheld->transport;
+    if (fault_before(fault) < 0) {
+        return -1;
+    }
+    if (fault_roll(fault, fault->spec.seek)) {
+        errno = EIO;
+        return -1;
+    }
+    fault_enter(handheld);
+    off_t result = fault->inner->seek(handheld, offset);
+    fault_leave(handheld, fault);
+    return result;
+}
+
+static size_t fault_identity(struct Handheld* handheld, void* buf, size_t n) {
+    struct FaultHandheld* fault = fault_enter(handheld);
+    size_t result = fault->inner->identity != NULL ? fault->inner->identity(handheld, buf, n) : 0;
+    fault_leave(handheld, fault);
+    return result;
+}
+
+static int fault_transport_stats(struct Handheld* handheld, struct MiuchizTransportStats* stats) {
+    struct FaultHandheld* fault = fault_enter(handheld);
+    int result = fault->inner->transport_stats != NULL ? fault->inner->transport_stats(handheld, stats) : -1;
+    fault_leave(handheld, fault);
+    if (result == 0) {
+        stats->reattaches += fault->reattaches;
+    }
+    return result;
+}
+
+static unsigned int fault_generation(struct Handheld* handheld) {
+    struct FaultHandheld* fault = fault_enter(handheld);
+    unsigned int result = fault->inner->generation != NULL ? fault->inner->generation(handheld) : 0;
+    fault_leave(handheld, fault);
+    return result + fault->reattaches;
+}
+
+static const struct MiuchizBackend fault_backend = {
+    .name = "fault",
+    .prefix = NULL, /* never chosen by device string; see miuchiz_fault_attach */
+    .open = fault_open,
+    .close = fault_close,
+    .read = fault_read,
+    .write = fault_write,
+    .seek = fault_seek,
+    .identity = fault_identity,
+    .transport_stats = fault_transport_stats,
+    .generation = fault_generation,
+};
+
+void miuchiz_fault_attach(struct Handheld* handheld) {
+    if (!faults_from_environment) {
+        faults_from_environment = 1;
+        const char* spec = getenv("MIUCHIZ_FAULTS");
+        if (spec != NULL && spec[0] != '\0' && fault_parse(spec, &faults) == 0) {
+            faults_set = 1;
+        }
+        else if (spec != NULL && spec[0] != '\0') {
+            miuchiz_log("libmiuchiz: ignoring malformed MIUCHIZ_FAULTS \"%s\"\n", spec);
+        }
+    }
+    if (!faults_set || handheld->backend == &fault_backend) {
+        return;
+    }
+
+    struct FaultHandheld* fault = calloc(1, sizeof(struct FaultHandheld));
+    if (fault == NULL) {
+        return;
+    }
+    fault->spec = faults;
+    /* Distinct, but repeatable, choices per handle. */
+    fault->rng = faults.seed * 2654435761u + ++faulted_handles;
+    if (fault->rng == 0) {
+        fault->rng = 1;
+    }
+    fault->inner = handheld->backend;
+    fault->inner_transport = handheld->transport;
+    handheld->backend = &fault_backend;
+    handheld->transport = fault;
+}
@@ -0,0 +1,369 @@
+/*
+ * Flash image backend: serves a handheld from a flash dump on disk, so every
+ * action works offline on images and the layers above the backend seam can
+ * be exercised and profiled without any transport in the way. Compiled on
+ * every platform and reached through the backend.c dispatch layer for
+ * handhelds whose device string is "img:" + image path, optionally followed
+ * by options in query form:
+ *
+ *   img:flash.bin?otp=otp.bin&mode=write
+ *
+ *   otp=FILE    a 16 KiB OTP dump (as written by dump-otp) for sector 0.
+ *               Without one, sector 0 is blank but for the signature Miuchiz
+ *               Sync checks, and the handheld is identified by its image
+ *               path rather than by its OTP.
+ *   mode=cow    (default) writes land in a private copy of the image that
+ *               is discarded on close.
+ *   mode=write  writes go through to the image file.
+ *
+ * The image is memory-mapped rather than read in, and the command interface
+ * the page layer drives (filemarks, READ/WRITE commands at sector 0x31, page
+ * data at sectors 0x58 and 0x33, READ REVERSE) is answered straight out of
+ * the mapping, as the handheld's firmware answers it out of flash.
+ */
+
+#include "libmiuchiz-usb.h"
+#include "backend-internal.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(_WIN32)
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+#define IMG_DEVICE_PREFIX "img:"
+#define IMG_FLASH_SIZE ((size_t)MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT)
+
+/* Sector 0 exposes the OTP starting at this offset, repeating. */
+#define IMG_OTP_STARTING_OFFSET (0xBDC)
+/* Where Miuchiz Sync looks for the signature within sector 0. */
+#define IMG_SIGNATURE_OFFSET (43)
+
+/* The command interface's opcodes (see commands.c). */
+#define IMG_OPCODE_READ            (0x28)
+#define IMG_OPCODE_WRITE           (0x2A)
+#define IMG_OPCODE_WRITE_FILEMARKS (0x80)
+#define IMG_OPCODE_READ_REVERSE    (0x81)
+
+struct ImgHandheld {
+    unsigned char* flash;   /* the mapped image, IMG_FLASH_SIZE bytes */
+    unsigned char otp[MIUCHIZ_OTP_SIZE];
+    char* identity;         /* the image's absolute path; NULL with an OTP */
+    int write_through;
+    uint32_t current_sector;
+    int read_page;          /* page selected by the last READ command, or -1 */
+    int write_page;         /* page selected by the last WRITE command, or -1 */
+    uint32_t write_size;    /* payload size of the last WRITE command */
+    int ejected;            /* read past the flash; off the bus until reopened */
+#if defined(_WIN32)
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+static uint32_t img_be32(const unsigned char* bytes) {
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16)
+         | ((uint32_t)bytes[2] << 8) | (uint32_t)bytes[3];
+}
+
+/* Splits "path?key=value&..." into its parts, in place. Returns 0 on
+ * success, -1 on an unknown option. */
+static int img_parse_spec(char* spec, const char** otp_path, int* write_through) {
+    *otp_path = NULL;
+    *write_through = 0;
+
+    char* query = strchr(spec, '?');
+    if (query == NULL) {
+        return 0;
+    }
+    *query++ = '\0';
+
+    for (char* option = query; option != NULL && *option != '\0';) {
+        char* next = strchr(option, '&');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        if (strncmp(option, "otp=", 4) == 0) {
+            *otp_path = option + 4;
+        }
+        else if (strcmp(option, "mode=cow") == 0) {
+            *write_through = 0;
+        }
+        else if (strcmp(option, "mode=write") == 0) {
+            *write_through = 1;
+        }
+        else {
+            miuchiz_log("libmiuchiz: unknown image option \"%s\"\n", option);
+            return -1;
+        }
+        option = next;
+    }
+    return 0;
+}
+
+static int img_load_otp(struct ImgHandheld* img, const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        miuchiz_log("libmiuchiz: unable to open OTP image %s. [%d] %s\n", path, errno, strerror(errno));
+        return -1;
+    }
+    size_t got = fread(img->otp, 1, sizeof(img->otp), fp);
+    fclose(fp);
+    if (got != sizeof(img->otp)) {
+        miuchiz_log("libmiuchiz: %s is not a %d-byte OTP image\n", path, MIUCHIZ_OTP_SIZE);
+        return -1;
+    }
+    return 0;
+}
+
+/* Maps the flash image, privately (copy-on-write) or shared (write-through). */
+static int img_map(struct ImgHandheld* img, const char* path) {
+#if defined(_WIN32)
+    DWORD access = img->write_through ? GENERIC_READ | GENERIC_WRITE : GENERIC_READ;
+    img->file = CreateFileA(path, access, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (img->file == INVALID_HANDLE_VALUE) {
+        miuchiz_log("libmiuchiz: unable to open flash image %s. [%lu]\n", path, GetLastError());
+        return -1;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(img->file, &size) || (uint64_t)size.QuadPart != IMG_FLASH_SIZE) {
+        miuchiz_log("libmiuchiz: %s is not a %zu-byte flash image\n", path, IMG_FLASH_SIZE);
+        return -1;
+    }
+    img->mapping = CreateFileMappingA(img->file, NULL, img->write_through ? PAGE_READWRITE : PAGE_WRITECOPY,
+                                      0, 0, NULL);
+    if (img->mapping == NULL) {
+        miuchiz_log("libmiuchiz: unable to map flash image %s. [%lu]\n", path, GetLastError());
+        return -1;
+    }
+    img->flash = MapViewOfFile(img->mapping, img->write_through ? FILE_MAP_WRITE : FILE_MAP_COPY,
+                               0, 0, IMG_FLASH_SIZE);
+    if (img->flash == NULL) {
+        miuchiz_log("libmiuchiz: unable to map flash image %s. [%lu]\n", path, GetLastError());
+        return -1;
+    }
+    return 0;
+#else
+    int fd = open(path, img->write_through ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        miuchiz_log("libmiuchiz: unable to open flash image %s. [%d] %s\n", path, errno, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size != IMG_FLASH_SIZE) {
+        miuchiz_log("libmiuchiz: %s is not a %zu-byte flash image\n", path, IMG_FLASH_SIZE);
+        close(fd);
+        return -1;
+    }
+    void* flash = mmap(NULL, IMG_FLASH_SIZE, PROT_READ | PROT_WRITE,
+                       img->write_through ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+    close(fd); /* the mapping keeps the file */
+    if (flash == MAP_FAILED) {
+        miuchiz_log("libmiuchiz: unable to map flash image %s. [%d] %s\n", path, errno, strerror(errno));
+        return -1;
+    }
+    img->flash = flash;
+    return 0;
+#endif
+}
+
+static void img_free(struct ImgHandheld* img) {
+#if defined(_WIN32)
+    if (img->flash != NULL) {
+        if (img->write_through) {
+            FlushViewOfFile(img->flash, 0);
+        }
+        UnmapViewOfFile(img->flash);
+    }
+    if (img->mapping != NULL) {
+        CloseHandle(img->mapping);
+    }
+    if (img->file != INVALID_HANDLE_VALUE) {
+        CloseHandle(img->file);
+    }
+#else
+    if (img->flash != NULL) {
+        if (img->write_through) {
+            msync(img->flash, IMG_FLASH_SIZE, MS_SYNC);
+        }
+        munmap(img->flash, IMG_FLASH_SIZE);
+    }
+#endif
+    free(img->identity);
+    free(img);
+}
+
+static void img_open(struct Handheld* handheld) {
+    handheld->transport = NULL;
+
+    char* spec = strdup(handheld->device + strlen(IMG_DEVICE_PREFIX));
+    struct ImgHandheld* img = calloc(1, sizeof(struct ImgHandheld));
+    if (spec == NULL || img == NULL) {
+        free(spec);
+        free(img);
+        return;
+    }
+#if defined(_WIN32)
+    img->file = INVALID_HANDLE_VALUE;
+#endif
+    img->read_page = -1;
+    img->write_page = -1;
+
+    const char* otp_path = NULL;
+    if (img_parse_spec(spec, &otp_path, &img->write_through) != 0 || img_map(img, spec) != 0) {
+        goto fail;
+    }
+
+    if (otp_path != NULL) {
+        if (img_load_otp(img, otp_path) != 0) {
+            goto fail;
+        }
+    }
+    else {
+        for (size_t i = 0; i < 10; i++) {
+            img->otp[(IMG_OTP_STARTING_OFFSET + IMG_SIGNATURE_OFFSET + i) % MIUCHIZ_OTP_SIZE] = "SITRONIXTM"[i];
+        }
+#if defined(_WIN32)
+        img->identity = _fullpath(NULL, spec, 0);
+#else
+        img->identity = realpath(spec, NULL);
+#endif
+        if (img->identity == NULL) {
+            img->identity = strdup(spec);
+        }
+    }
+
+    free(spec);
+    handheld->transport = img;
+    return;
+
+fail:
+    free(spec);
+    img_free(img);
+}
+
+static void img_close(struct Handheld* handheld) {
+    struct ImgHandheld* img = handheld->transport;
+    if (img != NULL) {
+        img_free(img);
+        handheld->transport = NULL;
+    }
+}
+
+static size_t img_identity(struct Handheld* handheld, void* buf, size_t n) {
+    struct ImgHandheld* img = handheld->transport;
+    if (img == NULL || img->identity == NULL) {
+        return 0;
+    }
+    size_t len = strlen(img->identity);
+    memcpy(buf, img->identity, len < n ? len : n);
+    return len;
+}
+
+/* Like the real handheld, a sector transfer is all or nothing and the data
+ * sectors only mean something inside a READ/WRITE command sequence. */
+
+static ssize_t img_read(struct Handheld* handheld, void* buf, size_t n) {
+    struct ImgHandheld* img = handheld->transport;
+    if (img == NULL || img->ejected) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    unsigned char* out = buf;
+    memset(out, 0, n);
+    if (img->current_sector == 0) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = img->otp[(IMG_OTP_STARTING_OFFSET + i) % MIUCHIZ_OTP_SIZE];
+        }
+    }
+    else if (img->current_sector == MIUCHIZ_SECTOR_DATA_READ && img->read_page >= 0 && n >= 4) {
+        /* 4-byte big-endian length, then the page. */
+        out[2] = (MIUCHIZ_PAGE_SIZE >> 8) & 0xFF;
+        size_t copy = n - 4 < MIUCHIZ_PAGE_SIZE ? n - 4 : MIUCHIZ_PAGE_SIZE;
+        memcpy(out + 4, img->flash + (size_t)img->read_page * MIUCHIZ_PAGE_SIZE, copy);
+    }
+    return (ssize_t)n;
+}
+
+static void img_command(struct ImgHandheld* img, const unsigned char* cmd, size_t n) {
+    switch (cmd[0]) {
+        case IMG_OPCODE_WRITE_FILEMARKS:
+        case IMG_OPCODE_READ_REVERSE:
+            img->read_page = -1;
+            img->write_page = -1;
+            break;
+        case IMG_OPCODE_READ:
+            if (n >= 5) {
+                uint32_t page = img_be32(cmd + 1);
+                if (page >= MIUCHIZ_PAGE_COUNT) {
+                    /* Reading past the flash makes the handheld drop off the
+                     * bus (the eject action relies on it). */
+                    img->ejected = 1;
+                }
+                else {
+                    img->read_page = (int)page;
+                }
+            }
+            break;
+        case IMG_OPCODE_WRITE:
+            if (n >= 9 && img_be32(cmd + 1) < MIUCHIZ_PAGE_COUNT) {
+                img->write_page = (int)img_be32(cmd + 1);
+                img->write_size = img_be32(cmd + 5);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+static ssize_t img_write(struct Handheld* handheld, const void* buf, size_t n) {
+    struct ImgHandheld* img = handheld->transport;
+    if (img == NULL || img->ejected) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    const unsigned char* data = buf;
+    if (img->current_sector == MIUCHIZ_SECTOR_SCSI_WRITE && n >= 1) {
+        img_command(img, data, n);
+    }
+    else if (img->current_sector == MIUCHIZ_SECTOR_DATA_WRITE && img->write_page >= 0) {
+        size_t copy = n < img->write_size ? n : img->write_size;
+        if (copy > MIUCHIZ_PAGE_SIZE) {
+            copy = MIUCHIZ_PAGE_SIZE;
+        }
+        memcpy(img->flash + (size_t)img->write_page * MIUCHIZ_PAGE_SIZE, data, copy);
+    }
+    return (ssize_t)n;
+}
+
+static off_t img_seek(struct Handheld* handheld, off_t offset) {
+    struct ImgHandheld* img = handheld->transport;
+    if (img == NULL) {
+        return -1;
+    }
+    img->current_sector = (uint32_t)(offset / MIUCHIZ_SECTOR_SIZE);
+    return 0;
+}
+
+const struct MiuchizBackend miuchiz_img_backend = {
+    .name = "img",
+    .prefix = IMG_DEVICE_PREFIX,
+    .open = img_open,
+    .close = img_close,
+    .read = img_read,
+    .write = img_write,
+    .seek = img_seek,
+    .identity = img_identity,
+    /* Images are not attached anywhere to be found. */
+};
@@ -2,9 +2,11 @@
 #define MIUCHIZ_LIBMIUCHIZ_BACKEND_INTERNAL_H
 
 #include "libmiuchiz-usb.h"
+#include "backend.h"
 
 /*
- * The two transports behind the miuchiz_backend_* dispatchers (backend.c).
+ * The built-in transports behind the miuchiz_backend_* dispatchers
+ * (backend.c).
  *
  * miuchiz_platform_*: real hardware, exactly one implementation compiled in
  * (backend-linux.c / backend-windows.c / backend-libusb.c, selected at
@@ -13,8 +15,19 @@
  * miuchiz_emu_*: a running emiu2 emulator instance, reached over a local
  * socket (backend-emu.c, compiled on every platform). Emulator handhelds are
  * recognized by their device string: "emu:" followed by the endpoint file
- * path. They keep their connection state in handheld->emu, leaving
+ * path. They keep their connection state in handheld->transport, leaving
  * handheld->fd (whose type belongs to the platform backend) untouched.
+ *
+ * miuchiz_img_*: a flash image file served from memory (backend-img.c,
+ * compiled on every platform). Image handhelds are "img:" followed by the
+ * image path and options, keep their state in handheld->transport, and are never
+ * enumerated: they exist only where a device string names them.
+ *
+ * Recording (MIUCHIZ_RECORD) wraps any of them in a decorator that traces
+ * every operation; miuchiz_replay_* plays such a trace back as a "replay:"
+ * handheld (backend-record.c, compiled on every platform). Fault injection
+ * (miuchiz_set_faults, MIUCHIZ_FAULTS) wraps them in another, beneath the
+ * recorder (backend-fault.c).
  */
 
 /* --- the platform backend (one of the three per-OS files) ---------------- */
@@ -31,16 +44,7 @@ long miuchiz_platform_page_alignment(void);
 
 /* --- the emulator backend (backend-emu.c, always compiled) --------------- */
 
-/** Whether this handheld's device string names an emulator endpoint. */
-int miuchiz_emu_is(const struct Handheld* handheld);
-
-/**
- * Resolves `app`'s runtime directory per the shared Miuchiz Reborn
- * storage-location policy (mirrors the miuchiz-reborn-paths crate; verified
- * against its vendored test vectors by the paths-conformance test).
- * @return 0 on success, -1 on failure.
- */
-int miuchiz_emu_runtime_dir(const char* app, char* buf, size_t bufn);
+extern const struct MiuchizBackend miuchiz_emu_backend;
 
 /**
  * The directory emulators publish USB endpoints in: emiu2's runtime
@@ -49,12 +53,6 @@ int miuchiz_emu_runtime_dir(const char* app, char* buf, size_t bufn);
  */
 int miuchiz_emu_endpoint_dir(char* buf, size_t bufn);
 
-void miuchiz_emu_open(struct Handheld* handheld);
-void miuchiz_emu_close(struct Handheld* handheld);
-ssize_t miuchiz_emu_read(struct Handheld* handheld, void* buf, size_t n);
-ssize_t miuchiz_emu_write(struct Handheld* handheld, const void* buf, size_t n);
-off_t miuchiz_emu_seek(struct Handheld* handheld, off_t offset);
-
 /**
  * Discovers running emulator instances (endpoint files in the emiu2 runtime
  * directory), verifying each candidate like the platform enumerators do.
@@ -64,4 +62,30 @@ off_t miuchiz_emu_seek(struct Handheld* handheld, off_t offset);
  */
 int miuchiz_emu_enumerate(struct Handheld*** handhelds);
 
+/* --- the flash image backend (backend-img.c, always compiled) ------------ */
+
+extern const struct MiuchizBackend miuchiz_img_backend;
+
+/* --- recording and replay (backend-record.c, always compiled) ------------ */
+
+/* "replay:" + trace path: answers from a recorded session. */
+extern const struct MiuchizBackend miuchiz_replay_backend;
+
+/**
+ * Starts recording the handheld's traffic to the MIUCHIZ_RECORD trace, when
+ * that is set, by wrapping its current transport. Call on a handheld whose
+ * transport is chosen but, unless it came from discovery, not yet opened.
+ */
+void miuchiz_record_attach(struct Handheld* handheld);
+
+/* --- fault injection (backend-fault.c, always compiled) ------------------ */
+
+/**
+ * Starts injecting the configured faults (miuchiz_set_faults, or
+ * MIUCHIZ_FAULTS) into the handheld's traffic, when any are configured, by
+ * wrapping its current transport. Call before miuchiz_record_attach, on a
+ * handheld whose transport is chosen.
+ */
+void miuchiz_fault_attach(struct Handheld* handheld);
+
 #endif
@@ -0,0 +1,615 @@
+/*
+ * Recording and replaying transports, so a session on the line - pipe
+ * errors, odd status, long pacing and all - becomes a repeatable test and a
+ * benchmark of the layers above the backend seam against real device
+ * behavior.
+ *
+ * Recording: with MIUCHIZ_RECORD set to a file path, every handheld opened
+ * or discovered is wrapped in a decorator that passes each operation on to
+ * the handheld's own transport and appends it to a trace: the operation and
+ * its arguments, what it returned, errno, when it started relative to the
+ * previous one, how long it took, and for data-bearing operations a hash of
+ * the payload and the payload itself. The first handheld records to the path
+ * itself, later ones to "path.1", "path.2" and so on.
+ *
+ * Replaying: "replay:" + trace path is a transport that answers from the
+ * trace. Each operation must be the one recorded next, with the same
+ * arguments (and, for writes, the same payload); the first that is not ends
+ * the replay with EIO, naming where the session diverged. By default
+ * answers come back at once; "?timing=original" waits each out for as long
+ * as the device took, and leaves at least the recorded gap between one
+ * operation and the next.
+ *
+ * Trace format (integers are LEB128 varints unless noted):
+ *   header : "MIUTRACE"  version:u8(1)  device_len  device[..]
+ *   record : op:u8  gap_us  duration_us  arg  result (zigzag)  errno
+ *            then, for READ, WRITE and IDENTITY:
+ *              fnv1a64:u64le  data_len  data[..]
+ *            and for STATS: the eight MiuchizTransportStats counters.
+ * arg is the requested size for READ, WRITE and IDENTITY and the offset for
+ * SEEK. Operations a transport leaves out are recorded with the result the
+ * dispatcher would have given, so a trace replays through any dispatcher.
+ */
+
+#include "libmiuchiz-usb.h"
+#include "backend-internal.h"
+#include "timer.h"
+#include "sleep.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#define TRACE_MAGIC "MIUTRACE"
+#define TRACE_VERSION (1)
+#define REPLAY_DEVICE_PREFIX "replay:"
+
+enum TraceOp {
+    TRACE_OPEN = 1,
+    TRACE_CLOSE,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_SEEK,
+    TRACE_IDENTITY,
+    TRACE_STATS,
+    TRACE_GENERATION,
+};
+
+static const char* trace_op_name(int op) {
+    static const char* names[] = {
+        "?", "open", "close", "read", "write", "seek", "identity", "stats", "generation",
+    };
+    return (op >= TRACE_OPEN && op <= TRACE_GENERATION) ? names[op] : names[0];
+}
+
+static uint64_t trace_hash(const void* data, size_t n) {
+    const unsigned char* bytes = data;
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < n; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+/* ---------------------------------------------------------------------------
+ * Recording.
+ * ------------------------------------------------------------------------ */
+
+struct RecordHandheld {
+    const struct MiuchizBackend* inner;
+    void* inner_transport;
+    FILE* fp;
+    struct Utimer clock;
+    uint64_t last_end_us; /* since the clock started */
+};
+
+static const struct MiuchizBackend record_backend;
+
+static uint64_t record_now_us(struct RecordHandheld* record) {
+    miuchiz_utimer_end(&record->clock);
+    return miuchiz_utimer_elapsed(&record->clock);
+}
+
+static void put_varint(FILE* fp, uint64_t value) {
+    unsigned char bytes[10];
+    size_t n = 0;
+    do {
+        bytes[n] = value & 0x7F;
+        value >>= 7;
+        if (value != 0) {
+            bytes[n] |= 0x80;
+        }
+        n++;
+    } while (value != 0);
+    fwrite(bytes, 1, n, fp);
+}
+
+static void put_u64le(FILE* fp, uint64_t value) {
+    unsigned char bytes[8];
+    for (int i = 0; i < 8; i++) {
+        bytes[i] = (unsigned char)(value >> (8 * i));
+    }
+    fwrite(bytes, 1, sizeof(bytes), fp);
+}
+
+/* The handheld as its own transport sees it, for the span of one call. */
+static struct RecordHandheld* record_enter(struct Handheld* handheld) {
+    struct RecordHandheld* record = handheld->transport;
+    handheld->backend = record->inner;
+    handheld->transport = record->inner_transport;
+    return record;
+}
+
+static void record_leave(struct Handheld* handheld, struct RecordHandheld* record) {
+    record->inner = handheld->backend;
+    record->inner_transport = handheld->transport;
+    handheld->backend = &record_backend;
+    handheld->transport = record;
+}
+
+/* Appends one record; data is NULL for operations that carry none. Keeps
+ * errno, which belongs to the operation. */
+static void record_put(struct RecordHandheld* record, int op, uint64_t start_us, uint64_t arg,
+                       int64_t result, int err, const void* data, size_t n) {
+    uint64_t end_us = record_now_us(record);
+    FILE* fp = record->fp;
+    fputc(op, fp);
+    put_varint(fp, start_us > record->last_end_us ? start_us - record->last_end_us : 0);
+    put_varint(fp, end_us - start_us);
+    put_varint(fp, arg);
+    put_varint(fp, ((uint64_t)result << 1) ^ (uint64_t)(result >> 63));
+    put_varint(fp, (uint64_t)(err > 0 ? err : 0));
+    if (op == TRACE_READ || op == TRACE_WRITE || op == TRACE_IDENTITY) {
+        put_u64le(fp, trace_hash(data, n));
+        put_varint(fp, n);
+        fwrite(data, 1, n, fp);
+    }
+    if (result < 0) {
+        fflush(fp); /* keep the interesting part should the session crash */
+    }
+    record->last_end_us = record_now_us(record);
+    errno = err;
+}
+
+static void record_open(struct Handheld* handheld) {
+    struct RecordHandheld* record = record_enter(handheld);
+    uint64_t start_us = record_now_us(record);
+    errno = 0;
+    record->inner->open(handheld);
+    int err = errno;
+    record_leave(handheld, record);
+    record_put(record, TRACE_OPEN, start_us, 0, 0, err, NULL, 0);
+}
+
+static void record_close(struct Handheld* handheld) {
+    struct RecordHandheld* record = record_enter(handheld);
+    uint64_t start_us = record_now_us(record);
+    record->inner->close(handheld);
+    record_put(record, TRACE_CLOSE, start_us, 0, 0, 0, NULL, 0);
+    fclose(record->fp);
+    free(record);
+    /* The handle is left with its own transport, closed. */
+}
+
+static ssize_t record_read(struct Handheld* handheld, void* buf, size_t n) {
+    struct RecordHandheld* record = record_enter(handheld);
+    uint64_t start_us = record_now_us(record);
+    errno = 0;
+    ssize_t result = record->inner->read(handheld, buf, n);
+    int err = errno;
+    record_leave(handheld, record);
+    size_t got = result > 0 ? ((size_t)result < n ? (size_t)result : n) : 0;
+    record_put(record, TRACE_READ, start_us, n, result, err, buf, got);
+    return result;
+}
+
+static ssize_t record_write(struct Handheld* handheld, const void* buf, size_t n) {
+    struct RecordHandheld* record = record_enter(handheld);
+    uint64_t start_us = record_now_us(record);
+    errno = 0;
+    ssize_t result = record->inner->write(handheld, buf, n);
+    int err = errno;
+    record_leave(handheld, record);
+    record_put(record, TRACE_WRITE, start_us, n, result, err, buf, n);
+    return result;
+}
+
+static off_t record_seek(struct Handheld* handheld, off_t offset) {
+    struct RecordHandheld* record = record_enter(handheld);
+    uint64_t start_us = record_now_us(record);
+    errno = 0;
+    off_t result = record->inner->seek(handheld, offset);
+    int err = errno;
+    record_leave(handheld, record);
+    record_put(record, TRACE_SEEK, start_us, (uint64_t)offset, result, err, NULL, 0);
+    return result;
+}
+
+static size_t record_identity(struct Handheld* handheld, void* buf, size_t n) {
+    struct RecordHandheld* record = record_enter(handheld);
+    uint64_t start_us = record_now_us(record);
+    size_t result = record->inner->identity != NULL ? record->inner->identity(handheld, buf, n) : 0;
+    record_leave(handheld, record);
+    record_put(record, TRACE_IDENTITY, start_us, n, (int64_t)result, 0, buf, result < n ? result : n);
+    return result;
+}
+
+static int record_transport_stats(struct Handheld* handheld, struct MiuchizTransportStats* stats) {
+    struct RecordHandheld* record = record_enter(handheld);
+    uint64_t start_us = record_now_us(record);
+    int result = record->inner->transport_stats != NULL ? record->inner->transport_stats(handheld, stats) : -1;
+    record_leave(handheld, record);
+    record_put(record, TRACE_STATS, start_us, 0, result, 0, NULL, 0);
+    if (result == 0) {
+        uint64_t counters[] = {
+            stats->transactions, stats->send_calls, stats->recv_calls, stats->bytes_sent,
+            stats->bytes_received, stats->naks, stats->nak_wait_us, stats->reattaches,
+        };
+        for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+            put_varint(record->fp, counters[i]);
+        }
+    }
+    return result;
+}
+
+static unsigned int record_generation(struct Handheld* handheld) {
+    struct RecordHandheld* record = record_enter(handheld);
+    uint64_t start_us = record_now_us(record);
+    unsigned int result = record->inner->generation != NULL ? record->inner->generation(handheld) : 0;
+    record_leave(handheld, record);
+    record_put(record, TRACE_GENERATION, start_us, 0, result, 0, NULL, 0);
+    return result;
+}
+
+static const struct MiuchizBackend record_backend = {
+    .name = "record",
+    .prefix = NULL, /* never chosen by device string; see miuchiz_record_attach */
+    .open = record_open,
+    .close = record_close,
+    .read = record_read,
+    .write = record_write,
+    .seek = record_seek,
+    .identity = record_identity,
+    .transport_stats = record_transport_stats,
+    .generation = record_generation,
+};
+
+void miuchiz_record_attach(struct Handheld* handheld) {
+    static unsigned int traces = 0;
+
+    const char* path = getenv("MIUCHIZ_RECORD");
+    if (path == NULL || path[0] == '\0' || handheld->backend == &record_backend) {
+        return;
+    }
+
+    char numbered[1024];
+    if (traces > 0) {
+        snprintf(numbered, sizeof(numbered), "%s.%u", path, traces);
+        path = numbered;
+    }
+    struct RecordHandheld* record = calloc(1, sizeof(struct RecordHandheld));
+    FILE* fp = record != NULL ? fopen(path, "wb") : NULL;
+    if (fp == NULL) {
+        miuchiz_log("libmiuchiz: unable to record %s to %s\n", handheld->device, path);
+        free(record);
+        return;
+    }
+    traces++;
+
+    fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), fp);
+    fputc(TRACE_VERSION, fp);
+    size_t device_len = strlen(handheld->device);
+    put_varint(fp, device_len);
+    fwrite(handheld->device, 1, device_len, fp);
+
+    record->fp = fp;
+    miuchiz_utimer_start(&record->clock);
+    record->inner = handheld->backend;
+    record->inner_transport = handheld->transport;
+    handheld->backend = &record_backend;
+    handheld->transport = record;
+}
+
+/* ---------------------------------------------------------------------------
+ * Replaying.
+ * ------------------------------------------------------------------------ */
+
+struct TraceRecord {
+    int op;
+    uint64_t gap_us;
+    uint64_t duration_us;
+    uint64_t arg;
+    int64_t result;
+    int err;
+    uint64_t hash;
+    const unsigned char* data;
+    size_t data_len;
+    struct MiuchizTransportStats stats;
+};
+
+struct ReplayHandheld {
+    unsigned char* trace;
+    size_t len;
+    size_t pos;
+    size_t index;    /* of the next record, for divergence reports */
+    int original_timing;
+    int diverged;
+    struct Utimer clock;
+    uint64_t last_end_us; /* since the clock started */
+};
+
+static int get_varint(struct ReplayHandheld* replay, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (replay->pos >= replay->len) {
+            return -1;
+        }
+        unsigned char byte = replay->trace[replay->pos++];
+        *value |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Parses the next record. Returns 0, or -1 at the end of the trace. */
+static int replay_parse(struct ReplayHandheld* replay, struct TraceRecord* record) {
+    memset(record, 0, sizeof(*record));
+    if (replay->pos >= replay->len) {
+        return -1;
+    }
+    record->op = replay->trace[replay->pos++];
+
+    uint64_t result, err;
+    if (get_varint(replay, &record->gap_us) < 0 || get_varint(replay, &record->duration_us) < 0
+        || get_varint(replay, &record->arg) < 0 || get_varint(replay, &result) < 0
+        || get_varint(replay, &err) < 0) {
+        return -1;
+    }
+    record->result = (int64_t)(result >> 1) ^ -(int64_t)(result & 1);
+    record->err = (int)err;
+
+    if (record->op == TRACE_READ || record->op == TRACE_WRITE || record->op == TRACE_IDENTITY) {
+        if (replay->len - replay->pos < 8) {
+            return -1;
+        }
+        for (int i = 0; i < 8; i++) {
+            record->hash |= (uint64_t)replay->trace[replay->pos++] << (8 * i);
+        }
+        uint64_t data_len;
+        if (get_varint(replay, &data_len) < 0 || data_len > replay->len - replay->pos) {
+            return -1;
+        }
+        record->data = replay->trace + replay->pos;
+        record->data_len = (size_t)data_len;
+        replay->pos += (size_t)data_len;
+    }
+    else if (record->op == TRACE_STATS && record->result == 0) {
+        uint64_t* counters[] = {
+            &record->stats.transactions, &record->stats.send_calls, &record->stats.recv_calls,
+            &record->stats.bytes_sent, &record->stats.bytes_received, &record->stats.naks,
+            &record->stats.nak_wait_us, &record->stats.reattaches,
+        };
+        for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+            if (get_varint(replay, counters[i]) < 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Waits out what is left of the recorded gap before an operation - the
+ * caller's own work since the last one counts towards it - and then the
+ * operation itself. */
+static void replay_pace(struct ReplayHandheld* replay, const struct TraceRecord* record) {
+    miuchiz_utimer_end(&replay->clock);
+    uint64_t since_us = miuchiz_utimer_elapsed(&replay->clock) - replay->last_end_us;
+    uint64_t wait_us = (record->gap_us > since_us ? record->gap_us - since_us : 0) + record->duration_us;
+    if (wait_us > 0) {
+        miuchiz_sleep_us((unsigned int)wait_us);
+    }
+    miuchiz_utimer_end(&replay->clock);
+    replay->last_end_us = miuchiz_utimer_elapsed(&replay->clock);
+}
+
+/* Takes the next record, which must be `op` with argument `arg`. Returns 0,
+ * or -1 (errno EIO) once the session has diverged from the trace. */
+static int replay_take(struct ReplayHandheld* replay, int op, uint64_t arg, struct TraceRecord* record) {
+    if (replay == NULL || replay->diverged) {
+        errno = EIO;
+        return -1;
+    }
+    size_t at = replay->pos;
+    if (replay_parse(replay, record) < 0) {
+        miuchiz_log("libmiuchiz: replay: %s after the end of the trace (record %zu)\n",
+                    trace_op_name(op), replay->index);
+        replay->diverged = 1;
+        errno = EIO;
+        return -1;
+    }
+    if (record->op != op || record->arg != arg) {
+        miuchiz_log("libmiuchiz: replay diverged at record %zu: %s(%llu) where the trace has %s(%llu)\n",
+                    replay->index, trace_op_name(op), (unsigned long long)arg,
+                    trace_op_name(record->op), (unsigned long long)record->arg);
+        replay->pos = at;
+        replay->diverged = 1;
+        errno = EIO;
+        return -1;
+    }
+    /* A damaged or hand-edited trace must not hand back more than the caller
+     * has room for, nor claim more was read than it holds. */
+    if (record->data_len > arg || (op == TRACE_READ && record->result > (int64_t)record->data_len)) {
+        miuchiz_log("libmiuchiz: replay diverged at record %zu: %s(%llu) holds %zu bytes\n",
+                    replay->index, trace_op_name(op), (unsigned long long)arg, record->data_len);
+        replay->pos = at;
+        replay->diverged = 1;
+        errno = EIO;
+        return -1;
+    }
+    replay->index++;
+    if (replay->original_timing) {
+        replay_pace(replay, record);
+    }
+    return 0;
+}
+
+static void replay_free(struct ReplayHandheld* replay) {
+    free(replay->trace);
+    free(replay);
+}
+
+/* Reads the trace named by "path[?timing=original|compressed]" and checks
+ * its header. */
+static struct ReplayHandheld* replay_load(const char* spec) {
+    char* path = strdup(spec);
+    struct ReplayHandheld* replay = calloc(1, sizeof(struct ReplayHandheld));
+    if (path == NULL || replay == NULL) {
+        free(path);
+        free(replay);
+        return NULL;
+    }
+    char* query = strchr(path, '?');
+    if (query != NULL) {
+        *query++ = '\0';
+        if (strcmp(query, "timing=original") == 0) {
+            replay->original_timing = 1;
+        }
+        else if (strcmp(query, "timing=compressed") != 0) {
+            miuchiz_log("libmiuchiz: unknown replay option \"%s\"\n", query);
+            goto fail;
+        }
+    }
+
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        miuchiz_log("libmiuchiz: unable to open trace %s. [%d] %s\n", path, errno, strerror(errno));
+        goto fail;
+    }
+    size_t capacity = 1 << 16;
+    replay->trace = malloc(capacity);
+    size_t got;
+    while (replay->trace != NULL && (got = fread(replay->trace + replay->len, 1, capacity - replay->len, fp)) > 0) {
+        replay->len += got;
+        if (replay->len == capacity) {
+            unsigned char* grown = realloc(replay->trace, capacity * 2);
+            if (grown == NULL) {
+                break;
+            }
+            replay->trace = grown;
+            capacity *= 2;
+        }
+    }
+    fclose(fp);
+
+    size_t magic_len = strlen(TRACE_MAGIC);
+    uint64_t device_len = 0;
+    if (replay->trace == NULL || replay->len < magic_len + 1
+        || memcmp(replay->trace, TRACE_MAGIC, magic_len) != 0 || replay->trace[magic_len] != TRACE_VERSION) {
+        miuchiz_log("libmiuchiz: %s is not a version %d trace\n", path, TRACE_VERSION);
+        goto fail;
+    }
+    replay->pos = magic_len + 1;
+    if (get_varint(replay, &device_len) < 0 || device_len > replay->len - replay->pos) {
+        miuchiz_log("libmiuchiz: %s is truncated\n", path);
+        goto fail;
+    }
+    miuchiz_log("libmiuchiz: replaying %.*s from %s\n", (int)device_len,
+                (const char*)replay->trace + replay->pos, path);
+    replay->pos += (size_t)device_len;
+    free(path);
+    return replay;
+
+fail:
+    free(path);
+    replay_free(replay);
+    return NULL;
+}
+
+static void replay_open(struct Handheld* handheld) {
+    struct ReplayHandheld* replay = replay_load(handheld->device + strlen(REPLAY_DEVICE_PREFIX));
+    handheld->transport = replay;
+    if (replay == NULL) {
+        return;
+    }
+    /* Handhelds found by discovery were already open when recording began. */
+    size_t at = replay->pos;
+    struct TraceRecord record;
+    if (replay_parse(replay, &record) == 0 && record.op == TRACE_OPEN) {
+        replay->index++;
+    }
+    else {
+        replay->pos = at;
+    }
+    miuchiz_utimer_start(&replay->clock);
+}
+
+static void replay_close(struct Handheld* handheld) {
+    struct ReplayHandheld* replay = handheld->transport;
+    if (replay != NULL) {
+        replay_free(replay);
+        handheld->transport = NULL;
+    }
+}
+
+static ssize_t replay_read(struct Handheld* handheld, void* buf, size_t n) {
+    struct TraceRecord record;
+    if (replay_take(handheld->transport, TRACE_READ, n, &record) < 0) {
+        return -1;
+    }
+    memcpy(buf, record.data, record.data_len);
+    errno = record.err;
+    return (ssize_t)record.result;
+}
+
+static ssize_t replay_write(struct Handheld* handheld, const void* buf, size_t n) {
+    struct ReplayHandheld* replay = handheld->transport;
+    struct TraceRecord record;
+    if (replay_take(replay, TRACE_WRITE, n, &record) < 0) {
+        return -1;
+    }
+    if (record.hash != trace_hash(buf, n)) {
+        miuchiz_log("libmiuchiz: replay diverged at record %zu: the write's payload differs\n",
+                    replay->index - 1);
+        replay->diverged = 1;
+        errno = EIO;
+        return -1;
+    }
+    errno = record.err;
+    return (ssize_t)record.result;
+}
+
+static off_t replay_seek(struct Handheld* handheld, off_t offset) {
+    struct TraceRecord record;
+    if (replay_take(handheld->transport, TRACE_SEEK, (uint64_t)offset, &record) < 0) {
+        return -1;
+    }
+    errno = record.err;
+    return (off_t)record.result;
+}
+
+static size_t replay_identity(struct Handheld* handheld, void* buf, size_t n) {
+    struct TraceRecord record;
+    if (replay_take(handheld->transport, TRACE_IDENTITY, n, &record) < 0) {
+        return 0;
+    }
+    memcpy(buf, record.data, record.data_len);
+    return (size_t)record.result;
+}
+
+static int replay_transport_stats(struct Handheld* handheld, struct MiuchizTransportStats* stats) {
+    struct TraceRecord record;
+    if (replay_take(handheld->transport, TRACE_STATS, 0, &record) < 0) {
+        return -1;
+    }
+    if (record.result == 0) {
+        *stats = record.stats;
+    }
+    return (int)record.result;
+}
+
+static unsigned int replay_generation(struct Handheld* handheld) {
+    struct TraceRecord record;
+    if (replay_take(handheld->transport, TRACE_GENERATION, 0, &record) < 0) {
+        return 0;
+    }
+    return (unsigned int)record.result;
+}
+
+const struct MiuchizBackend miuchiz_replay_backend = {
+    .name = "replay",
+    .prefix = REPLAY_DEVICE_PREFIX,
+    .open = replay_open,
+    .close = replay_close,
+    .read = replay_read,
+    .write = replay_write,
+    .seek = replay_seek,
+    .identity = replay_identity,
+    .transport_stats = replay_transport_stats,
+    .generation = replay_generation,
+    /* A trace is only ever replayed by name. */
+};
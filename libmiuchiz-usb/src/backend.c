@@ -8,50 +8,112 @@
 /*
  * Per-handle transport dispatch. The platform backend (compiled in at
  * configure time) reaches real hardware; the emulator backend reaches
- * running emiu2 instances over a local socket. A handheld's transport is
- * decided by its device string: "emu:..." is an emulator, anything else
- * belongs to the platform backend.
+ * running emiu2 instances over a local socket; the image backend serves a
+ * flash dump from memory; the replay backend answers from a recorded
+ * session. A handheld's transport is decided once, when it
+ * is opened, by the prefix of its device string ("emu:..." is an emulator,
+ * "img:..." an image, anything without a registered prefix belongs to the
+ * platform backend), and every later call is one indirect call through it.
  */
 
-fp_t miuchiz_backend_open(struct Handheld* handheld) {
-    if (miuchiz_emu_is(handheld)) {
-        miuchiz_emu_open(handheld);
-        return handheld->fd; /* untouched; emulator state lives in ->emu */
+#define MIUCHIZ_BACKEND_MAX (16)
+
+static void platform_open(struct Handheld* handheld) {
+    miuchiz_platform_open(handheld);
+}
+
+static const struct MiuchizBackend platform_backend = {
+    .name = "platform",
+    .prefix = NULL,
+    .open = platform_open,
+    .close = miuchiz_platform_close,
+    .read = miuchiz_platform_read,
+    .write = miuchiz_platform_write,
+    .seek = miuchiz_platform_seek,
+    /* Device nodes and bus addresses are reassigned on every replug, so
+     * there is no identity; a replugged handheld is a new device node, so
+     * nothing reattaches. */
+    .enumerate = miuchiz_platform_enumerate,
+};
+
+/* Registered transports, searched newest first. */
+static const struct MiuchizBackend* registry[MIUCHIZ_BACKEND_MAX] = {
+    &miuchiz_emu_backend,
+    &miuchiz_img_backend,
+    &miuchiz_replay_backend,
+};
+static int registry_count = 3;
+
+int miuchiz_backend_register(const struct MiuchizBackend* backend) {
+    if (backend->prefix == NULL || registry_count >= MIUCHIZ_BACKEND_MAX) {
+        return -1;
     }
-    return miuchiz_platform_open(handheld);
+    registry[registry_count++] = backend;
+    return 0;
 }
 
-void miuchiz_backend_close(struct Handheld* handheld) {
-    if (miuchiz_emu_is(handheld)) {
-        miuchiz_emu_close(handheld);
-        return;
+const struct MiuchizBackend* miuchiz_backend_for(const char* device) {
+    if (device != NULL) {
+        for (int i = registry_count - 1; i >= 0; i--) {
+            const char* prefix = registry[i]->prefix;
+            if (strncmp(device, prefix, strlen(prefix)) == 0) {
+                return registry[i];
+            }
+        }
     }
-    miuchiz_platform_close(handheld);
+    return &platform_backend;
 }
 
-ssize_t miuchiz_backend_read(struct Handheld* handheld, void* buf, size_t n) {
-    if (miuchiz_emu_is(handheld)) {
-        return miuchiz_emu_read(handheld, buf, n);
+/* Handles made by an enumerator, rather than opened, may not have chosen. */
+static const struct MiuchizBackend* backend_of(struct Handheld* handheld) {
+    if (handheld->backend == NULL) {
+        handheld->backend = miuchiz_backend_for(handheld->device);
     }
-    return miuchiz_platform_read(handheld, buf, n);
+    return handheld->backend;
+}
+
+fp_t miuchiz_backend_open(struct Handheld* handheld) {
+    handheld->backend = miuchiz_backend_for(handheld->device);
+    /* Faults go in below the recorder, so a trace shows what they did. */
+    miuchiz_fault_attach(handheld);
+    miuchiz_record_attach(handheld);
+    handheld->backend->open(handheld);
+    return handheld->fd; /* untouched by transports other than the platform's */
+}
+
+void miuchiz_backend_close(struct Handheld* handheld) {
+    backend_of(handheld)->close(handheld);
+}
+
+ssize_t miuchiz_backend_read(struct Handheld* handheld, void* buf, size_t n) {
+    return backend_of(handheld)->read(handheld, buf, n);
 }
 
 ssize_t miuchiz_backend_write(struct Handheld* handheld, const void* buf, size_t n) {
-    if (miuchiz_emu_is(handheld)) {
-        return miuchiz_emu_write(handheld, buf, n);
-    }
-    return miuchiz_platform_write(handheld, buf, n);
+    return backend_of(handheld)->write(handheld, buf, n);
 }
 
 off_t miuchiz_backend_seek(struct Handheld* handheld, off_t offset) {
-    if (miuchiz_emu_is(handheld)) {
-        return miuchiz_emu_seek(handheld, offset);
-    }
-    return miuchiz_platform_seek(handheld, offset);
+    return backend_of(handheld)->seek(handheld, offset);
+}
+
+size_t miuchiz_backend_identity(struct Handheld* handheld, void* buf, size_t n) {
+    const struct MiuchizBackend* backend = backend_of(handheld);
+    return backend->identity != NULL ? backend->identity(handheld, buf, n) : 0;
+}
+
+int miuchiz_backend_transport_stats(struct Handheld* handheld, struct MiuchizTransportStats* stats) {
+    const struct MiuchizBackend* backend = backend_of(handheld);
+    return backend->transport_stats != NULL ? backend->transport_stats(handheld, stats) : -1;
+}
+
+unsigned int miuchiz_backend_generation(struct Handheld* handheld) {
+    const struct MiuchizBackend* backend = backend_of(handheld);
+    return backend->generation != NULL ? backend->generation(handheld) : 0;
 }
 
 /* The DMA helpers are not per-handle; the platform backend's (stricter)
- * alignment rules satisfy the emulator transport too. */
+ * alignment rules satisfy the other transports too. */
 
 void* miuchiz_backend_dma_alloc(size_t size) {
     return miuchiz_platform_dma_alloc(size);
@@ -65,22 +127,34 @@ long miuchiz_backend_page_alignment(void) {
     return miuchiz_platform_page_alignment();
 }
 
+int miuchiz_backend_is_named_only(const char* device) {
+    return miuchiz_backend_for(device)->enumerate == NULL;
+}
+
 int miuchiz_backend_enumerate(struct Handheld*** handhelds) {
     *handhelds = NULL;
 
-    struct Handheld** platform_list = NULL;
-    int platform_count = miuchiz_platform_enumerate(&platform_list);
-
-    struct Handheld** emu_list = NULL;
-    int emu_count = miuchiz_emu_enumerate(&emu_list);
+    /* The platform's handhelds first, then each registered transport's in
+     * registration order. */
+    struct Handheld** lists[MIUCHIZ_BACKEND_MAX + 1] = { NULL };
+    int counts[MIUCHIZ_BACKEND_MAX + 1] = { 0 };
+    int platform_count = miuchiz_platform_enumerate(&lists[0]);
+    counts[0] = platform_count;
+    for (int i = 0; i < registry_count; i++) {
+        if (registry[i]->enumerate != NULL) {
+            counts[i + 1] = registry[i]->enumerate(&lists[i + 1]);
+        }
+    }
 
-    int real = (platform_count > 0) ? platform_count : 0;
-    int emulated = (emu_count > 0) ? emu_count : 0;
-    int total = real + emulated;
+    int total = 0;
+    for (int i = 0; i <= registry_count; i++) {
+        total += (counts[i] > 0) ? counts[i] : 0;
+    }
 
     if (total == 0) {
-        free(platform_list);
-        free(emu_list);
+        for (int i = 0; i <= registry_count; i++) {
+            free(lists[i]);
+        }
         /* Preserve the platform backend's "device present but inaccessible"
          * report (MIUCHIZ_ERROR_ACCESS, with no array) when there is nothing
          * else to show. Otherwise callers get an empty NULL-terminated array,
@@ -97,14 +171,16 @@ int miuchiz_backend_enumerate(struct Handheld*** handhelds) {
     memset(merged, 0, (total + 1) * sizeof(struct Handheld*));
 
     int at = 0;
-    for (int i = 0; i < real; i++) {
-        merged[at++] = platform_list[i];
-    }
-    for (int i = 0; i < emulated; i++) {
-        merged[at++] = emu_list[i];
+    for (int i = 0; i <= registry_count; i++) {
+        for (int j = 0; j < counts[i]; j++) {
+            /* Discovered handles skipped miuchiz_backend_open. */
+            backend_of(lists[i][j]);
+            miuchiz_fault_attach(lists[i][j]);
+            miuchiz_record_attach(lists[i][j]);
+            merged[at++] = lists[i][j];
+        }
+        free(lists[i]);
     }
-    free(platform_list);
-    free(emu_list);
 
     *handhelds = merged;
     return total;
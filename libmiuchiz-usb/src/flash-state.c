@@ -0,0 +1,224 @@
+#include "libmiuchiz-usb.h"
+#include "paths.h"
+#include "sha256.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+    #include <io.h>
+#else
+    #include <unistd.h>
+#endif
+
+/*
+ * Last-known flash state. Whatever a tool last wrote to a handheld or read
+ * from it is remembered page by page under the handheld's fingerprint, so a
+ * later load can leave alone the pages that already hold what it would
+ * write. Only the pages that change are rewritten, each in its own
+ * fixed-size record carrying its own check, so no update ever rewrites the
+ * whole file and a record torn by a crash is simply unknown.
+ */
+
+/* State file: a header, then a record per page at a fixed offset. A record
+ * past the end of the file, zeroed or failing its check is unknown.
+ *   Header:
+ *   [0-3]   "MZFS"
+ *   [4-5]   format version
+ *   [6-7]   number of pages
+ *   [8-15]  reserved
+ *   Record:
+ *   [0-1]   page
+ *   [2-3]   flags (bit 0 = the hash is known)
+ *   [4-7]   reserved
+ *   [8-39]  SHA-256 of the page
+ *   [40-47] first 8 bytes of the SHA-256 of bytes 0-39 */
+#define FLASH_STATE_MAGIC "MZFS"
+#define FLASH_STATE_FORMAT_VERSION (1)
+#define FLASH_STATE_HEADER_SIZE (16)
+#define FLASH_STATE_RECORD_SIZE (48)
+#define FLASH_STATE_CHECKED_SIZE (40)
+#define FLASH_STATE_CHECK_SIZE (8)
+#define FLASH_STATE_FLAG_KNOWN (0x01)
+
+struct FlashState {
+    FILE* fp;
+    int dirty; /* records written since the last flush */
+    unsigned char known[MIUCHIZ_PAGE_COUNT];
+    unsigned char hashes[MIUCHIZ_PAGE_COUNT][MIUCHIZ_SHA256_SIZE];
+};
+
+/* The state file for a fingerprint, creating its directory. */
+static int flash_state_path(const char* fingerprint, char* buf, size_t bufn) {
+    if (strlen(fingerprint) != MIUCHIZ_FINGERPRINT_LENGTH
+        || strspn(fingerprint, "0123456789abcdef") != MIUCHIZ_FINGERPRINT_LENGTH) {
+        return -1;
+    }
+    char dir[1024];
+    if (miuchiz_reborn_dir("cache", MIUCHIZ_REBORN_APP, dir, sizeof(dir)) != 0) {
+        return -1;
+    }
+    if (strlen(dir) + sizeof("/flash") > sizeof(dir)) {
+        return -1;
+    }
+    strcat(dir, "/flash");
+    if (miuchiz_make_dirs(dir) != 0) {
+        return -1;
+    }
+    int n = snprintf(buf, bufn, "%s/%s.state", dir, fingerprint);
+    return (n > 0 && (size_t)n < bufn) ? 0 : -1;
+}
+
+static void record_check(const unsigned char* record, unsigned char* check) {
+    unsigned char digest[MIUCHIZ_SHA256_SIZE];
+    miuchiz_sha256(record, FLASH_STATE_CHECKED_SIZE, digest);
+    memcpy(check, digest, FLASH_STATE_CHECK_SIZE);
+}
+
+/* Writes a state with every page unknown: just a header, put in place whole
+ * so a crash never leaves half of one. */
+static int flash_state_create(const char* path) {
+    char tmp_path[1110];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    unsigned char header[FLASH_STATE_HEADER_SIZE] = { 0 };
+    memcpy(header, FLASH_STATE_MAGIC, 4);
+    miuchiz_le16_write(header + 4, FLASH_STATE_FORMAT_VERSION);
+    miuchiz_le16_write(header + 6, MIUCHIZ_PAGE_COUNT);
+
+    FILE* fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+    int ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header);
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+    if (!ok || miuchiz_replace_file(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Reads the header and every record there is. A header that is not a
+ * state's makes the caller start afresh; a bad record is just unknown. */
+static int flash_state_load(struct FlashState* state) {
+    unsigned char header[FLASH_STATE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), state->fp) != sizeof(header)
+        || memcmp(header, FLASH_STATE_MAGIC, 4) != 0
+        || miuchiz_le16_read(header + 4) != FLASH_STATE_FORMAT_VERSION
+        || miuchiz_le16_read(header + 6) != MIUCHIZ_PAGE_COUNT) {
+        return -1;
+    }
+    unsigned char record[FLASH_STATE_RECORD_SIZE];
+    for (int page = 0; page < MIUCHIZ_PAGE_COUNT
+                       && fread(record, 1, sizeof(record), state->fp) == sizeof(record); page++) {
+        unsigned char check[FLASH_STATE_CHECK_SIZE];
+        record_check(record, check);
+        if (miuchiz_le16_read(record) == page
+            && (miuchiz_le16_read(record + 2) & FLASH_STATE_FLAG_KNOWN)
+            && memcmp(check, record + FLASH_STATE_CHECKED_SIZE, sizeof(check)) == 0) {
+            state->known[page] = 1;
+            memcpy(state->hashes[page], record + 8, MIUCHIZ_SHA256_SIZE);
+        }
+    }
+    return 0;
+}
+
+struct FlashState* miuchiz_flash_state_open(const char* fingerprint) {
+    char path[1100];
+    if (flash_state_path(fingerprint, path, sizeof(path)) != 0) {
+        return NULL;
+    }
+    struct FlashState* state = calloc(1, sizeof(struct FlashState));
+    if (state == NULL) {
+        return NULL;
+    }
+
+    state->fp = fopen(path, "r+b");
+    if (state->fp != NULL && flash_state_load(state) != 0) {
+        miuchiz_log("libmiuchiz: replacing malformed flash state %s\n", path);
+        fclose(state->fp);
+        state->fp = NULL;
+        memset(state->known, 0, sizeof(state->known));
+    }
+    if (state->fp == NULL) {
+        if (flash_state_create(path) == 0) {
+            state->fp = fopen(path, "r+b");
+        }
+        if (state->fp == NULL) {
+            miuchiz_log("libmiuchiz: could not open flash state %s\n", path);
+            free(state);
+            return NULL;
+        }
+    }
+    return state;
+}
+
+int miuchiz_flash_state_get(struct FlashState* state, int page, unsigned char* hash) {
+    if (page < 0 || page >= MIUCHIZ_PAGE_COUNT || !state->known[page]) {
+        return 0;
+    }
+    memcpy(hash, state->hashes[page], MIUCHIZ_SHA256_SIZE);
+    return 1;
+}
+
+int miuchiz_flash_state_set(struct FlashState* state, int page, const unsigned char* hash) {
+    if (page < 0 || page >= MIUCHIZ_PAGE_COUNT) {
+        return -1;
+    }
+    // Records already saying as much are left as they are
+    if (hash == NULL ? !state->known[page]
+                     : state->known[page] && memcmp(state->hashes[page], hash, MIUCHIZ_SHA256_SIZE) == 0) {
+        return 0;
+    }
+
+    unsigned char record[FLASH_STATE_RECORD_SIZE] = { 0 };
+    miuchiz_le16_write(record, (uint16_t)page);
+    if (hash != NULL) {
+        miuchiz_le16_write(record + 2, FLASH_STATE_FLAG_KNOWN);
+        memcpy(record + 8, hash, MIUCHIZ_SHA256_SIZE);
+    }
+    record_check(record, record + FLASH_STATE_CHECKED_SIZE);
+
+    state->known[page] = 0;
+    if (fseek(state->fp, FLASH_STATE_HEADER_SIZE + (long)page * FLASH_STATE_RECORD_SIZE, SEEK_SET) != 0
+        || fwrite(record, 1, sizeof(record), state->fp) != sizeof(record)) {
+        return -1;
+    }
+    state->dirty = 1;
+    if (hash != NULL) {
+        state->known[page] = 1;
+        memcpy(state->hashes[page], hash, MIUCHIZ_SHA256_SIZE);
+    }
+    return 0;
+}
+
+int miuchiz_flash_state_flush(struct FlashState* state) {
+    if (!state->dirty) {
+        return 0;
+    }
+    state->dirty = 0;
+    if (fflush(state->fp) != 0) {
+        return -1;
+    }
+    /* On to the disk, not just the OS: a page forgotten before it is written
+     * must stay forgotten through a power cut part way. */
+#if defined(_WIN32)
+    return _commit(_fileno(state->fp)) == 0 ? 0 : -1;
+#else
+    return fsync(fileno(state->fp)) == 0 ? 0 : -1;
+#endif
+}
+
+void miuchiz_flash_state_close(struct FlashState* state) {
+    if (state != NULL) {
+        if (fclose(state->fp) != 0) {
+            miuchiz_log("libmiuchiz: could not write flash state\n");
+        }
+        free(state);
+    }
+}
@@ -0,0 +1,251 @@
+#include "libmiuchiz-usb.h"
+#include "backend.h"
+#include "paths.h"
+#include "sha256.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+/*
+ * Device identity. A handheld's device string (a /dev/sdX node, a libusb
+ * bus/address, a drive letter) is reassigned on every replug, so anything that
+ * should follow a physical unit is keyed by a fingerprint derived from the
+ * unit itself, and the immutable facts about it are cached on disk under that
+ * fingerprint.
+ */
+
+/* Save page layout (page MIUCHIZ_SAVE_PAGE). */
+#define SAVE_PAGE_VERSION_OFFSET   (0x9A4)
+#define SAVE_PAGE_CHARACTER_OFFSET (0x9A8)
+
+/* Identity record file: a fixed little-endian header followed by the save
+ * page when the record has one.
+ *   [0-3]   "MZID"
+ *   [4-5]   format version
+ *   [6-7]   firmware version
+ *   [8]     character
+ *   [9]     flags (bit 0 = save page follows)
+ *   [10-15] reserved
+ *   [16-23] updated (Unix time) */
+#define IDENTITY_MAGIC "MZID"
+#define IDENTITY_FORMAT_VERSION (1)
+#define IDENTITY_HEADER_SIZE (24)
+#define IDENTITY_FLAG_SAVE_PAGE (0x01)
+
+int miuchiz_handheld_fingerprint(struct Handheld* handheld, char* buf, size_t nbuf) {
+    if (nbuf < MIUCHIZ_FINGERPRINT_LENGTH + 1) {
+        return MIUCHIZ_ERROR_TOO_SMALL;
+    }
+
+    if (handheld->fingerprint[0] == '\0') {
+        struct Sha256 ctx;
+        miuchiz_sha256_init(&ctx);
+
+        /* The two sources are domain-separated so an emulator identity can
+         * never collide with an OTP image. */
+        char identity[4096];
+        size_t identity_len = miuchiz_backend_identity(handheld, identity, sizeof(identity));
+        if (identity_len > 0) {
+            if (identity_len > sizeof(identity)) {
+                identity_len = sizeof(identity);
+            }
+            miuchiz_sha256_update(&ctx, "emu", 4);
+            miuchiz_sha256_update(&ctx, identity, identity_len);
+        }
+        else {
+            unsigned char* otp = malloc(MIUCHIZ_OTP_SIZE);
+            if (otp == NULL) {
+                miuchiz_log("miuchiz_handheld_fingerprint: allocation failed\n");
+                return MIUCHIZ_ERROR_IO;
+            }
+            int otp_read = miuchiz_handheld_read_sector(handheld, 0, otp, MIUCHIZ_OTP_SIZE);
+            if (otp_read != MIUCHIZ_OTP_SIZE) {
+                miuchiz_log("miuchiz_handheld_fingerprint: OTP read failed (%d)\n", otp_read);
+                free(otp);
+                return MIUCHIZ_ERROR_IO;
+            }
+            miuchiz_sha256_update(&ctx, "otp", 4);
+            miuchiz_sha256_update(&ctx, otp, MIUCHIZ_OTP_SIZE);
+            free(otp);
+        }
+
+        unsigned char digest[MIUCHIZ_SHA256_SIZE];
+        miuchiz_sha256_final(&ctx, digest);
+        miuchiz_hex_encode(digest, MIUCHIZ_FINGERPRINT_LENGTH / 2, handheld->fingerprint);
+    }
+
+    memcpy(buf, handheld->fingerprint, MIUCHIZ_FINGERPRINT_LENGTH + 1);
+    return 0;
+}
+
+static int is_fingerprint(const char* spec) {
+    if (strlen(spec) != MIUCHIZ_FINGERPRINT_LENGTH) {
+        return 0;
+    }
+    for (const char* c = spec; *c != '\0'; c++) {
+        if (!isxdigit((unsigned char)*c)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int miuchiz_handheld_matches(struct Handheld* handheld, const char* spec) {
+    if (strcmp(spec, handheld->device) == 0) {
+        return 1;
+    }
+    /* Only pay for a fingerprint (an OTP read) when spec could be one. */
+    if (!is_fingerprint(spec)) {
+        return 0;
+    }
+    char fingerprint[MIUCHIZ_FINGERPRINT_LENGTH + 1];
+    if (miuchiz_handheld_fingerprint(handheld, fingerprint, sizeof(fingerprint)) != 0) {
+        return 0;
+    }
+    for (int i = 0; i < MIUCHIZ_FINGERPRINT_LENGTH; i++) {
+        if (tolower((unsigned char)spec[i]) != fingerprint[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* The record file for a fingerprint; optionally creates its directory. */
+static int identity_path(const char* fingerprint, char* buf, size_t bufn, int create) {
+    char dir[1024];
+    if (miuchiz_reborn_dir("cache", MIUCHIZ_REBORN_APP, dir, sizeof(dir)) != 0) {
+        return -1;
+    }
+    if (strlen(dir) + sizeof("/identity") > sizeof(dir)) {
+        return -1;
+    }
+    strcat(dir, "/identity");
+    if (create && miuchiz_make_dirs(dir) != 0) {
+        return -1;
+    }
+    int n = snprintf(buf, bufn, "%s/%s.id", dir, fingerprint);
+    return (n > 0 && (size_t)n < bufn) ? 0 : -1;
+}
+
+int miuchiz_identity_load(const char* fingerprint, struct HandheldIdentity* identity) {
+    if (!is_fingerprint(fingerprint)) {
+        return -1;
+    }
+    char path[1100];
+    if (identity_path(fingerprint, path, sizeof(path), 0) != 0) {
+        return -1;
+    }
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    int result = -1;
+    unsigned char header[IDENTITY_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header)
+        || memcmp(header, IDENTITY_MAGIC, 4) != 0
+        || miuchiz_le16_read(header + 4) != IDENTITY_FORMAT_VERSION) {
+        miuchiz_log("libmiuchiz: ignoring malformed identity record %s\n", path);
+        goto leave;
+    }
+
+    memset(identity, 0, sizeof(*identity));
+    memcpy(identity->fingerprint, fingerprint, MIUCHIZ_FINGERPRINT_LENGTH + 1);
+    identity->firmware_version = miuchiz_le16_read(header + 6);
+    identity->character = header[8];
+    identity->updated = (uint64_t)miuchiz_le32_read(header + 16)
+                      | ((uint64_t)miuchiz_le32_read(header + 20) << 32);
+    if (header[9] & IDENTITY_FLAG_SAVE_PAGE) {
+        if (fread(identity->save_page, 1, MIUCHIZ_PAGE_SIZE, fp) != MIUCHIZ_PAGE_SIZE) {
+            goto leave;
+        }
+        identity->has_save_page = 1;
+    }
+    result = 0;
+
+leave:
+    fclose(fp);
+    return result;
+}
+
+int miuchiz_identity_store(const struct HandheldIdentity* identity) {
+    char path[1100];
+    char tmp_path[1110];
+    if (!is_fingerprint(identity->fingerprint)
+        || identity_path(identity->fingerprint, path, sizeof(path), 1) != 0) {
+        return -1;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    unsigned char header[IDENTITY_HEADER_SIZE] = { 0 };
+    memcpy(header, IDENTITY_MAGIC, 4);
+    miuchiz_le16_write(header + 4, IDENTITY_FORMAT_VERSION);
+    miuchiz_le16_write(header + 6, identity->firmware_version);
+    header[8] = identity->character;
+    header[9] = identity->has_save_page ? IDENTITY_FLAG_SAVE_PAGE : 0;
+    miuchiz_le32_write(header + 16, (uint32_t)(identity->updated & 0xFFFFFFFF));
+    miuchiz_le32_write(header + 20, (uint32_t)(identity->updated >> 32));
+
+    /* Write a sibling and rename it over the record, so a crash never leaves
+     * a torn record behind. */
+    FILE* fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+    int ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header);
+    if (ok && identity->has_save_page) {
+        ok = fwrite(identity->save_page, 1, MIUCHIZ_PAGE_SIZE, fp) == MIUCHIZ_PAGE_SIZE;
+    }
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+    if (!ok || miuchiz_replace_file(tmp_path, path) != 0) {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+int miuchiz_handheld_identity(struct Handheld* handheld, struct HandheldIdentity* identity, int refresh) {
+    char fingerprint[MIUCHIZ_FINGERPRINT_LENGTH + 1];
+    int result = miuchiz_handheld_fingerprint(handheld, fingerprint, sizeof(fingerprint));
+    if (result != 0) {
+        return result;
+    }
+
+    if (!refresh && miuchiz_identity_load(fingerprint, identity) == 0) {
+        return 0;
+    }
+
+    struct HandheldIdentity cached;
+    int have_cached = refresh && miuchiz_identity_load(fingerprint, &cached) == 0;
+
+    memset(identity, 0, sizeof(*identity));
+    memcpy(identity->fingerprint, fingerprint, sizeof(fingerprint));
+    result = miuchiz_handheld_read_page(handheld, MIUCHIZ_SAVE_PAGE,
+                                        identity->save_page, sizeof(identity->save_page));
+    if (result < 0) {
+        return MIUCHIZ_ERROR_IO;
+    }
+    identity->has_save_page = 1;
+    identity->firmware_version = miuchiz_le16_read(identity->save_page + SAVE_PAGE_VERSION_OFFSET);
+    identity->character = identity->save_page[SAVE_PAGE_CHARACTER_OFFSET];
+    identity->updated = (uint64_t)time(NULL);
+
+    /* A record that already says as much is left alone, so refreshing an
+     * unchanged handheld writes nothing. */
+    if (have_cached && cached.has_save_page
+        && memcmp(cached.save_page, identity->save_page, sizeof(identity->save_page)) == 0) {
+        identity->updated = cached.updated;
+        return 0;
+    }
+
+    if (miuchiz_identity_store(identity) != 0) {
+        miuchiz_log("libmiuchiz: could not persist identity record for %s\n", fingerprint);
+    }
+    return 0;
+}
@@ -11,6 +11,10 @@
 
 #define MIUCHIZ_PAGE_ATTEMPTS (3)
 #define MIUCHIZ_RETRY_DELAY_MS (50)
+/* An attempt cut short by the transport reattaching (see
+ * miuchiz_backend_generation) is redone without counting against
+ * MIUCHIZ_PAGE_ATTEMPTS, this many times at most. */
+#define MIUCHIZ_PAGE_REATTACHES (3)
 
 // Exposed functions
 
@@ -18,7 +22,9 @@ struct Handheld* miuchiz_handheld_create(const char* device) {
     struct Handheld* handheld = malloc(sizeof(struct Handheld));
 
     handheld->device = strdup(device);
-    handheld->emu = NULL;
+    handheld->backend = NULL;
+    handheld->transport = NULL;
+    handheld->fingerprint[0] = '\0';
     miuchiz_handheld_open(handheld);
 
     return handheld;
@@ -42,6 +48,24 @@ int miuchiz_handheld_create_all(struct Handheld*** handhelds) {
     return miuchiz_backend_enumerate(handhelds);
 }
 
+int miuchiz_handheld_create_all_for(struct Handheld*** handhelds, const char* device) {
+    if (device == NULL || !miuchiz_backend_is_named_only(device)) {
+        return miuchiz_backend_enumerate(handhelds);
+    }
+
+    *handhelds = calloc(2, sizeof(struct Handheld*));
+    if (*handhelds == NULL) {
+        return 0;
+    }
+    struct Handheld* handheld = miuchiz_handheld_create(device);
+    if (!miuchiz_handheld_is_handheld(handheld)) {
+        miuchiz_handheld_destroy(handheld);
+        return 0;
+    }
+    (*handhelds)[0] = handheld;
+    return 1;
+}
+
 void miuchiz_handheld_destroy_all(struct Handheld** handhelds) {
     if (handhelds != NULL) {
         for (struct Handheld** handheld = handhelds; *handheld != NULL; handheld++) {
@@ -51,6 +75,10 @@ void miuchiz_handheld_destroy_all(struct Handheld** handhelds) {
     }
 }
 
+int miuchiz_handheld_transport_stats(struct Handheld* handheld, struct MiuchizTransportStats* stats) {
+    return miuchiz_backend_transport_stats(handheld, stats);
+}
+
 int miuchiz_handheld_is_handheld(struct Handheld* handheld) {
     char* data = malloc(MIUCHIZ_SECTOR_SIZE);
     int bytes_read = miuchiz_handheld_read_sector(handheld, 0, data, MIUCHIZ_SECTOR_SIZE);
@@ -80,8 +108,11 @@ int miuchiz_handheld_write_sector(struct Handheld* handheld, int sector, const v
 
     memcpy(aligned_buf, data, ndata);
 
-    miuchiz_backend_seek(handheld, sector * MIUCHIZ_SECTOR_SIZE);
-    int result = miuchiz_backend_write(handheld, aligned_buf, ndata);
+    // A failed seek would put the data on whatever sector was current
+    int result = MIUCHIZ_ERROR_IO;
+    if (miuchiz_backend_seek(handheld, sector * MIUCHIZ_SECTOR_SIZE) >= 0) {
+        result = miuchiz_backend_write(handheld, aligned_buf, ndata);
+    }
 
     //miuchiz_hex_dump(aligned_buf, 0x20);
     if (result == MIUCHIZ_ERROR_IO) {
@@ -107,8 +138,10 @@ int miuchiz_handheld_read_sector(struct Handheld* handheld, int sector, void* bu
         return MIUCHIZ_ERROR_IO;
     }
 
-    miuchiz_backend_seek(handheld, sector * MIUCHIZ_SECTOR_SIZE);
-    int result = miuchiz_backend_read(handheld, aligned_buf, required_size);
+    int result = MIUCHIZ_ERROR_IO;
+    if (miuchiz_backend_seek(handheld, sector * MIUCHIZ_SECTOR_SIZE) >= 0) {
+        result = miuchiz_backend_read(handheld, aligned_buf, required_size);
+    }
     if (result >= 0) {
         memcpy(buf, aligned_buf, nbuf);
     }
@@ -156,34 +189,48 @@ int miuchiz_handheld_read_page(struct Handheld* handheld, int page, void* buf, s
     }
 
     int read_result = MIUCHIZ_ERROR_IO;
+    int attempts = MIUCHIZ_PAGE_ATTEMPTS;
 
-    for (int attempt = 0; attempt < MIUCHIZ_PAGE_ATTEMPTS; attempt++) {
+    for (int attempt = 0; attempt < attempts; attempt++) {
         if (attempt > 0) {
             miuchiz_log("miuchiz_handheld_read_page: retrying page %d (attempt %d of %d)\n",
-                        page, attempt + 1, MIUCHIZ_PAGE_ATTEMPTS);
+                        page, attempt + 1, attempts);
             miuchiz_sleep_ms(MIUCHIZ_RETRY_DELAY_MS);
         }
+        unsigned int generation = miuchiz_backend_generation(handheld);
 
         // Write initiator to command interface
+        int command_result;
         {
             struct SCSIWriteFilemarksCommand cmd = miuchiz_scsi_write_filemarks_command();
-            miuchiz_handheld_send_scsi(handheld, &cmd, sizeof(cmd));
+            command_result = miuchiz_handheld_send_scsi(handheld, &cmd, sizeof(cmd));
         }
 
         // Tell command interface we want to read from this page
-        {
+        if (command_result >= 0) {
             struct SCSIReadCommand cmd = miuchiz_scsi_read_command(page);
-            miuchiz_handheld_send_scsi(handheld, &cmd, sizeof(cmd));
+            command_result = miuchiz_handheld_send_scsi(handheld, &cmd, sizeof(cmd));
         }
 
-        // Read response data from device's data output interface
-        read_result = miuchiz_handheld_read_sector(handheld, MIUCHIZ_SECTOR_DATA_READ, page_data, page_data_size);
-        if (read_result >= 0) {
-            // Skip the length bytes
-            memcpy(buf, page_data + sizeof(int32_t), nbuf);
+        // Read response data from device's data output interface, unless the
+        // device missed the command; it would answer with the previous page
+        if (command_result < 0) {
+            miuchiz_log("miuchiz_handheld_read_page: command for page %d failed. [%d] %s\n", page, errno, strerror(errno));
+            read_result = MIUCHIZ_ERROR_IO;
         }
         else {
-            miuchiz_log("miuchiz_handheld_read_sector failed in read_page. [%d] %s\n", errno, strerror(errno));
+            read_result = miuchiz_handheld_read_sector(handheld, MIUCHIZ_SECTOR_DATA_READ, page_data, page_data_size);
+            if (read_result >= 0 && (size_t)read_result < page_data_size) {
+                miuchiz_log("miuchiz_handheld_read_page: short read of page %d (%d bytes)\n", page, read_result);
+                read_result = MIUCHIZ_ERROR_IO;
+            }
+            else if (read_result >= 0) {
+                // Skip the length bytes
+                memcpy(buf, page_data + sizeof(int32_t), nbuf);
+            }
+            else {
+                miuchiz_log("miuchiz_handheld_read_sector failed in read_page. [%d] %s\n", errno, strerror(errno));
+            }
         }
 
         // Send terminator to command interface
@@ -192,6 +239,15 @@ int miuchiz_handheld_read_page(struct Handheld* handheld, int page, void* buf, s
             miuchiz_handheld_send_scsi(handheld, &cmd, sizeof(cmd));
         }
 
+        // A reattached device only saw part of the sequence
+        if (miuchiz_backend_generation(handheld) != generation) {
+            miuchiz_log("miuchiz_handheld_read_page: device reattached while reading page %d\n", page);
+            read_result = MIUCHIZ_ERROR_IO;
+            if (attempts < MIUCHIZ_PAGE_ATTEMPTS + MIUCHIZ_PAGE_REATTACHES) {
+                attempts++;
+            }
+        }
+
         if (read_result != MIUCHIZ_ERROR_IO) {
             break; // success, or an error retrying can't change
         }
@@ -213,29 +269,41 @@ int miuchiz_handheld_write_page(struct Handheld* handheld, int page, const void*
     }
 
     int write_result = MIUCHIZ_ERROR_IO;
+    int attempts = MIUCHIZ_PAGE_ATTEMPTS;
 
-    for (int attempt = 0; attempt < MIUCHIZ_PAGE_ATTEMPTS; attempt++) {
+    for (int attempt = 0; attempt < attempts; attempt++) {
         if (attempt > 0) {
             miuchiz_log("miuchiz_handheld_write_page: retrying page %d (attempt %d of %d)\n",
-                        page, attempt + 1, MIUCHIZ_PAGE_ATTEMPTS);
+                        page, attempt + 1, attempts);
             miuchiz_sleep_ms(MIUCHIZ_RETRY_DELAY_MS);
         }
+        unsigned int generation = miuchiz_backend_generation(handheld);
 
         // Write initiator to command interface
+        int command_result;
         {
             struct SCSIWriteFilemarksCommand cmd = miuchiz_scsi_write_filemarks_command();
-            miuchiz_handheld_send_scsi(handheld, &cmd, sizeof(cmd));
+            command_result = miuchiz_handheld_send_scsi(handheld, &cmd, sizeof(cmd));
         }
 
         // Tell command interface we want to write to this page
-        {
+        if (command_result >= 0) {
             struct SCSIWriteCommand cmd = miuchiz_scsi_write_command(page, nbuf);
-            miuchiz_handheld_send_scsi(handheld, &cmd, sizeof(cmd));
+            command_result = miuchiz_handheld_send_scsi(handheld, &cmd, sizeof(cmd));
         }
 
-        // Put our data into the data input interface
-        {
+        // Put our data into the data input interface, unless the device
+        // missed the command
+        if (command_result < 0) {
+            miuchiz_log("miuchiz_handheld_write_page: command for page %d failed. [%d] %s\n", page, errno, strerror(errno));
+            write_result = MIUCHIZ_ERROR_IO;
+        }
+        else {
             write_result = miuchiz_handheld_write_sector(handheld, MIUCHIZ_SECTOR_DATA_WRITE, buf, nbuf);
+            if (write_result >= 0 && (size_t)write_result < nbuf) {
+                miuchiz_log("miuchiz_handheld_write_page: short write of page %d (%d bytes)\n", page, write_result);
+                write_result = MIUCHIZ_ERROR_IO;
+            }
         }
 
         // Send terminator to command interface
@@ -244,6 +312,15 @@ int miuchiz_handheld_write_page(struct Handheld* handheld, int page, const void*
             miuchiz_handheld_send_scsi(handheld, &cmd, sizeof(cmd));
         }
 
+        // A reattached device only saw part of the sequence; the retry verifies
+        if (miuchiz_backend_generation(handheld) != generation) {
+            miuchiz_log("miuchiz_handheld_write_page: device reattached while writing page %d\n", page);
+            write_result = MIUCHIZ_ERROR_IO;
+            if (attempts < MIUCHIZ_PAGE_ATTEMPTS + MIUCHIZ_PAGE_REATTACHES) {
+                attempts++;
+            }
+        }
+
         if (write_result == MIUCHIZ_ERROR_IO) {
             continue;
         }
@@ -0,0 +1,222 @@
+#include "libmiuchiz-usb.h"
+#include "paths.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(_WIN32)
+    #include <windows.h>
+    #include <direct.h>
+#else
+    #include <sys/stat.h>
+    #include <sys/types.h>
+#endif
+
+/* Mirrors the Miuchiz Reborn storage-location policy. The authoritative
+ * implementation is the miuchiz-reborn-paths Rust crate; its test-vectors.txt
+ * is the shared conformance suite (vendored under tests/ and run by the
+ * paths-conformance test - keep all three in sync).
+ *
+ *   MIUCHIZ_REBORN_HOME set  ->  <home>/<category>/<app>
+ *
+ * Otherwise, per category:
+ *
+ *   runtime: the OS runtime dir  ->  <runtime>/<umbrella>/<app>
+ *                (only Linux has one: $XDG_RUNTIME_DIR, absolute paths only)
+ *            else the system temp dir ->  <temp>/<umbrella>/<app>
+ *   others:  the OS per-user base for the category -> <base>/<umbrella>/<app>
+ *                Linux:   $XDG_{CONFIG,DATA,CACHE,STATE}_HOME (absolute paths
+ *                         only), else ~/.config, ~/.local/share, ~/.cache,
+ *                         ~/.local/state
+ *                macOS:   ~/Library/Caches for cache, else
+ *                         ~/Library/Application Support
+ *                Windows: %LOCALAPPDATA% for cache and state, else %APPDATA%
+ *
+ * The umbrella is "Miuchiz Reborn" on Windows/macOS and "miuchiz-reborn"
+ * elsewhere. The vectors pin only the MIUCHIZ_REBORN_HOME behavior for the
+ * non-runtime categories; the OS bases follow the crate's documentation. */
+
+/* Copies `root` into `base`, dropping trailing separators: base directory
+ * joins must tolerate a trailing separator on the env value (macOS $TMPDIR
+ * famously has one) the way path joins do. */
+static int copy_base(char* base, size_t nbase, const char* root) {
+    size_t len = strlen(root);
+    if (len >= nbase) {
+        return -1;
+    }
+    strcpy(base, root);
+    while (len > 1 && (base[len - 1] == '/' || base[len - 1] == '\\')) {
+        base[--len] = '\0';
+    }
+    return 0;
+}
+
+#if defined(_WIN32)
+static int os_base_dir(const char* category, char* base, size_t nbase) {
+    if (strcmp(category, "runtime") == 0) {
+        DWORD len = GetTempPathA((DWORD)nbase, base);
+        if (len == 0 || len >= nbase) {
+            return -1;
+        }
+        while (len > 1 && (base[len - 1] == '\\' || base[len - 1] == '/')) {
+            base[--len] = '\0';
+        }
+        return 0;
+    }
+    const char* var = (strcmp(category, "cache") == 0 || strcmp(category, "state") == 0)
+                    ? "LOCALAPPDATA" : "APPDATA";
+    const char* root = getenv(var);
+    if (root == NULL || root[0] == '\0') {
+        return -1;
+    }
+    return copy_base(base, nbase, root);
+}
+#else
+static int home_subdir(const char* sub, char* base, size_t nbase) {
+    const char* home = getenv("HOME");
+    if (home == NULL || home[0] != '/') {
+        return -1;
+    }
+    char joined[1024];
+    int n = snprintf(joined, sizeof(joined), "%s/%s", home, sub);
+    if (n <= 0 || (size_t)n >= sizeof(joined)) {
+        return -1;
+    }
+    return copy_base(base, nbase, joined);
+}
+
+static int os_base_dir(const char* category, char* base, size_t nbase) {
+    if (strcmp(category, "runtime") == 0) {
+        const char* root = NULL;
+    #if !defined(__APPLE__)
+        const char* xdg = getenv("XDG_RUNTIME_DIR");
+        if (xdg != NULL && xdg[0] == '/') {
+            root = xdg;
+        }
+    #endif
+        if (root == NULL) {
+            root = getenv("TMPDIR");
+            if (root == NULL || root[0] == '\0') {
+                root = "/tmp";
+            }
+        }
+        return copy_base(base, nbase, root);
+    }
+
+    #if defined(__APPLE__)
+        if (strcmp(category, "cache") == 0) {
+            return home_subdir("Library/Caches", base, nbase);
+        }
+        return home_subdir("Library/Application Support", base, nbase);
+    #else
+        const char* var;
+        const char* fallback;
+        if (strcmp(category, "config") == 0) {
+            var = "XDG_CONFIG_HOME";
+            fallback = ".config";
+        }
+        else if (strcmp(category, "data") == 0) {
+            var = "XDG_DATA_HOME";
+            fallback = ".local/share";
+        }
+        else if (strcmp(category, "cache") == 0) {
+            var = "XDG_CACHE_HOME";
+            fallback = ".cache";
+        }
+        else {
+            var = "XDG_STATE_HOME";
+            fallback = ".local/state";
+        }
+        const char* xdg = getenv(var);
+        if (xdg != NULL && xdg[0] == '/') {
+            return copy_base(base, nbase, xdg);
+        }
+        return home_subdir(fallback, base, nbase);
+    #endif
+}
+#endif
+
+int miuchiz_reborn_dir(const char* category, const char* app, char* buf, size_t bufn) {
+    static const char* categories[] = {"config", "data", "cache", "state", "runtime"};
+    int known = 0;
+    for (size_t i = 0; i < sizeof(categories) / sizeof(*categories); i++) {
+        if (strcmp(category, categories[i]) == 0) {
+            known = 1;
+        }
+    }
+    if (!known) {
+        return -1;
+    }
+
+    const char* home = getenv("MIUCHIZ_REBORN_HOME");
+    if (home != NULL && home[0] != '\0') {
+        int n = snprintf(buf, bufn, "%s/%s/%s", home, category, app);
+        return (n > 0 && (size_t)n < bufn) ? 0 : -1;
+    }
+
+    char base[1024];
+    if (os_base_dir(category, base, sizeof(base)) != 0) {
+        return -1;
+    }
+
+#if defined(_WIN32)
+    int n = snprintf(buf, bufn, "%s\\Miuchiz Reborn\\%s", base, app);
+#elif defined(__APPLE__)
+    int n = snprintf(buf, bufn, "%s/Miuchiz Reborn/%s", base, app);
+#else
+    int n = snprintf(buf, bufn, "%s/miuchiz-reborn/%s", base, app);
+#endif
+    return (n > 0 && (size_t)n < bufn) ? 0 : -1;
+}
+
+static int make_dir(const char* path) {
+#if defined(_WIN32)
+    int result = _mkdir(path);
+#else
+    int result = mkdir(path, 0700);
+#endif
+    return (result == 0 || errno == EEXIST) ? 0 : -1;
+}
+
+int miuchiz_make_dirs(const char* path) {
+    char partial[1024];
+    size_t len = strlen(path);
+    if (len == 0 || len >= sizeof(partial)) {
+        return -1;
+    }
+    strcpy(partial, path);
+
+    /* Create each ancestor in turn; the first component (a root or a drive)
+     * is skipped so "/" and "C:\" are never attempted. */
+    for (size_t i = 1; i < len; i++) {
+        if (partial[i] == '/' || partial[i] == '\\') {
+            if (partial[i - 1] == ':' || partial[i - 1] == '/' || partial[i - 1] == '\\') {
+                continue;
+            }
+            char saved = partial[i];
+            partial[i] = '\0';
+            if (make_dir(partial) != 0) {
+                return -1;
+            }
+            partial[i] = saved;
+        }
+    }
+    return make_dir(partial);
+}
+
+int miuchiz_replace_file(const char* from, const char* to) {
+#if defined(_WIN32)
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return rename(from, to) == 0 ? 0 : -1;
+#endif
+}
+
+int miuchiz_app_dir(const char* category, const char* app, char* buf, size_t nbuf) {
+    if (miuchiz_reborn_dir(category, app, buf, nbuf) != 0) {
+        return -1;
+    }
+    return miuchiz_make_dirs(buf);
+}
@@ -0,0 +1,36 @@
+#ifndef MIUCHIZ_LIBMIUCHIZ_PATHS_H
+#define MIUCHIZ_LIBMIUCHIZ_PATHS_H
+
+#include <stddef.h>
+
+/*
+ * The shared Miuchiz Reborn storage-location policy (mirrors the
+ * miuchiz-reborn-paths crate; verified against its vendored test vectors by
+ * the paths-conformance test).
+ */
+
+/* The library's own application name under the policy, for the directories
+ * it keeps state in (identity cache and the like). */
+#define MIUCHIZ_REBORN_APP "miuchiz-usb"
+
+/**
+ * Resolves `app`'s directory for `category` ("config", "data", "cache",
+ * "state" or "runtime").
+ * @return 0 on success, -1 on failure (unknown category, no usable base).
+ */
+int miuchiz_reborn_dir(const char* category, const char* app, char* buf, size_t bufn);
+
+/**
+ * Creates `path` and any missing parents, like mkdir -p.
+ * @return 0 if the directory exists afterwards, -1 otherwise.
+ */
+int miuchiz_make_dirs(const char* path);
+
+/**
+ * Atomically replaces `to` with `from` (a rename that overwrites), so readers
+ * see either the old or the new file, never a partial one.
+ * @return 0 on success, -1 on failure.
+ */
+int miuchiz_replace_file(const char* from, const char* to);
+
+#endif
@@ -16,4 +16,16 @@ void miuchiz_sleep_ms(unsigned int ms) {
     while (nanosleep(&req, &req) == -1 && errno == EINTR) {
     }
 #endif
-}
\ No newline at end of file
+}
+
+void miuchiz_sleep_us(unsigned int us) {
+#if defined(_WIN32)
+    Sleep((us + 999u) / 1000u);
+#else
+    struct timespec req;
+    req.tv_sec = us / 1000000u;
+    req.tv_nsec = (long)(us % 1000000u) * 1000L;
+    while (nanosleep(&req, &req) == -1 && errno == EINTR) {
+    }
+#endif
+}
@@ -0,0 +1,115 @@
+/*
+ * Checks the transport registry (miuchiz_backend_register): a transport
+ * registered at runtime serves the device strings with its prefix, through
+ * every dispatcher, with its optional operations left out; a later
+ * registration stands in for a built-in one; and anything unclaimed still
+ * goes to the platform backend.
+ *
+ * Usage: backend-registry
+ */
+
+#include "libmiuchiz-usb.h"
+#include "backend.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A test double: a handheld whose sector 0 carries the signature and which
+ * counts the operations it is asked for. */
+struct Fake {
+    off_t offset;
+    int opens;
+    int reads;
+    int closes;
+};
+
+static struct Fake fake;
+
+static void fake_open(struct Handheld* handheld) {
+    fake.opens++;
+    handheld->transport = &fake;
+}
+
+static void fake_close(struct Handheld* handheld) {
+    fake.closes++;
+    handheld->transport = NULL;
+}
+
+static ssize_t fake_read(struct Handheld* handheld, void* buf, size_t n) {
+    struct Fake* state = handheld->transport;
+    state->reads++;
+    memset(buf, 0, n);
+    if (state->offset == 0 && n >= 53) {
+        memcpy((char*)buf + 43, "SITRONIXTM", 10);
+    }
+    return (ssize_t)n;
+}
+
+static ssize_t fake_write(struct Handheld* handheld, const void* buf, size_t n) {
+    (void)handheld;
+    (void)buf;
+    return (ssize_t)n;
+}
+
+static off_t fake_seek(struct Handheld* handheld, off_t offset) {
+    struct Fake* state = handheld->transport;
+    state->offset = offset;
+    return 0;
+}
+
+static const struct MiuchizBackend fake_backend = {
+    .name = "fake",
+    .prefix = "fake:",
+    .open = fake_open,
+    .close = fake_close,
+    .read = fake_read,
+    .write = fake_write,
+    .seek = fake_seek,
+};
+
+/* Claims the image prefix. */
+static const struct MiuchizBackend fake_img_backend = {
+    .name = "fake-img",
+    .prefix = "img:",
+    .open = fake_open,
+    .close = fake_close,
+    .read = fake_read,
+    .write = fake_write,
+    .seek = fake_seek,
+};
+
+int main(void) {
+    CHECK(miuchiz_backend_for("fake:1")->prefix == NULL,
+          "an unregistered prefix did not go to the platform backend");
+    CHECK(miuchiz_backend_register(&fake_backend) == 0, "registering failed");
+    CHECK(miuchiz_backend_for("fake:1") == &fake_backend, "the registered prefix is not served by it");
+    CHECK(strcmp(miuchiz_backend_for("emu:/tmp/x.sock")->name, "emu") == 0, "emu: lost its transport");
+
+    struct Handheld* handheld = miuchiz_handheld_create("fake:1");
+    CHECK(handheld->backend == &fake_backend && fake.opens == 1, "create did not open through the transport");
+    CHECK(miuchiz_handheld_is_handheld(handheld) && fake.reads == 1, "sector 0 was not read through the transport");
+
+    struct MiuchizTransportStats stats;
+    CHECK(miuchiz_handheld_transport_stats(handheld, &stats) == -1, "stats without a stats operation");
+    char fingerprint[MIUCHIZ_FINGERPRINT_LENGTH + 1];
+    CHECK(miuchiz_handheld_fingerprint(handheld, fingerprint, sizeof(fingerprint)) == 0,
+          "no fingerprint without an identity operation");
+    miuchiz_handheld_destroy(handheld);
+    CHECK(fake.closes == 1, "destroy did not close through the transport");
+
+    /* Without an enumerate operation, its devices are only ever named. */
+    struct Handheld** handhelds = NULL;
+    CHECK(miuchiz_handheld_create_all_for(&handhelds, "fake:2") == 1 && fake.opens == 2,
+          "a named-only device was not opened by name");
+    miuchiz_handheld_destroy_all(handhelds);
+
+    CHECK(miuchiz_backend_register(&fake_img_backend) == 0, "registering over img: failed");
+    handheld = miuchiz_handheld_create("img:/nonexistent.bin");
+    CHECK(handheld->backend == &fake_img_backend && miuchiz_handheld_is_handheld(handheld),
+          "the later registration did not stand in for the built-in img: transport");
+    miuchiz_handheld_destroy(handheld);
+
+    return test_finish();
+}
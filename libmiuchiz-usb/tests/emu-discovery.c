@@ -0,0 +1,129 @@
+/*
+ * Checks emulator discovery (miuchiz_emu_enumerate) against a directory of
+ * endpoints: live emiu2 stand-ins (emu-stub.c), a stale socket file whose
+ * emulator is gone, and wedged endpoints that accept connections but never
+ * speak. Live emulators must be found within about a round trip, the stale
+ * file pruned, and the wedged ones must cost one discovery deadline in total
+ * rather than one each.
+ *
+ * Usage: emu-discovery
+ */
+
+#include "libmiuchiz-usb.h"
+#include "backend-internal.h"
+#include "timer.h"
+#include "emu-stub.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define LIVE_EMULATORS (3)
+#define WEDGED_EMULATORS (2)
+
+/* Healthy discovery is a connect and two round trips per emulator, all in
+ * parallel; this leaves room for a loaded CI machine. */
+#define HEALTHY_LIMIT_US (250000)
+/* One discovery deadline (1.5 s) plus slack, well short of two. */
+#define WEDGED_LIMIT_US (2500000)
+
+/* Binds a Unix socket at path; listens when `listening`, else closes it,
+ * leaving the file behind with nothing listening. Returns the fd or -1. */
+static int make_endpoint(const char* path, int listening) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        return -1;
+    }
+    if (!listening) {
+        close(fd);
+        return -1;
+    }
+    listen(fd, 4);
+    return fd;
+}
+
+/* Enumerates, checks every live stand-in was found and is usable, and
+ * returns the time taken in microseconds. */
+static uint64_t discover(struct EmuStub** stubs, const char* label) {
+    struct Utimer timer;
+    miuchiz_utimer_start(&timer);
+    struct Handheld** handhelds = NULL;
+    int count = miuchiz_emu_enumerate(&handhelds);
+    miuchiz_utimer_end(&timer);
+
+    CHECK(count == LIVE_EMULATORS, "%s: found %d emulators, expected %d", label, count, LIVE_EMULATORS);
+    for (int s = 0; s < LIVE_EMULATORS; s++) {
+        int found = 0;
+        for (int i = 0; i < count; i++) {
+            found |= strcmp(handhelds[i]->device, emu_stub_device(stubs[s])) == 0;
+        }
+        CHECK(found, "%s: %s not discovered", label, emu_stub_device(stubs[s]));
+    }
+    /* The discovered handles keep the connection discovery verified. */
+    for (int i = 0; i < count; i++) {
+        unsigned char page[MIUCHIZ_PAGE_SIZE];
+        CHECK(miuchiz_handheld_read_page(handhelds[i], 0x10, page, sizeof(page)) >= 0,
+              "%s: %s unusable after discovery", label, handhelds[i]->device);
+    }
+    miuchiz_handheld_destroy_all(handhelds);
+
+    uint64_t elapsed = miuchiz_utimer_elapsed(&timer);
+    printf("%-24s %8.1f ms\n", label, elapsed / 1000.0);
+    return elapsed;
+}
+
+int main(void) {
+    char dir[64];
+    if (test_scratch_dir("emu-discovery", dir, sizeof(dir)) != 0) {
+        return 1;
+    }
+    setenv("EMIU2_USB_DIR", dir, 1);
+
+    struct EmuStub* stubs[LIVE_EMULATORS];
+    struct EmuStubOptions options = { .dir = dir, .latency_us = 50 };
+    for (int i = 0; i < LIVE_EMULATORS; i++) {
+        stubs[i] = emu_stub_start(&options);
+        if (stubs[i] == NULL) {
+            fprintf(stderr, "FAIL: could not start the emulator stand-in in %s\n", dir);
+            return 1;
+        }
+    }
+
+    uint64_t healthy = discover(stubs, "healthy");
+    CHECK(healthy < HEALTHY_LIMIT_US, "healthy discovery took %.1f ms", healthy / 1000.0);
+
+    char stale[600];
+    snprintf(stale, sizeof(stale), "%s/stale.sock", dir);
+    make_endpoint(stale, 0);
+    int wedged[WEDGED_EMULATORS];
+    char wedged_paths[WEDGED_EMULATORS][600];
+    for (int i = 0; i < WEDGED_EMULATORS; i++) {
+        snprintf(wedged_paths[i], sizeof(wedged_paths[i]), "%s/wedged-%d.sock", dir, i);
+        wedged[i] = make_endpoint(wedged_paths[i], 1);
+    }
+
+    uint64_t crowded = discover(stubs, "stale + wedged");
+    CHECK(crowded < WEDGED_LIMIT_US, "discovery with wedged emulators took %.1f ms", crowded / 1000.0);
+    CHECK(access(stale, F_OK) != 0, "stale endpoint %s was not pruned", stale);
+    for (int i = 0; i < WEDGED_EMULATORS; i++) {
+        CHECK(access(wedged_paths[i], F_OK) == 0, "live but wedged endpoint %s was pruned", wedged_paths[i]);
+        close(wedged[i]);
+        unlink(wedged_paths[i]);
+    }
+
+    for (int i = 0; i < LIVE_EMULATORS; i++) {
+        emu_stub_stop(stubs[i]);
+    }
+    rmdir(dir);
+
+    return test_finish();
+}
@@ -0,0 +1,204 @@
+/*
+ * End-to-end check and benchmark of the emulator transport's transaction
+ * pipelining and protocol negotiation, against the in-process emiu2
+ * stand-in (emu-stub.c).
+ *
+ * Against a protocol 3 stand-in, reads and writes pages with stop-and-wait
+ * (MIUCHIZ_EMU_WINDOW=1) and with the default window, verifying every byte
+ * against the stand-in's flash; then does the same against one that offers
+ * protocol 4, where whole transfers move per transaction; then repeats both
+ * protocols against a device that NAKs at random to exercise the fallback,
+ * partial transfers and the adaptive NAK wait (whose counters must register
+ * the NAKs). Throughput is printed for comparison. Besides correctness, the
+ * test asserts the framing's syscall budget: one send and one receive per
+ * transaction at worst (stop-and-wait), and a small fraction of that when
+ * pipelined, where a whole burst of requests goes out in one gathered send
+ * and its responses come back in one buffered receive; and that protocol 4
+ * was negotiated, i.e. takes a fraction of protocol 3's transactions.
+ *
+ * Usage: emu-pipeline [pages]
+ */
+
+#include "libmiuchiz-usb.h"
+#include "timer.h"
+#include "emu-stub.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_PAGES (64)
+
+/* Delay the stand-in puts on each response, in the range of an emulator
+ * answering from its frame loop. */
+#define LINK_LATENCY_US (50)
+
+/* A page-aligned scratch region well clear of the save page. */
+#define FIRST_PAGE (0x100)
+
+/* Pipelined reads must average at least this many transactions per
+ * syscall (a full window manages well over twice that). */
+#define MIN_TRANSACTIONS_PER_SYSCALL (4)
+
+/* Protocol 4 needs at most this fraction of protocol 3's transactions (a
+ * page read alone drops from 76 to 2). */
+#define MIN_AGGREGATION (8)
+
+struct Result {
+    double pages_per_sec;
+    double syscalls_per_page;     /* during the reads */
+    double transactions_per_page;
+    double nak_wait_us_per_page;
+    double cpu_us_per_page;       /* the library's thread only */
+};
+
+/* CPU time of the calling thread (the stand-in serves from its own). */
+static double thread_cpu_us(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0) {
+        return 0.0;
+    }
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* Reads then rewrites `pages` pages through a fresh handheld using `window`
+ * (NULL for the library default), measuring the reads. */
+static struct Result exercise(struct EmuStub* stub, const char* window, int pages, const char* label) {
+    if (window != NULL) {
+        setenv("MIUCHIZ_EMU_WINDOW", window, 1);
+    }
+    else {
+        unsetenv("MIUCHIZ_EMU_WINDOW");
+    }
+
+    struct Result result = { 0 };
+    struct Handheld* handheld = miuchiz_handheld_create(emu_stub_device(stub));
+    CHECK(handheld != NULL, "%s: create", label);
+    if (handheld == NULL) {
+        return result;
+    }
+    CHECK(miuchiz_handheld_is_handheld(handheld), "%s: not recognized as a handheld", label);
+
+    unsigned char* flash = emu_stub_flash(stub);
+    unsigned char page[MIUCHIZ_PAGE_SIZE];
+
+    struct MiuchizTransportStats before;
+    CHECK(miuchiz_handheld_transport_stats(handheld, &before) == 0, "%s: no transport stats", label);
+
+    double cpu_before = thread_cpu_us();
+    struct Utimer timer;
+    miuchiz_utimer_start(&timer);
+    for (int i = 0; i < pages; i++) {
+        int p = FIRST_PAGE + i;
+        int result = miuchiz_handheld_read_page(handheld, p, page, sizeof(page));
+        CHECK(result >= 0, "%s: read page 0x%X returned %d", label, p, result);
+        CHECK(memcmp(page, flash + (size_t)p * MIUCHIZ_PAGE_SIZE, sizeof(page)) == 0,
+              "%s: page 0x%X differs from the device", label, p);
+    }
+    miuchiz_utimer_end(&timer);
+    uint64_t elapsed = miuchiz_utimer_elapsed(&timer);
+    result.cpu_us_per_page = (thread_cpu_us() - cpu_before) / pages;
+
+    struct MiuchizTransportStats after;
+    miuchiz_handheld_transport_stats(handheld, &after);
+    result.transactions_per_page = (double)(after.transactions - before.transactions) / pages;
+    result.syscalls_per_page = (double)(after.send_calls - before.send_calls
+                                      + after.recv_calls - before.recv_calls) / pages;
+    result.nak_wait_us_per_page = (double)(after.nak_wait_us - before.nak_wait_us) / pages;
+
+    for (int i = 0; i < pages; i++) {
+        int p = FIRST_PAGE + i;
+        for (size_t j = 0; j < sizeof(page); j++) {
+            page[j] = (unsigned char)(j * 7 + p + (window != NULL ? window[0] : 0));
+        }
+        int result = miuchiz_handheld_write_page(handheld, p, page, sizeof(page));
+        CHECK(result >= 0, "%s: write page 0x%X returned %d", label, p, result);
+        CHECK(memcmp(page, flash + (size_t)p * MIUCHIZ_PAGE_SIZE, sizeof(page)) == 0,
+              "%s: write to page 0x%X did not land", label, p);
+    }
+
+    miuchiz_handheld_destroy(handheld);
+
+    result.pages_per_sec = elapsed > 0 ? pages * 1e6 / (double)elapsed : 0.0;
+    printf("%-24s %8.1f pages/s %8.1f syscalls/page (%.1f transactions)"
+           " %8.1f us NAK wait/page %8.1f us CPU/page\n", label,
+           result.pages_per_sec, result.syscalls_per_page, result.transactions_per_page,
+           result.nak_wait_us_per_page, result.cpu_us_per_page);
+    return result;
+}
+
+static struct EmuStub* start_stub(const char* dir, unsigned int version, double nak_rate) {
+    struct EmuStubOptions options = {
+        .dir = dir,
+        .latency_us = LINK_LATENCY_US,
+        .nak_rate = nak_rate,
+        .busy_us = 200,
+        .version = version,
+    };
+    struct EmuStub* stub = emu_stub_start(&options);
+    if (stub == NULL) {
+        fprintf(stderr, "FAIL: could not start the emulator stand-in in %s\n", dir);
+        test_failures++;
+    }
+    return stub;
+}
+
+int main(int argc, char** argv) {
+    int pages = argc > 1 ? atoi(argv[1]) : DEFAULT_PAGES;
+    if (pages <= 0 || FIRST_PAGE + pages >= MIUCHIZ_SAVE_PAGE) {
+        fprintf(stderr, "Usage: %s [pages (1-%d)]\n", argv[0], MIUCHIZ_SAVE_PAGE - FIRST_PAGE - 1);
+        return 2;
+    }
+
+    char dir[64];
+    if (test_scratch_dir("emu-pipeline", dir, sizeof(dir)) != 0) {
+        return 1;
+    }
+
+    struct Result pipelined = { 0 };
+    struct EmuStub* stub = start_stub(dir, 3, 0.0);
+    if (stub != NULL) {
+        struct Result serial = exercise(stub, "1", pages, "stop-and-wait");
+        pipelined = exercise(stub, NULL, pages, "pipelined");
+        if (serial.pages_per_sec > 0.0) {
+            printf("%-24s %8.2fx\n", "speedup", pipelined.pages_per_sec / serial.pages_per_sec);
+        }
+        CHECK(serial.syscalls_per_page <= 2 * serial.transactions_per_page,
+              "stop-and-wait: %.1f syscalls/page for %.1f transactions",
+              serial.syscalls_per_page, serial.transactions_per_page);
+        CHECK(pipelined.syscalls_per_page * MIN_TRANSACTIONS_PER_SYSCALL
+                  <= pipelined.transactions_per_page,
+              "pipelined: %.1f syscalls/page for %.1f transactions",
+              pipelined.syscalls_per_page, pipelined.transactions_per_page);
+        emu_stub_stop(stub);
+    }
+
+    stub = start_stub(dir, 4, 0.0);
+    if (stub != NULL) {
+        struct Result aggregate = exercise(stub, NULL, pages, "protocol 4");
+        if (pipelined.pages_per_sec > 0.0) {
+            printf("%-24s %8.2fx\n", "speedup over 3", aggregate.pages_per_sec / pipelined.pages_per_sec);
+        }
+        CHECK(aggregate.transactions_per_page * MIN_AGGREGATION <= pipelined.transactions_per_page,
+              "protocol 4: %.1f transactions/page against %.1f under protocol 3",
+              aggregate.transactions_per_page, pipelined.transactions_per_page);
+        emu_stub_stop(stub);
+    }
+
+    for (unsigned int version = 3; version <= 4; version++) {
+        stub = start_stub(dir, version, 0.05);
+        if (stub != NULL) {
+            const char* label = version == 3 ? "pipelined, NAKing" : "protocol 4, NAKing";
+            struct Result naking = exercise(stub, NULL, pages / 4 + 1, label);
+            CHECK(naking.nak_wait_us_per_page > 0.0, "%s: no NAK wait was recorded", label);
+            emu_stub_stop(stub);
+        }
+    }
+
+    rmdir(dir);
+
+    return test_finish();
+}
@@ -0,0 +1,116 @@
+/*
+ * Checks that an emulator handheld survives emulator hiccups mid-transfer:
+ * a dropped connection, the device going off the bus for a while (the cable
+ * toggled), and the emulator restarting under a new endpoint. Each hiccup is
+ * scheduled partway through a page's command sequence on the in-process
+ * emiu2 stand-in (emu-stub.c); the page must still come back intact, from
+ * the same handle, with the reattachment counted. Finally, an emulator that
+ * does not come back must make the handle fail within the reattach budget
+ * rather than hang.
+ *
+ * Usage: emu-reattach
+ */
+
+#include "libmiuchiz-usb.h"
+#include "timer.h"
+#include "emu-stub.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define IDENTITY "emu-reattach"
+
+/* A page-aligned scratch region well clear of the save page. */
+#define FIRST_PAGE (0x100)
+
+/* Transactions into a page read at which hiccups strike: past the first of
+ * its SCSI commands, before the sector data. */
+#define MID_PAGE (4)
+
+#define UNPLUG_MS (300)
+#define GONE_BUDGET_MS (300)
+/* The budget, the page layer's retries and slack for a loaded machine. */
+#define GONE_LIMIT_US (2000000)
+
+static struct EmuStub* start_stub(const char* dir) {
+    struct EmuStubOptions options = { .dir = dir, .identity = IDENTITY, .latency_us = 50 };
+    struct EmuStub* stub = emu_stub_start(&options);
+    if (stub == NULL) {
+        fprintf(stderr, "FAIL: could not start the emulator stand-in in %s\n", dir);
+        test_failures++;
+    }
+    return stub;
+}
+
+/* Reads a page and checks it against the stand-in's flash and the expected
+ * reattach count. */
+static void read_checked(struct Handheld* handheld, struct EmuStub* stub, int page,
+                         uint64_t reattaches, const char* label) {
+    unsigned char buf[MIUCHIZ_PAGE_SIZE];
+    struct Utimer timer;
+    miuchiz_utimer_start(&timer);
+    int result = miuchiz_handheld_read_page(handheld, page, buf, sizeof(buf));
+    miuchiz_utimer_end(&timer);
+
+    CHECK(result >= 0, "%s: read of page 0x%X returned %d", label, page, result);
+    CHECK(memcmp(buf, emu_stub_flash(stub) + (size_t)page * MIUCHIZ_PAGE_SIZE, sizeof(buf)) == 0,
+          "%s: page 0x%X differs from the device", label, page);
+    CHECK(strcmp(handheld->device, emu_stub_device(stub)) == 0,
+          "%s: handle is at %s, emulator at %s", label, handheld->device, emu_stub_device(stub));
+
+    struct MiuchizTransportStats stats;
+    CHECK(miuchiz_handheld_transport_stats(handheld, &stats) == 0 && stats.reattaches == reattaches,
+          "%s: %llu reattaches, expected %llu", label,
+          (unsigned long long)stats.reattaches, (unsigned long long)reattaches);
+    printf("%-24s %8.1f ms\n", label, miuchiz_utimer_elapsed(&timer) / 1000.0);
+}
+
+int main(void) {
+    char dir[64];
+    if (test_scratch_dir("emu-reattach", dir, sizeof(dir)) != 0) {
+        return 1;
+    }
+    setenv("EMIU2_USB_DIR", dir, 1);
+    unsetenv("MIUCHIZ_EMU_REATTACH_MS");
+
+    struct EmuStub* stub = start_stub(dir);
+    if (stub == NULL) {
+        return 1;
+    }
+    struct Handheld* handheld = miuchiz_handheld_create(emu_stub_device(stub));
+    int page = FIRST_PAGE;
+    read_checked(handheld, stub, page++, 0, "healthy");
+
+    emu_stub_drop(stub, MID_PAGE);
+    read_checked(handheld, stub, page++, 1, "connection dropped");
+
+    emu_stub_unplug(stub, MID_PAGE, UNPLUG_MS);
+    read_checked(handheld, stub, page++, 2, "cable toggled");
+
+    /* A restarted emulator publishes a new endpoint under the same identity. */
+    emu_stub_stop(stub);
+    stub = start_stub(dir);
+    if (stub != NULL) {
+        read_checked(handheld, stub, page++, 3, "emulator restarted");
+        emu_stub_stop(stub);
+    }
+
+    setenv("MIUCHIZ_EMU_REATTACH_MS", "300", 1);
+    unsigned char buf[MIUCHIZ_PAGE_SIZE];
+    struct Utimer timer;
+    miuchiz_utimer_start(&timer);
+    int result = miuchiz_handheld_read_page(handheld, page, buf, sizeof(buf));
+    miuchiz_utimer_end(&timer);
+    uint64_t elapsed = miuchiz_utimer_elapsed(&timer);
+    printf("%-24s %8.1f ms\n", "emulator gone", elapsed / 1000.0);
+    CHECK(result < 0, "emulator gone: read returned %d", result);
+    CHECK(elapsed < GONE_LIMIT_US, "emulator gone: failing took %.1f ms", elapsed / 1000.0);
+
+    miuchiz_handheld_destroy(handheld);
+    rmdir(dir);
+
+    return test_finish();
+}
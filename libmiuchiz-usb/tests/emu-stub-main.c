@@ -0,0 +1,204 @@
+/*
+ * miuchiz-emu-stub: the emiu2 stand-in (emu-stub.c) as a standalone
+ * emulator. Publishes an endpoint in the emulator runtime directory (the
+ * one discovery searches, or -d) and serves a Miuchiz handheld in USB mode
+ * over it until interrupted, so the miuchiz tools, benchmarks and CI jobs
+ * can run against the "emu:" transport with neither hardware nor emiu2.
+ *
+ * Prints the device string once serving. On exit the endpoint is removed
+ * and, with -w, the flash is written back to the -f image.
+ */
+
+#include "emu-stub.h"
+#include "backend-internal.h"
+#include "paths.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+
+struct args {
+    char* dir;
+    char* identity;
+    char* flash_path;
+    char* otp_path;
+    int write_back;
+    unsigned int latency_us;
+    double nak_rate;
+    unsigned int busy_us;
+    unsigned int seed;
+    unsigned int version;
+};
+
+static void usage(const char* program_name) {
+    fprintf(stderr,
+            "Usage: %s [-d dir] [-i identity] [-f flash.bin [-w]] [-o otp.bin]\n"
+            "       [-l latency_us] [-n nak_rate] [-b busy_us] [-s seed] [-p protocol]\n",
+            program_name);
+}
+
+static int args_parse(struct args* args, int argc, char** argv) {
+    int opt;
+    int option_index;
+    static struct option long_options[] = {
+        {"dir",        required_argument, 0, 'd' },
+        {"identity",   required_argument, 0, 'i' },
+        {"flash",      required_argument, 0, 'f' },
+        {"write-back", no_argument,       0, 'w' },
+        {"otp",        required_argument, 0, 'o' },
+        {"latency",    required_argument, 0, 'l' },
+        {"nak-rate",   required_argument, 0, 'n' },
+        {"busy",       required_argument, 0, 'b' },
+        {"seed",       required_argument, 0, 's' },
+        {"protocol",   required_argument, 0, 'p' },
+        {0,          0,                 0,  0 }
+    };
+
+    memset(args, 0, sizeof(*args));
+    args->busy_us = 1000;
+
+    while ((opt = getopt_long(argc, argv, "d:i:f:wo:l:n:b:s:p:", long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'd':
+                args->dir = optarg;
+                break;
+            case 'i':
+                args->identity = optarg;
+                break;
+            case 'f':
+                args->flash_path = optarg;
+                break;
+            case 'w':
+                args->write_back = 1;
+                break;
+            case 'o':
+                args->otp_path = optarg;
+                break;
+            case 'l':
+                args->latency_us = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                args->nak_rate = atof(optarg);
+                break;
+            case 'b':
+                args->busy_us = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                args->seed = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                args->version = (unsigned int)strtoul(optarg, NULL, 0);
+                break;
+            default:
+                return 1;
+        }
+    }
+
+    if (optind < argc
+        || args->nak_rate < 0.0 || args->nak_rate >= 1.0
+        || (args->version != 0 && args->version != 3 && args->version != 4)
+        || (args->write_back && args->flash_path == NULL)) {
+        return 1;
+    }
+    return 0;
+}
+
+/* Reads exactly `n` bytes of an image file into a fresh buffer. */
+static unsigned char* load_image(const char* path, size_t n) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        fprintf(stderr, "Unable to open %s. [%d] %s\n", path, errno, strerror(errno));
+        return NULL;
+    }
+    unsigned char* image = malloc(n);
+    if (image != NULL && fread(image, 1, n, fp) != n) {
+        fprintf(stderr, "%s is not a %zu-byte image.\n", path, n);
+        free(image);
+        image = NULL;
+    }
+    fclose(fp);
+    return image;
+}
+
+int main(int argc, char** argv) {
+    struct args args;
+    if (args_parse(&args, argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char dir[1024];
+    if (args.dir != NULL) {
+        snprintf(dir, sizeof(dir), "%s", args.dir);
+    }
+    else if (miuchiz_emu_endpoint_dir(dir, sizeof(dir)) != 0) {
+        fprintf(stderr, "Unable to find the emulator runtime directory.\n");
+        return 1;
+    }
+    if (miuchiz_make_dirs(dir) != 0) {
+        fprintf(stderr, "Unable to create %s. [%d] %s\n", dir, errno, strerror(errno));
+        return 1;
+    }
+
+    int result = 1;
+    unsigned char* flash = NULL;
+    unsigned char* otp = NULL;
+    if (args.flash_path != NULL && (flash = load_image(args.flash_path, EMU_STUB_FLASH_SIZE)) == NULL) {
+        goto leave;
+    }
+    if (args.otp_path != NULL && (otp = load_image(args.otp_path, EMU_STUB_OTP_SIZE)) == NULL) {
+        goto leave;
+    }
+
+    /* Served threads inherit the mask, so the signals reach sigwait. */
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    struct EmuStubOptions options = {
+        .dir = dir,
+        .identity = args.identity,
+        .latency_us = args.latency_us,
+        .nak_rate = args.nak_rate,
+        .busy_us = args.busy_us,
+        .seed = args.seed,
+        .version = args.version,
+        .flash = flash,
+        .otp = otp,
+    };
+    struct EmuStub* stub = emu_stub_start(&options);
+    if (stub == NULL) {
+        fprintf(stderr, "Unable to serve an endpoint in %s.\n", dir);
+        goto leave;
+    }
+    printf("%s\n", emu_stub_device(stub));
+    fflush(stdout);
+
+    int signal_number = 0;
+    sigwait(&signals, &signal_number);
+
+    result = 0;
+    if (args.write_back) {
+        FILE* fp = fopen(args.flash_path, "wb");
+        if (fp == NULL || fwrite(emu_stub_flash(stub), 1, EMU_STUB_FLASH_SIZE, fp) != EMU_STUB_FLASH_SIZE) {
+            fprintf(stderr, "Unable to write the flash back to %s.\n", args.flash_path);
+            result = 1;
+        }
+        if (fp != NULL && fclose(fp) != 0) {
+            result = 1;
+        }
+    }
+    emu_stub_stop(stub);
+
+leave:
+    free(flash);
+    free(otp);
+    return result;
+}
@@ -0,0 +1,792 @@
+/*
+ * In-process emiu2 stand-in; see emu-stub.h. Speaks the wire protocol from
+ * backend-emu.c's header comment (protocol version 3, and 4 when offered and
+ * taken up), one thread per client connection, all sharing one emulated
+ * handheld.
+ */
+
+#include "emu-stub.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define STUB_PROTOCOL_VERSION (3)
+#define STUB_PROTOCOL_AGGREGATE (4)
+#define STUB_BULK_MAX (64)
+#define STUB_MAX_REQUEST (1 << 20)
+/* Protocol 4 transfer limit; below what the library offers, so the
+ * negotiation has to settle on it. */
+#define STUB_TRANSFER_MAX (16384)
+
+#define HELLO_FLAG_PLUGGED (0x01)
+#define HELLO_FLAG_UPGRADE (0x02)
+
+#define TOKEN_SETUP (0)
+#define TOKEN_IN    (1)
+#define TOKEN_OUT   (2)
+
+#define RESP_ACK      (0)
+#define RESP_NAK      (1)
+#define RESP_STALL    (2)
+#define RESP_DATA     (3)
+#define RESP_DETACHED (4)
+#define RESP_DROP     (-1) /* not on the wire: hang up instead of answering */
+
+#define ENDPOINT_BULK (1)
+#define ENDPOINT_TRANSPORT (0xFF)
+
+#define CBW_SIZE (31)
+#define CSW_SIZE (13)
+
+#define SECTOR_SIZE (512)
+#define PAGE_SIZE (0x1000)
+#define PAGE_COUNT (0x200)
+#define SECTOR_OTP (0)
+#define SECTOR_SCSI_WRITE (0x31)
+#define SECTOR_DATA_WRITE (0x33)
+#define SECTOR_DATA_READ (0x58)
+
+/* Sector 0 exposes the OTP starting at this offset, repeating. */
+#define OTP_STARTING_OFFSET (0xBDC)
+/* Where Miuchiz Sync looks for the signature within sector 0. */
+#define SIGNATURE_OFFSET (43)
+
+#define OPCODE_READ            (0x28)
+#define OPCODE_WRITE           (0x2A)
+#define OPCODE_WRITE_FILEMARKS (0x80)
+#define OPCODE_READ_REVERSE    (0x81)
+
+enum Hiccup {
+    HICCUP_NONE,
+    HICCUP_DROP,
+    HICCUP_UNPLUG,
+};
+
+enum BotState {
+    BOT_IDLE,     /* waiting for a CBW */
+    BOT_DATA_IN,  /* staging data for IN tokens */
+    BOT_DATA_OUT, /* collecting data from OUT packets */
+    BOT_STATUS,   /* CSW staged */
+};
+
+struct StubConn {
+    struct EmuStub* stub;
+    int fd;
+    pthread_t thread;
+    struct StubConn* next;
+    int version;          /* protocol spoken on the connection */
+    size_t transfer_max;  /* under protocol 4 */
+
+    enum BotState state;
+    uint32_t tag;
+    uint32_t lba;
+    unsigned char* data;
+    size_t data_len;
+    size_t data_pos;
+    unsigned char csw[CSW_SIZE];
+};
+
+struct EmuStub {
+    struct EmuStubOptions options;
+    char path[512];
+    char device[520];
+    char identity[256];
+    int listen_fd;
+    pthread_t accept_thread;
+    int stopping;
+
+    pthread_mutex_t lock; /* guards everything below and each connection's BOT state */
+    struct StubConn* conns;
+    unsigned char* flash;
+    unsigned char otp[EMU_STUB_OTP_SIZE];
+    int read_page;        /* page selected by the last READ command, or -1 */
+    int write_page;       /* page selected by the last WRITE command, or -1 */
+    int eject_pending;    /* detach once the current command completes */
+    int detached;
+    uint64_t replug_at;   /* when an unplugged device comes back; 0 = never */
+    unsigned int hiccup_after; /* transactions until the scheduled hiccup */
+    int hiccup;           /* HICCUP_* scheduled */
+    unsigned int unplug_ms;
+    uint64_t busy_until;
+    uint32_t rng;
+};
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000ULL;
+}
+
+static uint32_t stub_random(struct EmuStub* stub) {
+    /* xorshift32: deterministic per seed, which keeps NAK-heavy runs
+     * reproducible. */
+    uint32_t x = stub->rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    stub->rng = x;
+    return x;
+}
+
+static uint32_t be32(const unsigned char* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void le32(unsigned char* p, uint32_t v) {
+    p[0] = v & 0xFF;
+    p[1] = (v >> 8) & 0xFF;
+    p[2] = (v >> 16) & 0xFF;
+    p[3] = (v >> 24) & 0xFF;
+}
+
+static int read_all(int fd, void* buf, size_t n) {
+    char* p = buf;
+    while (n > 0) {
+        ssize_t got = read(fd, p, n);
+        if (got <= 0) {
+            return -1;
+        }
+        p += got;
+        n -= got;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const void* buf, size_t n) {
+    const char* p = buf;
+    while (n > 0) {
+        ssize_t sent = send(fd, p, n, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return -1;
+        }
+        p += sent;
+        n -= sent;
+    }
+    return 0;
+}
+
+static int writev_all(int fd, struct iovec* iov, size_t n) {
+    while (n > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return -1;
+        }
+        size_t left = (size_t)sent;
+        while (n > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*)iov->iov_base + left;
+            iov->iov_len -= left;
+        }
+    }
+    return 0;
+}
+
+/* --- the emulated handheld ------------------------------------------------ */
+
+static void device_read(struct EmuStub* stub, uint32_t lba, unsigned char* out, size_t n) {
+    memset(out, 0, n);
+    if (lba == SECTOR_OTP) {
+        for (size_t i = 0; i < n; i++) {
+            out[i] = stub->otp[(OTP_STARTING_OFFSET + i) % EMU_STUB_OTP_SIZE];
+        }
+    }
+    else if (lba == SECTOR_DATA_READ && stub->read_page >= 0 && n >= 4) {
+        /* 4-byte big-endian length, then the page. */
+        out[2] = (PAGE_SIZE >> 8) & 0xFF;
+        size_t copy = n - 4 < PAGE_SIZE ? n - 4 : PAGE_SIZE;
+        memcpy(out + 4, stub->flash + (size_t)stub->read_page * PAGE_SIZE, copy);
+    }
+}
+
+static void device_write(struct EmuStub* stub, uint32_t lba, const unsigned char* data, size_t n) {
+    if (lba == SECTOR_SCSI_WRITE && n >= 1) {
+        switch (data[0]) {
+            case OPCODE_WRITE_FILEMARKS:
+            case OPCODE_READ_REVERSE:
+                stub->read_page = -1;
+                stub->write_page = -1;
+                break;
+            case OPCODE_READ:
+                if (n >= 5) {
+                    uint32_t page = be32(data + 1);
+                    if (page >= PAGE_COUNT) {
+                        /* Like the real handheld: reading past the flash
+                         * makes it drop off the bus. */
+                        stub->eject_pending = 1;
+                    }
+                    else {
+                        stub->read_page = (int)page;
+                    }
+                }
+                break;
+            case OPCODE_WRITE:
+                if (n >= 9 && be32(data + 1) < PAGE_COUNT) {
+                    stub->write_page = (int)be32(data + 1);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    else if (lba == SECTOR_DATA_WRITE && stub->write_page >= 0) {
+        size_t copy = n < PAGE_SIZE ? n : PAGE_SIZE;
+        memcpy(stub->flash + (size_t)stub->write_page * PAGE_SIZE, data, copy);
+    }
+}
+
+/* --- Bulk-Only Transport -------------------------------------------------- */
+
+static void stage_csw(struct StubConn* conn, unsigned char status) {
+    memcpy(conn->csw, "USBS", 4);
+    le32(conn->csw + 4, conn->tag);
+    le32(conn->csw + 8, 0);
+    conn->csw[12] = status;
+    conn->state = BOT_STATUS;
+}
+
+static int stage_buffer(struct StubConn* conn, size_t n) {
+    unsigned char* data = realloc(conn->data, n > 0 ? n : 1);
+    if (data == NULL) {
+        return -1;
+    }
+    conn->data = data;
+    conn->data_len = n;
+    conn->data_pos = 0;
+    return 0;
+}
+
+static int bulk_out(struct StubConn* conn, const unsigned char* payload, size_t n) {
+    struct EmuStub* stub = conn->stub;
+
+    if (conn->state == BOT_IDLE) {
+        if (n != CBW_SIZE || memcmp(payload, "USBC", 4) != 0) {
+            return RESP_STALL;
+        }
+        conn->tag = payload[4] | (payload[5] << 8) | (payload[6] << 16) | ((uint32_t)payload[7] << 24);
+        uint32_t data_len = payload[8] | (payload[9] << 8) | (payload[10] << 16) | ((uint32_t)payload[11] << 24);
+        const unsigned char* cdb = payload + 15;
+        conn->lba = be32(cdb + 2);
+        if (data_len > STUB_MAX_REQUEST || stage_buffer(conn, data_len) < 0) {
+            stage_csw(conn, 0x01);
+            return RESP_ACK;
+        }
+        if (cdb[0] == 0x28) {
+            device_read(stub, conn->lba, conn->data, data_len);
+            conn->state = BOT_DATA_IN;
+            if (data_len == 0) {
+                stage_csw(conn, 0x00);
+            }
+        }
+        else if (cdb[0] == 0x2A) {
+            conn->state = BOT_DATA_OUT;
+            if (data_len == 0) {
+                stage_csw(conn, 0x00);
+            }
+        }
+        else {
+            stage_csw(conn, 0x01);
+        }
+        return RESP_ACK;
+    }
+
+    if (conn->state == BOT_DATA_OUT) {
+        size_t copy = n;
+        if (copy > conn->data_len - conn->data_pos) {
+            copy = conn->data_len - conn->data_pos;
+        }
+        memcpy(conn->data + conn->data_pos, payload, copy);
+        conn->data_pos += copy;
+        if (conn->data_pos == conn->data_len) {
+            device_write(stub, conn->lba, conn->data, conn->data_len);
+            stage_csw(conn, 0x00);
+        }
+        return RESP_ACK;
+    }
+
+    return RESP_STALL;
+}
+
+/* Produces the next IN packet into `out`; returns the response kind. */
+static int bulk_in(struct StubConn* conn, unsigned char* out, size_t* out_len) {
+    struct EmuStub* stub = conn->stub;
+
+    if (conn->state == BOT_DATA_IN) {
+        size_t chunk = conn->data_len - conn->data_pos;
+        if (chunk > STUB_BULK_MAX) {
+            chunk = STUB_BULK_MAX;
+        }
+        memcpy(out, conn->data + conn->data_pos, chunk);
+        conn->data_pos += chunk;
+        *out_len = chunk;
+        if (conn->data_pos == conn->data_len) {
+            stage_csw(conn, 0x00);
+        }
+        return RESP_DATA;
+    }
+
+    if (conn->state == BOT_STATUS) {
+        memcpy(out, conn->csw, CSW_SIZE);
+        *out_len = CSW_SIZE;
+        conn->state = BOT_IDLE;
+        if (stub->eject_pending) {
+            stub->detached = 1;
+        }
+        return RESP_DATA;
+    }
+
+    return RESP_NAK; /* nothing staged */
+}
+
+/* Whether the device is busy for the next packet (it NAKs while it is). */
+static int device_busy(struct EmuStub* stub) {
+    uint64_t now = now_us();
+    if (now < stub->busy_until) {
+        return 1;
+    }
+    if (stub->options.nak_rate > 0.0
+        && (stub_random(stub) / 4294967296.0) < stub->options.nak_rate) {
+        stub->busy_until = now + stub->options.busy_us;
+        return 1;
+    }
+    return 0;
+}
+
+/* The upgrade request: switches the connection to protocol 4 when this
+ * emulator offers it and the host asks for it. */
+static int upgrade(struct StubConn* conn, const unsigned char* payload, size_t n,
+                   unsigned char* out, size_t* out_len) {
+    unsigned int offered = conn->stub->options.version != 0
+                         ? conn->stub->options.version : STUB_PROTOCOL_AGGREGATE;
+    if (offered < STUB_PROTOCOL_AGGREGATE || n < 6
+        || (payload[0] | (payload[1] << 8)) != STUB_PROTOCOL_AGGREGATE) {
+        return RESP_STALL;
+    }
+    uint32_t wanted = payload[2] | (payload[3] << 8) | (payload[4] << 16) | ((uint32_t)payload[5] << 24);
+    conn->version = STUB_PROTOCOL_AGGREGATE;
+    conn->transfer_max = wanted < STUB_TRANSFER_MAX ? wanted : STUB_TRANSFER_MAX;
+    out[0] = STUB_PROTOCOL_AGGREGATE;
+    out[1] = 0;
+    le32(out + 2, (uint32_t)conn->transfer_max);
+    *out_len = 6;
+    return RESP_DATA;
+}
+
+/* A protocol 4 OUT: the device takes packets until it turns busy. */
+static int bulk_out_transfer(struct StubConn* conn, const unsigned char* payload, size_t n,
+                             unsigned char* out, size_t* out_len) {
+    size_t taken = 0;
+    do {
+        if (device_busy(conn->stub)) {
+            break;
+        }
+        size_t packet = n - taken < STUB_BULK_MAX ? n - taken : STUB_BULK_MAX;
+        if (conn->state == BOT_IDLE) {
+            packet = n; /* the CBW is one packet (and rejected if it is not) */
+        }
+        int kind = bulk_out(conn, payload + taken, packet);
+        if (kind != RESP_ACK) {
+            if (taken == 0) {
+                return kind;
+            }
+            break;
+        }
+        taken += packet;
+    } while (taken < n);
+
+    if (taken == n) {
+        return RESP_ACK;
+    }
+    if (taken == 0) {
+        return RESP_NAK;
+    }
+    le32(out, (uint32_t)taken);
+    *out_len = 4;
+    return RESP_DATA;
+}
+
+/* A protocol 4 IN: packets until `wanted` bytes, a short packet, or the
+ * device has nothing more staged. */
+static int bulk_in_transfer(struct StubConn* conn, size_t wanted, unsigned char* out, size_t* out_len) {
+    *out_len = 0;
+    while (*out_len + STUB_BULK_MAX <= wanted && !device_busy(conn->stub)) {
+        size_t packet = 0;
+        int kind = bulk_in(conn, out + *out_len, &packet);
+        if (kind != RESP_DATA) {
+            if (*out_len == 0) {
+                return kind;
+            }
+            break;
+        }
+        *out_len += packet;
+        if (packet < STUB_BULK_MAX) {
+            break;
+        }
+    }
+    return *out_len > 0 ? RESP_DATA : RESP_NAK;
+}
+
+static int transact(struct StubConn* conn, int endpoint, int token,
+                    const unsigned char* payload, size_t n,
+                    unsigned char* out, size_t* out_len) {
+    struct EmuStub* stub = conn->stub;
+
+    if (endpoint == ENDPOINT_TRANSPORT) {
+        return token == TOKEN_SETUP ? upgrade(conn, payload, n, out, out_len) : RESP_STALL;
+    }
+    if (stub->hiccup != HICCUP_NONE && stub->hiccup_after-- == 0) {
+        int hiccup = stub->hiccup;
+        stub->hiccup = HICCUP_NONE;
+        if (hiccup == HICCUP_DROP) {
+            return RESP_DROP;
+        }
+        /* Off the bus: the device comes back reset. */
+        stub->detached = 1;
+        stub->replug_at = now_us() + (uint64_t)stub->unplug_ms * 1000;
+        stub->read_page = -1;
+        stub->write_page = -1;
+    }
+    if (stub->detached && stub->replug_at != 0 && now_us() >= stub->replug_at) {
+        stub->detached = 0;
+        stub->replug_at = 0;
+    }
+    if (stub->detached) {
+        return RESP_DETACHED;
+    }
+    if (conn->version >= STUB_PROTOCOL_AGGREGATE && endpoint == ENDPOINT_BULK) {
+        if (token == TOKEN_OUT && n <= conn->transfer_max) {
+            return bulk_out_transfer(conn, payload, n, out, out_len);
+        }
+        if (token == TOKEN_IN && n == 4) {
+            uint32_t wanted = payload[0] | (payload[1] << 8) | (payload[2] << 16) | ((uint32_t)payload[3] << 24);
+            if (wanted <= conn->transfer_max) {
+                return bulk_in_transfer(conn, wanted, out, out_len);
+            }
+        }
+        return RESP_STALL;
+    }
+    if (device_busy(stub)) {
+        return RESP_NAK;
+    }
+    if (endpoint != ENDPOINT_BULK) {
+        return token == TOKEN_SETUP ? RESP_ACK : RESP_STALL;
+    }
+    if (token == TOKEN_OUT) {
+        return bulk_out(conn, payload, n);
+    }
+    if (token == TOKEN_IN) {
+        return bulk_in(conn, out, out_len);
+    }
+    return RESP_STALL;
+}
+
+/* --- serving -------------------------------------------------------------- */
+
+static int send_hello(struct StubConn* conn) {
+    struct EmuStub* stub = conn->stub;
+    size_t identity_len = strlen(stub->identity);
+    unsigned char hello[15];
+    memcpy(hello, "EMIU2USB", 8);
+    hello[8] = STUB_PROTOCOL_VERSION & 0xFF;
+    hello[9] = (STUB_PROTOCOL_VERSION >> 8) & 0xFF;
+    hello[10] = HELLO_FLAG_PLUGGED;
+    if (stub->options.version == 0 || stub->options.version >= STUB_PROTOCOL_AGGREGATE) {
+        hello[10] |= HELLO_FLAG_UPGRADE;
+    }
+    le32(hello + 11, (uint32_t)identity_len);
+    if (write_all(conn->fd, hello, sizeof(hello)) < 0) {
+        return -1;
+    }
+    return write_all(conn->fd, stub->identity, identity_len);
+}
+
+/* Responses held back to model the link delay. */
+#define STUB_QUEUE_MAX (64)
+#define STUB_RESPONSE_MAX (5 + STUB_TRANSFER_MAX)
+
+struct StubResponse {
+    uint64_t due_us;
+    size_t len;
+    unsigned char* bytes; /* STUB_RESPONSE_MAX */
+};
+
+/* Reads and executes one request, queueing its response. */
+static int handle_request(struct StubConn* conn, unsigned char* payload, struct StubResponse* response) {
+    struct EmuStub* stub = conn->stub;
+    unsigned char header[6];
+    if (read_all(conn->fd, header, sizeof(header)) < 0) {
+        return -1;
+    }
+    uint32_t n = header[2] | (header[3] << 8) | (header[4] << 16) | ((uint32_t)header[5] << 24);
+    if (n > STUB_MAX_REQUEST || (n > 0 && read_all(conn->fd, payload, n) < 0)) {
+        return -1;
+    }
+
+    size_t out_len = 0;
+    pthread_mutex_lock(&stub->lock);
+    int kind = transact(conn, header[0], header[1], payload, n, response->bytes + 5, &out_len);
+    pthread_mutex_unlock(&stub->lock);
+    if (kind == RESP_DROP) {
+        return -1;
+    }
+
+    response->due_us = now_us() + stub->options.latency_us;
+    response->bytes[0] = (unsigned char)kind;
+    response->len = 1;
+    if (kind == RESP_DATA) {
+        le32(response->bytes + 1, (uint32_t)out_len);
+        response->len = 5 + out_len;
+    }
+    return 0;
+}
+
+/* Answers requests, in order, until the client goes away. The device acts on
+ * a request as soon as it arrives, but its response is held for latency_us:
+ * a delay on the link rather than a slower device, so requests the client
+ * has already sent keep being taken while earlier responses are in flight. */
+static void serve_requests(struct StubConn* conn, unsigned char* payload) {
+    struct StubResponse* queue = malloc(STUB_QUEUE_MAX * sizeof(*queue));
+    unsigned char* bytes = malloc(STUB_QUEUE_MAX * STUB_RESPONSE_MAX);
+    if (queue == NULL || bytes == NULL) {
+        free(queue);
+        queue = NULL;
+    }
+    for (size_t i = 0; queue != NULL && i < STUB_QUEUE_MAX; i++) {
+        queue[i].bytes = bytes + i * STUB_RESPONSE_MAX;
+    }
+    size_t head = 0;
+    size_t count = 0;
+
+    while (queue != NULL) {
+        /* Take whatever the client has already sent before waiting out the
+         * oldest response (poll's millisecond timeout is too coarse to wait
+         * in). */
+        int readable = 1;
+        if (count > 0) {
+            struct pollfd pfd = { .fd = conn->fd, .events = POLLIN };
+            readable = count < STUB_QUEUE_MAX && poll(&pfd, 1, 0) > 0;
+        }
+
+        if (readable) {
+            if (handle_request(conn, payload, &queue[(head + count) % STUB_QUEUE_MAX]) < 0) {
+                break;
+            }
+            count++;
+            continue;
+        }
+
+        uint64_t now = now_us();
+        if (queue[head].due_us > now) {
+            usleep((useconds_t)(queue[head].due_us - now));
+            now = now_us();
+        }
+        /* Everything due goes out in one write, as from an emulator draining
+         * its queue once per tick. */
+        struct iovec iov[STUB_QUEUE_MAX];
+        size_t n = 0;
+        while (n < count && queue[(head + n) % STUB_QUEUE_MAX].due_us <= now) {
+            struct StubResponse* response = &queue[(head + n) % STUB_QUEUE_MAX];
+            iov[n].iov_base = response->bytes;
+            iov[n].iov_len = response->len;
+            n++;
+        }
+        if (writev_all(conn->fd, iov, n) < 0) {
+            break;
+        }
+        head = (head + n) % STUB_QUEUE_MAX;
+        count -= n;
+    }
+    free(queue);
+    free(bytes);
+}
+
+static void* serve_conn(void* arg) {
+    struct StubConn* conn = arg;
+    struct EmuStub* stub = conn->stub;
+
+    unsigned char* payload = malloc(STUB_MAX_REQUEST);
+    if (payload != NULL && send_hello(conn) == 0) {
+        serve_requests(conn, payload);
+    }
+    free(payload);
+
+    pthread_mutex_lock(&stub->lock);
+    close(conn->fd);
+    conn->fd = -1;
+    pthread_mutex_unlock(&stub->lock);
+    return NULL;
+}
+
+static void* accept_loop(void* arg) {
+    struct EmuStub* stub = arg;
+    for (;;) {
+        int fd = accept(stub->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break; /* listening socket shut down */
+        }
+        struct StubConn* conn = calloc(1, sizeof(struct StubConn));
+        conn->stub = stub;
+        conn->fd = fd;
+        conn->state = BOT_IDLE;
+        conn->version = STUB_PROTOCOL_VERSION;
+        conn->transfer_max = STUB_BULK_MAX;
+
+        pthread_mutex_lock(&stub->lock);
+        if (stub->stopping) {
+            pthread_mutex_unlock(&stub->lock);
+            close(fd);
+            free(conn);
+            break;
+        }
+        conn->next = stub->conns;
+        stub->conns = conn;
+        pthread_create(&conn->thread, NULL, serve_conn, conn);
+        pthread_mutex_unlock(&stub->lock);
+    }
+    return NULL;
+}
+
+struct EmuStub* emu_stub_start(const struct EmuStubOptions* options) {
+    static int instance = 0;
+
+    struct EmuStub* stub = calloc(1, sizeof(struct EmuStub));
+    if (stub == NULL) {
+        return NULL;
+    }
+    stub->options = *options;
+    stub->read_page = -1;
+    stub->write_page = -1;
+    stub->rng = options->seed != 0 ? options->seed : 0x4D495543; /* "MIUC" */
+    pthread_mutex_init(&stub->lock, NULL);
+
+    snprintf(stub->path, sizeof(stub->path), "%s/stub-%d-%d.sock",
+             options->dir, (int)getpid(), instance++);
+    snprintf(stub->device, sizeof(stub->device), "emu:%s", stub->path);
+    snprintf(stub->identity, sizeof(stub->identity), "%s",
+             options->identity != NULL ? options->identity : "emu-stub");
+
+    stub->flash = malloc(EMU_STUB_FLASH_SIZE);
+    if (stub->flash == NULL) {
+        free(stub);
+        return NULL;
+    }
+    if (options->flash != NULL) {
+        memcpy(stub->flash, options->flash, EMU_STUB_FLASH_SIZE);
+    }
+    else {
+        for (size_t i = 0; i < EMU_STUB_FLASH_SIZE; i++) {
+            stub->flash[i] = (unsigned char)((i * 31 + (i >> 12) * 7) & 0xFF);
+        }
+    }
+    if (options->otp != NULL) {
+        memcpy(stub->otp, options->otp, EMU_STUB_OTP_SIZE);
+    }
+    else {
+        for (size_t i = 0; i < EMU_STUB_OTP_SIZE; i++) {
+            stub->otp[i] = (unsigned char)((i * 13) & 0xFF);
+        }
+        for (size_t i = 0; i < 10; i++) {
+            stub->otp[(OTP_STARTING_OFFSET + SIGNATURE_OFFSET + i) % EMU_STUB_OTP_SIZE] = "SITRONIXTM"[i];
+        }
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(stub->path) >= sizeof(addr.sun_path)) {
+        free(stub->flash);
+        free(stub);
+        return NULL;
+    }
+    strcpy(addr.sun_path, stub->path);
+    unlink(stub->path);
+
+    stub->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (stub->listen_fd < 0
+        || bind(stub->listen_fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+        || listen(stub->listen_fd, 16) < 0) {
+        if (stub->listen_fd >= 0) {
+            close(stub->listen_fd);
+        }
+        free(stub->flash);
+        free(stub);
+        return NULL;
+    }
+
+    pthread_create(&stub->accept_thread, NULL, accept_loop, stub);
+    return stub;
+}
+
+void emu_stub_stop(struct EmuStub* stub) {
+    pthread_mutex_lock(&stub->lock);
+    stub->stopping = 1;
+    pthread_mutex_unlock(&stub->lock);
+
+    shutdown(stub->listen_fd, SHUT_RDWR);
+    pthread_join(stub->accept_thread, NULL);
+    close(stub->listen_fd);
+    unlink(stub->path);
+
+    pthread_mutex_lock(&stub->lock);
+    for (struct StubConn* conn = stub->conns; conn != NULL; conn = conn->next) {
+        if (conn->fd >= 0) {
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+    }
+    pthread_mutex_unlock(&stub->lock);
+
+    struct StubConn* conn = stub->conns;
+    while (conn != NULL) {
+        struct StubConn* next = conn->next;
+        pthread_join(conn->thread, NULL);
+        free(conn->data);
+        free(conn);
+        conn = next;
+    }
+
+    pthread_mutex_destroy(&stub->lock);
+    free(stub->flash);
+    free(stub);
+}
+
+void emu_stub_drop(struct EmuStub* stub, unsigned int after) {
+    pthread_mutex_lock(&stub->lock);
+    stub->hiccup = HICCUP_DROP;
+    stub->hiccup_after = after;
+    pthread_mutex_unlock(&stub->lock);
+}
+
+void emu_stub_unplug(struct EmuStub* stub, unsigned int after, unsigned int ms) {
+    pthread_mutex_lock(&stub->lock);
+    stub->hiccup = HICCUP_UNPLUG;
+    stub->hiccup_after = after;
+    stub->unplug_ms = ms;
+    pthread_mutex_unlock(&stub->lock);
+}
+
+const char* emu_stub_device(const struct EmuStub* stub) {
+    return stub->device;
+}
+
+unsigned char* emu_stub_flash(struct EmuStub* stub) {
+    return stub->flash;
+}
@@ -0,0 +1,70 @@
+#ifndef MIUCHIZ_TESTS_EMU_STUB_H
+#define MIUCHIZ_TESTS_EMU_STUB_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An in-process stand-in for an emiu2 emulator: serves the emulator's USB
+ * transaction protocol on a Unix socket, with a Miuchiz handheld in USB mode
+ * behind it (Bulk-Only Transport, SCSI READ(10)/WRITE(10), and the Miuchiz
+ * command interface over a flash image). Lets tests and benchmarks drive the
+ * library's "emu:" transport end to end without a real emulator, in
+ * process or, through miuchiz-emu-stub (emu-stub-main.c), from outside.
+ */
+
+#define EMU_STUB_FLASH_SIZE (0x200000)
+#define EMU_STUB_OTP_SIZE (0x4000)
+
+struct EmuStubOptions {
+    const char* dir;          /* directory the endpoint socket is created in */
+    const char* identity;     /* hello identity; NULL for a default */
+    unsigned int latency_us;  /* link delay on every response */
+    double nak_rate;          /* chance a transaction finds the device busy */
+    unsigned int busy_us;     /* how long a busy device keeps NAKing */
+    unsigned int seed;        /* for the NAK dice; 0 picks a fixed default */
+    unsigned int version;     /* highest protocol offered (3 or 4); 0 for 4 */
+    const unsigned char* flash; /* initial flash image; NULL for a pattern */
+    const unsigned char* otp; /* initial OTP image; NULL for a pattern
+                               * carrying the handheld signature */
+};
+
+struct EmuStub;
+
+/**
+ * Starts serving. The flash and OTP start as the given images, or else as
+ * deterministic patterns.
+ * @return The stub, or NULL on failure.
+ */
+struct EmuStub* emu_stub_start(const struct EmuStubOptions* options);
+
+/**
+ * Stops serving, disconnects every client and removes the endpoint.
+ */
+void emu_stub_stop(struct EmuStub* stub);
+
+/**
+ * The device string ("emu:" + endpoint path) that reaches this stub.
+ */
+const char* emu_stub_device(const struct EmuStub* stub);
+
+/**
+ * Drops the client's connection, as a crashing or restarting emulator would,
+ * once `after` more transactions have been served (0: on the next one).
+ */
+void emu_stub_drop(struct EmuStub* stub, unsigned int after);
+
+/**
+ * Takes the device off the bus for `ms` milliseconds, as toggling the
+ * emulator's cable would, once `after` more transactions have been served.
+ * Meanwhile every transaction is answered Detached.
+ */
+void emu_stub_unplug(struct EmuStub* stub, unsigned int after, unsigned int ms);
+
+/**
+ * The stub's flash image (EMU_STUB_FLASH_SIZE bytes). Only touch it while no
+ * client is mid-command.
+ */
+unsigned char* emu_stub_flash(struct EmuStub* stub);
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ * Dumps a flash image ("img:" device) in full, as dump-flash does (each page
+ * retried up to five times), with transport faults injected at increasing
+ * rates: failed operations, short transfers, bad statuses, stale answers and
+ * the device dropping off for a moment. Every dump must still come back intact; the
+ * time each takes is printed, as the cost of the recovery paths at that
+ * fault rate.
+ *
+ * Usage: fault-recovery
+ */
+
+#include "libmiuchiz-usb.h"
+#include "timer.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FLASH_SIZE ((size_t)MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT)
+#define DUMP_RETRIES (5)
+
+/* Dumps every page into dump. Returns the number of page reads that had to
+ * be retried, or -1 if a page could not be read at all. */
+static int dump(struct Handheld* handheld, unsigned char* dump) {
+    int retried = 0;
+    for (int p = 0; p < MIUCHIZ_PAGE_COUNT; p++) {
+        int retry = 0;
+        while (miuchiz_handheld_read_page(handheld, p, dump + (size_t)p * MIUCHIZ_PAGE_SIZE,
+                                          MIUCHIZ_PAGE_SIZE) < 0) {
+            if (++retry == DUMP_RETRIES) {
+                return -1;
+            }
+        }
+        retried += retry;
+    }
+    return retried;
+}
+
+int main(void) {
+    char dir[64];
+    if (test_scratch_dir("fault-recovery", dir, sizeof(dir)) != 0) {
+        return 1;
+    }
+    char flash_path[256];
+    snprintf(flash_path, sizeof(flash_path), "%s/flash.bin", dir);
+
+    unsigned char* flash = malloc(FLASH_SIZE);
+    unsigned char* copy = malloc(FLASH_SIZE);
+    test_fill_random(flash, FLASH_SIZE, 0xFA017);
+    FILE* fp = fopen(flash_path, "wb");
+    if (fp == NULL || fwrite(flash, 1, FLASH_SIZE, fp) != FLASH_SIZE || fclose(fp) != 0) {
+        fprintf(stderr, "FAIL: could not write the image in %s\n", dir);
+        return 1;
+    }
+    char device[300];
+    snprintf(device, sizeof(device), "img:%s", flash_path);
+
+    CHECK(miuchiz_set_faults("read=0.5,bogus=1") == -1, "an unknown fault was accepted");
+    CHECK(miuchiz_set_faults("read=2") == -1, "a probability above 1 was accepted");
+
+    static const double rates[] = { 0.0, 0.0005, 0.002, 0.01 };
+    for (size_t i = 0; i < sizeof(rates) / sizeof(rates[0]); i++) {
+        char spec[256];
+        snprintf(spec, sizeof(spec),
+                 "read=%g,write=%g,seek=%g,short=%g,csw=%g,stale=%g,detach=%g,detach_ms=20,seed=%zu",
+                 rates[i], rates[i], rates[i], rates[i], rates[i], rates[i], rates[i] / 10, i + 1);
+        CHECK(miuchiz_set_faults(spec) == 0, "spec \"%s\" rejected", spec);
+
+        struct Handheld* handheld = miuchiz_handheld_create(device);
+        memset(copy, 0, FLASH_SIZE);
+        struct Utimer timer;
+        miuchiz_utimer_start(&timer);
+        int retried = dump(handheld, copy);
+        miuchiz_utimer_end(&timer);
+        miuchiz_handheld_destroy(handheld);
+
+        CHECK(retried >= 0, "fault rate %g: a page failed %d times", rates[i], DUMP_RETRIES);
+        CHECK(memcmp(copy, flash, FLASH_SIZE) == 0, "fault rate %g: the dump differs from the image", rates[i]);
+        printf("fault rate %-8g %8.1f ms, %d page(s) retried\n",
+               rates[i], miuchiz_utimer_elapsed(&timer) / 1000.0, retried);
+    }
+    miuchiz_set_faults(NULL);
+
+    free(flash);
+    free(copy);
+    test_remove_tree(dir);
+
+    return test_finish();
+}
@@ -0,0 +1,110 @@
+/*
+ * Checks the last-known flash state kept per handheld: hashes set survive a
+ * close and reopen, forgotten pages read back as unknown, a record torn in
+ * the file costs only its own page, and a file that is not a state is
+ * replaced by an empty one. Every update is a single record written in
+ * place, so the file never grows past one record per page.
+ *
+ * Usage: flash-state
+ */
+
+#include "libmiuchiz-usb.h"
+#include "sha256.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FINGERPRINT "0123456789abcdef"
+#define STATE_HEADER_SIZE (16)
+#define STATE_RECORD_SIZE (48)
+
+static void page_hash(int page, unsigned char* hash) {
+    unsigned char data[MIUCHIZ_PAGE_SIZE];
+    memset(data, page & 0xFF, sizeof(data));
+    data[0] = (unsigned char)(page >> 8);
+    miuchiz_sha256(data, sizeof(data), hash);
+}
+
+int main(void) {
+    char dir[64];
+    if (test_scratch_home("flash-state", dir, sizeof(dir)) != 0) {
+        return 1;
+    }
+    char path[256];
+    snprintf(path, sizeof(path), "%s/cache/miuchiz-usb/flash/" FINGERPRINT ".state", dir);
+
+    unsigned char hash[MIUCHIZ_SHA256_SIZE];
+    unsigned char got[MIUCHIZ_SHA256_SIZE];
+
+    /* A handheld never seen has no page known. */
+    CHECK(miuchiz_flash_state_open("not a fingerprint") == NULL, "an invalid fingerprint opened a state");
+    struct FlashState* state = miuchiz_flash_state_open(FINGERPRINT);
+    CHECK(state != NULL, "the state could not be created");
+    if (state == NULL) {
+        return 1;
+    }
+    for (int page = 0; page < MIUCHIZ_PAGE_COUNT; page++) {
+        CHECK(!miuchiz_flash_state_get(state, page, got), "page %d of a new state is known", page);
+    }
+
+    /* Every page set, then some forgotten, survives a reopen. */
+    for (int page = 0; page < MIUCHIZ_PAGE_COUNT; page++) {
+        page_hash(page, hash);
+        CHECK(miuchiz_flash_state_set(state, page, hash) == 0, "setting page %d failed", page);
+    }
+    CHECK(miuchiz_flash_state_set(state, 7, NULL) == 0, "forgetting page 7 failed");
+    CHECK(miuchiz_flash_state_set(state, 300, NULL) == 0, "forgetting page 300 failed");
+    CHECK(miuchiz_flash_state_flush(state) == 0, "flushing failed");
+    miuchiz_flash_state_close(state);
+    CHECK(test_file_size(path) == STATE_HEADER_SIZE + MIUCHIZ_PAGE_COUNT * STATE_RECORD_SIZE,
+          "the state is %ld bytes", test_file_size(path));
+
+    state = miuchiz_flash_state_open(FINGERPRINT);
+    CHECK(state != NULL, "the state could not be reopened");
+    if (state == NULL) {
+        return 1;
+    }
+    for (int page = 0; page < MIUCHIZ_PAGE_COUNT; page++) {
+        page_hash(page, hash);
+        int known = miuchiz_flash_state_get(state, page, got);
+        if (page == 7 || page == 300) {
+            CHECK(!known, "forgotten page %d is known", page);
+        }
+        else {
+            CHECK(known && memcmp(got, hash, sizeof(hash)) == 0, "page %d did not survive a reopen", page);
+        }
+    }
+    miuchiz_flash_state_close(state);
+
+    /* A torn record loses its own page, and no other. */
+    FILE* fp = fopen(path, "r+b");
+    CHECK(fp != NULL, "the state file is missing");
+    if (fp != NULL) {
+        fseek(fp, STATE_HEADER_SIZE + 42L * STATE_RECORD_SIZE + 20, SEEK_SET);
+        fputc(0x5A, fp);
+        fclose(fp);
+    }
+    state = miuchiz_flash_state_open(FINGERPRINT);
+    CHECK(state != NULL && !miuchiz_flash_state_get(state, 42, got), "a torn record read back as known");
+    page_hash(43, hash);
+    CHECK(state != NULL && miuchiz_flash_state_get(state, 43, got) && memcmp(got, hash, sizeof(hash)) == 0,
+          "the record after a torn one was lost");
+    miuchiz_flash_state_close(state);
+
+    /* A file that is not a state is started afresh. */
+    fp = fopen(path, "wb");
+    if (fp != NULL) {
+        fputs("not a state", fp);
+        fclose(fp);
+    }
+    state = miuchiz_flash_state_open(FINGERPRINT);
+    CHECK(state != NULL && !miuchiz_flash_state_get(state, 43, got), "a malformed state was not replaced");
+    miuchiz_flash_state_close(state);
+    CHECK(test_file_size(path) == STATE_HEADER_SIZE, "a replaced state is %ld bytes", test_file_size(path));
+
+    test_remove_tree(dir);
+
+    return test_finish();
+}
@@ -0,0 +1,144 @@
+/*
+ * Checks the identity records kept per handheld: a record stored reads back
+ * whole, with or without its save page; records that are not whole - another
+ * magic, another format version, a save page cut short - are refused rather
+ * than half read; and refreshing a handheld whose save page has not changed
+ * leaves its record as it is.
+ *
+ * Usage: identity
+ */
+
+#include "libmiuchiz-usb.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define FINGERPRINT "0123456789abcdef"
+#define IDENTITY_HEADER_SIZE (24)
+#define FLASH_SIZE ((size_t)MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT)
+
+/* Overwrites `n` bytes of a file at `offset`, or cuts it to `offset` bytes
+ * when `data` is NULL. */
+static void damage(const char* path, long offset, const void* data, size_t n) {
+    if (data == NULL) {
+        CHECK(truncate(path, offset) == 0, "could not truncate %s", path);
+        return;
+    }
+    FILE* fp = fopen(path, "r+b");
+    CHECK(fp != NULL, "%s is missing", path);
+    if (fp != NULL) {
+        fseek(fp, offset, SEEK_SET);
+        fwrite(data, 1, n, fp);
+        fclose(fp);
+    }
+}
+
+static ino_t file_inode(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_ino : 0;
+}
+
+int main(void) {
+    char dir[64];
+    if (test_scratch_home("identity", dir, sizeof(dir)) != 0) {
+        return 1;
+    }
+    char path[256];
+    snprintf(path, sizeof(path), "%s/cache/miuchiz-usb/identity/" FINGERPRINT ".id", dir);
+
+    struct HandheldIdentity identity;
+    struct HandheldIdentity got;
+
+    /* A record with its save page reads back whole. */
+    memset(&identity, 0, sizeof(identity));
+    strcpy(identity.fingerprint, FINGERPRINT);
+    identity.firmware_version = 0x0102;
+    identity.character = 3;
+    identity.updated = 0x123456789ULL;
+    identity.has_save_page = 1;
+    for (int i = 0; i < MIUCHIZ_PAGE_SIZE; i++) {
+        identity.save_page[i] = (unsigned char)(i * 7);
+    }
+    CHECK(miuchiz_identity_load(FINGERPRINT, &got) != 0, "a record loaded before any was stored");
+    CHECK(miuchiz_identity_store(&identity) == 0, "storing a record failed");
+    CHECK(miuchiz_identity_load(FINGERPRINT, &got) == 0
+          && strcmp(got.fingerprint, FINGERPRINT) == 0
+          && got.firmware_version == identity.firmware_version
+          && got.character == identity.character
+          && got.updated == identity.updated
+          && got.has_save_page
+          && memcmp(got.save_page, identity.save_page, sizeof(got.save_page)) == 0,
+          "a record with its save page did not read back");
+
+    /* As does one without. */
+    identity.has_save_page = 0;
+    CHECK(miuchiz_identity_store(&identity) == 0, "storing a record without a save page failed");
+    CHECK(miuchiz_identity_load(FINGERPRINT, &got) == 0 && !got.has_save_page
+          && got.firmware_version == identity.firmware_version,
+          "a record without its save page did not read back");
+
+    /* Neither stores nor loads anything but a fingerprint. */
+    CHECK(miuchiz_identity_load("../../etc/passwd", &got) != 0, "an invalid fingerprint loaded a record");
+    strcpy(identity.fingerprint, "not a fingerprint");
+    CHECK(miuchiz_identity_store(&identity) != 0, "a record was stored under an invalid fingerprint");
+    strcpy(identity.fingerprint, FINGERPRINT);
+
+    /* Records that are not whole are refused. */
+    identity.has_save_page = 1;
+    CHECK(miuchiz_identity_store(&identity) == 0, "storing a record failed");
+    damage(path, 0, "MZXX", 4);
+    CHECK(miuchiz_identity_load(FINGERPRINT, &got) != 0, "a record with another magic loaded");
+
+    CHECK(miuchiz_identity_store(&identity) == 0, "storing a record failed");
+    damage(path, 4, "\x09\x00", 2);
+    CHECK(miuchiz_identity_load(FINGERPRINT, &got) != 0, "a record of another format version loaded");
+
+    CHECK(miuchiz_identity_store(&identity) == 0, "storing a record failed");
+    damage(path, IDENTITY_HEADER_SIZE + MIUCHIZ_PAGE_SIZE / 2, NULL, 0);
+    CHECK(miuchiz_identity_load(FINGERPRINT, &got) != 0, "a record with its save page cut short loaded");
+
+    CHECK(miuchiz_identity_store(&identity) == 0, "storing a record failed");
+    damage(path, IDENTITY_HEADER_SIZE / 2, NULL, 0);
+    CHECK(miuchiz_identity_load(FINGERPRINT, &got) != 0, "a record with its header cut short loaded");
+    unlink(path);
+
+    /* A handheld refreshed with its save page unchanged keeps its record;
+     * one whose save page changed has it rewritten. */
+    char flash_path[256];
+    char device[300];
+    snprintf(flash_path, sizeof(flash_path), "%s/flash.bin", dir);
+    snprintf(device, sizeof(device), "img:%s?mode=write", flash_path);
+    unsigned char* flash = calloc(1, FLASH_SIZE);
+    CHECK(flash != NULL && test_write_file(flash_path, flash, FLASH_SIZE) == 0, "could not write the image");
+    free(flash);
+
+    struct Handheld* handheld = miuchiz_handheld_create(device);
+    char fingerprint[MIUCHIZ_FINGERPRINT_LENGTH + 1];
+    CHECK(miuchiz_handheld_fingerprint(handheld, fingerprint, sizeof(fingerprint)) == 0, "the image has no fingerprint");
+    char record_path[256];
+    snprintf(record_path, sizeof(record_path), "%s/cache/miuchiz-usb/identity/%s.id", dir, fingerprint);
+
+    CHECK(miuchiz_handheld_identity(handheld, &identity, 1) == 0, "identifying the image failed");
+    ino_t first = file_inode(record_path);
+    CHECK(first != 0, "identifying the image stored no record");
+    CHECK(miuchiz_handheld_identity(handheld, &got, 1) == 0 && got.updated == identity.updated,
+          "refreshing the image failed");
+    CHECK(file_inode(record_path) == first, "refreshing an unchanged save page rewrote the record");
+
+    unsigned char page[MIUCHIZ_PAGE_SIZE] = { 0 };
+    page[0x9A8] = 4;
+    CHECK(miuchiz_handheld_write_page(handheld, MIUCHIZ_SAVE_PAGE, page, sizeof(page)) >= 0, "writing the save page failed");
+    CHECK(miuchiz_handheld_identity(handheld, &got, 1) == 0 && got.character == 4,
+          "refreshing a changed save page failed");
+    CHECK(miuchiz_identity_load(fingerprint, &got) == 0 && got.character == 4,
+          "refreshing a changed save page did not rewrite the record");
+    miuchiz_handheld_destroy(handheld);
+
+    test_remove_tree(dir);
+
+    return test_finish();
+}
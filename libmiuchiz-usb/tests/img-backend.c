@@ -0,0 +1,107 @@
+/*
+ * Checks the flash image backend ("img:" devices) end to end: every page of
+ * a random image reads back through the page layer; writes stay in memory
+ * in the default copy-on-write mode and reach the file with mode=write; an
+ * OTP image is exposed through sector 0 as the handheld rotates it; and the
+ * image is selected by name without a device search. Read throughput is
+ * printed, as the cost of the layers above the backend seam alone.
+ *
+ * Usage: img-backend
+ */
+
+#include "libmiuchiz-usb.h"
+#include "timer.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FLASH_SIZE ((size_t)MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT)
+#define OTP_STARTING_OFFSET (0xBDC)
+
+/* A page-aligned scratch region well clear of the save page. */
+#define SCRATCH_PAGE (0x100)
+
+int main(void) {
+    char dir[64];
+    if (test_scratch_dir("img-backend", dir, sizeof(dir)) != 0) {
+        return 1;
+    }
+    char flash_path[256];
+    char otp_path[256];
+    snprintf(flash_path, sizeof(flash_path), "%s/flash.bin", dir);
+    snprintf(otp_path, sizeof(otp_path), "%s/otp.bin", dir);
+
+    unsigned char* flash = malloc(FLASH_SIZE);
+    unsigned char* on_disk = malloc(FLASH_SIZE);
+    unsigned char otp[MIUCHIZ_OTP_SIZE];
+    test_fill_random(flash, FLASH_SIZE, 0x1234567);
+    test_fill_random(otp, sizeof(otp), 0x7654321);
+    memcpy(otp + OTP_STARTING_OFFSET + 43, "SITRONIXTM", 10);
+    if (test_write_file(flash_path, flash, FLASH_SIZE) != 0 || test_write_file(otp_path, otp, sizeof(otp)) != 0) {
+        fprintf(stderr, "FAIL: could not write the images in %s\n", dir);
+        return 1;
+    }
+
+    char device[600];
+    unsigned char page[MIUCHIZ_PAGE_SIZE];
+
+    /* Copy-on-write: every page reads back, and a write is seen by this
+     * handle only. */
+    snprintf(device, sizeof(device), "img:%s", flash_path);
+    struct Handheld** handhelds = NULL;
+    int count = miuchiz_handheld_create_all_for(&handhelds, device);
+    CHECK(count == 1 && strcmp(handhelds[0]->device, device) == 0, "cow: %s not opened by name", device);
+    if (count == 1) {
+        struct Handheld* handheld = handhelds[0];
+        struct Utimer timer;
+        miuchiz_utimer_start(&timer);
+        for (int p = 0; p < MIUCHIZ_PAGE_COUNT; p++) {
+            int result = miuchiz_handheld_read_page(handheld, p, page, sizeof(page));
+            CHECK(result >= 0 && memcmp(page, flash + (size_t)p * MIUCHIZ_PAGE_SIZE, sizeof(page)) == 0,
+                  "cow: page 0x%X differs from the image", p);
+        }
+        miuchiz_utimer_end(&timer);
+        uint64_t elapsed = miuchiz_utimer_elapsed(&timer);
+        printf("%-24s %8.1f pages/s\n", "read", elapsed > 0 ? MIUCHIZ_PAGE_COUNT * 1e6 / elapsed : 0.0);
+
+        memset(page, 0xA5, sizeof(page));
+        CHECK(miuchiz_handheld_write_page(handheld, SCRATCH_PAGE, page, sizeof(page)) >= 0, "cow: write failed");
+        unsigned char back[MIUCHIZ_PAGE_SIZE];
+        CHECK(miuchiz_handheld_read_page(handheld, SCRATCH_PAGE, back, sizeof(back)) >= 0
+              && memcmp(back, page, sizeof(page)) == 0, "cow: write not seen by the handle");
+    }
+    miuchiz_handheld_destroy_all(handhelds);
+    CHECK(test_read_file(flash_path, on_disk, FLASH_SIZE) == (long)FLASH_SIZE && memcmp(on_disk, flash, FLASH_SIZE) == 0,
+          "cow: the image file changed");
+
+    /* Write-through, with the OTP: sector 0 shows the OTP as the handheld
+     * does, and writes reach the file. */
+    snprintf(device, sizeof(device), "img:%s?otp=%s&mode=write", flash_path, otp_path);
+    struct Handheld* handheld = miuchiz_handheld_create(device);
+    CHECK(miuchiz_handheld_is_handheld(handheld), "write: not recognized as a handheld");
+    unsigned char sector0[MIUCHIZ_OTP_SIZE];
+    CHECK(miuchiz_handheld_read_sector(handheld, 0, sector0, sizeof(sector0)) >= 0
+          && memcmp(sector0, otp + OTP_STARTING_OFFSET, sizeof(otp) - OTP_STARTING_OFFSET) == 0
+          && memcmp(sector0 + sizeof(otp) - OTP_STARTING_OFFSET, otp, OTP_STARTING_OFFSET) == 0,
+          "write: sector 0 does not expose the OTP");
+    memset(page, 0x5A, sizeof(page));
+    CHECK(miuchiz_handheld_write_page(handheld, SCRATCH_PAGE, page, sizeof(page)) >= 0, "write: write failed");
+    miuchiz_handheld_destroy(handheld);
+    memcpy(flash + (size_t)SCRATCH_PAGE * MIUCHIZ_PAGE_SIZE, page, sizeof(page));
+    CHECK(test_read_file(flash_path, on_disk, FLASH_SIZE) == (long)FLASH_SIZE && memcmp(on_disk, flash, FLASH_SIZE) == 0,
+          "write: the write did not reach the image file");
+
+    /* Images that cannot be served are not handhelds. */
+    snprintf(device, sizeof(device), "img:%s", otp_path);
+    count = miuchiz_handheld_create_all_for(&handhelds, device);
+    CHECK(count == 0 && handhelds != NULL && handhelds[0] == NULL, "a 16 KiB file opened as a flash image");
+    miuchiz_handheld_destroy_all(handhelds);
+
+    test_remove_tree(dir);
+    free(flash);
+    free(on_disk);
+
+    return test_finish();
+}
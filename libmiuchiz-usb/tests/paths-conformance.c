@@ -1,7 +1,7 @@
 /*
  * Runs the Miuchiz Reborn storage-location policy's shared conformance suite
  * (test-vectors.txt, vendored from the miuchiz-reborn-paths repository)
- * against this library's C implementation of the policy's runtime category.
+ * against this library's C implementation of the policy (paths.c).
  * A policy change lands in the vector file first, and this test fails until
  * the C side follows.
  *
@@ -9,6 +9,7 @@
  */
 
 #include "backend-internal.h"
+#include "paths.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -102,22 +103,17 @@ int main(int argc, char** argv) {
         if (strcmp(platforms, "all") != 0 && strcmp(platforms, CURRENT_PLATFORM) != 0) {
             continue;
         }
-        /* This implementation mirrors only the runtime category. */
-        if (strcmp(category, "runtime") != 0) {
-            continue;
-        }
-
         apply_env(env);
 
         char got[1024];
-        if (miuchiz_emu_runtime_dir(app, got, sizeof(got)) != 0) {
-            fprintf(stderr, "FAIL runtime_dir(%s) errored (expected %s)\n", app, expected);
+        if (miuchiz_reborn_dir(category, app, got, sizeof(got)) != 0) {
+            fprintf(stderr, "FAIL %s_dir(%s) errored (expected %s)\n", category, app, expected);
             failed++;
             continue;
         }
         normalize_slashes(got);
         if (strcmp(got, expected) != 0) {
-            fprintf(stderr, "FAIL runtime_dir(%s) = %s, expected %s\n", app, got, expected);
+            fprintf(stderr, "FAIL %s_dir(%s) = %s, expected %s\n", category, app, got, expected);
             failed++;
         }
         ran++;
@@ -0,0 +1,362 @@
+/*
+ * Performance regression checks, run by ctest under the "perf" label: each
+ * scenario drives the library against in-process emiu2 stand-ins
+ * (emu-stub.c), measures it, writes the measurements to a results file and
+ * compares them with a committed baseline, failing on a regression of a
+ * count beyond the baseline's tolerance.
+ *
+ * Scenarios:
+ *   dump        reads every page
+ *   load        writes every page
+ *   load-check  reads every page and writes back only those that differ
+ *               (one in 16), as load-flash --check-changes does
+ *   enumerate   discovers ENUMERATE_ENDPOINTS emulators, repeatedly
+ *
+ * Measured are throughput, the transport's transactions and send/receive
+ * syscalls, and the heap allocations the library makes on the calling
+ * thread (where the linker can wrap malloc; see CMakeLists.txt).
+ *
+ * Results and baselines share one format, a line per metric:
+ *   "name": {"value": V, "tolerance": T, "better": "lower"|"higher"},
+ * A "lower" metric regresses above V * (1 + T), a "higher" one below
+ * V * (1 - T). Counts are exact for a given tree, get tight tolerances and
+ * fail the check; rates are timed by the wall clock, so they depend on the
+ * machine and whatever else it runs, and a slow one is reported but never
+ * fails it. To accept new figures, copy the results file over the baseline.
+ *
+ * Usage: miuchiz-perf scenario baseline.json results.json
+ */
+
+#include "libmiuchiz-usb.h"
+#include "backend-internal.h"
+#include "timer.h"
+#include "emu-stub.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ENUMERATE_ENDPOINTS (8)
+#define ENUMERATE_ROUNDS (10)
+#define CHANGED_PAGE_EVERY (16)
+
+/* A modest link delay; no NAKs, so every count is repeatable. */
+#define STUB_LATENCY_US (20)
+
+#define COUNT_TOLERANCE (0.10)
+#define RATE_TOLERANCE (0.80)
+#define METRICS_MAX (8)
+
+/* --- allocation counting ------------------------------------------------- */
+
+static _Thread_local int counting = 0;
+static uint64_t allocations = 0;
+
+#ifdef MIUCHIZ_PERF_WRAP_MALLOC
+void* __real_malloc(size_t n);
+void* __real_calloc(size_t count, size_t n);
+void* __real_realloc(void* p, size_t n);
+
+void* __wrap_malloc(size_t n) {
+    if (counting) {
+        allocations++;
+    }
+    return __real_malloc(n);
+}
+
+void* __wrap_calloc(size_t count, size_t n) {
+    if (counting) {
+        allocations++;
+    }
+    return __real_calloc(count, n);
+}
+
+void* __wrap_realloc(void* p, size_t n) {
+    if (counting) {
+        allocations++;
+    }
+    return __real_realloc(p, n);
+}
+#endif
+
+/* --- metrics ------------------------------------------------------------- */
+
+struct Metric {
+    char name[64];
+    double value;
+    double tolerance;
+    int higher_is_better;
+    int timed; /* by the wall clock, so only reported */
+};
+
+struct Metrics {
+    struct Metric metric[METRICS_MAX];
+    int count;
+};
+
+static void metric_add(struct Metrics* metrics, const char* name, double value, double tolerance,
+                       int higher_is_better) {
+    if (metrics->count < METRICS_MAX) {
+        struct Metric* m = &metrics->metric[metrics->count++];
+        snprintf(m->name, sizeof(m->name), "%s", name);
+        m->value = value;
+        m->tolerance = tolerance;
+        m->higher_is_better = higher_is_better;
+        m->timed = 0;
+    }
+}
+
+/* Adds a rate timed by the wall clock. */
+static void metric_add_rate(struct Metrics* metrics, const char* name, double value) {
+    metric_add(metrics, name, value, RATE_TOLERANCE, 1);
+    if (metrics->count > 0) {
+        metrics->metric[metrics->count - 1].timed = 1;
+    }
+}
+
+static const struct Metric* metric_find(const struct Metrics* metrics, const char* name) {
+    for (int i = 0; i < metrics->count; i++) {
+        if (strcmp(metrics->metric[i].name, name) == 0) {
+            return &metrics->metric[i];
+        }
+    }
+    return NULL;
+}
+
+static int metrics_read(const char* path, struct Metrics* metrics) {
+    memset(metrics, 0, sizeof(*metrics));
+    FILE* fp = fopen(path, "r");
+    if (fp == NULL) {
+        return -1;
+    }
+    char line[256];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        struct Metric m;
+        char better[16];
+        if (sscanf(line, " \"%63[^\"]\": {\"value\": %lf, \"tolerance\": %lf, \"better\": \"%15[^\"]\"",
+                   m.name, &m.value, &m.tolerance, better) == 4) {
+            metric_add(metrics, m.name, m.value, m.tolerance, strcmp(better, "higher") == 0);
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+static int metrics_write(const char* path, const char* scenario, const struct Metrics* metrics) {
+    FILE* fp = fopen(path, "w");
+    if (fp == NULL) {
+        return -1;
+    }
+    fprintf(fp, "{\n  \"scenario\": \"%s\",\n  \"metrics\": {\n", scenario);
+    for (int i = 0; i < metrics->count; i++) {
+        const struct Metric* m = &metrics->metric[i];
+        fprintf(fp, "    \"%s\": {\"value\": %.1f, \"tolerance\": %.2f, \"better\": \"%s\"}%s\n",
+                m->name, m->value, m->tolerance, m->higher_is_better ? "higher" : "lower",
+                i + 1 < metrics->count ? "," : "");
+    }
+    fprintf(fp, "  }\n}\n");
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+/* Compares with the baseline, printing both. Returns the regressions of
+ * counts; timed metrics beyond tolerance are only pointed out. */
+static int metrics_compare(const struct Metrics* measured, const struct Metrics* baseline) {
+    int regressions = 0;
+    printf("%-16s %14s %14s\n", "metric", "measured", "baseline");
+    for (int i = 0; i < measured->count; i++) {
+        const struct Metric* m = &measured->metric[i];
+        const struct Metric* b = metric_find(baseline, m->name);
+        if (b == NULL) {
+            printf("%-16s %14.1f %14s\n", m->name, m->value, "-");
+            continue;
+        }
+        int regressed = b->higher_is_better ? m->value < b->value * (1.0 - b->tolerance)
+                                            : m->value > b->value * (1.0 + b->tolerance);
+        int improved = b->higher_is_better ? m->value > b->value * (1.0 + b->tolerance)
+                                           : m->value < b->value * (1.0 - b->tolerance);
+        printf("%-16s %14.1f %14.1f%s\n", m->name, m->value, b->value,
+               regressed && m->timed ? "  slower; timed, so not checked"
+               : regressed ? "  REGRESSED"
+               : improved ? "  improved; consider updating the baseline" : "");
+        regressions += regressed && !m->timed;
+    }
+    return regressions;
+}
+
+/* --- scenarios ----------------------------------------------------------- */
+
+static void fill_pattern(unsigned char* data, size_t n, uint32_t seed) {
+    for (size_t i = 0; i < n; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        data[i] = (unsigned char)seed;
+    }
+}
+
+/* Adds the transport's share of the work and the allocations made. */
+static void add_transfer_metrics(struct Metrics* metrics, struct Handheld* handheld, uint64_t elapsed_us,
+                                 int pages) {
+    metric_add_rate(metrics, "pages_per_sec", elapsed_us > 0 ? pages * 1e6 / elapsed_us : 0.0);
+    struct MiuchizTransportStats stats;
+    if (miuchiz_handheld_transport_stats(handheld, &stats) == 0) {
+        metric_add(metrics, "transactions", (double)stats.transactions, COUNT_TOLERANCE, 0);
+        metric_add(metrics, "syscalls", (double)(stats.send_calls + stats.recv_calls), COUNT_TOLERANCE, 0);
+    }
+#ifdef MIUCHIZ_PERF_WRAP_MALLOC
+    metric_add(metrics, "allocations", (double)allocations, COUNT_TOLERANCE, 0);
+#endif
+}
+
+static int run_transfer(const char* scenario, const char* dir, struct Metrics* metrics) {
+    size_t flash_size = (size_t)MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT;
+    unsigned char* image = malloc(flash_size);
+    fill_pattern(image, flash_size, 0x5EED);
+
+    struct EmuStubOptions options = { .dir = dir, .latency_us = STUB_LATENCY_US };
+    int check_changes = strcmp(scenario, "load-check") == 0;
+    if (check_changes) {
+        options.flash = image; /* all but one page in CHANGED_PAGE_EVERY already there */
+    }
+    struct EmuStub* stub = emu_stub_start(&options);
+    if (stub == NULL) {
+        fprintf(stderr, "FAIL: could not start the emulator stand-in in %s\n", dir);
+        free(image);
+        return 1;
+    }
+    if (check_changes) {
+        for (int p = 0; p < MIUCHIZ_PAGE_COUNT; p += CHANGED_PAGE_EVERY) {
+            emu_stub_flash(stub)[(size_t)p * MIUCHIZ_PAGE_SIZE] ^= 0xFF;
+        }
+    }
+
+    struct Handheld* handheld = miuchiz_handheld_create(emu_stub_device(stub));
+    unsigned char page[MIUCHIZ_PAGE_SIZE];
+    int failed = 0;
+    struct Utimer timer;
+    miuchiz_utimer_start(&timer);
+    counting = 1;
+    for (int p = 0; p < MIUCHIZ_PAGE_COUNT && !failed; p++) {
+        const unsigned char* wanted = image + (size_t)p * MIUCHIZ_PAGE_SIZE;
+        if (strcmp(scenario, "dump") == 0) {
+            failed = miuchiz_handheld_read_page(handheld, p, page, sizeof(page)) < 0;
+        }
+        else if (check_changes) {
+            failed = miuchiz_handheld_read_page(handheld, p, page, sizeof(page)) < 0;
+            if (!failed && memcmp(page, wanted, sizeof(page)) != 0) {
+                failed = miuchiz_handheld_write_page(handheld, p, wanted, sizeof(page)) < 0;
+            }
+        }
+        else {
+            failed = miuchiz_handheld_write_page(handheld, p, wanted, sizeof(page)) < 0;
+        }
+    }
+    counting = 0;
+    miuchiz_utimer_end(&timer);
+
+    if (failed) {
+        fprintf(stderr, "FAIL: %s: a page transfer failed\n", scenario);
+    }
+    else if (strcmp(scenario, "dump") != 0 && memcmp(emu_stub_flash(stub), image, flash_size) != 0) {
+        fprintf(stderr, "FAIL: %s: the device does not hold the loaded image\n", scenario);
+        failed = 1;
+    }
+    add_transfer_metrics(metrics, handheld, miuchiz_utimer_elapsed(&timer), MIUCHIZ_PAGE_COUNT);
+
+    miuchiz_handheld_destroy(handheld);
+    emu_stub_stop(stub);
+    free(image);
+    return failed;
+}
+
+static int run_enumerate(const char* dir, struct Metrics* metrics) {
+    setenv("EMIU2_USB_DIR", dir, 1);
+    struct EmuStub* stubs[ENUMERATE_ENDPOINTS];
+    struct EmuStubOptions options = { .dir = dir, .latency_us = STUB_LATENCY_US };
+    int failed = 0;
+    for (int i = 0; i < ENUMERATE_ENDPOINTS; i++) {
+        stubs[i] = emu_stub_start(&options);
+        if (stubs[i] == NULL) {
+            fprintf(stderr, "FAIL: could not start the emulator stand-in in %s\n", dir);
+            for (int j = 0; j < i; j++) {
+                emu_stub_stop(stubs[j]);
+            }
+            return 1;
+        }
+    }
+
+    struct Utimer timer;
+    miuchiz_utimer_start(&timer);
+    for (int round = 0; round < ENUMERATE_ROUNDS; round++) {
+        struct Handheld** handhelds = NULL;
+        counting = 1;
+        int count = miuchiz_emu_enumerate(&handhelds);
+        counting = 0;
+        if (count != ENUMERATE_ENDPOINTS) {
+            fprintf(stderr, "FAIL: enumerate: found %d emulators, expected %d\n", count, ENUMERATE_ENDPOINTS);
+            failed = 1;
+        }
+        miuchiz_handheld_destroy_all(handhelds);
+    }
+    miuchiz_utimer_end(&timer);
+    uint64_t elapsed = miuchiz_utimer_elapsed(&timer);
+
+    metric_add_rate(metrics, "enumerations_per_sec", elapsed > 0 ? ENUMERATE_ROUNDS * 1e6 / elapsed : 0.0);
+#ifdef MIUCHIZ_PERF_WRAP_MALLOC
+    metric_add(metrics, "allocations", (double)allocations / ENUMERATE_ROUNDS, COUNT_TOLERANCE, 0);
+#endif
+
+    for (int i = 0; i < ENUMERATE_ENDPOINTS; i++) {
+        emu_stub_stop(stubs[i]);
+    }
+    return failed;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s dump|load|load-check|enumerate baseline.json results.json\n", argv[0]);
+        return 1;
+    }
+    const char* scenario = argv[1];
+
+    char dir[64];
+    if (test_scratch_dir("perf", dir, sizeof(dir)) != 0) {
+        return 1;
+    }
+
+    struct Metrics measured = { 0 };
+    int failed;
+    if (strcmp(scenario, "enumerate") == 0) {
+        failed = run_enumerate(dir, &measured);
+    }
+    else if (strcmp(scenario, "dump") == 0 || strcmp(scenario, "load") == 0
+             || strcmp(scenario, "load-check") == 0) {
+        failed = run_transfer(scenario, dir, &measured);
+    }
+    else {
+        fprintf(stderr, "Unknown scenario: %s\n", scenario);
+        failed = 1;
+    }
+    rmdir(dir);
+    if (failed) {
+        return 1;
+    }
+
+    if (metrics_write(argv[3], scenario, &measured) != 0) {
+        fprintf(stderr, "FAIL: could not write %s\n", argv[3]);
+        return 1;
+    }
+    struct Metrics baseline;
+    if (metrics_read(argv[2], &baseline) != 0) {
+        fprintf(stderr, "FAIL: no baseline at %s; the results in %s can become it\n", argv[2], argv[3]);
+        return 1;
+    }
+    int regressions = metrics_compare(&measured, &baseline);
+    if (regressions > 0) {
+        fprintf(stderr, "%d count(s) regressed beyond tolerance against %s\n", regressions, argv[2]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,219 @@
+/*
+ * Records a session against the in-process emiu2 stand-in (emu-stub.c), with
+ * link latency and a device that NAKs, through MIUCHIZ_RECORD; then replays
+ * the trace as a "replay:" handheld. The replay must give back the same
+ * pages and transport counters, accept the same writes, take about the
+ * recorded time with ?timing=original - gaps between operations included -
+ * and a fraction of it by default, and
+ * fail, rather than make something up, once the session strays from the
+ * recorded one - or once a damaged trace holds more than was asked for.
+ *
+ * Usage: record-replay
+ */
+
+#include "libmiuchiz-usb.h"
+#include "timer.h"
+#include "emu-stub.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PAGES (16)
+
+/* A page-aligned scratch region well clear of the save page. */
+#define FIRST_PAGE (0x100)
+
+/* A gap between recorded operations far longer than replaying one takes. */
+#define GAP_US (100000)
+
+/* Trace records as backend-record.c writes them, for traces made by hand. */
+#define TRACE_READ (3)
+#define TRACE_SEEK (5)
+#define TRACE_IDENTITY (6)
+
+static void put_varint(FILE* fp, uint64_t value) {
+    while (value >= 0x80) {
+        fputc((int)(value & 0x7F) | 0x80, fp);
+        value >>= 7;
+    }
+    fputc((int)value, fp);
+}
+
+/* Appends a record answering `arg` with `result` and `data_len` bytes,
+ * `gap_us` after the one before. */
+static void put_record(FILE* fp, int op, uint64_t gap_us, uint64_t arg, int64_t result, size_t data_len) {
+    fputc(op, fp);
+    put_varint(fp, gap_us);
+    put_varint(fp, 0);
+    put_varint(fp, arg);
+    put_varint(fp, ((uint64_t)result << 1) ^ (uint64_t)(result >> 63));
+    put_varint(fp, 0);
+    if (op == TRACE_READ || op == TRACE_IDENTITY) {
+        for (int i = 0; i < 8; i++) {
+            fputc(0, fp);
+        }
+        put_varint(fp, data_len);
+        for (size_t i = 0; i < data_len; i++) {
+            fputc(0xEE, fp);
+        }
+    }
+}
+
+static FILE* trace_create(const char* path) {
+    FILE* fp = fopen(path, "wb");
+    if (fp != NULL) {
+        fputs("MIUTRACE", fp);
+        fputc(1, fp);
+        put_varint(fp, strlen("hand-made"));
+        fputs("hand-made", fp);
+    }
+    return fp;
+}
+
+/* The session: reads PAGES pages, rewrites the first, reads the counters.
+ * Returns its duration in microseconds. */
+static uint64_t session(struct Handheld* handheld, const unsigned char* expected,
+                        struct MiuchizTransportStats* stats, const char* label) {
+    unsigned char page[MIUCHIZ_PAGE_SIZE];
+    struct Utimer timer;
+    miuchiz_utimer_start(&timer);
+    for (int i = 0; i < PAGES; i++) {
+        int p = FIRST_PAGE + i;
+        CHECK(miuchiz_handheld_read_page(handheld, p, page, sizeof(page)) >= 0
+              && memcmp(page, expected + (size_t)p * MIUCHIZ_PAGE_SIZE, sizeof(page)) == 0,
+              "%s: page 0x%X differs from the device", label, p);
+    }
+    memset(page, 0x3C, sizeof(page));
+    CHECK(miuchiz_handheld_write_page(handheld, FIRST_PAGE, page, sizeof(page)) >= 0,
+          "%s: write failed", label);
+    CHECK(miuchiz_handheld_transport_stats(handheld, stats) == 0, "%s: no transport stats", label);
+    miuchiz_utimer_end(&timer);
+
+    uint64_t elapsed = miuchiz_utimer_elapsed(&timer);
+    printf("%-24s %8.1f ms\n", label, elapsed / 1000.0);
+    return elapsed;
+}
+
+int main(void) {
+    char dir[64];
+    if (test_scratch_dir("record-replay", dir, sizeof(dir)) != 0) {
+        return 1;
+    }
+    char trace[256];
+    snprintf(trace, sizeof(trace), "%s/session.trace", dir);
+
+    struct EmuStubOptions options = {
+        .dir = dir,
+        .latency_us = 200,
+        .nak_rate = 0.05,
+        .busy_us = 500,
+        .seed = 7,
+    };
+    struct EmuStub* stub = emu_stub_start(&options);
+    if (stub == NULL) {
+        fprintf(stderr, "FAIL: could not start the emulator stand-in in %s\n", dir);
+        return 1;
+    }
+    /* What the device held when recorded; the replay must show the same. */
+    size_t flash_size = (size_t)MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT;
+    unsigned char* flash = malloc(flash_size);
+    memcpy(flash, emu_stub_flash(stub), flash_size);
+
+    setenv("MIUCHIZ_RECORD", trace, 1);
+    struct Handheld* handheld = miuchiz_handheld_create(emu_stub_device(stub));
+    unsetenv("MIUCHIZ_RECORD");
+    struct MiuchizTransportStats recorded;
+    uint64_t live_us = session(handheld, flash, &recorded, "recorded");
+    miuchiz_handheld_destroy(handheld);
+    emu_stub_stop(stub);
+    CHECK(recorded.naks > 0, "the recorded session saw no NAKs");
+
+    char device[300];
+    snprintf(device, sizeof(device), "replay:%s", trace);
+    handheld = miuchiz_handheld_create(device);
+    struct MiuchizTransportStats replayed;
+    uint64_t compressed_us = session(handheld, flash, &replayed, "replayed");
+    CHECK(memcmp(&replayed, &recorded, sizeof(recorded)) == 0, "replayed counters differ from the recording");
+    miuchiz_handheld_destroy(handheld);
+
+    snprintf(device, sizeof(device), "replay:%s?timing=original", trace);
+    handheld = miuchiz_handheld_create(device);
+    uint64_t original_us = session(handheld, flash, &replayed, "replayed, original timing");
+    miuchiz_handheld_destroy(handheld);
+
+    /* The device's time and the gaps between operations are replayed; the
+     * host's own time is not added to them. */
+    CHECK(original_us * 2 >= live_us, "original timing took %.1f ms of %.1f",
+          original_us / 1000.0, live_us / 1000.0);
+    CHECK(compressed_us * 4 <= live_us, "compressed timing took %.1f ms of %.1f",
+          compressed_us / 1000.0, live_us / 1000.0);
+
+    /* A session that asks for something else fails. */
+    snprintf(device, sizeof(device), "replay:%s", trace);
+    handheld = miuchiz_handheld_create(device);
+    unsigned char page[MIUCHIZ_PAGE_SIZE];
+    CHECK(miuchiz_handheld_read_page(handheld, FIRST_PAGE + PAGES, page, sizeof(page)) < 0,
+          "a diverging read was answered");
+    miuchiz_handheld_destroy(handheld);
+
+    /* A damaged trace answering with more than was asked for, or claiming
+     * more was read than it holds, fails instead of overrunning the caller. */
+    unsigned char sector[MIUCHIZ_SECTOR_SIZE];
+    size_t bad_lengths[][2] = { { sizeof(sector) * 3, sizeof(sector) }, { 16, sizeof(sector) } };
+    for (size_t i = 0; i < sizeof(bad_lengths) / sizeof(bad_lengths[0]); i++) {
+        FILE* fp = trace_create(trace);
+        CHECK(fp != NULL, "could not write a trace");
+        if (fp == NULL) {
+            break;
+        }
+        put_record(fp, TRACE_SEEK, 0, 0, 0, 0);
+        put_record(fp, TRACE_READ, 0, sizeof(sector), (int64_t)bad_lengths[i][1], bad_lengths[i][0]);
+        fclose(fp);
+        handheld = miuchiz_handheld_create(device);
+        CHECK(miuchiz_handheld_read_sector(handheld, 0, sector, sizeof(sector)) < 0,
+              "a read of %zu bytes was answered from a record of %zu", bad_lengths[i][1], bad_lengths[i][0]);
+        miuchiz_handheld_destroy(handheld);
+    }
+
+    FILE* fp = trace_create(trace);
+    CHECK(fp != NULL, "could not write a trace");
+    if (fp != NULL) {
+        put_record(fp, TRACE_IDENTITY, 0, 4096, 8192, 8192);
+        fclose(fp);
+        handheld = miuchiz_handheld_create(device);
+        char fingerprint[MIUCHIZ_FINGERPRINT_LENGTH + 1];
+        CHECK(miuchiz_handheld_fingerprint(handheld, fingerprint, sizeof(fingerprint)) != 0,
+              "an identity was answered from a record longer than asked for");
+        miuchiz_handheld_destroy(handheld);
+    }
+
+    /* The gap before an operation is waited out with original timing, and
+     * only then. */
+    fp = trace_create(trace);
+    CHECK(fp != NULL, "could not write a trace");
+    if (fp != NULL) {
+        put_record(fp, TRACE_SEEK, 0, 0, 0, 0);
+        put_record(fp, TRACE_READ, GAP_US, sizeof(sector), sizeof(sector), sizeof(sector));
+        fclose(fp);
+        for (int original = 0; original <= 1; original++) {
+            snprintf(device, sizeof(device), "replay:%s%s", trace, original ? "?timing=original" : "");
+            handheld = miuchiz_handheld_create(device);
+            struct Utimer timer;
+            miuchiz_utimer_start(&timer);
+            CHECK(miuchiz_handheld_read_sector(handheld, 0, sector, sizeof(sector)) >= 0,
+                  "a read after a gap was not answered");
+            miuchiz_utimer_end(&timer);
+            uint64_t elapsed = miuchiz_utimer_elapsed(&timer);
+            CHECK(original ? elapsed >= GAP_US : elapsed < GAP_US, "a read after a %d ms gap took %.1f ms%s",
+                  GAP_US / 1000, elapsed / 1000.0, original ? " with original timing" : "");
+            miuchiz_handheld_destroy(handheld);
+        }
+    }
+
+    free(flash);
+    test_remove_tree(dir);
+
+    return test_finish();
+}
@@ -0,0 +1,71 @@
+#ifndef MIUCHIZ_TESTS_TEST_UTIL_H
+#define MIUCHIZ_TESTS_TEST_UTIL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * What the library's tests share: counting failed checks, scratch
+ * directories to work in, and whole files read and written. A test CHECKs
+ * as it goes and ends with `return test_finish();`. The scratch directories
+ * are POSIX only, as are the tests that use them.
+ */
+
+extern int test_failures;
+
+#define CHECK(cond, ...) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "FAIL: " __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            test_failures++; \
+        } \
+    } while (0)
+
+/**
+ * Reports the checks that failed, if any.
+ * @return The test's exit status.
+ */
+int test_finish(void);
+
+/**
+ * Creates a scratch directory, /tmp/miuchiz-<name>-XXXXXX.
+ * @param dir Receives its path.
+ * @return 0 on success, -1 (reported) on failure.
+ */
+int test_scratch_dir(const char* name, char* dir, size_t ndir);
+
+/**
+ * As test_scratch_dir, and makes it the home the library keeps its caches
+ * and data in (MIUCHIZ_REBORN_HOME).
+ */
+int test_scratch_home(const char* name, char* dir, size_t ndir);
+
+/**
+ * Removes a directory and everything in it.
+ */
+void test_remove_tree(const char* path);
+
+/**
+ * Fills a buffer from xorshift32, so the same seed gives the same bytes.
+ */
+void test_fill_random(unsigned char* data, size_t n, uint32_t seed);
+
+/**
+ * Writes a whole file, in place if it exists.
+ * @return 0 on success, -1 on failure.
+ */
+int test_write_file(const char* path, const void* data, size_t n);
+
+/**
+ * Reads up to `n` bytes of a file.
+ * @return The bytes read, or -1 if it cannot be opened.
+ */
+long test_read_file(const char* path, void* data, size_t n);
+
+/**
+ * @return The size of a file, or -1 if it cannot be opened.
+ */
+long test_file_size(const char* path);
+
+#endif
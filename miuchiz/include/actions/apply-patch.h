@@ -0,0 +1,6 @@
+#ifndef MIUCHIZ_APPLY_PATCH_H
+#define MIUCHIZ_APPLY_PATCH_H
+
+int apply_patch_main(int argc, char** argv);
+
+#endif
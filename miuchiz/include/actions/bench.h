@@ -0,0 +1,6 @@
+#ifndef MIUCHIZ_BENCH_H
+#define MIUCHIZ_BENCH_H
+
+int bench_main(int argc, char** argv);
+
+#endif
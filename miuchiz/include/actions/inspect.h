@@ -0,0 +1,6 @@
+#ifndef MIUCHIZ_INSPECT_H
+#define MIUCHIZ_INSPECT_H
+
+int inspect_main(int argc, char** argv);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef MIUCHIZ_MAKE_PATCH_H
+#define MIUCHIZ_MAKE_PATCH_H
+
+int make_patch_main(int argc, char** argv);
+
+#endif
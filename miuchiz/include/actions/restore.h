@@ -0,0 +1,6 @@
+#ifndef MIUCHIZ_RESTORE_H
+#define MIUCHIZ_RESTORE_H
+
+int restore_main(int argc, char** argv);
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef MIUCHIZ_SNAPSHOT_H
+#define MIUCHIZ_SNAPSHOT_H
+
+int snapshot_main(int argc, char** argv);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef MIUCHIZ_BLANK_MAP_H
+#define MIUCHIZ_BLANK_MAP_H
+
+#include "libmiuchiz-usb.h"
+
+/*
+ * Blank pages, as erased flash (every byte 0xFF) or zeroed (every byte 0x00),
+ * and the map kept beside a sparse raw image of the pages it leaves as
+ * holes. A hole reads as zeros, which is right for a zeroed page; the map
+ * records which holes are erased pages instead. It is the image's path with
+ * ".blank" appended, and only exists while some page is erased.
+ */
+
+#define BLANK_PAGE_MIXED (-1)
+
+struct BlankMap {
+    unsigned char erased[MIUCHIZ_PAGE_COUNT / 8]; /* a bit per page */
+    unsigned char erased_page[MIUCHIZ_PAGE_SIZE]; /* what those pages read as */
+};
+
+/**
+ * Finds whether a page is blank, a word at a time.
+ * @return 0xFF or 0x00 if every byte is that, else BLANK_PAGE_MIXED.
+ */
+int blank_page_fill(const unsigned char* data);
+
+/**
+ * Starts a map with no erased pages.
+ */
+void blank_map_clear(struct BlankMap* map);
+
+/**
+ * Reads the map kept beside an image; without one, no page is erased.
+ * @return 0 on success, -1 (errno set) on failure: EINVAL if the file there
+ *         is not a map.
+ */
+int blank_map_load(const char* image_path, struct BlankMap* map);
+
+/**
+ * Writes the map beside an image, or removes it if no page is erased.
+ * @return 0 on success, -1 (errno set) on failure.
+ */
+int blank_map_save(const char* image_path, const struct BlankMap* map);
+
+int blank_map_get(const struct BlankMap* map, int page);
+
+void blank_map_set(struct BlankMap* map, int page, int erased);
+
+/**
+ * A page of an image as it is meant to read: the mapped bytes, or an erased
+ * page where the map says so.
+ */
+const unsigned char* blank_map_page(const struct BlankMap* map, const unsigned char* image, int page);
+
+#endif
@@ -0,0 +1,145 @@
+#ifndef MIUCHIZ_CONTAINER_H
+#define MIUCHIZ_CONTAINER_H
+
+#include "libmiuchiz-usb.h"
+#include "sha256.h"
+#include "page-range.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * A self-describing flash dump: a header naming the handheld, its firmware
+ * and the tool that made it, the page data, then an index with the hash and
+ * flags of every page read. The index follows the data, so a container is
+ * written front to back (to a pipe, even), and read by seeking to its end.
+ * A packed container codes each page on its own (page-codec.h) and stores a
+ * page identical to one before it only once. A sparse container stores
+ * no bytes at all for blank pages; their flags say what they hold. A
+ * snapshot's manifest is a container whose pages are all kept elsewhere,
+ * in a snapshot store, by their hashes.
+ */
+
+#define CONTAINER_EXTENSION ".mzd"
+#define CONTAINER_PACKED_EXTENSION ".mzz"
+
+/* Page flags */
+#define CONTAINER_PAGE_BLANK    (1u << 0) /* every byte is 0xFF, as erased */
+#define CONTAINER_PAGE_RETRIED  (1u << 1) /* it took more than one read */
+#define CONTAINER_PAGE_VERIFIED (1u << 2) /* a second read matched the first */
+#define CONTAINER_PAGE_PACKED   (1u << 3) /* stored coded, not as is */
+#define CONTAINER_PAGE_ZERO     (1u << 4) /* every byte is 0x00 */
+#define CONTAINER_PAGE_STORED   (1u << 5) /* kept outside, found by its hash */
+
+/* Writer options */
+#define CONTAINER_WRITE_PACK   (1u << 0) /* code pages where that makes them smaller,
+                                            and store repeated pages once */
+#define CONTAINER_WRITE_SPARSE (1u << 1) /* store nothing for blank and zero pages */
+
+struct ContainerInfo {
+    char fingerprint[MIUCHIZ_FINGERPRINT_LENGTH + 1]; /* empty if unknown */
+    int has_identity;          /* whether the two fields below are known */
+    uint16_t firmware_version;
+    uint8_t character;
+    uint64_t created;          /* Unix time */
+    char tool_version[16];
+    struct PageRange pages;    /* the pages the dump was of */
+};
+
+struct ContainerPage {
+    int page;
+    unsigned int flags;
+    uint32_t length;           /* bytes stored */
+    uint64_t offset;           /* where they are stored */
+    unsigned char hash[MIUCHIZ_SHA256_SIZE]; /* of the page's contents */
+};
+
+struct ContainerWriter;
+
+/**
+ * Starts a container, writing its header.
+ * @param options CONTAINER_WRITE_PACK and CONTAINER_WRITE_SPARSE, as wanted.
+ * @return The writer, or NULL (errno set) on failure.
+ */
+struct ContainerWriter* container_writer_open(FILE* fp, const struct ContainerInfo* info, unsigned int options);
+
+/**
+ * Adds the next page. Pages must be added in order, within the range.
+ * @param flags CONTAINER_PAGE_RETRIED and CONTAINER_PAGE_VERIFIED as they
+ *        apply, and CONTAINER_PAGE_STORED if the caller keeps the page
+ *        elsewhere, so no bytes of it are written; the others are worked
+ *        out here.
+ * @return 0 on success, -1 (errno set) on failure.
+ */
+int container_writer_page(struct ContainerWriter* writer, int page, const unsigned char* data, unsigned int flags);
+
+/**
+ * Writes the index of the pages added, and frees the writer. Pages of the
+ * range that were never added are absent from it.
+ * @return 0 on success, -1 (errno set) on failure.
+ */
+int container_writer_finish(struct ContainerWriter* writer);
+
+struct Container;
+
+/**
+ * Whether a file starts like a container.
+ */
+int container_detect(const char* path);
+
+/**
+ * Opens a container, reading its header and index.
+ * @return The container, or NULL (errno set) on failure: EINVAL if the file
+ *         is not a container or its index is damaged.
+ */
+struct Container* container_open(const char* path);
+
+const struct ContainerInfo* container_info(struct Container* container);
+
+/**
+ * The number of pages in the index.
+ */
+int container_page_count(struct Container* container);
+
+/**
+ * The bytes the stored pages take up.
+ */
+uint64_t container_data_size(struct Container* container);
+
+/**
+ * The nth page of the index, in page order.
+ */
+const struct ContainerPage* container_page(struct Container* container, int n);
+
+/**
+ * Looks a page up in the index.
+ * @return Its entry, or NULL if the container does not hold it.
+ */
+const struct ContainerPage* container_find(struct Container* container, int page);
+
+/**
+ * Fetches a page kept outside the container by its hash.
+ * @return 0 on success, -1 (errno set) on failure.
+ */
+typedef int (*ContainerPageSource)(void* context, const unsigned char hash[MIUCHIZ_SHA256_SIZE], unsigned char* data);
+
+/**
+ * Whether any page is kept outside the container.
+ */
+int container_has_stored_pages(struct Container* container);
+
+/**
+ * Sets where pages kept outside the container are read from.
+ */
+void container_set_source(struct Container* container, ContainerPageSource source, void* context);
+
+/**
+ * Reads a page's contents, checking them against the index.
+ * @return 0 on success; -1 (errno set) if it cannot be read, is not held
+ *         (ENOENT) or does not decode or match its hash (EILSEQ).
+ */
+int container_read_page(struct Container* container, int page, unsigned char* data);
+
+void container_close(struct Container* container);
+
+#endif
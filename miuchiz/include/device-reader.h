@@ -0,0 +1,31 @@
+#ifndef MIUCHIZ_DEVICE_READER_H
+#define MIUCHIZ_DEVICE_READER_H
+
+#include "libmiuchiz-usb.h"
+#include "page-ring.h"
+
+#include <stdio.h>
+
+/*
+ * The device side of a dump: a worker that reads pages from a handheld into
+ * a page ring, for the file side to take as they arrive.
+ */
+
+struct DeviceReader {
+    struct Handheld* handheld;
+    struct PageRing* ring;
+    FILE* messages;
+    int first;  /* the page to start at */
+    int last;   /* the last page to read */
+    int verify; /* read each page twice */
+};
+
+/**
+ * The worker, for page_worker_start: reads every page from the first to the
+ * last in order into the ring, stopping at the first page that fails too
+ * many times, then closes the ring. Slot flags note the pages that were
+ * retried (CONTAINER_PAGE_RETRIED) or verified (CONTAINER_PAGE_VERIFIED).
+ */
+int device_reader_run(void* arg);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef MIUCHIZ_IMAGE_FILE_H
+#define MIUCHIZ_IMAGE_FILE_H
+
+#include <stddef.h>
+
+/*
+ * A flash image file mapped into memory, so pages are compared and copied
+ * in place rather than through a seek and a read or write per page.
+ */
+
+struct ImageFile;
+
+/**
+ * Maps an existing file read-only.
+ * @return The mapping, or NULL (errno set) if the file cannot be opened or
+ *         mapped, e.g. because it is not a regular file.
+ */
+struct ImageFile* image_file_open(const char* path);
+
+/**
+ * Creates (or truncates) a file of exactly `size` bytes, with its space
+ * allocated up front, and maps it for writing.
+ * @return The mapping, or NULL (errno set) on failure.
+ */
+struct ImageFile* image_file_create(const char* path, size_t size);
+
+/**
+ * Creates (or truncates) a file of exactly `size` bytes as a sparse file,
+ * with no space allocated, and maps it for writing. What is never written
+ * stays a hole and reads as zeros.
+ * @return The mapping, or NULL (errno set) on failure.
+ */
+struct ImageFile* image_file_create_sparse(const char* path, size_t size);
+
+/**
+ * Maps an existing file for writing, keeping what it holds and growing or
+ * cutting it to exactly `size` bytes, e.g. to finish an interrupted dump.
+ * @return The mapping, or NULL (errno set) on failure.
+ */
+struct ImageFile* image_file_reopen(const char* path, size_t size);
+
+unsigned char* image_file_data(struct ImageFile* image);
+
+size_t image_file_size(struct ImageFile* image);
+
+/**
+ * Makes part of a writable mapping read as zeros, freeing the space it
+ * takes in the file where the filesystem can make a hole of it.
+ */
+void image_file_discard(struct ImageFile* image, size_t offset, size_t length);
+
+/**
+ * Writes a writable mapping's changes back to the file.
+ * @return 0 on success, -1 on failure.
+ */
+int image_file_sync(struct ImageFile* image);
+
+/**
+ * Unmaps and closes the file. Changes not synced may still reach it.
+ */
+void image_file_close(struct ImageFile* image);
+
+/**
+ * Unmaps and closes a writable file, cutting it down to its first `length`
+ * bytes, e.g. those written before a failure.
+ */
+void image_file_close_at(struct ImageFile* image, size_t length);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef MIUCHIZ_JOURNAL_H
+#define MIUCHIZ_JOURNAL_H
+
+#include "libmiuchiz-usb.h"
+#include "sha256.h"
+#include "page-range.h"
+
+/*
+ * A progress journal kept next to a flash image while dump-flash or
+ * load-flash runs, so an interrupted transfer can be resumed instead of
+ * started over. It records, in page order, each page of the transfer's
+ * range that has been completed and the SHA-256 of its contents, and names
+ * the operation, the range and the handheld it belongs to. It is removed
+ * once the transfer finishes.
+ */
+
+#define JOURNAL_DUMP (1)
+#define JOURNAL_LOAD (2)
+
+struct Journal;
+
+/**
+ * Opens the journal for an image.
+ * @param image_path The image being dumped to or loaded from; the journal
+ *        is this path with ".journal" appended.
+ * @param kind JOURNAL_DUMP or JOURNAL_LOAD.
+ * @param fingerprint The handheld's fingerprint.
+ * @param range The pages being transferred.
+ * @param resume Non-zero to read the pages an earlier run completed; zero to
+ *        start with none.
+ * @return The journal, or NULL (errno set) on failure: ENOENT if there is no
+ *         journal to resume, EINVAL if it belongs to another operation,
+ *         range or handheld or is not a journal.
+ */
+struct Journal* journal_open(const char* image_path, int kind, const char* fingerprint,
+                             struct PageRange range, int resume);
+
+/**
+ * The first page of the range the journal does not record as completed.
+ */
+int journal_next(struct Journal* journal);
+
+/**
+ * The recorded SHA-256 of a completed page.
+ */
+const unsigned char* journal_hash(struct Journal* journal, int page);
+
+/**
+ * Starts recording, keeping only the completed pages before `page`.
+ * @return 0 on success, -1 (errno set) if the journal cannot be written.
+ */
+int journal_begin(struct Journal* journal, int page);
+
+/**
+ * Records the next page as completed, with the SHA-256 of its contents.
+ * Pages must be recorded in order.
+ * @return 0 on success, -1 if the record could not be written.
+ */
+int journal_record(struct Journal* journal, int page, const unsigned char hash[MIUCHIZ_SHA256_SIZE]);
+
+/**
+ * Closes the journal.
+ * @param finished Non-zero if the transfer completed, which deletes the
+ *        journal; otherwise it is kept for a later resume.
+ */
+void journal_close(struct Journal* journal, int finished);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef MIUCHIZ_PAGE_CODEC_H
+#define MIUCHIZ_PAGE_CODEC_H
+
+#include "libmiuchiz-usb.h"
+
+#include <stddef.h>
+
+/*
+ * A small LZ77 codec for single flash pages. Each page is coded on its own,
+ * so any page can be decoded without the others; runs such as erased 0xFF
+ * bytes are matches against the byte before, and cost a few bytes a page.
+ */
+
+/* The most a page can code to: its bytes as literals, with a control byte
+ * per 128 and one for a last short run. */
+#define PAGE_CODEC_BOUND (MIUCHIZ_PAGE_SIZE + MIUCHIZ_PAGE_SIZE / 128 + 1)
+
+/**
+ * Codes a page.
+ * @param out At least PAGE_CODEC_BOUND bytes.
+ * @return The number of bytes coded, which may be more than the page's.
+ */
+size_t page_codec_encode(const unsigned char* page, unsigned char* out);
+
+/**
+ * Decodes a page.
+ * @return 0 on success, -1 if the coded bytes are not exactly one page.
+ */
+int page_codec_decode(const unsigned char* in, size_t length, unsigned char* page);
+
+#endif
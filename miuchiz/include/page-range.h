@@ -0,0 +1,40 @@
+#ifndef MIUCHIZ_PAGE_RANGE_H
+#define MIUCHIZ_PAGE_RANGE_H
+
+#include "libmiuchiz-usb.h"
+
+/*
+ * Inclusive ranges of flash pages, as given on the command line: either
+ * first-last, a single page, or the name of a region of the flash.
+ */
+
+/* The device's test program checksums the flash starting at this offset;
+ * everything before it is the boot area. */
+#define FLASH_APPLICATION_START (0x1F000)
+
+struct PageRange {
+    int first;
+    int last;
+};
+
+/**
+ * Parses a page range: "first-last" or "page" (decimal or 0x hex), or one
+ * of the regions "boot" (below FLASH_APPLICATION_START), "application" (from
+ * there up to the save page), "save" (MIUCHIZ_SAVE_PAGE) or "all".
+ * @return 0 on success, 1 if the text is not a range within the flash.
+ */
+int page_range_parse(const char* text, struct PageRange* range);
+
+/**
+ * The range covering every page.
+ */
+struct PageRange page_range_all(void);
+
+int page_range_count(struct PageRange range);
+
+/**
+ * Whether the range covers every page.
+ */
+int page_range_is_all(struct PageRange range);
+
+#endif
@@ -0,0 +1,83 @@
+#ifndef MIUCHIZ_PAGE_RING_H
+#define MIUCHIZ_PAGE_RING_H
+
+#include "libmiuchiz-usb.h"
+
+/*
+ * A bounded single-producer, single-consumer ring of page buffers, for
+ * handing pages between the thread that talks to the handheld and the one
+ * that reads or writes files, so neither waits on the other unless the ring
+ * runs full or empty. Slots are claimed, filled and published by the
+ * producer, then taken and released by the consumer, in order, without
+ * locks; a side that has to wait blocks until the other wakes it.
+ */
+
+struct PageSlot {
+    int page;
+    int status; /* 0 when data holds the page; else the producer failed it */
+    unsigned int flags; /* the caller's own notes on the page */
+    unsigned char data[MIUCHIZ_PAGE_SIZE];
+};
+
+struct PageRing;
+
+/**
+ * Creates a ring of the given number of slots.
+ * @return The ring, or NULL on failure.
+ */
+struct PageRing* page_ring_create(int slots);
+
+void page_ring_destroy(struct PageRing* ring);
+
+/**
+ * Producer: waits for a free slot.
+ * @return The slot to fill, or NULL once the consumer has cancelled.
+ */
+struct PageSlot* page_ring_claim(struct PageRing* ring);
+
+/**
+ * Producer: hands the claimed slot to the consumer.
+ */
+void page_ring_publish(struct PageRing* ring);
+
+/**
+ * Producer: no more slots will be published.
+ */
+void page_ring_close(struct PageRing* ring);
+
+/**
+ * Consumer: waits for the next published slot.
+ * @return The slot, or NULL once the ring is closed and drained.
+ */
+struct PageSlot* page_ring_take(struct PageRing* ring);
+
+/**
+ * Consumer: gives the taken slot back to the producer.
+ */
+void page_ring_release(struct PageRing* ring);
+
+/**
+ * Consumer: stops the producer; its next claim returns NULL.
+ */
+void page_ring_cancel(struct PageRing* ring);
+
+struct PageWorker;
+
+/**
+ * Runs fn(arg) on a new thread.
+ * @return The worker, or NULL if no thread could be started.
+ */
+struct PageWorker* page_worker_start(int (*fn)(void*), void* arg);
+
+/**
+ * Whether the worker's function has returned.
+ */
+int page_worker_done(struct PageWorker* worker);
+
+/**
+ * Waits for the worker's function to return and frees the worker.
+ * @return What the function returned.
+ */
+int page_worker_join(struct PageWorker* worker);
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef MIUCHIZ_PATCH_FILE_H
+#define MIUCHIZ_PATCH_FILE_H
+
+#include "libmiuchiz-usb.h"
+#include "sha256.h"
+#include "page-range.h"
+
+#include <stdio.h>
+#include <stdint.h>
+
+/*
+ * A page-level delta between two flash images: the SHA-256 of every page of
+ * the base image within a range, then each page of that range the target
+ * image changes, coded as a packed container codes it. A handheld running
+ * the base is brought up to the target by writing those pages alone, after
+ * checking some of the others against their hashes. A patch is written and
+ * read front to back, so either end may be a pipe.
+ */
+
+#define PATCH_EXTENSION ".mzp"
+
+struct PatchInfo {
+    uint64_t created;          /* Unix time */
+    char tool_version[16];
+    struct PageRange pages;    /* the pages the patch covers */
+    unsigned char base_hash[MIUCHIZ_SHA256_SIZE];   /* of the base's pages in range */
+    unsigned char target_hash[MIUCHIZ_SHA256_SIZE]; /* of the target's */
+};
+
+struct PatchPage {
+    int page;
+    const unsigned char* data; /* what the target holds there */
+    unsigned char hash[MIUCHIZ_SHA256_SIZE];
+};
+
+/**
+ * Writes the patch from one image to another.
+ * @param info The range, the time and the tool version; the image hashes are
+ *        worked out here.
+ * @param base, target Whole flash images; only the pages in range are read.
+ * @param written If not NULL, receives the size of the patch.
+ * @return The number of pages the patch changes, or -1 (errno set) on
+ *         failure.
+ */
+int patch_write(FILE* fp, const struct PatchInfo* info, const unsigned char* base, const unsigned char* target,
+                uint64_t* written);
+
+struct Patch;
+
+/**
+ * Whether a file starts like a patch.
+ */
+int patch_detect(const char* path);
+
+/**
+ * Reads a whole patch, decoding its pages and checking them and it.
+ * @return The patch, or NULL (errno set) on failure: EINVAL if the stream is
+ *         not a patch or is damaged, EILSEQ if a page does not match its hash.
+ */
+struct Patch* patch_read(FILE* fp);
+
+const struct PatchInfo* patch_info(struct Patch* patch);
+
+/**
+ * The SHA-256 of a page of the base image, which must be in range.
+ */
+const unsigned char* patch_base_hash(struct Patch* patch, int page);
+
+/**
+ * The number of pages the patch changes.
+ */
+int patch_page_count(struct Patch* patch);
+
+/**
+ * The nth page changed, in page order.
+ */
+const struct PatchPage* patch_page(struct Patch* patch, int n);
+
+/**
+ * Looks a page up among those changed.
+ * @return Its entry, or NULL if the patch leaves it as the base has it.
+ */
+const struct PatchPage* patch_find(struct Patch* patch, int page);
+
+void patch_close(struct Patch* patch);
+
+#endif
@@ -0,0 +1,105 @@
+#ifndef MIUCHIZ_SNAPSHOT_STORE_H
+#define MIUCHIZ_SNAPSHOT_STORE_H
+
+#include "libmiuchiz-usb.h"
+#include "sha256.h"
+#include "container.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A content-addressed store of flash snapshots. Every page is kept once,
+ * named by its SHA-256, however many snapshots of however many handhelds
+ * hold it; a snapshot is a manifest, a container whose pages are all kept
+ * in the store (CONTAINER_PAGE_STORED). Pages no manifest refers to any
+ * longer are removed by collecting the store, which waits for no snapshot
+ * to be in progress.
+ *   <store>/pages/<first 2 hex digits>/<64 hex digits>
+ *   <store>/snapshots/<name>.mzd
+ *   <store>/lock
+ */
+
+struct SnapshotStore;
+
+/**
+ * The store used unless another is named: "store" in the tool's data
+ * directory.
+ * @return 0 on success, -1 if there is no usable location.
+ */
+int snapshot_store_default_dir(char* buf, size_t nbuf);
+
+/**
+ * Opens a store, creating it if need be.
+ * @param dir The store's directory, or NULL for the default.
+ * @return The store, or NULL (errno set) on failure.
+ */
+struct SnapshotStore* snapshot_store_open(const char* dir);
+
+const char* snapshot_store_dir(struct SnapshotStore* store);
+
+/**
+ * Holds the store for a snapshot until it is closed: snapshots may be taken
+ * side by side, but the store is not collected meanwhile, so pages put for a
+ * manifest not yet in place stay. Waits while the store is being collected.
+ * @return 0 on success, -1 (errno set) on failure.
+ */
+int snapshot_store_hold(struct SnapshotStore* store);
+
+/**
+ * Adds a page, unless the store holds it already.
+ * @param hash The SHA-256 of the page.
+ * @return 1 if it was added, 0 if it was already there, -1 (errno set) on
+ *         failure.
+ */
+int snapshot_store_put(struct SnapshotStore* store, const unsigned char* data,
+                       const unsigned char hash[MIUCHIZ_SHA256_SIZE]);
+
+/**
+ * Reads a page by its hash, checking it. A ContainerPageSource, with the
+ * store as its context.
+ * @return 0 on success, -1 (errno set) if it is not held (ENOENT), cannot be
+ *         read or does not match its hash (EILSEQ).
+ */
+int snapshot_store_get(void* store, const unsigned char hash[MIUCHIZ_SHA256_SIZE], unsigned char* data);
+
+/**
+ * Whether a name can name a snapshot: not empty, not starting with a dot and
+ * without path separators.
+ */
+int snapshot_store_name_valid(const char* name);
+
+/**
+ * The path of a snapshot's manifest.
+ * @return The path, which the caller frees, or NULL on failure.
+ */
+char* snapshot_store_manifest_path(struct SnapshotStore* store, const char* name);
+
+/**
+ * Opens a manifest, or any container keeping pages in the store, reading
+ * those pages from the store.
+ * @return The container, or NULL (errno set) as container_open.
+ */
+struct Container* snapshot_store_open_manifest(struct SnapshotStore* store, const char* path);
+
+/**
+ * Calls `each` with the name of every snapshot, in no particular order,
+ * stopping early if it returns non-zero.
+ * @return 0 on success, -1 (errno set) if the snapshots cannot be listed.
+ */
+int snapshot_store_list(struct SnapshotStore* store, int (*each)(void* context, const char* name), void* context);
+
+/**
+ * Removes the pages no snapshot refers to, and what snapshots that never
+ * finished left behind. Nothing is removed unless every manifest can be
+ * read, or while a snapshot holds the store.
+ * @param removed Receives the number of pages removed.
+ * @param freed Receives the bytes they and the leftovers took up.
+ * @return 0 on success, -1 (errno set) on failure: EINVAL if a manifest is
+ *         damaged, EBUSY if a snapshot is being taken into the store.
+ */
+int snapshot_store_collect(struct SnapshotStore* store, int* removed, uint64_t* freed);
+
+void snapshot_store_close(struct SnapshotStore* store);
+
+#endif
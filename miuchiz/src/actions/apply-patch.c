@@ -0,0 +1,339 @@
+#include "libmiuchiz-usb.h"
+#include "actions/apply-patch.h"
+#include "patch-file.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#if defined(_WIN32)
+    #include <io.h>
+#endif
+
+/* Pages beyond those the patch changes read back before anything is
+ * written, unless told otherwise. */
+#define DEFAULT_SAMPLE_PAGES (8)
+#define PAGE_TRIES (5)
+
+struct args {
+    char* device;
+    char* infile;
+    int sample;
+};
+
+static void usage(char* program_name) {
+    fprintf(stderr, "Usage: %s [-d device] [-n pages] patchfile\n", program_name);
+    fprintf(stderr, "Writes the pages a patch changes, once the handheld is seen to hold the patch's base.\n");
+    fprintf(stderr, "-n is how many unchanged pages to check against the base first (default %d).\n", DEFAULT_SAMPLE_PAGES);
+}
+
+static int args_parse(struct args* args, int argc, char** argv) {
+    int opt;
+    int option_index;
+    static struct option long_options[] = {
+        {"device", required_argument, 0, 'd' },
+        {"sample", required_argument, 0, 'n' },
+        {0,        0,                 0,  0 }
+    };
+
+    memset(args, 0, sizeof(*args));
+    args->sample = DEFAULT_SAMPLE_PAGES;
+
+    while ((opt = getopt_long(argc, argv, "d:n:", (struct option*)&long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'd':
+                args->device = strdup(optarg);
+                break;
+            case 'n': {
+                char* end;
+                long sample = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || sample < 0 || sample > MIUCHIZ_PAGE_COUNT) {
+                    fprintf(stderr, "The pages to check must be a number within 0-%d.\n", MIUCHIZ_PAGE_COUNT);
+                    return 1;
+                }
+                args->sample = (int)sample;
+                break;
+            }
+            default:
+                return 1;
+                break;
+        }
+    }
+
+    if (optind < argc) args->infile = strdup(argv[optind++]); else return 1;
+
+    if (optind < argc) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static void args_free(struct args* args) {
+    free(args->device);
+    free(args->infile);
+}
+
+static struct Patch* read_patch(const char* path) {
+    if (strcmp(path, "-") == 0) {
+#if defined(_WIN32)
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        return patch_read(stdin);
+    }
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    struct Patch* patch = patch_read(fp);
+    int saved = errno;
+    fclose(fp);
+    errno = saved;
+    return patch;
+}
+
+/* Reads a page's hash from the handheld, retrying as load-flash does, and
+ * remembers it in the flash state, if there is one. */
+static int device_page_hash(struct Handheld* handheld, struct FlashState* state, int pagenum, unsigned char* hash) {
+    unsigned char page[MIUCHIZ_PAGE_SIZE];
+    for (int retry = 0; retry < PAGE_TRIES; retry++) {
+        if (miuchiz_handheld_read_page(handheld, pagenum, page, sizeof(page)) != MIUCHIZ_ERROR_IO) {
+            miuchiz_sha256(page, sizeof(page), hash);
+            if (state != NULL) {
+                miuchiz_flash_state_set(state, pagenum, hash);
+            }
+            return 0;
+        }
+        printf("Reading from page %d of device failed. Retrying.\n", pagenum);
+    }
+    printf("Reading of page %d has failed too many times.\n", pagenum);
+    return -1;
+}
+
+/* xorshift32, seeded from the clock: each run checks different pages, so
+ * across a fleet every page is checked somewhere. */
+static uint32_t next_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/* Picks up to `count` of the pages in range the patch does not change,
+ * leaving out the save page, which the handheld changes itself as it is
+ * played. @return The number picked. */
+static int pick_sample(struct Patch* patch, int count, int* picked) {
+    struct PageRange pages = patch_info(patch)->pages;
+    int unchanged = 0;
+    for (int pagenum = pages.first; pagenum <= pages.last; pagenum++) {
+        if (pagenum != MIUCHIZ_SAVE_PAGE && patch_find(patch, pagenum) == NULL) {
+            picked[unchanged++] = pagenum;
+        }
+    }
+    if (count > unchanged) {
+        count = unchanged;
+    }
+
+    // A partial Fisher-Yates shuffle leaves the choice at the front
+    uint32_t state = (uint32_t)time(NULL) * 2654435761u ^ (uint32_t)clock();
+    if (state == 0) {
+        state = 1;
+    }
+    for (int i = 0; i < count; i++) {
+        int j = i + (int)(next_random(&state) % (uint32_t)(unchanged - i));
+        int swap = picked[i];
+        picked[i] = picked[j];
+        picked[j] = swap;
+    }
+    return count;
+}
+
+int apply_patch_main(int argc, char** argv) {
+    int result = 0;
+    struct Handheld** handhelds = NULL;
+    struct Patch* patch = NULL;
+    struct FlashState* state = NULL;
+
+    struct args args;
+    if (args_parse(&args, argc, argv)) {
+        usage(argv[0]);
+        result = 1;
+        goto leave_args;
+    }
+
+    patch = read_patch(args.infile);
+    if (patch == NULL) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "%s is not a patch, or it is damaged.\n", args.infile);
+        }
+        else if (errno == EILSEQ) {
+            fprintf(stderr, "A page of %s does not match its hash.\n", args.infile);
+        }
+        else {
+            fprintf(stderr, "Unable to read %s. [%d] %s\n", args.infile, errno, strerror(errno));
+        }
+        result = 1;
+        goto leave_args;
+    }
+
+    // Get a list of all the connected handhelds
+    int handheld_count = miuchiz_handheld_create_all_for(&handhelds, args.device);
+
+    // Handle the case where something went wrong getting handhelds
+    if (handhelds == NULL) {
+        fprintf(stderr, "Failed to search for handhelds.\n");
+        result = 1;
+        goto leave_handhelds;
+    }
+
+    const char* specified_device = NULL;
+    if (handheld_count == 0) {
+        fprintf(stderr, "No handhelds are connected.\n");
+        result = 1;
+        goto leave_handhelds;
+    }
+    else if (handheld_count == 1 || args.device) {
+        specified_device = args.device;
+    }
+    else {
+        fprintf(stderr, "%d handhelds are connected. Specify 1 with -d or --device.\n", handheld_count);
+        result = 1;
+        goto leave_handhelds;
+    }
+
+    // Find the handheld
+    struct Handheld* handheld = NULL;
+    for (int i = 0; i < handheld_count; i++) {
+        if (!specified_device || (specified_device && miuchiz_handheld_matches(handhelds[i], specified_device))) {
+            handheld = handhelds[i];
+            break;
+        }
+    }
+
+    if (!handheld) {
+        if (specified_device) {
+            fprintf(stderr, "No handheld was found at %s.\n", specified_device);
+        }
+        else {
+            fprintf(stderr, "Unable to find handheld.\n");
+        }
+        result = 1;
+        goto leave_handhelds;
+    }
+
+    // What is read and written here is what the handheld holds, for loads
+    char fingerprint[MIUCHIZ_FINGERPRINT_LENGTH + 1];
+    if (miuchiz_handheld_fingerprint(handheld, fingerprint, sizeof(fingerprint)) == 0) {
+        state = miuchiz_flash_state_open(fingerprint);
+    }
+
+    /* Nothing is written until the handheld is seen to hold the base: every
+     * page the patch changes must hold what the base or the target has
+     * there, and a sample of the others what the base has. A page already
+     * holding the target is left alone, so an interrupted patch is finished
+     * by applying it again. The save page is no sign of the base, as playing
+     * changes it; a patch that changes it simply overwrites it. */
+    int count = patch_page_count(patch);
+    unsigned char hash[MIUCHIZ_SHA256_SIZE];
+    char pending[MIUCHIZ_PAGE_COUNT] = { 0 };
+    int to_write = 0;
+    for (int i = 0; i < count; i++) {
+        const struct PatchPage* page = patch_page(patch, i);
+        if (device_page_hash(handheld, state, page->page, hash) != 0) {
+            result = 1;
+            goto leave_handhelds;
+        }
+        if (memcmp(hash, page->hash, sizeof(hash)) == 0) {
+            continue;
+        }
+        if (page->page != MIUCHIZ_SAVE_PAGE
+            && memcmp(hash, patch_base_hash(patch, page->page), sizeof(hash)) != 0) {
+            fprintf(stderr, "Page %d holds neither what the patch expects nor what it writes; "
+                            "the handheld does not hold the patch's base.\n", page->page);
+            result = 1;
+            goto leave_handhelds;
+        }
+        pending[page->page] = 1;
+        to_write++;
+    }
+
+    int picked[MIUCHIZ_PAGE_COUNT];
+    int sampled = pick_sample(patch, args.sample, picked);
+    for (int i = 0; i < sampled; i++) {
+        if (device_page_hash(handheld, state, picked[i], hash) != 0) {
+            result = 1;
+            goto leave_handhelds;
+        }
+        if (memcmp(hash, patch_base_hash(patch, picked[i]), sizeof(hash)) != 0) {
+            fprintf(stderr, "Page %d does not hold what the patch expects; "
+                            "the handheld does not hold the patch's base.\n", picked[i]);
+            result = 1;
+            goto leave_handhelds;
+        }
+    }
+
+    if (to_write == 0) {
+        printf("The handheld already holds the patch; checked %d other pages.\n", sampled);
+        goto leave_handhelds;
+    }
+
+    int written = 0;
+    for (int i = 0; i < count; i++) {
+        const struct PatchPage* page = patch_page(patch, i);
+        if (!pending[page->page]) {
+            continue;
+        }
+        // Forgotten first, so a write that never finishes leaves it unknown
+        if (state != NULL
+            && (miuchiz_flash_state_set(state, page->page, NULL) != 0 || miuchiz_flash_state_flush(state) != 0)) {
+            printf("\rUnable to update what the handheld is known to hold. [%d] %s\n", errno, strerror(errno));
+            result = 1;
+            break;
+        }
+        int page_write_success = 0;
+        for (int retry = 0; retry < PAGE_TRIES && !page_write_success; retry++) {
+            if (miuchiz_handheld_write_page(handheld, page->page, page->data, MIUCHIZ_PAGE_SIZE) == MIUCHIZ_ERROR_IO) {
+                printf("\rWriting of page %d to device failed. Retrying.\n", page->page);
+                continue;
+            }
+            page_write_success = 1;
+        }
+        if (!page_write_success) {
+            printf("\rWriting of page %d has failed too many times.\n", page->page);
+            result = 1;
+            break;
+        }
+        if (state != NULL) {
+            miuchiz_flash_state_set(state, page->page, page->hash);
+        }
+        written++;
+        printf("\rWriting page %d/%d", written, to_write);
+        fflush(stdout);
+    }
+    printf("\n");
+
+    if (result == 0) {
+        printf("Wrote %d pages; %d already held the patch; checked %d other pages.\n",
+               written, count - to_write, sampled);
+    }
+    else {
+        printf("Wrote %d of %d pages. Apply the patch again to finish.\n", written, to_write);
+    }
+
+leave_handhelds:
+    miuchiz_flash_state_close(state);
+    miuchiz_handheld_destroy_all(handhelds);
+    patch_close(patch);
+
+leave_args:
+    args_free(&args);
+
+    return result;
+}
@@ -0,0 +1,494 @@
+#include "libmiuchiz-usb.h"
+#include "actions/bench.h"
+#include "commands.h"
+#include "page-range.h"
+#include "timer.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <getopt.h>
+#include <string.h>
+#include <inttypes.h>
+
+/* Runs fixed workloads against a handheld and reports how fast it answered,
+ * so cables, hubs, backends and library versions can be compared by number
+ * rather than by stopwatch. */
+
+#define BENCH_DEFAULT_WORKLOADS "seq,random,sector0,command"
+#define BENCH_DEFAULT_COUNT (64)
+#define BENCH_RETRIES (5)
+
+enum workload {
+    WORKLOAD_SEQ,
+    WORKLOAD_RANDOM,
+    WORKLOAD_SECTOR0,
+    WORKLOAD_COMMAND,
+    WORKLOAD_WRITE,
+    WORKLOAD_COUNT
+};
+
+static const char* workload_names[WORKLOAD_COUNT] = {
+    "seq", "random", "sector0", "command", "write"
+};
+
+struct args {
+    char* device;
+    int workloads[WORKLOAD_COUNT];
+    int count; /* operations per workload; 0 for the default */
+    int scratch_first;
+    int scratch_last; /* -1 when no scratch range was given */
+    uint32_t seed;
+    int json;
+};
+
+struct result {
+    enum workload workload;
+    int ops;
+    int errors;
+    size_t bytes; /* moved by each operation */
+    uint64_t elapsed_us;
+    uint64_t* latencies_us; /* per successful operation, sorted */
+    int have_stats;
+    struct MiuchizTransportStats stats; /* the workload's share */
+};
+
+static void usage(char* program_name) {
+    fprintf(stderr, "Usage: %s [-d device] [-w workload,...] [-n count] [-s first-last] [-r seed] [-j]\n", program_name);
+    fprintf(stderr, "Workloads: seq (default all pages), random, sector0, command, write (needs -s)\n");
+}
+
+static int parse_workloads(struct args* args, const char* list) {
+    memset(args->workloads, 0, sizeof(args->workloads));
+    char* copy = strdup(list);
+    int result = 0;
+    for (char* name = strtok(copy, ","); name != NULL; name = strtok(NULL, ",")) {
+        int found = 0;
+        for (int w = 0; w < WORKLOAD_COUNT; w++) {
+            if (strcmp(name, workload_names[w]) == 0) {
+                args->workloads[w] = 1;
+                found = 1;
+            }
+        }
+        if (!found) {
+            fprintf(stderr, "Unknown workload: %s\n", name);
+            result = 1;
+        }
+    }
+    free(copy);
+    return result;
+}
+
+static int parse_range(struct args* args, const char* text) {
+    struct PageRange range;
+    if (page_range_parse(text, &range)) {
+        return 1;
+    }
+    args->scratch_first = range.first;
+    args->scratch_last = range.last;
+    return 0;
+}
+
+static int args_parse(struct args* args, int argc, char** argv) {
+    int opt;
+    int option_index;
+    static struct option long_options[] = {
+        {"device",   required_argument, 0, 'd' },
+        {"workload", required_argument, 0, 'w' },
+        {"count",    required_argument, 0, 'n' },
+        {"scratch",  required_argument, 0, 's' },
+        {"seed",     required_argument, 0, 'r' },
+        {"json",     no_argument,       0, 'j' },
+        {0,          0,                 0,  0 }
+    };
+
+    memset(args, 0, sizeof(*args));
+    args->scratch_last = -1;
+    args->seed = 1;
+    parse_workloads(args, BENCH_DEFAULT_WORKLOADS);
+
+    while ((opt = getopt_long(argc, argv, "d:w:n:s:r:j", (struct option*)&long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'd':
+                args->device = strdup(optarg);
+                break;
+            case 'w':
+                if (parse_workloads(args, optarg)) {
+                    return 1;
+                }
+                break;
+            case 'n':
+                args->count = atoi(optarg);
+                if (args->count <= 0) {
+                    return 1;
+                }
+                break;
+            case 's':
+                if (parse_range(args, optarg)) {
+                    fprintf(stderr, "Scratch range must be first-last, within 0-%d.\n", MIUCHIZ_PAGE_COUNT - 1);
+                    return 1;
+                }
+                break;
+            case 'r':
+                args->seed = (uint32_t)strtoul(optarg, NULL, 0);
+                break;
+            case 'j':
+                args->json = 1;
+                break;
+            default:
+                return 1;
+                break;
+        }
+    }
+
+    if (optind < argc) {
+        return 1;
+    }
+
+    // Writing is only ever done where the user said it may be
+    if (args->workloads[WORKLOAD_WRITE] && args->scratch_last < 0) {
+        fprintf(stderr, "The write workload needs a scratch page range (-s).\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void args_free(struct args* args) {
+    free(args->device);
+}
+
+static uint32_t next_random(uint32_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
+
+static int read_page(struct Handheld* handheld, int page, void* buf) {
+    for (int retry = 0; retry < BENCH_RETRIES; retry++) {
+        if (miuchiz_handheld_read_page(handheld, page, buf, MIUCHIZ_PAGE_SIZE) >= 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int write_page(struct Handheld* handheld, int page, const void* buf) {
+    for (int retry = 0; retry < BENCH_RETRIES; retry++) {
+        if (miuchiz_handheld_write_page(handheld, page, buf, MIUCHIZ_PAGE_SIZE) >= 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* One operation of a workload. Returns 0 on success. */
+static int run_op(struct Handheld* handheld, enum workload workload, int i, const struct args* args,
+                  uint32_t* random_state, unsigned char* buf) {
+    switch (workload) {
+        case WORKLOAD_SEQ:
+            return miuchiz_handheld_read_page(handheld, i % MIUCHIZ_PAGE_COUNT, buf, MIUCHIZ_PAGE_SIZE) < 0;
+        case WORKLOAD_RANDOM:
+            return miuchiz_handheld_read_page(handheld, next_random(random_state) % MIUCHIZ_PAGE_COUNT,
+                                              buf, MIUCHIZ_PAGE_SIZE) < 0;
+        case WORKLOAD_SECTOR0:
+            return miuchiz_handheld_read_sector(handheld, 0, buf, MIUCHIZ_SECTOR_SIZE) < 0;
+        case WORKLOAD_COMMAND: {
+            // An empty command sequence: initiator, then terminator
+            struct SCSIWriteFilemarksCommand start = miuchiz_scsi_write_filemarks_command();
+            struct SCSIReadReverseCommand end = miuchiz_scsi_read_reverse_command();
+            return miuchiz_handheld_send_scsi(handheld, &start, sizeof(start)) < 0
+                || miuchiz_handheld_send_scsi(handheld, &end, sizeof(end)) < 0;
+        }
+        case WORKLOAD_WRITE: {
+            int span = args->scratch_last - args->scratch_first + 1;
+            memset(buf, 0xA5 ^ i, MIUCHIZ_PAGE_SIZE);
+            return miuchiz_handheld_write_page(handheld, args->scratch_first + i % span,
+                                               buf, MIUCHIZ_PAGE_SIZE) < 0;
+        }
+        default:
+            return 1;
+    }
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int run_workload(struct Handheld* handheld, enum workload workload, const struct args* args,
+                        struct result* result) {
+    int ops = args->count;
+    if (ops == 0) {
+        ops = workload == WORKLOAD_SEQ ? MIUCHIZ_PAGE_COUNT : BENCH_DEFAULT_COUNT;
+    }
+    memset(result, 0, sizeof(*result));
+    result->workload = workload;
+    result->ops = ops;
+    result->bytes = workload == WORKLOAD_SECTOR0 ? MIUCHIZ_SECTOR_SIZE
+                  : workload == WORKLOAD_COMMAND ? 0 : MIUCHIZ_PAGE_SIZE;
+    result->latencies_us = malloc(sizeof(uint64_t) * ops);
+    unsigned char* buf = malloc(MIUCHIZ_PAGE_SIZE);
+    if (result->latencies_us == NULL || buf == NULL) {
+        free(result->latencies_us);
+        free(buf);
+        return 1;
+    }
+
+    struct MiuchizTransportStats before;
+    result->have_stats = miuchiz_handheld_transport_stats(handheld, &before) == 0;
+
+    uint32_t random_state = args->seed != 0 ? args->seed : 1;
+    struct Utimer total;
+    struct Utimer op;
+    int succeeded = 0;
+    miuchiz_utimer_start(&total);
+    for (int i = 0; i < ops; i++) {
+        miuchiz_utimer_start(&op);
+        int failed = run_op(handheld, workload, i, args, &random_state, buf);
+        miuchiz_utimer_end(&op);
+        if (failed) {
+            result->errors++;
+        }
+        else {
+            result->latencies_us[succeeded++] = miuchiz_utimer_elapsed(&op);
+        }
+    }
+    miuchiz_utimer_end(&total);
+    result->elapsed_us = miuchiz_utimer_elapsed(&total);
+    qsort(result->latencies_us, succeeded, sizeof(uint64_t), compare_u64);
+
+    if (result->have_stats) {
+        struct MiuchizTransportStats after;
+        miuchiz_handheld_transport_stats(handheld, &after);
+        result->stats.transactions = after.transactions - before.transactions;
+        result->stats.send_calls = after.send_calls - before.send_calls;
+        result->stats.recv_calls = after.recv_calls - before.recv_calls;
+        result->stats.bytes_sent = after.bytes_sent - before.bytes_sent;
+        result->stats.bytes_received = after.bytes_received - before.bytes_received;
+        result->stats.naks = after.naks - before.naks;
+        result->stats.nak_wait_us = after.nak_wait_us - before.nak_wait_us;
+        result->stats.reattaches = after.reattaches - before.reattaches;
+    }
+
+    free(buf);
+    return 0;
+}
+
+/* The latency below which the given fraction of successful operations
+ * completed (nearest rank). */
+static uint64_t percentile(const struct result* result, double fraction) {
+    int succeeded = result->ops - result->errors;
+    if (succeeded == 0) {
+        return 0;
+    }
+    int rank = (int)(fraction * succeeded + 0.999999);
+    if (rank < 1) {
+        rank = 1;
+    }
+    return result->latencies_us[(rank > succeeded ? succeeded : rank) - 1];
+}
+
+static double ops_per_second(const struct result* result) {
+    int succeeded = result->ops - result->errors;
+    return result->elapsed_us > 0 ? succeeded * 1e6 / result->elapsed_us : 0.0;
+}
+
+static double mib_per_second(const struct result* result) {
+    return ops_per_second(result) * result->bytes / (1024.0 * 1024.0);
+}
+
+static void print_text(const char* device, const struct result* results, int count) {
+    printf("Device: %s\n", device);
+    printf("%-8s %6s %6s %10s %8s %9s %9s %9s %9s %9s\n",
+           "workload", "ops", "errors", "ops/s", "MiB/s", "min us", "p50 us", "p90 us", "p99 us", "max us");
+    for (int i = 0; i < count; i++) {
+        const struct result* r = &results[i];
+        printf("%-8s %6d %6d %10.1f %8.3f %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 " %9" PRIu64 "\n",
+               workload_names[r->workload], r->ops, r->errors, ops_per_second(r), mib_per_second(r),
+               percentile(r, 0.0), percentile(r, 0.5), percentile(r, 0.9), percentile(r, 0.99),
+               percentile(r, 1.0));
+    }
+    for (int i = 0; i < count; i++) {
+        const struct result* r = &results[i];
+        if (r->have_stats) {
+            printf("%-8s %" PRIu64 " transactions, %" PRIu64 " NAKs (%" PRIu64 " us waiting), %" PRIu64 " reattaches\n",
+                   workload_names[r->workload], r->stats.transactions, r->stats.naks,
+                   r->stats.nak_wait_us, r->stats.reattaches);
+        }
+    }
+}
+
+static void print_json_string(const char* s) {
+    putchar('"');
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            printf("\\%c", c);
+        }
+        else if (c < 0x20) {
+            printf("\\u%04x", c);
+        }
+        else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void print_json(const char* device, const struct result* results, int count) {
+    printf("{\n  \"version\": ");
+    print_json_string(MIUCHIZ_UTILS_VERSION);
+    printf(",\n  \"device\": ");
+    print_json_string(device);
+    printf(",\n  \"workloads\": [");
+    for (int i = 0; i < count; i++) {
+        const struct result* r = &results[i];
+        printf("%s\n    {\"name\": \"%s\", \"ops\": %d, \"errors\": %d, \"bytes_per_op\": %zu, "
+               "\"elapsed_us\": %" PRIu64 ", \"ops_per_sec\": %.3f, \"mib_per_sec\": %.4f,\n"
+               "     \"latency_us\": {\"min\": %" PRIu64 ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+               ", \"p99\": %" PRIu64 ", \"max\": %" PRIu64 "}",
+               i > 0 ? "," : "", workload_names[r->workload], r->ops, r->errors, r->bytes,
+               r->elapsed_us, ops_per_second(r), mib_per_second(r),
+               percentile(r, 0.0), percentile(r, 0.5), percentile(r, 0.9), percentile(r, 0.99),
+               percentile(r, 1.0));
+        if (r->have_stats) {
+            printf(",\n     \"transport\": {\"transactions\": %" PRIu64 ", \"send_calls\": %" PRIu64
+                   ", \"recv_calls\": %" PRIu64 ", \"bytes_sent\": %" PRIu64 ", \"bytes_received\": %" PRIu64
+                   ", \"naks\": %" PRIu64 ", \"nak_wait_us\": %" PRIu64 ", \"reattaches\": %" PRIu64 "}",
+                   r->stats.transactions, r->stats.send_calls, r->stats.recv_calls, r->stats.bytes_sent,
+                   r->stats.bytes_received, r->stats.naks, r->stats.nak_wait_us, r->stats.reattaches);
+        }
+        printf("}");
+    }
+    printf("\n  ]\n}\n");
+}
+
+int bench_main(int argc, char** argv) {
+    int result = 0;
+    unsigned char* saved = NULL;
+    struct result results[WORKLOAD_COUNT];
+    int result_count = 0;
+
+    // Get arguments from the command line
+    struct args args;
+    if (args_parse(&args, argc, argv)) {
+        usage(argv[0]);
+        result = 1;
+        goto leave_args;
+    }
+
+    // Get a list of all the connected handhelds
+    struct Handheld** handhelds;
+    int handheld_count = miuchiz_handheld_create_all_for(&handhelds, args.device);
+
+    // Handle the case where something went wrong getting handhelds
+    if (handhelds == NULL) {
+        fprintf(stderr, "Failed to search for handhelds.\n");
+        result = 1;
+        goto leave_handhelds;
+    }
+
+    const char* specified_device = NULL;
+    if (handheld_count == 0) {
+        fprintf(stderr, "No handhelds are connected.\n");
+        result = 1;
+        goto leave_handhelds;
+    }
+    else if (handheld_count == 1 || args.device) {
+        specified_device = args.device;
+    }
+    else {
+        fprintf(stderr, "%d handhelds are connected. Specify 1 with -d or --device.\n", handheld_count);
+        result = 1;
+        goto leave_handhelds;
+    }
+
+    // Find the handheld
+    struct Handheld* handheld = NULL;
+    for (int i = 0; i < handheld_count; i++) {
+        if (!specified_device || (specified_device && miuchiz_handheld_matches(handhelds[i], specified_device))) {
+            handheld = handhelds[i];
+            break;
+        }
+    }
+
+    if (!handheld) {
+        if (specified_device) {
+            fprintf(stderr, "No handheld was found at %s.\n", specified_device);
+        }
+        else {
+            fprintf(stderr, "Unable to find handheld.\n");
+        }
+        result = 1;
+        goto leave_handhelds;
+    }
+
+    // Keep the scratch pages so they can be put back afterwards
+    int scratch_pages = args.scratch_last - args.scratch_first + 1;
+    if (args.workloads[WORKLOAD_WRITE]) {
+        saved = malloc((size_t)scratch_pages * MIUCHIZ_PAGE_SIZE);
+        for (int i = 0; saved != NULL && i < scratch_pages; i++) {
+            if (read_page(handheld, args.scratch_first + i, saved + (size_t)i * MIUCHIZ_PAGE_SIZE)) {
+                fprintf(stderr, "Reading scratch page %d failed; not writing.\n", args.scratch_first + i);
+                result = 1;
+                goto leave_handhelds;
+            }
+        }
+        if (saved == NULL) {
+            result = 1;
+            goto leave_handhelds;
+        }
+    }
+
+    for (int w = 0; w < WORKLOAD_COUNT; w++) {
+        if (!args.workloads[w]) {
+            continue;
+        }
+        if (!args.json) {
+            fprintf(stderr, "\rRunning %s...", workload_names[w]);
+        }
+        if (run_workload(handheld, (enum workload)w, &args, &results[result_count]) == 0) {
+            result_count++;
+        }
+        else {
+            result = 1;
+        }
+    }
+    if (!args.json) {
+        fprintf(stderr, "\r              \r");
+    }
+
+    if (saved != NULL) {
+        for (int i = 0; i < scratch_pages; i++) {
+            if (write_page(handheld, args.scratch_first + i, saved + (size_t)i * MIUCHIZ_PAGE_SIZE)) {
+                fprintf(stderr, "Restoring scratch page %d failed.\n", args.scratch_first + i);
+                result = 1;
+            }
+        }
+    }
+
+    if (args.json) {
+        print_json(handheld->device, results, result_count);
+    }
+    else {
+        print_text(handheld->device, results, result_count);
+    }
+
+    for (int i = 0; i < result_count; i++) {
+        if (results[i].errors > 0) {
+            result = 1;
+        }
+        free(results[i].latencies_us);
+    }
+
+leave_handhelds:
+    free(saved);
+    miuchiz_handheld_destroy_all(handhelds);
+
+leave_args:
+    args_free(&args);
+
+    return result;
+}
@@ -1,5 +1,12 @@
 #include "libmiuchiz-usb.h"
 #include "actions/dump-flash.h"
+#include "page-ring.h"
+#include "device-reader.h"
+#include "image-file.h"
+#include "journal.h"
+#include "page-range.h"
+#include "container.h"
+#include "blank-map.h"
 #include "timer.h"
 
 #include <stdlib.h>
@@ -9,19 +16,47 @@
 #include <getopt.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+
+#if defined(_WIN32)
+    #include <io.h>
+#endif
 
 /* The device's test program checksums the flash starting at this offset,
  * skipping everything before it. */
-#define FLASH_CHECKSUM_START (0x1F000)
+#define FLASH_CHECKSUM_START (FLASH_APPLICATION_START)
+
+#define FLASH_SIZE ((size_t)MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT)
+
+/* Pages the device thread may read ahead of the file. */
+#define DUMP_RING_PAGES (32)
 
 struct args {
     char* device;
     char* outfile;
     int do_checksum;
+    int resume;
+    int verify;
+    int container; /* write a container rather than a raw image */
+    int pack;      /* with its pages compressed */
+    int sparse;    /* store nothing for blank pages */
+    struct PageRange pages;
 };
 
 static void usage(char* program_name) {
-    fprintf(stderr, "Usage: %s [-d device] [-c] outfile\n", program_name);
+    fprintf(stderr, "Usage: %s [-d device] [-c] [-r] [-e] [-p pages] [-f raw|container] [-z] [-s] outfile\n", program_name);
+    fprintf(stderr, "An outfile of - streams the image to standard output.\n");
+    fprintf(stderr, "Pages are first-last or a single page, or one of boot, application, save or all.\n");
+    fprintf(stderr, "The format defaults to container for an outfile ending in " CONTAINER_EXTENSION
+                    " or " CONTAINER_PACKED_EXTENSION ", else raw.\n");
+    fprintf(stderr, "-z compresses a container's pages, as does an outfile ending in " CONTAINER_PACKED_EXTENSION ".\n");
+    fprintf(stderr, "-s leaves blank pages out: as holes in a raw file, or as flags in a container.\n");
+}
+
+static int has_extension(const char* path, const char* extension) {
+    size_t length = strlen(path);
+    size_t extension_length = strlen(extension);
+    return length > extension_length && strcmp(path + length - extension_length, extension) == 0;
 }
 
 static int args_parse(struct args* args, int argc, char** argv) {
@@ -30,14 +65,22 @@ static int args_parse(struct args* args, int argc, char** argv) {
     static struct option long_options[] = {
         {"device",   required_argument, 0, 'd' },
         {"checksum", no_argument,       0, 'c' },
+        {"resume",   no_argument,       0, 'r' },
+        {"pages",    required_argument, 0, 'p' },
+        {"verify",   no_argument,       0, 'e' },
+        {"format",   required_argument, 0, 'f' },
+        {"compress", no_argument,       0, 'z' },
+        {"sparse",   no_argument,       0, 's' },
         {0,        0,                 0,  0 }
     };
 
     memset(args, 0, sizeof(*args));
 
     args->do_checksum = 0;
+    args->pages = page_range_all();
+    args->container = -1;
 
-    while ((opt = getopt_long(argc, argv, "d:c", (struct option*)&long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "d:crp:ef:zs", (struct option*)&long_options, &option_index)) != -1) {
         switch (opt) {
             case 'd':
                 args->device = strdup(optarg);
@@ -45,6 +88,36 @@ static int args_parse(struct args* args, int argc, char** argv) {
             case 'c':
                 args->do_checksum = 1;
                 break;
+            case 'r':
+                args->resume = 1;
+                break;
+            case 'p':
+                if (page_range_parse(optarg, &args->pages)) {
+                    fprintf(stderr, "Pages must be first-last or a page within 0-%d, or boot, application, save or all.\n",
+                            MIUCHIZ_PAGE_COUNT - 1);
+                    return 1;
+                }
+                break;
+            case 'e':
+                args->verify = 1;
+                break;
+            case 'z':
+                args->pack = 1;
+                break;
+            case 's':
+                args->sparse = 1;
+                break;
+            case 'f':
+                if (strcmp(optarg, "raw") == 0) {
+                    args->container = 0;
+                }
+                else if (strcmp(optarg, "container") == 0) {
+                    args->container = 1;
+                }
+                else {
+                    return 1;
+                }
+                break;
             default:
                 return 1;
                 break;
@@ -53,10 +126,27 @@ static int args_parse(struct args* args, int argc, char** argv) {
 
     if (optind < argc) args->outfile = strdup(argv[optind++]); else return 1;
 
+    if (has_extension(args->outfile, CONTAINER_PACKED_EXTENSION) && args->container != 0) {
+        args->pack = 1;
+    }
+    if (args->container < 0) {
+        args->container = args->pack || has_extension(args->outfile, CONTAINER_EXTENSION);
+    }
+
     if (optind < argc) {
         return 1;
     }
 
+    if (args->pack && !args->container) {
+        fprintf(stderr, "Only a container can be compressed.\n");
+        return 1;
+    }
+
+    if (args->do_checksum && !page_range_is_all(args->pages)) {
+        fprintf(stderr, "The checksum covers the whole flash; it cannot be taken of some pages.\n");
+        return 1;
+    }
+
     return 0;
 }
 
@@ -65,8 +155,8 @@ static void args_free(struct args* args) {
     free(args->outfile);
 }
 
-static uint64_t checksum(void* buf, size_t n) {
-    uint8_t* buffer = (uint8_t*)buf;
+static uint64_t checksum(const void* buf, size_t n) {
+    const uint8_t* buffer = (const uint8_t*)buf;
     uint64_t result = 0;
     for (size_t i = 0; i < n; i++) {
         result += buffer[i];
@@ -74,6 +164,43 @@ static uint64_t checksum(void* buf, size_t n) {
     return result;
 }
 
+/* Finds where an interrupted dump left off: after the pages the journal
+ * records that the image still holds, provided the last of them still reads
+ * the same from the handheld.
+ * @return The page to continue from, or -1 if the dump cannot be resumed. */
+static int resume_dump(struct Handheld* handheld, struct ImageFile* image, const struct BlankMap* blanks,
+                       struct Journal* journal, struct PageRange pages) {
+    int completed = journal_next(journal);
+    unsigned char hash[MIUCHIZ_SHA256_SIZE];
+    for (int pagenum = pages.first; pagenum < completed; pagenum++) {
+        miuchiz_sha256(blank_map_page(blanks, image_file_data(image), pagenum), MIUCHIZ_PAGE_SIZE, hash);
+        if (memcmp(hash, journal_hash(journal, pagenum), sizeof(hash)) != 0) {
+            completed = pagenum;
+            break;
+        }
+    }
+    if (completed == pages.first) {
+        return completed;
+    }
+
+    unsigned char page[MIUCHIZ_PAGE_SIZE];
+    int read_result = MIUCHIZ_ERROR_IO;
+    for (int retry = 0; retry < 5 && read_result == MIUCHIZ_ERROR_IO; retry++) {
+        read_result = miuchiz_handheld_read_page(handheld, completed - 1, page, sizeof(page));
+    }
+    if (read_result == MIUCHIZ_ERROR_IO) {
+        fprintf(stderr, "Reading of page %d has failed too many times.\n", completed - 1);
+        return -1;
+    }
+    miuchiz_sha256(page, sizeof(page), hash);
+    if (memcmp(hash, journal_hash(journal, completed - 1), sizeof(hash)) != 0) {
+        fprintf(stderr, "Page %d on the handheld no longer matches the interrupted dump. Dump again without --resume.\n",
+                completed - 1);
+        return -1;
+    }
+    return completed;
+}
+
 int dump_flash_main(int argc, char** argv) {
     int result = 0;
 
@@ -87,7 +214,7 @@ int dump_flash_main(int argc, char** argv) {
 
     // Get a list of all the connected handhelds
     struct Handheld** handhelds;
-    int handheld_count = miuchiz_handheld_create_all(&handhelds);
+    int handheld_count = miuchiz_handheld_create_all_for(&handhelds, args.device);
 
     // Handle the case where something went wrong getting handhelds
     if (handhelds == NULL) {
@@ -114,7 +241,7 @@ int dump_flash_main(int argc, char** argv) {
     // Find the handheld
     struct Handheld* handheld = NULL;
     for (int i = 0; i < handheld_count; i++) {
-        if (!specified_device || (specified_device && strcmp(specified_device, handhelds[i]->device) == 0)) {
+        if (!specified_device || (specified_device && miuchiz_handheld_matches(handhelds[i], specified_device))) {
             handheld = handhelds[i];
             break;
         }
@@ -131,75 +258,308 @@ int dump_flash_main(int argc, char** argv) {
         goto leave_handhelds;
     }
 
-    FILE* fp = fopen(args.outfile, "wb");
-    if (fp == NULL) {
+    // Map the output where possible; pipes and devices are written through.
+    // When the image itself goes to stdout, everything else goes to stderr.
+    struct PageRange pages = args.pages;
+    int next_page = pages.first;
+    int to_stdout = strcmp(args.outfile, "-") == 0;
+    FILE* messages = to_stdout ? stderr : stdout;
+    FILE* fp = NULL;
+    struct ImageFile* image = NULL;
+    struct Journal* journal = NULL;
+    struct FlashState* state = NULL;
+    struct BlankMap blanks;
+    int holes = 0; /* whether the image is a new sparse file, all holes */
+    char fingerprint[MIUCHIZ_FINGERPRINT_LENGTH + 1] = { 0 };
+    blank_map_clear(&blanks);
+    if (to_stdout) {
+        if (args.resume) {
+            fprintf(stderr, "--resume needs an output file.\n");
+            result = 1;
+            goto leave_file;
+        }
+#if defined(_WIN32)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        fp = stdout;
+    }
+    else if (args.container) {
+        if (args.resume) {
+            fprintf(stderr, "--resume needs a raw output file.\n");
+            result = 1;
+            goto leave_file;
+        }
+        fp = fopen(args.outfile, "wb");
+    }
+    else {
+        /* A journal beside the output records each page as it is written,
+         * so an interrupted dump can continue where it stopped. It belongs
+         * to this handheld; without a fingerprint, no journal is kept. */
+        if (miuchiz_handheld_fingerprint(handheld, fingerprint, sizeof(fingerprint)) != 0 && args.resume) {
+            fprintf(stderr, "Unable to identify the handheld to resume its dump.\n");
+            result = 1;
+            goto leave_file;
+        }
+        if (args.resume) {
+            journal = journal_open(args.outfile, JOURNAL_DUMP, fingerprint, pages, 1);
+            if (journal == NULL && errno != ENOENT) {
+                fprintf(stderr, "%s.journal is not a journal of a dump of these pages from this handheld.\n", args.outfile);
+                result = 1;
+                goto leave_file;
+            }
+            if (journal == NULL) {
+                fprintf(messages, "No interrupted dump to resume; starting from page %d.\n", pages.first);
+            }
+        }
+
+        /* Resuming, or dumping only some pages, fills in an image that is
+         * already there; its other pages are kept. */
+        int resuming = journal != NULL && journal_next(journal) > pages.first;
+        if (resuming || !page_range_is_all(pages)) {
+            image = image_file_reopen(args.outfile, FLASH_SIZE);
+            if (image == NULL && (resuming || errno != ENOENT)) {
+                fprintf(stderr, "Unable to open %s to update it. [%d] %s\n", args.outfile, errno, strerror(errno));
+                result = 1;
+                goto leave_file;
+            }
+            if (resuming) {
+                // Kept as it was should the resume go no further
+                next_page = journal_next(journal);
+            }
+            // The image's blank pages, as a sparse dump left them
+            if (image != NULL && blank_map_load(args.outfile, &blanks) != 0) {
+                fprintf(stderr, "Unable to read %s.blank. [%d] %s\n", args.outfile, errno, strerror(errno));
+                image_file_close(image);
+                image = NULL;
+                result = 1;
+                goto leave_file;
+            }
+        }
+        if (image == NULL) {
+            image = args.sparse ? image_file_create_sparse(args.outfile, FLASH_SIZE)
+                                : image_file_create(args.outfile, FLASH_SIZE);
+            holes = args.sparse;
+            if (image == NULL && errno == EINVAL) {
+                fp = fopen(args.outfile, "wb");
+            }
+        }
+    }
+    if (image == NULL && fp == NULL) {
         fprintf(stderr, "Unable to open %s for writing. [%d] %s\n", args.outfile, errno, strerror(errno));
         result = 1;
         goto leave_file;
     }
+    if (args.sparse && image == NULL && !args.container) {
+        fprintf(stderr, "--sparse needs a regular output file or a container.\n");
+        result = 1;
+        goto leave_file;
+    }
+
+    int first_page = pages.first;
+    if (image != NULL && fingerprint[0] != '\0') {
+        if (journal == NULL) {
+            journal = journal_open(args.outfile, JOURNAL_DUMP, fingerprint, pages, 0);
+        }
+        else if ((first_page = resume_dump(handheld, image, &blanks, journal, pages)) < 0) {
+            result = 1;
+            goto leave_file;
+        }
+        if (journal == NULL || journal_begin(journal, first_page) != 0) {
+            fprintf(stderr, "Unable to write %s.journal. [%d] %s\n", args.outfile, errno, strerror(errno));
+            result = 1;
+            goto leave_file;
+        }
+        if (first_page > pages.first) {
+            fprintf(messages, "Resuming from page %d.\n", first_page);
+        }
+    }
+    else if (args.resume) {
+        fprintf(stderr, "%s cannot be resumed; only dumps to regular files can.\n", args.outfile);
+        result = 1;
+        goto leave_file;
+    }
+    next_page = first_page;
+
+    // A container starts with what is known of the handheld and this dump
+    struct ContainerWriter* container = NULL;
+    if (args.container) {
+        struct ContainerInfo info;
+        struct HandheldIdentity identity;
+        memset(&info, 0, sizeof(info));
+        if (miuchiz_handheld_identity(handheld, &identity, 1) == 0) {
+            memcpy(info.fingerprint, identity.fingerprint, sizeof(info.fingerprint));
+            info.has_identity = 1;
+            info.firmware_version = identity.firmware_version;
+            info.character = identity.character;
+        }
+        info.created = (uint64_t)time(NULL);
+        strncpy(info.tool_version, MIUCHIZ_UTILS_VERSION, sizeof(info.tool_version) - 1);
+        info.pages = pages;
+        container = container_writer_open(fp, &info, (args.pack ? CONTAINER_WRITE_PACK : 0)
+                                                     | (args.sparse ? CONTAINER_WRITE_SPARSE : 0));
+        if (container == NULL) {
+            fprintf(stderr, "Unable to write %s. [%d] %s\n", args.outfile, errno, strerror(errno));
+            result = 1;
+            goto leave_file;
+        }
+    }
+
+    /* Every page read is what the handheld holds, remembered so later loads
+     * can skip it; without a fingerprint, nothing is. */
+    if (fingerprint[0] != '\0' || miuchiz_handheld_fingerprint(handheld, fingerprint, sizeof(fingerprint)) == 0) {
+        state = miuchiz_flash_state_open(fingerprint);
+    }
+
+    struct PageRing* ring = page_ring_create(DUMP_RING_PAGES);
+    struct DeviceReader reader = { handheld, ring, messages, first_page, pages.last, args.verify };
+    struct PageWorker* worker = ring != NULL ? page_worker_start(device_reader_run, &reader) : NULL;
+    if (worker == NULL) {
+        fprintf(stderr, "Unable to start reading from the handheld.\n");
+        page_ring_destroy(ring);
+        if (container != NULL) {
+            container_writer_finish(container);
+        }
+        result = 1;
+        goto leave_file;
+    }
 
     struct Utimer timer;
     miuchiz_utimer_start(&timer);
 
-    int success = 0;
+    // Pages arrive in order; file writes, checksums and compression happen
+    // here, while the device thread is already reading the next pages
     uint64_t flash_checksum = 0;
-    for (int pagenum = 0; pagenum < MIUCHIZ_PAGE_COUNT; pagenum++) {
-        success = 0;
-        char page[MIUCHIZ_PAGE_SIZE] = { 0 };
+    for (int pagenum = 0; args.do_checksum && pagenum < first_page; pagenum++) {
+        if ((size_t)pagenum * MIUCHIZ_PAGE_SIZE >= FLASH_CHECKSUM_START) {
+            flash_checksum += checksum(blank_map_page(&blanks, image_file_data(image), pagenum), MIUCHIZ_PAGE_SIZE);
+        }
+    }
+    struct PageSlot* slot;
+    while ((slot = page_ring_take(ring)) != NULL) {
+        int pagenum = slot->page;
 
         miuchiz_utimer_end(&timer);
         int seconds = miuchiz_utimer_elapsed(&timer) / 1000000;
         int minutes = seconds / 60;
         seconds = seconds % 60;
-        printf("\r[%02d:%02d] Reading page %d/%d (%d%%)", 
+        int done = pagenum - pages.first + 1;
+        fprintf(messages, "\r[%02d:%02d] Reading page %d/%d (%d%%)", 
                minutes,
                seconds,
-               pagenum + 1,
-               MIUCHIZ_PAGE_COUNT,
-               (100 * (pagenum + 1)) / MIUCHIZ_PAGE_COUNT);
-        fflush(stdout);
-
-        for (int retry = 0; retry < 5; retry++) {
-            int read_result = miuchiz_handheld_read_page(handheld, pagenum, page, sizeof(page));
-            if (read_result == MIUCHIZ_ERROR_IO) {
-                printf("\rReading of page %d failed. Retrying.\n", pagenum);
-            }
-            else {
-                success = 1;
-                break;
-            }
+               done,
+               page_range_count(pages),
+               (100 * done) / page_range_count(pages));
+        fflush(messages);
+
+        if (slot->status != 0) {
+            fprintf(messages, "\rReading of page %d has failed too many times.\n", pagenum);
+            page_ring_release(ring);
+            break;
         }
 
-        if (success == 0) {
-            printf("\rReading of page %d has failed too many times.\n", pagenum);
-            break;
+        unsigned char hash[MIUCHIZ_SHA256_SIZE];
+        miuchiz_sha256(slot->data, sizeof(slot->data), hash);
+        if (state != NULL && miuchiz_flash_state_set(state, pagenum, hash) != 0) {
+            miuchiz_flash_state_close(state);
+            state = NULL;
         }
 
         if (args.do_checksum && (size_t)pagenum * MIUCHIZ_PAGE_SIZE >= FLASH_CHECKSUM_START) {
-            flash_checksum += checksum(page, sizeof(page));
+            flash_checksum += checksum(slot->data, sizeof(slot->data));
         }
 
-        if (fwrite(page, 1, sizeof(page), fp) != sizeof(page)) {
-            printf("\rWriting page %d to file failed.\n", pagenum);
-            result = 1;
+        if (container != NULL) {
+            if (container_writer_page(container, pagenum, slot->data, slot->flags) != 0) {
+                fprintf(messages, "\rWriting page %d to file failed.\n", pagenum);
+                page_ring_release(ring);
+                break;
+            }
+        }
+        else if (image != NULL) {
+            // A sparse dump leaves blank pages as holes, noting the erased
+            // ones; a new sparse file is all holes to begin with
+            size_t offset = (size_t)pagenum * MIUCHIZ_PAGE_SIZE;
+            int fill = args.sparse ? blank_page_fill(slot->data) : BLANK_PAGE_MIXED;
+            if (fill == BLANK_PAGE_MIXED) {
+                memcpy(image_file_data(image) + offset, slot->data, sizeof(slot->data));
+            }
+            else if (!holes) {
+                image_file_discard(image, offset, sizeof(slot->data));
+            }
+            blank_map_set(&blanks, pagenum, fill == 0xFF);
+            if (journal != NULL) {
+                if (journal_record(journal, pagenum, hash) != 0) {
+                    fprintf(messages, "\rUnable to update %s.journal; this dump cannot be resumed.\n", args.outfile);
+                    journal_close(journal, 1);
+                    journal = NULL;
+                }
+            }
+        }
+        else if (fwrite(slot->data, 1, sizeof(slot->data), fp) != sizeof(slot->data)) {
+            fprintf(messages, "\rWriting page %d to file failed.\n", pagenum);
+            page_ring_release(ring);
             break;
         }
+        page_ring_release(ring);
+        next_page++;
     }
 
-    if (success) {
-        printf("\n");
+    // Stops the device thread early if this side gave up
+    page_ring_cancel(ring);
+    page_worker_join(worker);
+    page_ring_destroy(ring);
+
+    // A container's index goes last, listing whichever pages were read
+    if (container != NULL && container_writer_finish(container) != 0 && next_page > pages.last) {
+        fprintf(messages, "\nWriting %s failed. [%d] %s", args.outfile, errno, strerror(errno));
+        next_page = pages.first;
+    }
+
+    // One write-back for the whole image, or a flush of what stdio holds
+    if (next_page > pages.last
+        && (image != NULL ? image_file_sync(image) != 0 : fflush(fp) != 0)) {
+        fprintf(messages, "\nWriting %s failed. [%d] %s", args.outfile, errno, strerror(errno));
+        next_page = pages.first;
+    }
+
+    // The map of erased pages goes with the image, even one cut short, and
+    // without it the image is wrong
+    if (image != NULL) {
+        for (int pagenum = next_page; page_range_is_all(pages) && pagenum < MIUCHIZ_PAGE_COUNT; pagenum++) {
+            blank_map_set(&blanks, pagenum, 0);
+        }
+        if (blank_map_save(args.outfile, &blanks) != 0) {
+            fprintf(messages, "\nWriting %s.blank failed. [%d] %s", args.outfile, errno, strerror(errno));
+            next_page = pages.first;
+        }
+    }
+
+    if (next_page > pages.last) {
+        fprintf(messages, "\n");
         if (args.do_checksum) {
-            printf("Checksum: %llX\n", (unsigned long long)flash_checksum);
+            fprintf(messages, "Checksum: %llX\n", (unsigned long long)flash_checksum);
         }
     }
     else {
         result = 1;
+        if (journal != NULL) {
+            fprintf(messages, "\nRun again with --resume to continue from page %d.\n", next_page);
+        }
     }
 
 leave_file:
-    if (fp) {
+    journal_close(journal, result == 0);
+    miuchiz_flash_state_close(state);
+    if (fp && fp != stdout) {
         fclose(fp);
     }
+    if (image && page_range_is_all(pages)) {
+        // Keep only what was read if the dump stopped short
+        image_file_close_at(image, (size_t)next_page * MIUCHIZ_PAGE_SIZE);
+    }
+    else if (image) {
+        image_file_close(image);
+    }
 
 leave_handhelds:
     miuchiz_handheld_destroy_all(handhelds);
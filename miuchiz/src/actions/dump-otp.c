@@ -86,7 +86,7 @@ int dump_otp_main(int argc, char** argv) {
         goto leave;
     }
 
-    handheld_count = miuchiz_handheld_create_all(&handhelds);
+    handheld_count = miuchiz_handheld_create_all_for(&handhelds, args.device);
 
     // Handle the case where something went wrong getting handhelds
     if (handhelds == NULL) {
@@ -111,7 +111,7 @@ int dump_otp_main(int argc, char** argv) {
 
     // Find the handheld
     for (int i = 0; i < handheld_count; i++) {
-        if (!specified_device || (specified_device && strcmp(specified_device, handhelds[i]->device) == 0)) {
+        if (!specified_device || (specified_device && miuchiz_handheld_matches(handhelds[i], specified_device))) {
             target_handheld = handhelds[i];
             break;
         }
@@ -137,7 +137,7 @@ int dump_otp_main(int argc, char** argv) {
 
     /* When you read from sector 0, it exposes the OTP, repeating, and
      * beginning at offset 0xBDC in the OTP. */
-    const size_t OTP_SIZE = 0x4000; // 16KiB
+    const size_t OTP_SIZE = MIUCHIZ_OTP_SIZE; // 16KiB
     const size_t OTP_STARTING_OFFSET = 0xBDC;
     otp = malloc(OTP_SIZE);
     read_sector = malloc(OTP_SIZE);
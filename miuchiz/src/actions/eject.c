@@ -59,7 +59,7 @@ int eject_main(int argc, char** argv) {
 
     // Get a list of all the connected handhelds
     struct Handheld** handhelds;
-    int handheld_count = miuchiz_handheld_create_all(&handhelds);
+    int handheld_count = miuchiz_handheld_create_all_for(&handhelds, args.device);
 
     // Handle the case where something went wrong getting handhelds
     if (handhelds == NULL) {
@@ -86,7 +86,7 @@ int eject_main(int argc, char** argv) {
     // Find the handheld
     struct Handheld* handheld = NULL;
     for (int i = 0; i < handheld_count; i++) {
-        if (!specified_device || (specified_device && strcmp(specified_device, handhelds[i]->device) == 0)) {
+        if (!specified_device || (specified_device && miuchiz_handheld_matches(handhelds[i], specified_device))) {
             handheld = handhelds[i];
             break;
         }
@@ -0,0 +1,187 @@
+#include "libmiuchiz-usb.h"
+#include "actions/inspect.h"
+#include "container.h"
+#include "snapshot-store.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+struct args {
+    char* infile;
+    char* store;
+    int list;
+    int check;
+};
+
+static void usage(char* program_name) {
+    fprintf(stderr, "Usage: %s [-l] [-c] [-s store] container\n", program_name);
+}
+
+static int args_parse(struct args* args, int argc, char** argv) {
+    int opt;
+    int option_index;
+    static struct option long_options[] = {
+        {"list",  no_argument,       0, 'l' },
+        {"check", no_argument,       0, 'c' },
+        {"store", required_argument, 0, 's' },
+        {0,       0,                 0,  0 }
+    };
+
+    memset(args, 0, sizeof(*args));
+
+    while ((opt = getopt_long(argc, argv, "lcs:", (struct option*)&long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'l':
+                args->list = 1;
+                break;
+            case 'c':
+                args->check = 1;
+                break;
+            case 's':
+                args->store = strdup(optarg);
+                break;
+            default:
+                return 1;
+                break;
+        }
+    }
+
+    if (optind < argc) args->infile = strdup(argv[optind++]); else return 1;
+
+    if (optind < argc) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static void args_free(struct args* args) {
+    free(args->infile);
+    free(args->store);
+}
+
+/* Everything here comes from the header and the index; only --check reads
+ * the page data. */
+int inspect_main(int argc, char** argv) {
+    int result = 0;
+
+    struct args args;
+    if (args_parse(&args, argc, argv)) {
+        usage(argv[0]);
+        result = 1;
+        goto leave_args;
+    }
+
+    struct Container* container = container_open(args.infile);
+    if (container == NULL) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "%s is not a container, or its index is damaged.\n", args.infile);
+        }
+        else {
+            fprintf(stderr, "Unable to open %s for reading. [%d] %s\n", args.infile, errno, strerror(errno));
+        }
+        result = 1;
+        goto leave_args;
+    }
+
+    const struct ContainerInfo* info = container_info(container);
+    if (info->has_identity) {
+        printf("Fingerprint: %s; Major version: %d.%02d; Character: %d\n",
+               info->fingerprint,
+               (info->firmware_version >> 8) & 0xFF, info->firmware_version & 0xFF,
+               info->character);
+    }
+    else {
+        printf("Fingerprint: %s\n", info->fingerprint[0] != '\0' ? info->fingerprint : "Unknown");
+    }
+
+    char created[32] = "Unknown";
+    time_t when = (time_t)info->created;
+    struct tm* tm = gmtime(&when);
+    if (tm != NULL) {
+        strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S UTC", tm);
+    }
+    printf("Dumped: %s; Tool version: %s\n", created, info->tool_version);
+
+    int count = container_page_count(container);
+    int blank = 0;
+    int zero = 0;
+    int retried = 0;
+    int verified = 0;
+    int packed = 0;
+    int stored = 0;
+    for (int i = 0; i < count; i++) {
+        const struct ContainerPage* page = container_page(container, i);
+        blank += (page->flags & CONTAINER_PAGE_BLANK) != 0;
+        zero += (page->flags & CONTAINER_PAGE_ZERO) != 0;
+        retried += (page->flags & CONTAINER_PAGE_RETRIED) != 0;
+        verified += (page->flags & CONTAINER_PAGE_VERIFIED) != 0;
+        packed += (page->flags & CONTAINER_PAGE_PACKED) != 0;
+        stored += (page->flags & CONTAINER_PAGE_STORED) != 0;
+    }
+    printf("Pages: %d-%d; Held: %d; Missing: %d; Blank: %d; Zero: %d; Retried: %d; Verified: %d\n",
+           info->pages.first, info->pages.last, count,
+           page_range_count(info->pages) - count, blank, zero, retried, verified);
+    uint64_t held = (uint64_t)count * MIUCHIZ_PAGE_SIZE;
+    uint64_t size = container_data_size(container);
+    printf("Stored: %llu of %llu bytes (%d%%); Packed: %d; In a snapshot store: %d\n",
+           (unsigned long long)size, (unsigned long long)held,
+           held > 0 ? (int)(100 * size / held) : 0, packed, stored);
+
+    if (args.list) {
+        for (int i = 0; i < count; i++) {
+            const struct ContainerPage* page = container_page(container, i);
+            char hash[2 * MIUCHIZ_SHA256_SIZE + 1];
+            miuchiz_hex_encode(page->hash, MIUCHIZ_SHA256_SIZE, hash);
+            printf("0x%03X %s%s%s%s%s%s%s\n", page->page, hash,
+                   (page->flags & CONTAINER_PAGE_BLANK) ? " blank" : "",
+                   (page->flags & CONTAINER_PAGE_ZERO) ? " zero" : "",
+                   (page->flags & CONTAINER_PAGE_RETRIED) ? " retried" : "",
+                   (page->flags & CONTAINER_PAGE_VERIFIED) ? " verified" : "",
+                   (page->flags & CONTAINER_PAGE_PACKED) ? " packed" : "",
+                   (page->flags & CONTAINER_PAGE_STORED) ? " stored" : "");
+        }
+    }
+
+    // A snapshot's pages are checked in the store
+    struct SnapshotStore* store = NULL;
+    if (args.check && stored > 0) {
+        store = snapshot_store_open(args.store);
+        if (store == NULL) {
+            fprintf(stderr, "Unable to open the snapshot store. [%d] %s\n", errno, strerror(errno));
+            result = 1;
+            goto leave_container;
+        }
+        container_set_source(container, snapshot_store_get, store);
+    }
+
+    if (args.check) {
+        unsigned char data[MIUCHIZ_PAGE_SIZE];
+        int damaged = 0;
+        for (int i = 0; i < count; i++) {
+            int pagenum = container_page(container, i)->page;
+            if (container_read_page(container, pagenum, data) != 0) {
+                printf("Page %d %s.\n", pagenum, errno == EILSEQ ? "does not match its hash"
+                                                : errno == ENOENT ? "is missing from the snapshot store"
+                                                : "cannot be read");
+                damaged++;
+            }
+        }
+        printf("%s\n", damaged == 0 ? "Intact." : "Damaged.");
+        result = damaged != 0;
+    }
+
+    snapshot_store_close(store);
+
+leave_container:
+    container_close(container);
+
+leave_args:
+    args_free(&args);
+
+    return result;
+}
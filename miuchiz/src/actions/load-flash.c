@@ -1,6 +1,14 @@
 #include "libmiuchiz-usb.h"
 #include "actions/load-flash.h"
+#include "page-ring.h"
+#include "image-file.h"
+#include "journal.h"
+#include "page-range.h"
+#include "container.h"
+#include "blank-map.h"
+#include "snapshot-store.h"
 #include "timer.h"
+#include "sleep.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -8,24 +16,65 @@
 #include <errno.h>
 #include <getopt.h>
 #include <string.h>
+#include <stdatomic.h>
+
+#if defined(_WIN32)
+    #include <io.h>
+#endif
+
+#define FLASH_SIZE ((size_t)MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT)
+
+/* Pages the file thread may read ahead of the device. */
+#define LOAD_RING_PAGES (32)
+#define PROGRESS_INTERVAL_MS (20)
+
+/* PageSlot flags */
+#define PAGE_IN_PLACE (1u << 0) /* the mirror file says the handheld holds it */
+#define PAGE_KNOWN    (1u << 1) /* the flash state says so; read back before it is skipped */
 
 struct args {
     char* device;
     char* infile;
     char* mirrorfile;
+    char* store;
     int check_changes;
+    int write_all;
+    int resume;
+    struct PageRange pages;
+    int pages_given;
 };
 
 struct setup_info {
     struct args args;
-    FILE* infile_fp;
-    FILE* mirrorfile_fp;
+    struct ImageFile* infile;
+    struct BlankMap blanks; /* the erased pages infile leaves as holes */
+    struct Container* container; /* set instead of infile for a container */
+    struct SnapshotStore* store; /* where the container's stored pages are */
+    FILE* instream; /* set instead of infile when reading standard input */
+    unsigned char* streamed; /* what container or instream held, kept to update the mirror */
+    struct ImageFile* mirrorfile;
+    struct Journal* journal; /* pages of this load that reached the device */
+    struct FlashState* state; /* what the handheld was last known to hold */
+    int state_next; /* the first page whose write is not yet in the state */
+    int in_place; /* pages not written, as the handheld held them already; the device thread's */
+    unsigned char hashes[MIUCHIZ_PAGE_COUNT][MIUCHIZ_SHA256_SIZE]; /* of the pages handed to the device */
     struct Handheld** handhelds;
     struct Handheld* target_handheld;
 };
 
+struct DeviceWriter {
+    struct setup_info* info;
+    struct PageRing* ring;
+    atomic_int pages_done; /* pages written, or found already in place */
+};
+
 static void usage(char* program_name) {
-    fprintf(stderr, "Usage: %s [-d device] [-m mirrorfile] infile\n", program_name);
+    fprintf(stderr, "Usage: %s [-d device] [-m mirrorfile] [-c] [-w] [-r] [-p pages] [-s store] infile\n", program_name);
+    fprintf(stderr, "An infile of - streams the image from standard input.\n");
+    fprintf(stderr, "Pages are first-last or a single page, or one of boot, application, save or all.\n");
+    fprintf(stderr, "An infile may be a raw image, sparse or not, or a container made by dump-flash.\n");
+    fprintf(stderr, "The pages of a snapshot's manifest are read from the snapshot store.\n");
+    fprintf(stderr, "Pages the handheld is known to hold already are skipped unless -w is given.\n");
 }
 
 static int args_parse(struct args* args, int argc, char** argv) {
@@ -34,13 +83,18 @@ static int args_parse(struct args* args, int argc, char** argv) {
     static struct option long_options[] = {
         {"device",        required_argument, 0, 'd' },
         {"check-changes", no_argument,       0, 'c'},
+        {"write-all",     no_argument,       0, 'w' },
         {"mirror",        required_argument, 0, 'm' },
+        {"resume",        no_argument,       0, 'r' },
+        {"pages",         required_argument, 0, 'p' },
+        {"store",         required_argument, 0, 's' },
         {0,               0,                 0,  0 }
     };
 
     memset(args, 0, sizeof(*args));
+    args->pages = page_range_all();
 
-    while ((opt = getopt_long(argc, argv, "d:cm:", (struct option*)&long_options, &option_index)) != -1) {
+    while ((opt = getopt_long(argc, argv, "d:cm:wrp:s:", (struct option*)&long_options, &option_index)) != -1) {
         switch (opt) {
             case 'd':
                 args->device = strdup(optarg);
@@ -48,9 +102,26 @@ static int args_parse(struct args* args, int argc, char** argv) {
             case 'c':
                 args->check_changes = 1;
                 break;
+            case 'w':
+                args->write_all = 1;
+                break;
             case 'm':
                 args->mirrorfile = strdup(optarg);
                 break;
+            case 'r':
+                args->resume = 1;
+                break;
+            case 'p':
+                if (page_range_parse(optarg, &args->pages)) {
+                    fprintf(stderr, "Pages must be first-last or a page within 0-%d, or boot, application, save or all.\n",
+                            MIUCHIZ_PAGE_COUNT - 1);
+                    return 1;
+                }
+                args->pages_given = 1;
+                break;
+            case 's':
+                args->store = strdup(optarg);
+                break;
             default:
                 return 1;
                 break;
@@ -70,31 +141,43 @@ static void args_free(struct args* args) {
     free(args->device);
     free(args->infile);
     free(args->mirrorfile);
+    free(args->store);
 }
 
-static int copy_mirror(FILE* target, FILE* source) {
-    if (!target || !source) {
+/* Brings the mirror file up to date with the pages just loaded, in one copy
+ * and one write-back: replacing it after a whole image, updating it in place
+ * after some pages. Pages the source leaves as holes are filled from its
+ * blank map, if it has one. */
+static int copy_mirror(const char* path, const unsigned char* source, const struct BlankMap* blanks,
+                       struct PageRange pages) {
+    struct ImageFile* target = page_range_is_all(pages) ? image_file_create(path, FLASH_SIZE)
+                                                        : image_file_reopen(path, FLASH_SIZE);
+    if (target == NULL) {
         return 1;
     }
-
-    char page[MIUCHIZ_PAGE_SIZE];
-    for (int pagenum = 0; pagenum < MIUCHIZ_PAGE_COUNT; pagenum++) {
-        fseek(source, MIUCHIZ_PAGE_SIZE * pagenum, SEEK_SET);
-        fseek(target, MIUCHIZ_PAGE_SIZE * pagenum, SEEK_SET);
-        if (fread(page, 1, sizeof(page), source) != sizeof(page)) {
-            return 1;
-        }
-        if (fwrite(page, 1, sizeof(page), target) != sizeof(page)) {
-            return 1;
+    size_t offset = (size_t)pages.first * MIUCHIZ_PAGE_SIZE;
+    memcpy(image_file_data(target) + offset, source + offset, (size_t)page_range_count(pages) * MIUCHIZ_PAGE_SIZE);
+    for (int pagenum = pages.first; blanks != NULL && pagenum <= pages.last; pagenum++) {
+        if (blank_map_get(blanks, pagenum)) {
+            memset(image_file_data(target) + (size_t)pagenum * MIUCHIZ_PAGE_SIZE, 0xFF, MIUCHIZ_PAGE_SIZE);
         }
     }
-    
-    return 0;
+    int result = image_file_sync(target) != 0;
+    image_file_close(target);
+    return result;
 }
 
 static int load_flash_setup(int argc, char** argv, struct setup_info* info) {
-    info->infile_fp = NULL;
-    info->mirrorfile_fp = NULL;
+    info->infile = NULL;
+    blank_map_clear(&info->blanks);
+    info->container = NULL;
+    info->store = NULL;
+    info->instream = NULL;
+    info->streamed = NULL;
+    info->mirrorfile = NULL;
+    info->journal = NULL;
+    info->state = NULL;
+    info->in_place = 0;
     info->handhelds = NULL;
     info->target_handheld = NULL;
 
@@ -105,7 +188,7 @@ static int load_flash_setup(int argc, char** argv, struct setup_info* info) {
     }
 
     // Get a list of all the connected handhelds
-    int handheld_count = miuchiz_handheld_create_all(&info->handhelds);
+    int handheld_count = miuchiz_handheld_create_all_for(&info->handhelds, info->args.device);
 
     // Handle the case where something went wrong getting handhelds
     if (info->handhelds == NULL) {
@@ -128,7 +211,7 @@ static int load_flash_setup(int argc, char** argv, struct setup_info* info) {
 
     // Find the handheld
     for (int i = 0; i < handheld_count; i++) {
-        if (!specified_device || (specified_device && strcmp(specified_device, info->handhelds[i]->device) == 0)) {
+        if (!specified_device || (specified_device && miuchiz_handheld_matches(info->handhelds[i], specified_device))) {
             info->target_handheld = info->handhelds[i];
             break;
         }
@@ -145,135 +228,469 @@ static int load_flash_setup(int argc, char** argv, struct setup_info* info) {
         return 1;
     }
 
-    // Open the file that will be loaded onto the device
-    info->infile_fp = fopen(info->args.infile, "rb");
-    if (info->infile_fp == NULL) {
-        printf("Unable to open %s for reading. [%d] %s\n", info->args.infile, errno, strerror(errno));
-        return 1;
+    if (strcmp(info->args.infile, "-") == 0) {
+        /* Standard input is read page by page as the device takes it, so
+         * its size is only known once it ends. It holds only the pages being
+         * loaded. */
+#if defined(_WIN32)
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+        if (info->args.resume) {
+            fprintf(stderr, "--resume needs an input file.\n");
+            return 1;
+        }
+        info->instream = stdin;
     }
+    else if (container_detect(info->args.infile)) {
+        /* A container is read a page at a time, each checked against its
+         * hash in the index. Unless told otherwise, its pages are loaded. */
+        info->container = container_open(info->args.infile);
+        if (info->container == NULL) {
+            printf("Unable to read the container %s. [%d] %s\n", info->args.infile, errno, strerror(errno));
+            return 1;
+        }
+        if (container_has_stored_pages(info->container)) {
+            info->store = snapshot_store_open(info->args.store);
+            if (info->store == NULL) {
+                printf("Unable to open the snapshot store. [%d] %s\n", errno, strerror(errno));
+                return 1;
+            }
+            container_set_source(info->container, snapshot_store_get, info->store);
+        }
+        if (!info->args.pages_given) {
+            info->args.pages = container_info(info->container)->pages;
+        }
+        for (int pagenum = info->args.pages.first; pagenum <= info->args.pages.last; pagenum++) {
+            if (container_find(info->container, pagenum) == NULL) {
+                printf("%s does not hold page %d.\n", info->args.infile, pagenum);
+                return 1;
+            }
+        }
+    }
+    else {
+        // Map the file that will be loaded onto the device
+        info->infile = image_file_open(info->args.infile);
+        if (info->infile == NULL) {
+            printf("Unable to open %s for reading. [%d] %s\n", info->args.infile, errno, strerror(errno));
+            return 1;
+        }
+
+        // Make sure the file to load onto the device is the right size
+        if (image_file_size(info->infile) != FLASH_SIZE) {
+            printf("Flash file must be 0x%X bytes.\n", MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT);
+            return 1;
+        }
 
-    // Make sure the file to load onto the device is the right size
-    fseek(info->infile_fp, 0, SEEK_END);
-    size_t infile_size = ftell(info->infile_fp);
+        // A sparse dump's erased pages are holes, which read as zeros
+        if (blank_map_load(info->args.infile, &info->blanks) != 0) {
+            printf("Unable to read %s.blank. [%d] %s\n", info->args.infile, errno, strerror(errno));
+            return 1;
+        }
+    }
 
-    if (infile_size != MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT) {
-        printf("Flash file must be 0x%X bytes.\n", MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT);
+    // Without a mapped image, the pages loaded are kept for the mirror file
+    if (info->args.mirrorfile && info->infile == NULL) {
+        info->streamed = malloc(FLASH_SIZE);
+        if (info->streamed == NULL) {
+            printf("Unable to allocate memory for the mirror file.\n");
+            return 1;
+        }
+    }
+
+    /* The library remembers what each handheld was last known to hold, so
+     * pages already there need not be written again. Without a fingerprint,
+     * or a state to keep, every page is written. */
+    char fingerprint[MIUCHIZ_FINGERPRINT_LENGTH + 1];
+    int identified = miuchiz_handheld_fingerprint(info->target_handheld, fingerprint, sizeof(fingerprint)) == 0;
+    if (identified) {
+        info->state = miuchiz_flash_state_open(fingerprint);
+    }
+
+    /* A snapshot's manifest lives in the store, which is no place for a
+     * journal that would outlast a failed load; its loads start over. */
+    if (info->store != NULL && info->args.resume) {
+        fprintf(stderr, "A snapshot's load cannot be resumed; load it again.\n");
         return 1;
     }
 
-    /* Try to open the mirror file, if it doesn't open, we just won't
-     * read from it. */
-    if (info->args.mirrorfile) {
-        info->mirrorfile_fp = fopen(info->args.mirrorfile, "rb");
-        if (info->mirrorfile_fp) {
-            fseek(info->mirrorfile_fp, 0, SEEK_END);
-            size_t mirrorfile_size = ftell(info->mirrorfile_fp);
-            
-            if (mirrorfile_size != MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT) {
-                printf("Mirror file must be 0x%X bytes.\n", MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT);
+    if (info->instream == NULL && info->store == NULL) {
+
+        /* A journal beside the image records each page once the handheld
+         * holds it, so an interrupted load can continue where it stopped.
+         * It belongs to this handheld; without a fingerprint, no journal is
+         * kept. Only a load asked to resume needs one: any other goes on
+         * without if the image's directory cannot hold it. */
+        if (identified) {
+            info->journal = journal_open(info->args.infile, JOURNAL_LOAD, fingerprint, info->args.pages, info->args.resume);
+            if (info->journal == NULL && errno == ENOENT) {
+                printf("No interrupted load to resume; starting from page %d.\n", info->args.pages.first);
+                info->journal = journal_open(info->args.infile, JOURNAL_LOAD, fingerprint, info->args.pages, 0);
+            }
+            else if (info->journal == NULL && errno == EINVAL) {
+                fprintf(stderr, "%s.journal is not a journal of a load of these pages onto this handheld.\n", info->args.infile);
+                return 1;
+            }
+            if (info->journal == NULL && info->args.resume) {
+                fprintf(stderr, "Unable to open %s.journal. [%d] %s\n", info->args.infile, errno, strerror(errno));
                 return 1;
             }
+            if (info->journal == NULL) {
+                printf("Unable to open %s.journal; this load cannot be resumed. [%d] %s\n",
+                       info->args.infile, errno, strerror(errno));
+            }
+        }
+        else if (info->args.resume) {
+            fprintf(stderr, "Unable to identify the handheld to resume its load.\n");
+            return 1;
+        }
+    }
+
+    /* Try to map the mirror file, if it doesn't open, we just won't
+     * read from it. */
+    if (info->args.mirrorfile) {
+        info->mirrorfile = image_file_open(info->args.mirrorfile);
+        if (info->mirrorfile && image_file_size(info->mirrorfile) != FLASH_SIZE) {
+            printf("Mirror file must be 0x%X bytes.\n", MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT);
+            return 1;
         }
     }
 
     return 0;
 }
 
-static int load_flash_process(struct setup_info* info) {
-    struct Utimer timer;
-    miuchiz_utimer_start(&timer);
-
-    int page_write_success = 0;
-    for (int pagenum = 0; pagenum < MIUCHIZ_PAGE_COUNT; pagenum++) {
-        page_write_success = 0;
-        char page[MIUCHIZ_PAGE_SIZE] = { 0 };
-
-        miuchiz_utimer_end(&timer);
-        int seconds = miuchiz_utimer_elapsed(&timer) / 1000000;
-        int minutes = seconds / 60;
-        seconds = seconds % 60;
-        printf("\r[%02d:%02d] Writing page %d/%d (%d%%)", 
-               minutes,
-               seconds,
-               pagenum + 1,
-               MIUCHIZ_PAGE_COUNT,
-               (100 * (pagenum + 1)) / MIUCHIZ_PAGE_COUNT);
-        fflush(stdout);
-
-        for (int retry = 0; retry < 5; retry++) {
-            // Read this page from the infile
-            fseek(info->infile_fp, pagenum * sizeof(page), SEEK_SET);
-            if (fread(page, 1, sizeof(page), info->infile_fp) != sizeof(page)) {
-                printf("\rReading of page %d from file failed. Retrying.\n", pagenum);
-                continue;
-            }
-
-            /* If a mirror file was opened, check whether the data to write already
-             * matches the mirror file. Consider page successfully written if it matches. */
-            if (info->mirrorfile_fp) {
-                char mirrorfile_page[MIUCHIZ_PAGE_SIZE] = { 0 };
-                fseek(info->mirrorfile_fp, pagenum * sizeof(mirrorfile_page), SEEK_SET);
-                if (fread(mirrorfile_page, 1, sizeof(mirrorfile_page), info->mirrorfile_fp) != sizeof(mirrorfile_page)) {
-                    printf("\rReading of page %d from mirror file failed. Retrying.\n", pagenum);
-                    continue;
-                }
-                if (memcmp(mirrorfile_page, page, MIUCHIZ_PAGE_SIZE) == 0) {
-                    page_write_success = 1;
-                }
-            }
-            
-            /* If check-changes was specified, read the current page from the device.
+/* The device thread: writes each page the file thread hands it, unless the
+ * handheld already holds it, stopping at the first that cannot be written. */
+static int write_pages(void* arg) {
+    struct DeviceWriter* writer = arg;
+    struct setup_info* info = writer->info;
+    struct PageSlot* slot;
+    int result = 0;
+
+    while ((slot = page_ring_take(writer->ring)) != NULL) {
+        int pagenum = slot->page;
+        /* A page that already matches the mirror file is considered
+         * successfully written. */
+        int page_write_success = (slot->flags & PAGE_IN_PLACE) != 0;
+        int in_place = page_write_success;
+        for (int retry = 0; retry < 5 && !page_write_success; retry++) {
+            /* If check-changes was specified, or the flash state says the
+             * handheld holds the page, read the current page from the device.
              * If the page already on the device is already identical, then consider this 
              * page successfully written. The read involved here is much faster than 
-             * writing, so this is normally faster if there are even a few identical pages. */
-
-            if (!page_write_success && info->args.check_changes) {
+             * writing, so this is normally faster if there are even a few identical pages.
+             * The state alone is never trusted: whatever else wrote to the
+             * handheld went unseen by it. */
+            if (info->args.check_changes || (slot->flags & PAGE_KNOWN)) {
                 char device_page[MIUCHIZ_PAGE_SIZE] = { 0 };
                 int device_read_result = miuchiz_handheld_read_page(info->target_handheld, pagenum, device_page, sizeof(device_page));
                 if (device_read_result == MIUCHIZ_ERROR_IO) {
                     printf("\rReading from page %d of device failed. Retrying.\n", pagenum);
                     continue;
                 }
-                if (memcmp(device_page, page, MIUCHIZ_PAGE_SIZE) == 0) {
+                if (memcmp(device_page, slot->data, MIUCHIZ_PAGE_SIZE) == 0) {
                     page_write_success = 1;
+                    in_place = 1;
+                    break;
                 }
             }
 
-            // This page may have already been considered successfully written due to check-changes
-            if (!page_write_success) {
-                int write_result = miuchiz_handheld_write_page(info->target_handheld, pagenum, page, sizeof(page));
-                if (write_result == MIUCHIZ_ERROR_IO) {
-                    printf("\rWriting of page %d to device failed. Retrying.\n", pagenum);
-                    continue;
-                }
+            int write_result = miuchiz_handheld_write_page(info->target_handheld, pagenum, slot->data, sizeof(slot->data));
+            if (write_result == MIUCHIZ_ERROR_IO) {
+                printf("\rWriting of page %d to device failed. Retrying.\n", pagenum);
+                continue;
             }
 
             page_write_success = 1;
-            break;
         }
+        page_ring_release(writer->ring);
 
-        if (page_write_success == 0) {
+        if (!page_write_success) {
             printf("\rWriting of page %d has failed too many times.\n", pagenum);
+            result = 1;
+            break;
+        }
+        info->in_place += in_place;
+        atomic_store(&writer->pages_done, pagenum + 1);
+    }
+
+    // Stops the file thread early if this side gave up
+    page_ring_cancel(writer->ring);
+    return result;
+}
+
+/* Fills one page from the input. A container's page must match its hash.
+ * A stream must hold exactly the pages being loaded: it fails on the page
+ * where it runs short, and the last page fails if anything follows it, so
+ * no page past the end of a bad stream reaches the device. */
+static int read_input_page(struct setup_info* info, int pagenum, unsigned char* page) {
+    size_t offset = (size_t)pagenum * MIUCHIZ_PAGE_SIZE;
+    if (info->infile != NULL) {
+        memcpy(page, blank_map_page(&info->blanks, image_file_data(info->infile), pagenum), MIUCHIZ_PAGE_SIZE);
+        return 0;
+    }
+    if (info->container != NULL) {
+        if (container_read_page(info->container, pagenum, page) != 0) {
+            if (errno == EILSEQ) {
+                printf("\nPage %d of %s does not match its hash.\n", pagenum, info->args.infile);
+            }
+            else if (errno == ENOENT) {
+                printf("\nPage %d of %s is missing from the snapshot store.\n", pagenum, info->args.infile);
+            }
+            else {
+                printf("\nReading page %d of %s failed. [%d] %s\n", pagenum, info->args.infile, errno, strerror(errno));
+            }
+            return 1;
+        }
+        if (info->streamed) {
+            memcpy(info->streamed + offset, page, MIUCHIZ_PAGE_SIZE);
+        }
+        return 0;
+    }
+
+    struct PageRange pages = info->args.pages;
+    size_t size = (size_t)page_range_count(pages) * MIUCHIZ_PAGE_SIZE;
+    size_t got = fread(page, 1, MIUCHIZ_PAGE_SIZE, info->instream);
+    if (got != MIUCHIZ_PAGE_SIZE) {
+        if (ferror(info->instream)) {
+            printf("\nReading %s failed. [%d] %s\n", info->args.infile, errno, strerror(errno));
+        }
+        else {
+            printf("\nFlash input ended after 0x%zX bytes; it must be 0x%zX bytes.\n",
+                   (size_t)(pagenum - pages.first) * MIUCHIZ_PAGE_SIZE + got, size);
+        }
+        return 1;
+    }
+    if (pagenum == pages.last && fgetc(info->instream) != EOF) {
+        printf("\nFlash input is longer than 0x%zX bytes.\n", size);
+        return 1;
+    }
+    if (info->streamed) {
+        memcpy(info->streamed + offset, page, MIUCHIZ_PAGE_SIZE);
+    }
+    return 0;
+}
+
+/* The SHA-256 of a page of an input file, from its index if it has one. */
+static void input_page_hash(struct setup_info* info, int pagenum, unsigned char* hash) {
+    if (info->container != NULL) {
+        memcpy(hash, container_find(info->container, pagenum)->hash, MIUCHIZ_SHA256_SIZE);
+    }
+    else {
+        miuchiz_sha256(blank_map_page(&info->blanks, image_file_data(info->infile), pagenum), MIUCHIZ_PAGE_SIZE, hash);
+    }
+}
+
+/* Finds where an interrupted load left off: after the pages the journal
+ * records, provided the image still holds them, re-writing the last of them
+ * unless the handheld is seen to hold it.
+ * @return The page to continue from, or -1 if the load cannot be resumed. */
+static int resume_load(struct setup_info* info) {
+    int completed = journal_next(info->journal);
+    unsigned char hash[MIUCHIZ_SHA256_SIZE];
+    for (int pagenum = info->args.pages.first; pagenum < completed; pagenum++) {
+        input_page_hash(info, pagenum, hash);
+        if (memcmp(hash, journal_hash(info->journal, pagenum), sizeof(hash)) != 0) {
+            fprintf(stderr, "%s has changed since the interrupted load. Load it again without --resume.\n",
+                    info->args.infile);
+            return -1;
+        }
+    }
+    if (completed == info->args.pages.first) {
+        return completed;
+    }
+
+    unsigned char page[MIUCHIZ_PAGE_SIZE];
+    int read_result = MIUCHIZ_ERROR_IO;
+    for (int retry = 0; retry < 5 && read_result == MIUCHIZ_ERROR_IO; retry++) {
+        read_result = miuchiz_handheld_read_page(info->target_handheld, completed - 1, page, sizeof(page));
+    }
+    if (read_result == MIUCHIZ_ERROR_IO) {
+        fprintf(stderr, "Reading of page %d has failed too many times.\n", completed - 1);
+        return -1;
+    }
+    unsigned char held[MIUCHIZ_SHA256_SIZE];
+    miuchiz_sha256(page, sizeof(page), held);
+    input_page_hash(info, completed - 1, hash);
+    if (memcmp(held, hash, sizeof(hash)) != 0) {
+        printf("Page %d is not on the handheld; writing it again.\n", completed - 1);
+        return completed - 1;
+    }
+    return completed;
+}
+
+/* Records the pages the device thread has finished since last time. */
+static void journal_catch_up(struct setup_info* info, int pages_done) {
+    while (info->journal != NULL && journal_next(info->journal) < pages_done) {
+        int pagenum = journal_next(info->journal);
+        unsigned char hash[MIUCHIZ_SHA256_SIZE];
+        input_page_hash(info, pagenum, hash);
+        if (journal_record(info->journal, pagenum, hash) != 0) {
+            printf("\rUnable to update %s.journal; this load cannot be resumed.\n", info->args.infile);
+            journal_close(info->journal, 1);
+            info->journal = NULL;
+        }
+    }
+}
+
+/* Records what the pages the device thread has finished since last time now
+ * hold. Should the state fail, it is dropped; nothing depends on it. */
+static void state_catch_up(struct setup_info* info, int pages_done) {
+    for (; info->state != NULL && info->state_next < pages_done; info->state_next++) {
+        if (miuchiz_flash_state_set(info->state, info->state_next, info->hashes[info->state_next]) != 0) {
+            miuchiz_flash_state_close(info->state);
+            info->state = NULL;
+        }
+    }
+}
+
+/* Whether the handheld held a page when a tool last saw it, as the flash
+ * state has it. The save page is always written: the handheld changes it
+ * itself as it is played, unseen by the state. */
+static int state_in_place(struct setup_info* info, int pagenum) {
+    unsigned char hash[MIUCHIZ_SHA256_SIZE];
+    return info->state != NULL && !info->args.write_all && pagenum != MIUCHIZ_SAVE_PAGE
+           && miuchiz_flash_state_get(info->state, pagenum, hash)
+           && memcmp(hash, info->hashes[pagenum], sizeof(hash)) == 0;
+}
+
+static void print_progress(struct Utimer* timer, struct PageRange pages, int pages_done) {
+    int count = page_range_count(pages);
+    int done = pages_done - pages.first < count ? pages_done - pages.first + 1 : count;
+    miuchiz_utimer_end(timer);
+    int seconds = miuchiz_utimer_elapsed(timer) / 1000000;
+    int minutes = seconds / 60;
+    seconds = seconds % 60;
+    printf("\r[%02d:%02d] Writing page %d/%d (%d%%)", 
+           minutes,
+           seconds,
+           done,
+           count,
+           (100 * done) / count);
+    fflush(stdout);
+}
+
+static int load_flash_process(struct setup_info* info) {
+    struct PageRange pages = info->args.pages;
+    int first_page = pages.first;
+    if (info->journal != NULL) {
+        if ((first_page = resume_load(info)) < 0) {
+            return 1;
+        }
+        if (journal_begin(info->journal, first_page) != 0) {
+            if (info->args.resume) {
+                fprintf(stderr, "Unable to write %s.journal. [%d] %s\n", info->args.infile, errno, strerror(errno));
+                return 1;
+            }
+            printf("Unable to write %s.journal; this load cannot be resumed. [%d] %s\n",
+                   info->args.infile, errno, strerror(errno));
+            journal_close(info->journal, 1);
+            info->journal = NULL;
+        }
+        else if (first_page > pages.first) {
+            printf("Resuming from page %d.\n", first_page);
+        }
+    }
+
+    struct PageRing* ring = page_ring_create(LOAD_RING_PAGES);
+    struct DeviceWriter writer = { .info = info, .ring = ring };
+    atomic_init(&writer.pages_done, first_page);
+    info->state_next = first_page;
+    struct PageWorker* worker = ring != NULL ? page_worker_start(write_pages, &writer) : NULL;
+    if (worker == NULL) {
+        printf("Unable to start writing to the handheld.\n");
+        page_ring_destroy(ring);
+        return 1;
+    }
+
+    struct Utimer timer;
+    miuchiz_utimer_start(&timer);
+
+    // File reads and mirror comparisons happen here, ahead of the device
+    // thread, which only ever waits on the handheld
+    int input_ok = 1;
+    struct PageSlot* slot;
+    for (int pagenum = first_page; pagenum <= pages.last && (slot = page_ring_claim(ring)) != NULL; pagenum++) {
+        print_progress(&timer, pages, atomic_load(&writer.pages_done));
+        journal_catch_up(info, atomic_load(&writer.pages_done));
+        state_catch_up(info, atomic_load(&writer.pages_done));
+
+        slot->page = pagenum;
+        slot->flags = 0;
+        slot->status = 0;
+        if (read_input_page(info, pagenum, slot->data)) {
+            input_ok = 0;
+            break;
+        }
+
+        /* The page is skipped if it already matches the mirror file, if one
+         * was opened; if the handheld was last known to hold it, the device
+         * thread reads it back to see whether it still does. */
+        miuchiz_sha256(slot->data, MIUCHIZ_PAGE_SIZE, info->hashes[pagenum]);
+        if (info->mirrorfile
+            && memcmp(image_file_data(info->mirrorfile) + (size_t)pagenum * MIUCHIZ_PAGE_SIZE,
+                      slot->data, MIUCHIZ_PAGE_SIZE) == 0) {
+            slot->flags |= PAGE_IN_PLACE;
+        }
+        else if (state_in_place(info, pagenum)) {
+            slot->flags |= PAGE_KNOWN;
+        }
+
+        /* A page about to be written is forgotten first, on disk, so the
+         * state never claims a page the write left half done. One the state
+         * knows is read back before it is skipped, so it is not forgotten. */
+        else if (info->state != NULL
+                 && (miuchiz_flash_state_set(info->state, pagenum, NULL) != 0
+                     || miuchiz_flash_state_flush(info->state) != 0)) {
+            printf("\rUnable to update what the handheld is known to hold. [%d] %s\n", errno, strerror(errno));
+            input_ok = 0;
             break;
         }
+        page_ring_publish(ring);
+    }
+    page_ring_close(ring);
+
+    // Keep the progress moving while the device thread finishes
+    while (!page_worker_done(worker)) {
+        if (input_ok) {
+            print_progress(&timer, pages, atomic_load(&writer.pages_done));
+        }
+        journal_catch_up(info, atomic_load(&writer.pages_done));
+        state_catch_up(info, atomic_load(&writer.pages_done));
+        miuchiz_sleep_ms(PROGRESS_INTERVAL_MS);
+    }
+    int page_write_success = page_worker_join(worker) == 0 && input_ok
+                             && atomic_load(&writer.pages_done) == pages.last + 1;
+    page_ring_destroy(ring);
+    journal_catch_up(info, atomic_load(&writer.pages_done));
+    state_catch_up(info, atomic_load(&writer.pages_done));
+    if (page_write_success) {
+        print_progress(&timer, pages, pages.last + 1);
     }
 
     if (!page_write_success) {
+        if (info->journal != NULL && input_ok) {
+            printf("\nRun again with --resume to continue from page %d.\n", journal_next(info->journal));
+        }
         return 1;
     }
 
     printf("\n");
+    if (info->in_place > 0) {
+        printf("%d of %d pages were on the handheld already.\n", info->in_place, page_range_count(pages));
+    }
 
-    if (info->args.mirrorfile) {
-        /* If the transfer was successful, the mirror file needs to be updated
-         * if one was provided. */
-        if (info->mirrorfile_fp) {
-            fclose(info->mirrorfile_fp);
-        }
+    journal_close(info->journal, 1);
+    info->journal = NULL;
 
-        info->mirrorfile_fp = fopen(info->args.mirrorfile, "wb");
+    /* If the transfer was successful, the mirror file needs to be updated
+     * if one was provided. Loading some pages only updates one that exists;
+     * the rest of the flash is unknown. */
+    if (info->args.mirrorfile && (info->mirrorfile || page_range_is_all(pages))) {
+        image_file_close(info->mirrorfile);
+        info->mirrorfile = NULL;
 
-        if (copy_mirror(info->mirrorfile_fp, info->infile_fp)) {
+        const unsigned char* loaded = info->infile ? image_file_data(info->infile) : info->streamed;
+        if (copy_mirror(info->args.mirrorfile, loaded, info->infile ? &info->blanks : NULL, pages)) {
             printf("Failed to update mirror file.\n");
             return 1;
         }
@@ -283,13 +700,13 @@ static int load_flash_process(struct setup_info* info) {
 }
 
 static void load_flash_cleanup(struct setup_info* info) {
-    if (info->infile_fp) {
-        fclose(info->infile_fp);
-    }
-
-    if (info->mirrorfile_fp) {
-        fclose(info->mirrorfile_fp);
-    }
+    image_file_close(info->infile);
+    container_close(info->container);
+    snapshot_store_close(info->store);
+    image_file_close(info->mirrorfile);
+    free(info->streamed);
+    journal_close(info->journal, 0);
+    miuchiz_flash_state_close(info->state);
 
     if (info->handhelds) {
         miuchiz_handheld_destroy_all(info->handhelds);
@@ -0,0 +1,236 @@
+#include "libmiuchiz-usb.h"
+#include "actions/make-patch.h"
+#include "image-file.h"
+#include "page-range.h"
+#include "container.h"
+#include "blank-map.h"
+#include "snapshot-store.h"
+#include "patch-file.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(_WIN32)
+    #include <io.h>
+#endif
+
+#define FLASH_SIZE ((size_t)MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT)
+
+struct args {
+    char* oldfile;
+    char* newfile;
+    char* outfile;
+    char* store;
+    struct PageRange pages;
+};
+
+static void usage(char* program_name) {
+    fprintf(stderr, "Usage: %s [-p pages] [-s store] -o patchfile old new\n", program_name);
+    fprintf(stderr, "Writes the pages that differ between two flash images, raw or containers, to patchfile (- for standard output).\n");
+}
+
+static int args_parse(struct args* args, int argc, char** argv) {
+    int opt;
+    int option_index;
+    static struct option long_options[] = {
+        {"output", required_argument, 0, 'o' },
+        {"pages",  required_argument, 0, 'p' },
+        {"store",  required_argument, 0, 's' },
+        {0,        0,                 0,  0 }
+    };
+
+    memset(args, 0, sizeof(*args));
+    args->pages = page_range_all();
+
+    while ((opt = getopt_long(argc, argv, "o:p:s:", (struct option*)&long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'o':
+                args->outfile = strdup(optarg);
+                break;
+            case 'p':
+                if (page_range_parse(optarg, &args->pages)) {
+                    fprintf(stderr, "Pages must be first-last or a page within 0-%d, or boot, application, save or all.\n",
+                            MIUCHIZ_PAGE_COUNT - 1);
+                    return 1;
+                }
+                break;
+            case 's':
+                args->store = strdup(optarg);
+                break;
+            default:
+                return 1;
+                break;
+        }
+    }
+
+    if (optind < argc) args->oldfile = strdup(argv[optind++]); else return 1;
+    if (optind < argc) args->newfile = strdup(argv[optind++]); else return 1;
+
+    if (optind < argc || args->outfile == NULL) {
+        return 1;
+    }
+
+    return 0;
+}
+
+static void args_free(struct args* args) {
+    free(args->oldfile);
+    free(args->newfile);
+    free(args->outfile);
+    free(args->store);
+}
+
+/* Reads the pages in range of a raw image, with its blank map, or of a
+ * container, whose pages are checked against their hashes, into `image`. */
+static int load_image(struct args* args, const char* path, unsigned char* image) {
+    if (container_detect(path)) {
+        struct Container* container = container_open(path);
+        if (container == NULL) {
+            fprintf(stderr, "Unable to read the container %s. [%d] %s\n", path, errno, strerror(errno));
+            return 1;
+        }
+        struct SnapshotStore* store = NULL;
+        int result = 0;
+        if (container_has_stored_pages(container)) {
+            store = snapshot_store_open(args->store);
+            if (store == NULL) {
+                fprintf(stderr, "Unable to open the snapshot store. [%d] %s\n", errno, strerror(errno));
+                result = 1;
+            }
+            else {
+                container_set_source(container, snapshot_store_get, store);
+            }
+        }
+        for (int pagenum = args->pages.first; result == 0 && pagenum <= args->pages.last; pagenum++) {
+            if (container_read_page(container, pagenum, image + (size_t)pagenum * MIUCHIZ_PAGE_SIZE) != 0) {
+                if (container_find(container, pagenum) == NULL) {
+                    fprintf(stderr, "%s does not hold page %d.\n", path, pagenum);
+                }
+                else if (errno == EILSEQ) {
+                    fprintf(stderr, "Page %d of %s does not match its hash.\n", pagenum, path);
+                }
+                else if (errno == ENOENT) {
+                    fprintf(stderr, "Page %d of %s is missing from the snapshot store.\n", pagenum, path);
+                }
+                else {
+                    fprintf(stderr, "Reading page %d of %s failed. [%d] %s\n", pagenum, path, errno, strerror(errno));
+                }
+                result = 1;
+            }
+        }
+        snapshot_store_close(store);
+        container_close(container);
+        return result;
+    }
+
+    struct ImageFile* file = image_file_open(path);
+    if (file == NULL) {
+        fprintf(stderr, "Unable to open %s for reading. [%d] %s\n", path, errno, strerror(errno));
+        return 1;
+    }
+    if (image_file_size(file) != FLASH_SIZE) {
+        fprintf(stderr, "Flash file must be 0x%zX bytes.\n", FLASH_SIZE);
+        image_file_close(file);
+        return 1;
+    }
+    struct BlankMap blanks;
+    if (blank_map_load(path, &blanks) != 0) {
+        fprintf(stderr, "Unable to read %s.blank. [%d] %s\n", path, errno, strerror(errno));
+        image_file_close(file);
+        return 1;
+    }
+    for (int pagenum = args->pages.first; pagenum <= args->pages.last; pagenum++) {
+        memcpy(image + (size_t)pagenum * MIUCHIZ_PAGE_SIZE,
+               blank_map_page(&blanks, image_file_data(file), pagenum), MIUCHIZ_PAGE_SIZE);
+    }
+    image_file_close(file);
+    return 0;
+}
+
+int make_patch_main(int argc, char** argv) {
+    int result = 0;
+    unsigned char* base = NULL;
+    unsigned char* target = NULL;
+
+    struct args args;
+    if (args_parse(&args, argc, argv)) {
+        usage(argv[0]);
+        result = 1;
+        goto leave_args;
+    }
+
+    base = malloc(FLASH_SIZE);
+    target = malloc(FLASH_SIZE);
+    if (base == NULL || target == NULL) {
+        fprintf(stderr, "Unable to allocate memory for the images.\n");
+        result = 1;
+        goto leave_images;
+    }
+    if (load_image(&args, args.oldfile, base) != 0 || load_image(&args, args.newfile, target) != 0) {
+        result = 1;
+        goto leave_images;
+    }
+
+    int to_stdout = strcmp(args.outfile, "-") == 0;
+    FILE* fp;
+    if (to_stdout) {
+#if defined(_WIN32)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        fp = stdout;
+    }
+    else {
+        fp = fopen(args.outfile, "wb");
+    }
+    if (fp == NULL) {
+        fprintf(stderr, "Unable to open %s for writing. [%d] %s\n", args.outfile, errno, strerror(errno));
+        result = 1;
+        goto leave_images;
+    }
+
+    struct PatchInfo info;
+    memset(&info, 0, sizeof(info));
+    info.created = (uint64_t)time(NULL);
+    strncpy(info.tool_version, MIUCHIZ_UTILS_VERSION, sizeof(info.tool_version) - 1);
+    info.pages = args.pages;
+    uint64_t written = 0;
+    int changed = patch_write(fp, &info, base, target, &written);
+    if (changed < 0) {
+        fprintf(stderr, "Writing %s failed. [%d] %s\n", args.outfile, errno, strerror(errno));
+        result = 1;
+    }
+    if (!to_stdout && fclose(fp) != 0 && result == 0) {
+        fprintf(stderr, "Writing %s failed. [%d] %s\n", args.outfile, errno, strerror(errno));
+        result = 1;
+    }
+    if (result != 0) {
+        if (!to_stdout) {
+            remove(args.outfile);
+        }
+        goto leave_images;
+    }
+
+    if (args.pages.last == MIUCHIZ_SAVE_PAGE
+        && memcmp(base + (size_t)MIUCHIZ_SAVE_PAGE * MIUCHIZ_PAGE_SIZE,
+                  target + (size_t)MIUCHIZ_SAVE_PAGE * MIUCHIZ_PAGE_SIZE, MIUCHIZ_PAGE_SIZE) != 0) {
+        fprintf(stderr, "Warning: the patch changes the save page, so applying it overwrites each handheld's "
+                        "character and creditz. Leave it out with -p application.\n");
+    }
+    fprintf(to_stdout ? stderr : stdout, "Patch of pages %d-%d: %d of %d pages change, in %llu bytes.\n",
+            args.pages.first, args.pages.last, changed, page_range_count(args.pages),
+            (unsigned long long)written);
+
+leave_images:
+    free(base);
+    free(target);
+
+leave_args:
+    args_free(&args);
+
+    return result;
+}
@@ -47,24 +47,6 @@ static void args_free(struct args* args) {
     free(args->device);
 }
 
-static int hcd_to_int(int hcd) {
-    int result = 0;
-    int place = 1;
-    int digit;
-    for (int i = 0; i < 4; i++) {
-        digit = hcd & 0xF;
-        result += digit * place;
-        place *= 10;
-
-        digit = (hcd & 0xF0) >> 4;
-        result += digit * place;
-        place *= 10;
-
-        hcd >>= 8;
-    }
-    return result;
-}
-
 int read_creditz_main(int argc, char** argv) {
     int result = 0;
 
@@ -78,7 +60,7 @@ int read_creditz_main(int argc, char** argv) {
 
     // Get a list of all the connected handhelds
     struct Handheld** handhelds;
-    int handheld_count = miuchiz_handheld_create_all(&handhelds);
+    int handheld_count = miuchiz_handheld_create_all_for(&handhelds, args.device);
 
     // Handle the case where something went wrong getting handhelds
     if (handhelds == NULL) {
@@ -105,7 +87,7 @@ int read_creditz_main(int argc, char** argv) {
     // Find the handheld
     struct Handheld* handheld = NULL;
     for (int i = 0; i < handheld_count; i++) {
-        if (!specified_device || (specified_device && strcmp(specified_device, handhelds[i]->device) == 0)) {
+        if (!specified_device || (specified_device && miuchiz_handheld_matches(handhelds[i], specified_device))) {
             handheld = handhelds[i];
             break;
         }
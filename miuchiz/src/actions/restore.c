@@ -0,0 +1,256 @@
+#include "libmiuchiz-usb.h"
+#include "actions/restore.h"
+#include "actions/load-flash.h"
+#include "page-range.h"
+#include "container.h"
+#include "snapshot-store.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+
+#if defined(_WIN32)
+    #include <io.h>
+#endif
+
+struct args {
+    char* device;
+    char* store;
+    char* outfile;
+    char* mirrorfile;
+    char* pages_text;
+    int check_changes;
+    struct PageRange pages;
+    char* name;
+};
+
+static void usage(char* program_name) {
+    fprintf(stderr, "Usage: %s [-s store] [-d device] [-m mirrorfile] [-c] [-p pages] name\n", program_name);
+    fprintf(stderr, "       %s [-s store] [-p pages] -o outfile name\n", program_name);
+    fprintf(stderr, "Loads a snapshot onto a handheld, or rebuilds its image in outfile (- for standard output).\n");
+}
+
+static int args_parse(struct args* args, int argc, char** argv) {
+    int opt;
+    int option_index;
+    static struct option long_options[] = {
+        {"device",        required_argument, 0, 'd' },
+        {"store",         required_argument, 0, 's' },
+        {"output",        required_argument, 0, 'o' },
+        {"mirror",        required_argument, 0, 'm' },
+        {"check-changes", no_argument,       0, 'c' },
+        {"pages",         required_argument, 0, 'p' },
+        {0,               0,                 0,  0 }
+    };
+
+    memset(args, 0, sizeof(*args));
+    args->pages = page_range_all();
+
+    while ((opt = getopt_long(argc, argv, "d:s:o:m:cp:", (struct option*)&long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'd':
+                args->device = strdup(optarg);
+                break;
+            case 's':
+                args->store = strdup(optarg);
+                break;
+            case 'o':
+                args->outfile = strdup(optarg);
+                break;
+            case 'm':
+                args->mirrorfile = strdup(optarg);
+                break;
+            case 'c':
+                args->check_changes = 1;
+                break;
+            case 'p':
+                if (page_range_parse(optarg, &args->pages)) {
+                    fprintf(stderr, "Pages must be first-last or a page within 0-%d, or boot, application, save or all.\n",
+                            MIUCHIZ_PAGE_COUNT - 1);
+                    return 1;
+                }
+                args->pages_text = strdup(optarg);
+                break;
+            default:
+                return 1;
+                break;
+        }
+    }
+
+    if (optind < argc) args->name = strdup(argv[optind++]); else return 1;
+
+    if (optind < argc) {
+        return 1;
+    }
+
+    if (!snapshot_store_name_valid(args->name)) {
+        fprintf(stderr, "%s cannot name a snapshot.\n", args->name);
+        return 1;
+    }
+
+    if (args->outfile != NULL && (args->device != NULL || args->mirrorfile != NULL || args->check_changes)) {
+        fprintf(stderr, "-d, -m and -c are for loading a handheld, not rebuilding an image.\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+static void args_free(struct args* args) {
+    free(args->device);
+    free(args->store);
+    free(args->outfile);
+    free(args->mirrorfile);
+    free(args->pages_text);
+    free(args->name);
+}
+
+/* Writes a snapshot's pages to an image file at their own offsets, or to
+ * standard output in order. A whole snapshot replaces the file; some pages
+ * update it in place. */
+static int rebuild(struct args* args, struct SnapshotStore* store, const char* manifest) {
+    struct Container* container = snapshot_store_open_manifest(store, manifest);
+    if (container == NULL) {
+        fprintf(stderr, "Unable to read the snapshot %s. [%d] %s\n", args->name, errno, strerror(errno));
+        return 1;
+    }
+    struct PageRange pages = args->pages_text != NULL ? args->pages : container_info(container)->pages;
+    int result = 0;
+    for (int pagenum = pages.first; pagenum <= pages.last; pagenum++) {
+        if (container_find(container, pagenum) == NULL) {
+            fprintf(stderr, "The snapshot %s does not hold page %d.\n", args->name, pagenum);
+            result = 1;
+            goto leave_container;
+        }
+    }
+
+    int to_stdout = strcmp(args->outfile, "-") == 0;
+    FILE* fp;
+    if (to_stdout) {
+#if defined(_WIN32)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+        fp = stdout;
+    }
+    else if (page_range_is_all(pages)) {
+        fp = fopen(args->outfile, "wb");
+    }
+    else {
+        fp = fopen(args->outfile, "r+b");
+        if (fp == NULL && errno == ENOENT) {
+            fp = fopen(args->outfile, "wb");
+        }
+    }
+    if (fp == NULL) {
+        fprintf(stderr, "Unable to open %s for writing. [%d] %s\n", args->outfile, errno, strerror(errno));
+        result = 1;
+        goto leave_container;
+    }
+
+    unsigned char page[MIUCHIZ_PAGE_SIZE];
+    for (int pagenum = pages.first; result == 0 && pagenum <= pages.last; pagenum++) {
+        if (container_read_page(container, pagenum, page) != 0) {
+            if (errno == ENOENT) {
+                fprintf(stderr, "Page %d of %s is missing from the store.\n", pagenum, args->name);
+            }
+            else if (errno == EILSEQ) {
+                fprintf(stderr, "Page %d of %s does not match its hash.\n", pagenum, args->name);
+            }
+            else {
+                fprintf(stderr, "Reading page %d of %s failed. [%d] %s\n", pagenum, args->name, errno, strerror(errno));
+            }
+            result = 1;
+        }
+        else if ((!to_stdout && fseek(fp, (long)pagenum * MIUCHIZ_PAGE_SIZE, SEEK_SET) != 0)
+                 || fwrite(page, 1, sizeof(page), fp) != sizeof(page)) {
+            fprintf(stderr, "Writing page %d to %s failed. [%d] %s\n", pagenum, args->outfile, errno, strerror(errno));
+            result = 1;
+        }
+    }
+    if (fflush(fp) != 0 && result == 0) {
+        fprintf(stderr, "Writing %s failed. [%d] %s\n", args->outfile, errno, strerror(errno));
+        result = 1;
+    }
+    if (!to_stdout) {
+        fclose(fp);
+    }
+    if (result == 0) {
+        fprintf(to_stdout ? stderr : stdout, "Rebuilt pages %d-%d of %s.\n", pages.first, pages.last, args->name);
+    }
+
+leave_container:
+    container_close(container);
+    return result;
+}
+
+int restore_main(int argc, char** argv) {
+    int result = 0;
+
+    struct args args;
+    if (args_parse(&args, argc, argv)) {
+        usage(argv[0]);
+        result = 1;
+        goto leave_args;
+    }
+
+    struct SnapshotStore* store = snapshot_store_open(args.store);
+    if (store == NULL) {
+        fprintf(stderr, "Unable to open the snapshot store %s. [%d] %s\n",
+                args.store != NULL ? args.store : "", errno, strerror(errno));
+        result = 1;
+        goto leave_args;
+    }
+
+    char* manifest = snapshot_store_manifest_path(store, args.name);
+    FILE* fp = manifest != NULL ? fopen(manifest, "rb") : NULL;
+    if (fp == NULL) {
+        fprintf(stderr, "There is no snapshot named %s in %s.\n", args.name, snapshot_store_dir(store));
+        result = 1;
+        goto leave_manifest;
+    }
+    fclose(fp);
+
+    if (args.outfile != NULL) {
+        result = rebuild(&args, store, manifest);
+        goto leave_manifest;
+    }
+
+    /* Loading is load-flash's, which reads a manifest as it would any
+     * container, its pages coming from the store. */
+    char* load_argv[16];
+    int load_argc = 0;
+    load_argv[load_argc++] = argv[0];
+    load_argv[load_argc++] = "--store";
+    load_argv[load_argc++] = (char*)snapshot_store_dir(store);
+    if (args.device != NULL) {
+        load_argv[load_argc++] = "--device";
+        load_argv[load_argc++] = args.device;
+    }
+    if (args.mirrorfile != NULL) {
+        load_argv[load_argc++] = "--mirror";
+        load_argv[load_argc++] = args.mirrorfile;
+    }
+    if (args.check_changes) {
+        load_argv[load_argc++] = "--check-changes";
+    }
+    if (args.pages_text != NULL) {
+        load_argv[load_argc++] = "--pages";
+        load_argv[load_argc++] = args.pages_text;
+    }
+    load_argv[load_argc++] = manifest;
+    load_argv[load_argc] = NULL;
+    optind = 0;
+    result = load_flash_main(load_argc, load_argv);
+
+leave_manifest:
+    free(manifest);
+    snapshot_store_close(store);
+
+leave_args:
+    args_free(&args);
+
+    return result;
+}
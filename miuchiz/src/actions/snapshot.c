@@ -0,0 +1,410 @@
+#include "libmiuchiz-usb.h"
+#include "actions/snapshot.h"
+#include "page-ring.h"
+#include "device-reader.h"
+#include "page-range.h"
+#include "container.h"
+#include "snapshot-store.h"
+#include "timer.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <getopt.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Pages the device thread may read ahead of the store. */
+#define SNAPSHOT_RING_PAGES (32)
+
+struct args {
+    char* device;
+    char* store;
+    char* name;
+    char* remove;
+    int list;
+    int collect;
+    int verify;
+    struct PageRange pages;
+};
+
+static void usage(char* program_name) {
+    fprintf(stderr, "Usage: %s [-d device] [-s store] [-e] [-p pages] [name]\n", program_name);
+    fprintf(stderr, "       %s [-s store] -l | -g | -x name\n", program_name);
+    fprintf(stderr, "A snapshot is named after the handheld's fingerprint and the time unless a name is given.\n");
+    fprintf(stderr, "-l lists the snapshots, -x removes one and -g removes the pages no snapshot needs.\n");
+}
+
+static int args_parse(struct args* args, int argc, char** argv) {
+    int opt;
+    int option_index;
+    static struct option long_options[] = {
+        {"device", required_argument, 0, 'd' },
+        {"store",  required_argument, 0, 's' },
+        {"verify", no_argument,       0, 'e' },
+        {"pages",  required_argument, 0, 'p' },
+        {"list",   no_argument,       0, 'l' },
+        {"gc",     no_argument,       0, 'g' },
+        {"remove", required_argument, 0, 'x' },
+        {0,        0,                 0,  0 }
+    };
+
+    memset(args, 0, sizeof(*args));
+    args->pages = page_range_all();
+
+    while ((opt = getopt_long(argc, argv, "d:s:ep:lgx:", (struct option*)&long_options, &option_index)) != -1) {
+        switch (opt) {
+            case 'd':
+                args->device = strdup(optarg);
+                break;
+            case 's':
+                args->store = strdup(optarg);
+                break;
+            case 'e':
+                args->verify = 1;
+                break;
+            case 'p':
+                if (page_range_parse(optarg, &args->pages)) {
+                    fprintf(stderr, "Pages must be first-last or a page within 0-%d, or boot, application, save or all.\n",
+                            MIUCHIZ_PAGE_COUNT - 1);
+                    return 1;
+                }
+                break;
+            case 'l':
+                args->list = 1;
+                break;
+            case 'g':
+                args->collect = 1;
+                break;
+            case 'x':
+                args->remove = strdup(optarg);
+                break;
+            default:
+                return 1;
+                break;
+        }
+    }
+
+    if (optind < argc) args->name = strdup(argv[optind++]);
+
+    if (optind < argc) {
+        return 1;
+    }
+
+    if ((args->list != 0) + (args->collect != 0) + (args->remove != NULL) + (args->name != NULL) > 1) {
+        return 1;
+    }
+
+    const char* name = args->remove != NULL ? args->remove : args->name;
+    if (name != NULL && !snapshot_store_name_valid(name)) {
+        fprintf(stderr, "%s cannot name a snapshot.\n", name);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void args_free(struct args* args) {
+    free(args->device);
+    free(args->store);
+    free(args->name);
+    free(args->remove);
+}
+
+static int list_one(void* context, const char* name) {
+    struct SnapshotStore* store = context;
+    char* path = snapshot_store_manifest_path(store, name);
+    struct Container* container = path != NULL ? container_open(path) : NULL;
+    free(path);
+    if (container == NULL) {
+        printf("%s: damaged\n", name);
+        return 0;
+    }
+
+    const struct ContainerInfo* info = container_info(container);
+    char created[32] = "Unknown";
+    time_t when = (time_t)info->created;
+    struct tm* tm = gmtime(&when);
+    if (tm != NULL) {
+        strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S UTC", tm);
+    }
+    printf("%s: Fingerprint: %s; Dumped: %s; Pages: %d-%d\n", name,
+           info->fingerprint[0] != '\0' ? info->fingerprint : "Unknown", created,
+           info->pages.first, info->pages.last);
+    container_close(container);
+    return 0;
+}
+
+/* Lists, removes or collects, without a handheld. */
+static int manage_store(struct args* args, struct SnapshotStore* store) {
+    if (args->list) {
+        if (snapshot_store_list(store, list_one, store) != 0) {
+            fprintf(stderr, "Unable to list the snapshots in %s. [%d] %s\n", snapshot_store_dir(store), errno, strerror(errno));
+            return 1;
+        }
+        return 0;
+    }
+
+    if (args->remove != NULL) {
+        char* path = snapshot_store_manifest_path(store, args->remove);
+        int removed = path != NULL && remove(path) == 0;
+        free(path);
+        if (!removed) {
+            fprintf(stderr, "Unable to remove the snapshot %s. [%d] %s\n", args->remove, errno, strerror(errno));
+            return 1;
+        }
+        printf("Removed %s. Its pages stay in the store until it is collected with -g.\n", args->remove);
+        return 0;
+    }
+
+    int removed;
+    uint64_t freed;
+    if (snapshot_store_collect(store, &removed, &freed) != 0) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "A snapshot in %s is damaged; nothing was collected.\n", snapshot_store_dir(store));
+        }
+        else if (errno == EBUSY) {
+            fprintf(stderr, "A snapshot is being taken into %s; collect it once that is done.\n", snapshot_store_dir(store));
+        }
+        else {
+            fprintf(stderr, "Unable to collect %s. [%d] %s\n", snapshot_store_dir(store), errno, strerror(errno));
+        }
+        return 1;
+    }
+    printf("Removed %d pages, freeing %llu bytes.\n", removed, (unsigned long long)freed);
+    return 0;
+}
+
+int snapshot_main(int argc, char** argv) {
+    int result = 0;
+
+    struct args args;
+    if (args_parse(&args, argc, argv)) {
+        usage(argv[0]);
+        result = 1;
+        goto leave_args;
+    }
+
+    struct SnapshotStore* store = snapshot_store_open(args.store);
+    if (store == NULL) {
+        fprintf(stderr, "Unable to open the snapshot store %s. [%d] %s\n",
+                args.store != NULL ? args.store : "", errno, strerror(errno));
+        result = 1;
+        goto leave_args;
+    }
+
+    if (args.list || args.collect || args.remove != NULL) {
+        result = manage_store(&args, store);
+        goto leave_store;
+    }
+
+    // Keep the store from being collected until the manifest is in place
+    if (snapshot_store_hold(store) != 0) {
+        fprintf(stderr, "Unable to lock the snapshot store %s. [%d] %s\n",
+                snapshot_store_dir(store), errno, strerror(errno));
+        result = 1;
+        goto leave_store;
+    }
+
+    // Get a list of all the connected handhelds
+    struct Handheld** handhelds;
+    int handheld_count = miuchiz_handheld_create_all_for(&handhelds, args.device);
+
+    // Handle the case where something went wrong getting handhelds
+    if (handhelds == NULL) {
+        fprintf(stderr, "Failed to search for handhelds.\n");
+        result = 1;
+        goto leave_handhelds;
+    }
+
+    const char* specified_device = NULL;
+    if (handheld_count == 0) {
+        fprintf(stderr, "No handhelds are connected.\n");
+        result = 1;
+        goto leave_handhelds;
+    }
+    else if (handheld_count == 1 || args.device) {
+        specified_device = args.device;
+    }
+    else {
+        fprintf(stderr, "%d handhelds are connected. Specify 1 with -d or --device.\n", handheld_count);
+        result = 1;
+        goto leave_handhelds;
+    }
+
+    // Find the handheld
+    struct Handheld* handheld = NULL;
+    for (int i = 0; i < handheld_count; i++) {
+        if (!specified_device || (specified_device && miuchiz_handheld_matches(handhelds[i], specified_device))) {
+            handheld = handhelds[i];
+            break;
+        }
+    }
+
+    if (!handheld) {
+        if (specified_device) {
+            fprintf(stderr, "No handheld was found at %s.\n", specified_device);
+        }
+        else {
+            fprintf(stderr, "Unable to find handheld.\n");
+        }
+        result = 1;
+        goto leave_handhelds;
+    }
+
+    // The manifest describes the handheld as a container would
+    struct PageRange pages = args.pages;
+    struct ContainerInfo info;
+    struct HandheldIdentity identity;
+    memset(&info, 0, sizeof(info));
+    if (miuchiz_handheld_identity(handheld, &identity, 1) == 0) {
+        memcpy(info.fingerprint, identity.fingerprint, sizeof(info.fingerprint));
+        info.has_identity = 1;
+        info.firmware_version = identity.firmware_version;
+        info.character = identity.character;
+    }
+    else {
+        miuchiz_handheld_fingerprint(handheld, info.fingerprint, sizeof(info.fingerprint));
+    }
+    info.created = (uint64_t)time(NULL);
+    strncpy(info.tool_version, MIUCHIZ_UTILS_VERSION, sizeof(info.tool_version) - 1);
+    info.pages = pages;
+
+    char name[256];
+    if (args.name != NULL) {
+        snprintf(name, sizeof(name), "%s", args.name);
+    }
+    else {
+        time_t now = (time_t)info.created;
+        struct tm* tm = gmtime(&now);
+        char stamp[32] = "0";
+        if (tm != NULL) {
+            strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", tm);
+        }
+        snprintf(name, sizeof(name), "%s-%s", info.fingerprint[0] != '\0' ? info.fingerprint : "unknown", stamp);
+    }
+
+    /* The manifest is written aside and renamed into place once every page
+     * is in the store, so a snapshot that exists is whole. */
+    char* path = snapshot_store_manifest_path(store, name);
+    char* partial = path != NULL ? malloc(strlen(path) + sizeof(".part")) : NULL;
+    FILE* fp = NULL;
+    if (partial == NULL) {
+        fprintf(stderr, "Unable to allocate memory for the snapshot's name.\n");
+        result = 1;
+        goto leave_manifest;
+    }
+    strcpy(partial, path);
+    strcat(partial, ".part");
+    if ((fp = fopen(path, "rb")) != NULL) {
+        fprintf(stderr, "There is already a snapshot named %s.\n", name);
+        result = 1;
+        goto leave_manifest;
+    }
+    fp = fopen(partial, "wb");
+    struct ContainerWriter* manifest = fp != NULL ? container_writer_open(fp, &info, 0) : NULL;
+    if (manifest == NULL) {
+        fprintf(stderr, "Unable to write %s. [%d] %s\n", partial, errno, strerror(errno));
+        result = 1;
+        goto leave_manifest;
+    }
+
+    // Every page read is what the handheld holds, for later loads to skip
+    struct FlashState* state = info.fingerprint[0] != '\0' ? miuchiz_flash_state_open(info.fingerprint) : NULL;
+
+    struct PageRing* ring = page_ring_create(SNAPSHOT_RING_PAGES);
+    struct DeviceReader reader = { handheld, ring, stdout, pages.first, pages.last, args.verify };
+    struct PageWorker* worker = ring != NULL ? page_worker_start(device_reader_run, &reader) : NULL;
+    if (worker == NULL) {
+        fprintf(stderr, "Unable to start reading from the handheld.\n");
+        page_ring_destroy(ring);
+        container_writer_finish(manifest);
+        miuchiz_flash_state_close(state);
+        result = 1;
+        goto leave_manifest;
+    }
+
+    struct Utimer timer;
+    miuchiz_utimer_start(&timer);
+
+    // Hashing and storing happen here, while the device thread reads on
+    int next_page = pages.first;
+    int added = 0;
+    struct PageSlot* slot;
+    while ((slot = page_ring_take(ring)) != NULL) {
+        int pagenum = slot->page;
+
+        miuchiz_utimer_end(&timer);
+        int seconds = miuchiz_utimer_elapsed(&timer) / 1000000;
+        int minutes = seconds / 60;
+        seconds = seconds % 60;
+        int done = pagenum - pages.first + 1;
+        printf("\r[%02d:%02d] Reading page %d/%d (%d%%)",
+               minutes,
+               seconds,
+               done,
+               page_range_count(pages),
+               (100 * done) / page_range_count(pages));
+        fflush(stdout);
+
+        if (slot->status != 0) {
+            printf("\rReading of page %d has failed too many times.\n", pagenum);
+            page_ring_release(ring);
+            break;
+        }
+
+        unsigned char hash[MIUCHIZ_SHA256_SIZE];
+        miuchiz_sha256(slot->data, sizeof(slot->data), hash);
+        if (state != NULL && miuchiz_flash_state_set(state, pagenum, hash) != 0) {
+            miuchiz_flash_state_close(state);
+            state = NULL;
+        }
+        int stored = snapshot_store_put(store, slot->data, hash);
+        if (stored < 0 || container_writer_page(manifest, pagenum, slot->data, slot->flags | CONTAINER_PAGE_STORED) != 0) {
+            printf("\rStoring page %d failed. [%d] %s\n", pagenum, errno, strerror(errno));
+            page_ring_release(ring);
+            break;
+        }
+        added += stored;
+        page_ring_release(ring);
+        next_page++;
+    }
+
+    // Stops the device thread early if this side gave up
+    page_ring_cancel(ring);
+    page_worker_join(worker);
+    page_ring_destroy(ring);
+    miuchiz_flash_state_close(state);
+
+    int finished = container_writer_finish(manifest) == 0;
+    finished = fclose(fp) == 0 && finished;
+    fp = NULL;
+    if (next_page <= pages.last || !finished || rename(partial, path) != 0) {
+        if (next_page > pages.last) {
+            printf("\nWriting %s failed. [%d] %s\n", path, errno, strerror(errno));
+        }
+        remove(partial);
+        result = 1;
+        goto leave_manifest;
+    }
+    printf("\nSnapshot %s: %d pages, %d of them new to the store.\n", name, page_range_count(pages), added);
+
+leave_manifest:
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    free(path);
+    free(partial);
+
+leave_handhelds:
+    miuchiz_handheld_destroy_all(handhelds);
+
+leave_store:
+    snapshot_store_close(store);
+
+leave_args:
+    args_free(&args);
+
+    return result;
+}
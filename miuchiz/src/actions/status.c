@@ -3,10 +3,34 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 
 static const char* units[] = {"Cloe", "Yasmin", "Spike", "Dash", "Roc", "Creeper", "Inferno"};
 
+/* Reads what status shows of a handheld. One that cannot be fingerprinted
+ * (its OTP is unreadable) still has a save page worth showing, read as
+ * plainly as before identities; only its fingerprint is left empty. */
+static int read_identity(struct Handheld* handheld, struct HandheldIdentity* identity) {
+    /* Always refresh: the save page is mutable, and reading it here also
+     * keeps the library's identity cache for this handheld current. */
+    if (miuchiz_handheld_identity(handheld, identity, 1) == 0) {
+        return 0;
+    }
+
+    memset(identity, 0, sizeof(*identity));
+    if (miuchiz_handheld_read_page(handheld, MIUCHIZ_SAVE_PAGE, identity->save_page, sizeof(identity->save_page)) < 0) {
+        return -1;
+    }
+    identity->has_save_page = 1;
+
+    /* There's not really a cleaner way to do this without mapping
+     * out the entire page as a struct. */
+    identity->firmware_version = miuchiz_le16_read(identity->save_page + 0x9A4);
+    identity->character = identity->save_page[0x9A8];
+    return 0;
+}
+
 int status_main(int argc, char** argv) {
     // status takes no arguments; the action interface mandates this signature.
     (void)argc;
@@ -26,22 +50,23 @@ int status_main(int argc, char** argv) {
     for (int i = 0; i < handheld_count; i++) {
         struct Handheld* handheld = handhelds[i];
 
-        char page[MIUCHIZ_PAGE_SIZE] = { 0 };
-
-        /* There's not really a cleaner way to do this without mapping
-         * out the entire page as a struct. */ 
-        miuchiz_handheld_read_page(handheld, 0x1FF, page, sizeof(page));
+        struct HandheldIdentity identity;
+        if (read_identity(handheld, &identity) != 0) {
+            printf("Device: %s; Unreadable\n", handheld->device);
+            continue;
+        }
 
-        uint16_t major_version = miuchiz_le16_read((const unsigned char*)&page[0x9A4]);
+        uint16_t major_version = identity.firmware_version;
         uint8_t major_version_upper = (major_version >> 8) & 0xFF;
         uint8_t major_version_lower = major_version & 0xFF;
-        uint8_t unit_id = page[0x9A8];
+        uint8_t unit_id = identity.character;
         const char* unit = unit_id < (sizeof(units) / sizeof(*units)) ? units[unit_id] : "Unknown";
 
-        printf("Device: %s; Major version: %d.%02d; Character: %s\n", 
+        printf("Device: %s; Major version: %d.%02d; Character: %s; Fingerprint: %s\n", 
                 handheld->device,
                 major_version_upper, major_version_lower,
-                unit);
+                unit,
+                identity.fingerprint[0] != '\0' ? identity.fingerprint : "Unknown");
     }
 
     miuchiz_handheld_destroy_all(handhelds);
@@ -0,0 +1,127 @@
+#include "blank-map.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+
+/* Map file:
+ *   [0-3]   "MZBM"
+ *   [4-5]   format version
+ *   [6-7]   number of pages
+ *   [8-71]  a bit per page, lowest bit first, set if the page is erased */
+#define BLANK_MAP_MAGIC "MZBM"
+#define BLANK_MAP_FORMAT_VERSION (1)
+#define BLANK_MAP_HEADER_SIZE (8)
+#define BLANK_MAP_SUFFIX ".blank"
+
+int blank_page_fill(const unsigned char* data) {
+    // Eight words a round, without branches inside, which compilers turn
+    // into vector loads; a round that sees both kinds of word ends it
+    uint64_t any = 0;
+    uint64_t all = UINT64_MAX;
+    for (size_t i = 0; i < MIUCHIZ_PAGE_SIZE; i += 8 * sizeof(uint64_t)) {
+        uint64_t words[8];
+        memcpy(words, data + i, sizeof(words));
+        for (int k = 0; k < 8; k++) {
+            any |= words[k];
+            all &= words[k];
+        }
+        if (any != 0 && all != UINT64_MAX) {
+            return BLANK_PAGE_MIXED;
+        }
+    }
+    return any == 0 ? 0x00 : 0xFF;
+}
+
+void blank_map_clear(struct BlankMap* map) {
+    memset(map->erased, 0, sizeof(map->erased));
+    memset(map->erased_page, 0xFF, sizeof(map->erased_page));
+}
+
+static char* map_path(const char* image_path) {
+    char* path = malloc(strlen(image_path) + sizeof(BLANK_MAP_SUFFIX));
+    if (path != NULL) {
+        strcpy(path, image_path);
+        strcat(path, BLANK_MAP_SUFFIX);
+    }
+    return path;
+}
+
+int blank_map_load(const char* image_path, struct BlankMap* map) {
+    blank_map_clear(map);
+    char* path = map_path(image_path);
+    if (path == NULL) {
+        return -1;
+    }
+    FILE* fp = fopen(path, "rb");
+    free(path);
+    if (fp == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    unsigned char header[BLANK_MAP_HEADER_SIZE];
+    int ok = fread(header, 1, sizeof(header), fp) == sizeof(header)
+             && memcmp(header, BLANK_MAP_MAGIC, 4) == 0
+             && miuchiz_le16_read(header + 4) == BLANK_MAP_FORMAT_VERSION
+             && miuchiz_le16_read(header + 6) == MIUCHIZ_PAGE_COUNT
+             && fread(map->erased, 1, sizeof(map->erased), fp) == sizeof(map->erased);
+    fclose(fp);
+    if (!ok) {
+        memset(map->erased, 0, sizeof(map->erased));
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+int blank_map_save(const char* image_path, const struct BlankMap* map) {
+    char* path = map_path(image_path);
+    if (path == NULL) {
+        return -1;
+    }
+
+    int any = 0;
+    for (size_t i = 0; i < sizeof(map->erased); i++) {
+        any |= map->erased[i];
+    }
+    if (!any) {
+        int result = remove(path) != 0 && errno != ENOENT ? -1 : 0;
+        free(path);
+        return result;
+    }
+
+    FILE* fp = fopen(path, "wb");
+    free(path);
+    if (fp == NULL) {
+        return -1;
+    }
+    unsigned char header[BLANK_MAP_HEADER_SIZE];
+    memcpy(header, BLANK_MAP_MAGIC, 4);
+    miuchiz_le16_write(header + 4, BLANK_MAP_FORMAT_VERSION);
+    miuchiz_le16_write(header + 6, MIUCHIZ_PAGE_COUNT);
+    int ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header)
+             && fwrite(map->erased, 1, sizeof(map->erased), fp) == sizeof(map->erased);
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+    return ok ? 0 : -1;
+}
+
+int blank_map_get(const struct BlankMap* map, int page) {
+    return (map->erased[page / 8] >> (page % 8)) & 1;
+}
+
+void blank_map_set(struct BlankMap* map, int page, int erased) {
+    if (erased) {
+        map->erased[page / 8] |= (unsigned char)(1u << (page % 8));
+    }
+    else {
+        map->erased[page / 8] &= (unsigned char)~(1u << (page % 8));
+    }
+}
+
+const unsigned char* blank_map_page(const struct BlankMap* map, const unsigned char* image, int page) {
+    return blank_map_get(map, page) ? map->erased_page : image + (size_t)page * MIUCHIZ_PAGE_SIZE;
+}
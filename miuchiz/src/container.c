@@ -0,0 +1,411 @@
+#include "container.h"
+#include "page-codec.h"
+#include "blank-map.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Container file, little-endian throughout:
+ *   Header:
+ *   [0-3]   "MZDC"
+ *   [4-5]   format version
+ *   [6-7]   header size
+ *   [8-23]  handheld fingerprint, NUL padded
+ *   [24-25] firmware version
+ *   [26]    character
+ *   [27]    flags (bit 0 = firmware version and character are known)
+ *   [28-29] first page of the dump
+ *   [30-31] last page of the dump
+ *   [32-39] created (Unix time)
+ *   [40-55] tool version, NUL padded
+ *   [56-63] reserved
+ *   Then the stored bytes of each page, as is or, if packed, coded; then the
+ *   index, one entry per page held, in page order. Entries of identical
+ *   pages may share stored bytes, and blank or zero pages may store none,
+ *   as do pages kept outside the container.
+ *   [0-1]   page
+ *   [2-3]   flags
+ *   [4-7]   stored length
+ *   [8-15]  offset of the stored bytes
+ *   [16-47] SHA-256 of the page
+ *   Then the trailer, which ends the file:
+ *   [0-3]   "MZDI"
+ *   [4-7]   number of index entries
+ *   [8-15]  offset of the index
+ *   [16-31] first 16 bytes of the SHA-256 of the index */
+#define CONTAINER_MAGIC "MZDC"
+#define CONTAINER_INDEX_MAGIC "MZDI"
+#define CONTAINER_FORMAT_VERSION (1)
+#define CONTAINER_HEADER_SIZE (64)
+#define CONTAINER_ENTRY_SIZE (48)
+#define CONTAINER_TRAILER_SIZE (32)
+#define CONTAINER_INDEX_HASH_SIZE (16)
+#define CONTAINER_HEADER_FLAG_IDENTITY (0x01)
+
+static void le64_write(unsigned char* bytes, uint64_t value) {
+    miuchiz_le32_write(bytes, (uint32_t)(value & 0xFFFFFFFF));
+    miuchiz_le32_write(bytes + 4, (uint32_t)(value >> 32));
+}
+
+static uint64_t le64_read(const unsigned char* bytes) {
+    return (uint64_t)miuchiz_le32_read(bytes) | ((uint64_t)miuchiz_le32_read(bytes + 4) << 32);
+}
+
+struct ContainerWriter {
+    FILE* fp;
+    struct ContainerInfo info;
+    uint64_t offset; /* bytes written so far */
+    unsigned int options;
+    int count;
+    struct ContainerPage pages[MIUCHIZ_PAGE_COUNT];
+};
+
+static int write_all(struct ContainerWriter* writer, const void* data, size_t n) {
+    if (fwrite(data, 1, n, writer->fp) != n) {
+        return -1;
+    }
+    writer->offset += n;
+    return 0;
+}
+
+struct ContainerWriter* container_writer_open(FILE* fp, const struct ContainerInfo* info, unsigned int options) {
+    struct ContainerWriter* writer = calloc(1, sizeof(struct ContainerWriter));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->fp = fp;
+    writer->info = *info;
+    writer->options = options;
+
+    unsigned char header[CONTAINER_HEADER_SIZE] = { 0 };
+    memcpy(header, CONTAINER_MAGIC, 4);
+    miuchiz_le16_write(header + 4, CONTAINER_FORMAT_VERSION);
+    miuchiz_le16_write(header + 6, CONTAINER_HEADER_SIZE);
+    memcpy(header + 8, info->fingerprint, strnlen(info->fingerprint, MIUCHIZ_FINGERPRINT_LENGTH));
+    miuchiz_le16_write(header + 24, info->firmware_version);
+    header[26] = info->character;
+    header[27] = info->has_identity ? CONTAINER_HEADER_FLAG_IDENTITY : 0;
+    miuchiz_le16_write(header + 28, (uint16_t)info->pages.first);
+    miuchiz_le16_write(header + 30, (uint16_t)info->pages.last);
+    le64_write(header + 32, info->created);
+    memcpy(header + 40, info->tool_version, strnlen(info->tool_version, sizeof(info->tool_version)));
+    if (write_all(writer, header, sizeof(header)) != 0) {
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+int container_writer_page(struct ContainerWriter* writer, int page, const unsigned char* data, unsigned int flags) {
+    int previous = writer->count > 0 ? writer->pages[writer->count - 1].page : writer->info.pages.first - 1;
+    if (page <= previous || page > writer->info.pages.last) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct ContainerPage* entry = &writer->pages[writer->count];
+    entry->page = page;
+    entry->flags = flags & (CONTAINER_PAGE_RETRIED | CONTAINER_PAGE_VERIFIED | CONTAINER_PAGE_STORED);
+    int fill = blank_page_fill(data);
+    if (fill == 0xFF) {
+        entry->flags |= CONTAINER_PAGE_BLANK;
+    }
+    else if (fill == 0x00) {
+        entry->flags |= CONTAINER_PAGE_ZERO;
+    }
+    entry->length = MIUCHIZ_PAGE_SIZE;
+    entry->offset = writer->offset;
+    miuchiz_sha256(data, MIUCHIZ_PAGE_SIZE, entry->hash);
+
+    if ((entry->flags & CONTAINER_PAGE_STORED)
+        || ((writer->options & CONTAINER_WRITE_SPARSE) && fill != BLANK_PAGE_MIXED)) {
+        entry->length = 0;
+        writer->count++;
+        return 0;
+    }
+
+    if (writer->options & CONTAINER_WRITE_PACK) {
+        // A page seen before points at its earlier copy
+        for (int i = 0; i < writer->count; i++) {
+            const struct ContainerPage* earlier = &writer->pages[i];
+            if (memcmp(earlier->hash, entry->hash, MIUCHIZ_SHA256_SIZE) == 0) {
+                entry->flags |= earlier->flags & CONTAINER_PAGE_PACKED;
+                entry->length = earlier->length;
+                entry->offset = earlier->offset;
+                writer->count++;
+                return 0;
+            }
+        }
+
+        unsigned char coded[PAGE_CODEC_BOUND];
+        size_t length = page_codec_encode(data, coded);
+        if (length < MIUCHIZ_PAGE_SIZE) {
+            entry->flags |= CONTAINER_PAGE_PACKED;
+            entry->length = (uint32_t)length;
+            if (write_all(writer, coded, length) != 0) {
+                return -1;
+            }
+            writer->count++;
+            return 0;
+        }
+    }
+
+    if (write_all(writer, data, MIUCHIZ_PAGE_SIZE) != 0) {
+        return -1;
+    }
+    writer->count++;
+    return 0;
+}
+
+int container_writer_finish(struct ContainerWriter* writer) {
+    struct Sha256 ctx;
+    miuchiz_sha256_init(&ctx);
+    uint64_t index_offset = writer->offset;
+    int result = 0;
+
+    for (int i = 0; result == 0 && i < writer->count; i++) {
+        struct ContainerPage* entry = &writer->pages[i];
+        unsigned char bytes[CONTAINER_ENTRY_SIZE];
+        miuchiz_le16_write(bytes, (uint16_t)entry->page);
+        miuchiz_le16_write(bytes + 2, (uint16_t)entry->flags);
+        miuchiz_le32_write(bytes + 4, entry->length);
+        le64_write(bytes + 8, entry->offset);
+        memcpy(bytes + 16, entry->hash, MIUCHIZ_SHA256_SIZE);
+        miuchiz_sha256_update(&ctx, bytes, sizeof(bytes));
+        result = write_all(writer, bytes, sizeof(bytes));
+    }
+
+    unsigned char digest[MIUCHIZ_SHA256_SIZE];
+    miuchiz_sha256_final(&ctx, digest);
+    unsigned char trailer[CONTAINER_TRAILER_SIZE];
+    memcpy(trailer, CONTAINER_INDEX_MAGIC, 4);
+    miuchiz_le32_write(trailer + 4, (uint32_t)writer->count);
+    le64_write(trailer + 8, index_offset);
+    memcpy(trailer + 16, digest, CONTAINER_INDEX_HASH_SIZE);
+    if (result == 0) {
+        result = write_all(writer, trailer, sizeof(trailer));
+    }
+    if (result == 0 && fflush(writer->fp) != 0) {
+        result = -1;
+    }
+    free(writer);
+    return result;
+}
+
+struct Container {
+    FILE* fp;
+    struct ContainerInfo info;
+    int count;
+    uint64_t data_size;
+    ContainerPageSource source;
+    void* source_context;
+    struct ContainerPage pages[MIUCHIZ_PAGE_COUNT];
+};
+
+int container_detect(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    unsigned char magic[4];
+    int result = 0;
+    if (fp != NULL) {
+        result = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && memcmp(magic, CONTAINER_MAGIC, 4) == 0;
+        fclose(fp);
+    }
+    return result;
+}
+
+/* Reads the header, trailer and index, checking they fit together. */
+static int container_load(struct Container* container) {
+    FILE* fp = container->fp;
+    unsigned char header[CONTAINER_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header)
+        || memcmp(header, CONTAINER_MAGIC, 4) != 0
+        || miuchiz_le16_read(header + 4) != CONTAINER_FORMAT_VERSION
+        || miuchiz_le16_read(header + 6) != CONTAINER_HEADER_SIZE) {
+        return -1;
+    }
+    struct ContainerInfo* info = &container->info;
+    memcpy(info->fingerprint, header + 8, MIUCHIZ_FINGERPRINT_LENGTH);
+    info->firmware_version = miuchiz_le16_read(header + 24);
+    info->character = header[26];
+    info->has_identity = (header[27] & CONTAINER_HEADER_FLAG_IDENTITY) != 0;
+    info->pages.first = miuchiz_le16_read(header + 28);
+    info->pages.last = miuchiz_le16_read(header + 30);
+    info->created = le64_read(header + 32);
+    memcpy(info->tool_version, header + 40, sizeof(info->tool_version) - 1);
+    if (info->pages.first > info->pages.last || info->pages.last >= MIUCHIZ_PAGE_COUNT) {
+        return -1;
+    }
+
+    unsigned char trailer[CONTAINER_TRAILER_SIZE];
+    if (fseek(fp, -CONTAINER_TRAILER_SIZE, SEEK_END) != 0) {
+        return -1;
+    }
+    long trailer_offset = ftell(fp);
+    if (trailer_offset < 0
+        || fread(trailer, 1, sizeof(trailer), fp) != sizeof(trailer)
+        || memcmp(trailer, CONTAINER_INDEX_MAGIC, 4) != 0) {
+        return -1;
+    }
+    uint32_t count = miuchiz_le32_read(trailer + 4);
+    uint64_t index_offset = le64_read(trailer + 8);
+    if (count > (uint32_t)page_range_count(info->pages)
+        || index_offset < CONTAINER_HEADER_SIZE
+        || index_offset + (uint64_t)count * CONTAINER_ENTRY_SIZE != (uint64_t)trailer_offset
+        || fseek(fp, (long)index_offset, SEEK_SET) != 0) {
+        return -1;
+    }
+
+    struct Sha256 ctx;
+    miuchiz_sha256_init(&ctx);
+    int previous = info->pages.first - 1;
+    for (uint32_t i = 0; i < count; i++) {
+        unsigned char bytes[CONTAINER_ENTRY_SIZE];
+        if (fread(bytes, 1, sizeof(bytes), fp) != sizeof(bytes)) {
+            return -1;
+        }
+        miuchiz_sha256_update(&ctx, bytes, sizeof(bytes));
+        struct ContainerPage* entry = &container->pages[i];
+        entry->page = miuchiz_le16_read(bytes);
+        entry->flags = miuchiz_le16_read(bytes + 2);
+        entry->length = miuchiz_le32_read(bytes + 4);
+        entry->offset = le64_read(bytes + 8);
+        memcpy(entry->hash, bytes + 16, MIUCHIZ_SHA256_SIZE);
+        int packed = (entry->flags & CONTAINER_PAGE_PACKED) != 0;
+        int blank = (entry->flags & (CONTAINER_PAGE_BLANK | CONTAINER_PAGE_ZERO | CONTAINER_PAGE_STORED)) != 0;
+        if (entry->page <= previous || entry->page > info->pages.last
+            || (entry->length == 0 ? !blank || packed
+                : packed ? entry->length > MIUCHIZ_PAGE_SIZE : entry->length != MIUCHIZ_PAGE_SIZE)
+            || ((entry->flags & CONTAINER_PAGE_STORED) && entry->length != 0)
+            || entry->offset < CONTAINER_HEADER_SIZE
+            || entry->offset + entry->length > index_offset) {
+            return -1;
+        }
+        previous = entry->page;
+    }
+    unsigned char digest[MIUCHIZ_SHA256_SIZE];
+    miuchiz_sha256_final(&ctx, digest);
+    if (memcmp(digest, trailer + 16, CONTAINER_INDEX_HASH_SIZE) != 0) {
+        return -1;
+    }
+    container->count = (int)count;
+    container->data_size = index_offset - CONTAINER_HEADER_SIZE;
+    return 0;
+}
+
+struct Container* container_open(const char* path) {
+    struct Container* container = calloc(1, sizeof(struct Container));
+    if (container == NULL) {
+        return NULL;
+    }
+    container->fp = fopen(path, "rb");
+    if (container->fp == NULL) {
+        int saved = errno;
+        free(container);
+        errno = saved;
+        return NULL;
+    }
+    if (container_load(container) != 0) {
+        container_close(container);
+        errno = EINVAL;
+        return NULL;
+    }
+    return container;
+}
+
+const struct ContainerInfo* container_info(struct Container* container) {
+    return &container->info;
+}
+
+int container_page_count(struct Container* container) {
+    return container->count;
+}
+
+uint64_t container_data_size(struct Container* container) {
+    return container->data_size;
+}
+
+const struct ContainerPage* container_page(struct Container* container, int n) {
+    return &container->pages[n];
+}
+
+const struct ContainerPage* container_find(struct Container* container, int page) {
+    // The index is in page order
+    int low = 0;
+    int high = container->count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (container->pages[mid].page == page) {
+            return &container->pages[mid];
+        }
+        if (container->pages[mid].page < page) {
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+int container_has_stored_pages(struct Container* container) {
+    for (int i = 0; i < container->count; i++) {
+        if (container->pages[i].flags & CONTAINER_PAGE_STORED) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void container_set_source(struct Container* container, ContainerPageSource source, void* context) {
+    container->source = source;
+    container->source_context = context;
+}
+
+int container_read_page(struct Container* container, int page, unsigned char* data) {
+    const struct ContainerPage* entry = container_find(container, page);
+    if (entry == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    // A page kept elsewhere comes from the source; a blank page stored as
+    // nothing is its flags; a packed page is read into the stack and
+    // decoded into place
+    unsigned char coded[MIUCHIZ_PAGE_SIZE];
+    int packed = (entry->flags & CONTAINER_PAGE_PACKED) != 0;
+    if (entry->flags & CONTAINER_PAGE_STORED) {
+        if (container->source == NULL) {
+            errno = ENOENT;
+            return -1;
+        }
+        if (container->source(container->source_context, entry->hash, data) != 0) {
+            return -1;
+        }
+    }
+    else if (entry->length == 0) {
+        memset(data, (entry->flags & CONTAINER_PAGE_BLANK) ? 0xFF : 0x00, MIUCHIZ_PAGE_SIZE);
+    }
+    else if (fseek(container->fp, (long)entry->offset, SEEK_SET) != 0
+             || fread(packed ? coded : data, 1, entry->length, container->fp) != entry->length) {
+        errno = EIO;
+        return -1;
+    }
+    if (packed && page_codec_decode(coded, entry->length, data) != 0) {
+        errno = EILSEQ;
+        return -1;
+    }
+    unsigned char hash[MIUCHIZ_SHA256_SIZE];
+    miuchiz_sha256(data, MIUCHIZ_PAGE_SIZE, hash);
+    if (memcmp(hash, entry->hash, sizeof(hash)) != 0) {
+        errno = EILSEQ;
+        return -1;
+    }
+    return 0;
+}
+
+void container_close(struct Container* container) {
+    if (container != NULL) {
+        fclose(container->fp);
+        free(container);
+    }
+}
@@ -0,0 +1,41 @@
+#include "device-reader.h"
+#include "container.h"
+
+#include <string.h>
+
+int device_reader_run(void* arg) {
+    struct DeviceReader* reader = arg;
+    struct PageSlot* slot;
+    unsigned char again[MIUCHIZ_PAGE_SIZE];
+    for (int pagenum = reader->first; pagenum <= reader->last && (slot = page_ring_claim(reader->ring)) != NULL; pagenum++) {
+        slot->page = pagenum;
+        slot->status = 1;
+        slot->flags = 0;
+        for (int retry = 0; retry < 5; retry++) {
+            if (retry > 0) {
+                slot->flags |= CONTAINER_PAGE_RETRIED;
+            }
+            int read_result = miuchiz_handheld_read_page(reader->handheld, pagenum, slot->data, sizeof(slot->data));
+            if (read_result == MIUCHIZ_ERROR_IO) {
+                fprintf(reader->messages, "\rReading of page %d failed. Retrying.\n", pagenum);
+                continue;
+            }
+            if (reader->verify) {
+                read_result = miuchiz_handheld_read_page(reader->handheld, pagenum, again, sizeof(again));
+                if (read_result == MIUCHIZ_ERROR_IO || memcmp(again, slot->data, sizeof(again)) != 0) {
+                    fprintf(reader->messages, "\rVerifying page %d failed. Retrying.\n", pagenum);
+                    continue;
+                }
+                slot->flags |= CONTAINER_PAGE_VERIFIED;
+            }
+            slot->status = 0;
+            break;
+        }
+        page_ring_publish(reader->ring);
+        if (slot->status != 0) {
+            break;
+        }
+    }
+    page_ring_close(reader->ring);
+    return 0;
+}
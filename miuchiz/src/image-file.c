@@ -0,0 +1,287 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+    #define _GNU_SOURCE // fallocate
+#endif
+
+#include "image-file.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(_WIN32)
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+#endif
+
+struct ImageFile {
+    unsigned char* data;
+    size_t size;
+#if defined(_WIN32)
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+};
+
+#if defined(_WIN32)
+
+static struct ImageFile* image_file_map(HANDLE file, size_t size, int writable) {
+    struct ImageFile* image = calloc(1, sizeof(struct ImageFile));
+    HANDLE mapping = NULL;
+    void* data = NULL;
+    if (image != NULL && size > 0) {
+        mapping = CreateFileMapping(file, NULL, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, NULL);
+    }
+    if (mapping != NULL) {
+        data = MapViewOfFile(mapping, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, size);
+    }
+    if (data == NULL) {
+        if (mapping != NULL) {
+            CloseHandle(mapping);
+        }
+        CloseHandle(file);
+        free(image);
+        errno = EIO;
+        return NULL;
+    }
+    image->data = data;
+    image->size = size;
+    image->file = file;
+    image->mapping = mapping;
+    return image;
+}
+
+struct ImageFile* image_file_open(const char* path) {
+    HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if (file == INVALID_HANDLE_VALUE) {
+        errno = ENOENT;
+        return NULL;
+    }
+    if (GetFileType(file) != FILE_TYPE_DISK || !GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        errno = EINVAL;
+        return NULL;
+    }
+    return image_file_map(file, (size_t)size.QuadPart, 0);
+}
+
+static struct ImageFile* image_file_create_as(const char* path, size_t size, int sparse) {
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)size;
+    DWORD returned;
+    if (file == INVALID_HANDLE_VALUE) {
+        errno = EACCES;
+        return NULL;
+    }
+    if (GetFileType(file) != FILE_TYPE_DISK) {
+        CloseHandle(file);
+        errno = EINVAL;
+        return NULL;
+    }
+    // Setting the end of the file allocates its space, unless it is sparse;
+    // a filesystem without sparse files allocates it anyway
+    if (sparse) {
+        DeviceIoControl(file, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &returned, NULL);
+    }
+    if (!SetFilePointerEx(file, end, NULL, FILE_BEGIN) || !SetEndOfFile(file)) {
+        CloseHandle(file);
+        errno = EINVAL;
+        return NULL;
+    }
+    return image_file_map(file, size, 1);
+}
+
+struct ImageFile* image_file_reopen(const char* path, size_t size) {
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER end;
+    end.QuadPart = (LONGLONG)size;
+    if (file == INVALID_HANDLE_VALUE) {
+        errno = ENOENT;
+        return NULL;
+    }
+    if (GetFileType(file) != FILE_TYPE_DISK || !SetFilePointerEx(file, end, NULL, FILE_BEGIN) || !SetEndOfFile(file)) {
+        CloseHandle(file);
+        errno = EINVAL;
+        return NULL;
+    }
+    return image_file_map(file, size, 1);
+}
+
+void image_file_discard(struct ImageFile* image, size_t offset, size_t length) {
+    FILE_ZERO_DATA_INFORMATION zero;
+    DWORD returned;
+    zero.FileOffset.QuadPart = (LONGLONG)offset;
+    zero.BeyondFinalZero.QuadPart = (LONGLONG)(offset + length);
+    if (!DeviceIoControl(image->file, FSCTL_SET_ZERO_DATA, &zero, sizeof(zero), NULL, 0, &returned, NULL)) {
+        memset(image->data + offset, 0, length);
+    }
+}
+
+int image_file_sync(struct ImageFile* image) {
+    return FlushViewOfFile(image->data, image->size) ? 0 : -1;
+}
+
+void image_file_close(struct ImageFile* image) {
+    if (image != NULL) {
+        UnmapViewOfFile(image->data);
+        CloseHandle(image->mapping);
+        CloseHandle(image->file);
+        free(image);
+    }
+}
+
+void image_file_close_at(struct ImageFile* image, size_t length) {
+    if (image != NULL) {
+        UnmapViewOfFile(image->data);
+        CloseHandle(image->mapping);
+        LARGE_INTEGER end;
+        end.QuadPart = (LONGLONG)length;
+        if (SetFilePointerEx(image->file, end, NULL, FILE_BEGIN)) {
+            SetEndOfFile(image->file);
+        }
+        CloseHandle(image->file);
+        free(image);
+    }
+}
+
+#else
+
+static struct ImageFile* image_file_map(int fd, size_t size, int writable) {
+    struct ImageFile* image = calloc(1, sizeof(struct ImageFile));
+    void* data = MAP_FAILED;
+    if (image != NULL && size > 0) {
+        data = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (data == MAP_FAILED) {
+        int saved = image == NULL ? ENOMEM : size == 0 ? EINVAL : errno;
+        close(fd);
+        free(image);
+        errno = saved;
+        return NULL;
+    }
+    image->data = data;
+    image->size = size;
+    image->fd = fd;
+    return image;
+}
+
+struct ImageFile* image_file_open(const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    return image_file_map(fd, (size_t)st.st_size, 0);
+}
+
+static struct ImageFile* image_file_create_as(const char* path, size_t size, int sparse) {
+    // Pipes and devices cannot be mapped, and opening one has side effects
+    struct stat st;
+    if (stat(path, &st) == 0 && !S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (ftruncate(fd, (off_t)size) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+#if !defined(__APPLE__)
+    // Claim the blocks now, so a full disk fails here rather than as a
+    // SIGBUS halfway through writing the mapping
+    int err = sparse ? 0 : posix_fallocate(fd, 0, (off_t)size);
+    if (err != 0 && err != EINVAL && err != EOPNOTSUPP) {
+        close(fd);
+        errno = err;
+        return NULL;
+    }
+#endif
+    return image_file_map(fd, size, 1);
+}
+
+struct ImageFile* image_file_reopen(const char* path, size_t size) {
+    int fd = open(path, O_RDWR);
+    struct stat st;
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    if ((size_t)st.st_size != size && ftruncate(fd, (off_t)size) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return NULL;
+    }
+    return image_file_map(fd, size, 1);
+}
+
+void image_file_discard(struct ImageFile* image, size_t offset, size_t length) {
+#if defined(__linux__)
+    if (fallocate(image->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)length) == 0) {
+        return;
+    }
+#endif
+    memset(image->data + offset, 0, length);
+}
+
+int image_file_sync(struct ImageFile* image) {
+    return msync(image->data, image->size, MS_SYNC);
+}
+
+void image_file_close(struct ImageFile* image) {
+    if (image != NULL) {
+        munmap(image->data, image->size);
+        close(image->fd);
+        free(image);
+    }
+}
+
+void image_file_close_at(struct ImageFile* image, size_t length) {
+    if (image != NULL) {
+        munmap(image->data, image->size);
+        if (ftruncate(image->fd, (off_t)length) != 0) {
+            // The file keeps its full size; nothing better to do
+        }
+        close(image->fd);
+        free(image);
+    }
+}
+
+#endif
+
+struct ImageFile* image_file_create(const char* path, size_t size) {
+    return image_file_create_as(path, size, 0);
+}
+
+struct ImageFile* image_file_create_sparse(const char* path, size_t size) {
+    return image_file_create_as(path, size, 1);
+}
+
+unsigned char* image_file_data(struct ImageFile* image) {
+    return image->data;
+}
+
+size_t image_file_size(struct ImageFile* image) {
+    return image->size;
+}
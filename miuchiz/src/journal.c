@@ -0,0 +1,205 @@
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(_WIN32)
+    #include <windows.h>
+#endif
+
+/* Journal file: a fixed little-endian header followed by one record per
+ * completed page, in page order. Records are appended as pages complete,
+ * so a run that is killed leaves at worst a torn last record, which is
+ * ignored.
+ *   Header:
+ *   [0-3]   "MZJN"
+ *   [4-5]   format version
+ *   [6-7]   kind (JOURNAL_DUMP or JOURNAL_LOAD)
+ *   [8-23]  handheld fingerprint, NUL padded
+ *   [24-25] first page of the range
+ *   [26-27] last page of the range
+ *   [28-31] reserved
+ *   Record:
+ *   [0-3]   page number
+ *   [4-35]  SHA-256 of the page */
+#define JOURNAL_MAGIC "MZJN"
+#define JOURNAL_FORMAT_VERSION (1)
+#define JOURNAL_HEADER_SIZE (32)
+#define JOURNAL_RECORD_SIZE (4 + MIUCHIZ_SHA256_SIZE)
+
+struct Journal {
+    char* path;
+    FILE* fp;
+    int kind;
+    char fingerprint[MIUCHIZ_FINGERPRINT_LENGTH + 1];
+    struct PageRange range;
+    int next;
+    unsigned char hashes[MIUCHIZ_PAGE_COUNT][MIUCHIZ_SHA256_SIZE];
+};
+
+/* Reads the pages an earlier run completed. */
+static int journal_load(struct Journal* journal) {
+    FILE* fp = fopen(journal->path, "rb");
+    if (fp == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+
+    unsigned char header[JOURNAL_HEADER_SIZE];
+    char fingerprint[MIUCHIZ_FINGERPRINT_LENGTH + 1] = { 0 };
+    if (fread(header, 1, sizeof(header), fp) != sizeof(header)
+        || memcmp(header, JOURNAL_MAGIC, 4) != 0
+        || miuchiz_le16_read(header + 4) != JOURNAL_FORMAT_VERSION
+        || miuchiz_le16_read(header + 6) != journal->kind
+        || miuchiz_le16_read(header + 24) != journal->range.first
+        || miuchiz_le16_read(header + 26) != journal->range.last) {
+        fclose(fp);
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(fingerprint, header + 8, MIUCHIZ_FINGERPRINT_LENGTH);
+    if (strcmp(fingerprint, journal->fingerprint) != 0) {
+        fclose(fp);
+        errno = EINVAL;
+        return -1;
+    }
+
+    unsigned char record[JOURNAL_RECORD_SIZE];
+    while (journal->next <= journal->range.last
+           && fread(record, 1, sizeof(record), fp) == sizeof(record)
+           && miuchiz_le32_read(record) == (uint32_t)journal->next) {
+        memcpy(journal->hashes[journal->next], record + 4, MIUCHIZ_SHA256_SIZE);
+        journal->next++;
+    }
+    fclose(fp);
+    return 0;
+}
+
+struct Journal* journal_open(const char* image_path, int kind, const char* fingerprint,
+                             struct PageRange range, int resume) {
+    struct Journal* journal = calloc(1, sizeof(struct Journal));
+    if (journal == NULL) {
+        return NULL;
+    }
+    journal->path = malloc(strlen(image_path) + sizeof(".journal"));
+    if (journal->path == NULL) {
+        free(journal);
+        return NULL;
+    }
+    strcpy(journal->path, image_path);
+    strcat(journal->path, ".journal");
+    journal->kind = kind;
+    journal->range = range;
+    journal->next = range.first;
+    strncpy(journal->fingerprint, fingerprint, MIUCHIZ_FINGERPRINT_LENGTH);
+
+    if (resume && journal_load(journal) != 0) {
+        int saved = errno;
+        free(journal->path);
+        free(journal);
+        errno = saved;
+        return NULL;
+    }
+    return journal;
+}
+
+int journal_next(struct Journal* journal) {
+    return journal->next;
+}
+
+const unsigned char* journal_hash(struct Journal* journal, int page) {
+    return journal->hashes[page];
+}
+
+/* Renames `from` over `to`, which rename alone will not do on Windows. */
+static int replace_file(const char* from, const char* to) {
+#if defined(_WIN32)
+    return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#else
+    return rename(from, to);
+#endif
+}
+
+int journal_begin(struct Journal* journal, int page) {
+    /* Rewritten whole beside the journal and renamed over it, so records past
+     * `page` from an earlier run are gone, and a crash part way leaves the
+     * earlier journal as it was. */
+    char* tmp_path = malloc(strlen(journal->path) + sizeof(".tmp"));
+    if (tmp_path == NULL) {
+        return -1;
+    }
+    strcpy(tmp_path, journal->path);
+    strcat(tmp_path, ".tmp");
+    FILE* fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        free(tmp_path);
+        return -1;
+    }
+
+    unsigned char header[JOURNAL_HEADER_SIZE] = { 0 };
+    memcpy(header, JOURNAL_MAGIC, 4);
+    miuchiz_le16_write(header + 4, JOURNAL_FORMAT_VERSION);
+    miuchiz_le16_write(header + 6, (uint16_t)journal->kind);
+    memcpy(header + 8, journal->fingerprint, strlen(journal->fingerprint));
+    miuchiz_le16_write(header + 24, (uint16_t)journal->range.first);
+    miuchiz_le16_write(header + 26, (uint16_t)journal->range.last);
+    int ok = fwrite(header, 1, sizeof(header), fp) == sizeof(header);
+
+    journal->next = journal->range.first;
+    unsigned char record[JOURNAL_RECORD_SIZE];
+    for (int i = journal->range.first; ok && i < page; i++) {
+        miuchiz_le32_write(record, (uint32_t)i);
+        memcpy(record + 4, journal->hashes[i], MIUCHIZ_SHA256_SIZE);
+        ok = fwrite(record, 1, sizeof(record), fp) == sizeof(record);
+        journal->next++;
+    }
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+    if (!ok || replace_file(tmp_path, journal->path) != 0) {
+        int saved = errno;
+        remove(tmp_path);
+        free(tmp_path);
+        errno = saved;
+        return -1;
+    }
+    free(tmp_path);
+
+    // Records are appended from here on
+    journal->fp = fopen(journal->path, "ab");
+    return journal->fp != NULL ? 0 : -1;
+}
+
+int journal_record(struct Journal* journal, int page, const unsigned char hash[MIUCHIZ_SHA256_SIZE]) {
+    if (journal->fp == NULL || page != journal->next) {
+        return -1;
+    }
+
+    unsigned char record[JOURNAL_RECORD_SIZE];
+    miuchiz_le32_write(record, (uint32_t)page);
+    memcpy(record + 4, hash, MIUCHIZ_SHA256_SIZE);
+    // Flushed per page, so the journal is never behind by more than the
+    // page in flight when the process is stopped
+    if (fwrite(record, 1, sizeof(record), journal->fp) != sizeof(record)
+        || fflush(journal->fp) != 0) {
+        return -1;
+    }
+    memcpy(journal->hashes[page], record + 4, MIUCHIZ_SHA256_SIZE);
+    journal->next++;
+    return 0;
+}
+
+void journal_close(struct Journal* journal, int finished) {
+    if (journal != NULL) {
+        if (journal->fp != NULL) {
+            fclose(journal->fp);
+        }
+        if (finished) {
+            remove(journal->path);
+        }
+        free(journal->path);
+        free(journal);
+    }
+}
@@ -1,9 +1,15 @@
+#include "actions/apply-patch.h"
+#include "actions/bench.h"
 #include "actions/dump-flash.h"
 #include "actions/dump-otp.h"
 #include "actions/eject.h"
+#include "actions/inspect.h"
 #include "actions/load-flash.h"
+#include "actions/make-patch.h"
 #include "actions/read-creditz.h"
+#include "actions/restore.h"
 #include "actions/set-creditz.h"
+#include "actions/snapshot.h"
 #include "actions/status.h"
 
 #include "libmiuchiz-usb.h"
@@ -20,12 +26,18 @@ struct action {
 };
 
 static struct action actions[] = {
+    {"apply-patch", apply_patch_main},
+    {"bench", bench_main},
     {"dump-flash", dump_flash_main},
     {"dump-otp", dump_otp_main},
     {"eject", eject_main},
+    {"inspect", inspect_main},
     {"load-flash", load_flash_main},
+    {"make-patch", make_patch_main},
     {"read-creditz", read_creditz_main},
+    {"restore", restore_main},
     {"set-creditz", set_creditz_main},
+    {"snapshot", snapshot_main},
     {"status", status_main},
     {NULL, NULL}
 };
@@ -0,0 +1,122 @@
+#include "page-codec.h"
+
+#include <stdint.h>
+#include <string.h>
+
+/* Coded page: a sequence of runs, each starting with a control byte.
+ *   0x00-0x7F: that many plus one literal bytes follow.
+ *   0x80-0xFE: a match of (control & 0x7F) + 4 bytes,
+ *   0xFF:      a match of 131 + the following 16-bit length bytes,
+ *   either followed by the 16-bit distance back to copy from. Matches may
+ *   overlap what they produce, so a distance of 1 repeats a byte. A match
+ *   always codes smaller than it is, which keeps PAGE_CODEC_BOUND. */
+#define LITERALS_MAX (128)
+#define MATCH_MIN (4)
+#define MATCH_SHORT_MAX (0x7E + MATCH_MIN)
+#define MATCH_LONG (0xFF)
+#define HASH_BITS (12)
+
+static unsigned int hash4(const unsigned char* p) {
+    uint32_t value = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+    return (value * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static size_t put_literals(unsigned char* out, size_t n, const unsigned char* literals, size_t count) {
+    while (count > 0) {
+        size_t run = count < LITERALS_MAX ? count : LITERALS_MAX;
+        out[n++] = (unsigned char)(run - 1);
+        memcpy(out + n, literals, run);
+        n += run;
+        literals += run;
+        count -= run;
+    }
+    return n;
+}
+
+size_t page_codec_encode(const unsigned char* page, unsigned char* out) {
+    // The latest position each 4-byte prefix was seen at, plus one
+    uint16_t heads[1 << HASH_BITS];
+    memset(heads, 0, sizeof(heads));
+
+    size_t n = 0;
+    size_t pending = 0; // where the literals not yet written start
+    size_t pos = 0;
+    while (pos + MATCH_MIN <= MIUCHIZ_PAGE_SIZE) {
+        unsigned int h = hash4(page + pos);
+        size_t candidate = heads[h];
+        heads[h] = (uint16_t)(pos + 1);
+
+        size_t length = 0;
+        if (candidate != 0) {
+            candidate--;
+            while (pos + length < MIUCHIZ_PAGE_SIZE && page[candidate + length] == page[pos + length]) {
+                length++;
+            }
+        }
+        if (length < MATCH_MIN) {
+            pos++;
+            continue;
+        }
+
+        n = put_literals(out, n, page + pending, pos - pending);
+        if (length <= MATCH_SHORT_MAX) {
+            out[n++] = (unsigned char)(0x80 | (length - MATCH_MIN));
+        }
+        else {
+            out[n++] = MATCH_LONG;
+            miuchiz_le16_write(out + n, (uint16_t)(length - MATCH_SHORT_MAX - 1));
+            n += 2;
+        }
+        miuchiz_le16_write(out + n, (uint16_t)(pos - candidate));
+        n += 2;
+
+        // Later matches may start anywhere within this one
+        size_t end = pos + length;
+        for (pos++; pos < end && pos + MATCH_MIN <= MIUCHIZ_PAGE_SIZE; pos++) {
+            heads[hash4(page + pos)] = (uint16_t)(pos + 1);
+        }
+        pos = end;
+        pending = end;
+    }
+    return put_literals(out, n, page + pending, MIUCHIZ_PAGE_SIZE - pending);
+}
+
+int page_codec_decode(const unsigned char* in, size_t length, unsigned char* page) {
+    size_t i = 0;
+    size_t pos = 0;
+    while (i < length) {
+        unsigned char control = in[i++];
+        if (control < 0x80) {
+            size_t count = (size_t)control + 1;
+            if (count > length - i || count > MIUCHIZ_PAGE_SIZE - pos) {
+                return -1;
+            }
+            memcpy(page + pos, in + i, count);
+            i += count;
+            pos += count;
+            continue;
+        }
+
+        size_t count = (size_t)(control & 0x7F) + MATCH_MIN;
+        if (control == MATCH_LONG) {
+            if (length - i < 2) {
+                return -1;
+            }
+            count = (size_t)miuchiz_le16_read(in + i) + MATCH_SHORT_MAX + 1;
+            i += 2;
+        }
+        if (length - i < 2) {
+            return -1;
+        }
+        size_t distance = miuchiz_le16_read(in + i);
+        i += 2;
+        if (distance == 0 || distance > pos || count > MIUCHIZ_PAGE_SIZE - pos) {
+            return -1;
+        }
+        // Byte by byte, as the match may overlap itself
+        for (size_t k = 0; k < count; k++, pos++) {
+            page[pos] = page[pos - distance];
+        }
+    }
+    return pos == MIUCHIZ_PAGE_SIZE ? 0 : -1;
+}
@@ -0,0 +1,59 @@
+#include "page-range.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct PageRegion {
+    const char* name;
+    struct PageRange range;
+};
+
+static const struct PageRegion regions[] = {
+    {"boot",        {0, FLASH_APPLICATION_START / MIUCHIZ_PAGE_SIZE - 1}},
+    {"application", {FLASH_APPLICATION_START / MIUCHIZ_PAGE_SIZE, MIUCHIZ_SAVE_PAGE - 1}},
+    {"save",        {MIUCHIZ_SAVE_PAGE, MIUCHIZ_SAVE_PAGE}},
+    {"all",         {0, MIUCHIZ_PAGE_COUNT - 1}},
+    {NULL,          {0, 0}}
+};
+
+int page_range_parse(const char* text, struct PageRange* range) {
+    for (const struct PageRegion* region = regions; region->name != NULL; region++) {
+        if (strcmp(text, region->name) == 0) {
+            *range = region->range;
+            return 0;
+        }
+    }
+
+    char* end;
+    long first = strtol(text, &end, 0);
+    if (end == text) {
+        return 1;
+    }
+    long last = first;
+    if (*end == '-') {
+        const char* start = end + 1;
+        last = strtol(start, &end, 0);
+        if (end == start) {
+            return 1;
+        }
+    }
+    if (*end != '\0' || first < 0 || last < first || last >= MIUCHIZ_PAGE_COUNT) {
+        return 1;
+    }
+    range->first = (int)first;
+    range->last = (int)last;
+    return 0;
+}
+
+struct PageRange page_range_all(void) {
+    struct PageRange range = { 0, MIUCHIZ_PAGE_COUNT - 1 };
+    return range;
+}
+
+int page_range_count(struct PageRange range) {
+    return range.last - range.first + 1;
+}
+
+int page_range_is_all(struct PageRange range) {
+    return range.first == 0 && range.last == MIUCHIZ_PAGE_COUNT - 1;
+}
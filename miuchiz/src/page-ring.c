@@ -0,0 +1,245 @@
+#include "page-ring.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#if defined(_WIN32)
+    #include <windows.h>
+#else
+    #include <pthread.h>
+#endif
+
+struct PageRing {
+    struct PageSlot* slots;
+    int count;
+    /* Slots published and released so far. head is written only by the
+     * producer and tail only by the consumer. */
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_int closed;
+    atomic_int cancelled;
+    /* A side finding the ring full or empty blocks on wake rather than
+     * spinning; the other side only takes the lock when someone is waiting,
+     * so a ring that never runs full or empty never locks. */
+    atomic_int waiting;
+#if defined(_WIN32)
+    SRWLOCK lock;
+    CONDITION_VARIABLE wake;
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+#endif
+};
+
+static void ring_lock(struct PageRing* ring) {
+#if defined(_WIN32)
+    AcquireSRWLockExclusive(&ring->lock);
+#else
+    pthread_mutex_lock(&ring->lock);
+#endif
+}
+
+static void ring_unlock(struct PageRing* ring) {
+#if defined(_WIN32)
+    ReleaseSRWLockExclusive(&ring->lock);
+#else
+    pthread_mutex_unlock(&ring->lock);
+#endif
+}
+
+/* Blocks until woken; called with the lock held. */
+static void ring_wait(struct PageRing* ring) {
+#if defined(_WIN32)
+    SleepConditionVariableSRW(&ring->wake, &ring->lock, INFINITE, 0);
+#else
+    pthread_cond_wait(&ring->wake, &ring->lock);
+#endif
+}
+
+/* Wakes the other side if it is blocked. The counters it waits on are
+ * updated before this looks at waiting, and it looks at them after raising
+ * waiting, both sequentially consistent, so one of the two always sees the
+ * other and no wakeup is lost. */
+static void ring_wake(struct PageRing* ring) {
+    if (atomic_load(&ring->waiting) > 0) {
+        ring_lock(ring);
+#if defined(_WIN32)
+        WakeAllConditionVariable(&ring->wake);
+#else
+        pthread_cond_broadcast(&ring->wake);
+#endif
+        ring_unlock(ring);
+    }
+}
+
+static int ring_full(struct PageRing* ring, unsigned int head) {
+    return head - atomic_load(&ring->tail) >= (unsigned int)ring->count && !atomic_load(&ring->cancelled);
+}
+
+static int ring_empty(struct PageRing* ring, unsigned int tail) {
+    return atomic_load(&ring->head) == tail && !atomic_load(&ring->closed);
+}
+
+struct PageRing* page_ring_create(int slots) {
+    struct PageRing* ring = calloc(1, sizeof(struct PageRing));
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->slots = calloc(slots, sizeof(struct PageSlot));
+    if (ring->slots == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->count = slots;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->closed, 0);
+    atomic_init(&ring->cancelled, 0);
+    atomic_init(&ring->waiting, 0);
+#if defined(_WIN32)
+    InitializeSRWLock(&ring->lock);
+    InitializeConditionVariable(&ring->wake);
+#else
+    if (pthread_mutex_init(&ring->lock, NULL) != 0) {
+        free(ring->slots);
+        free(ring);
+        return NULL;
+    }
+    if (pthread_cond_init(&ring->wake, NULL) != 0) {
+        pthread_mutex_destroy(&ring->lock);
+        free(ring->slots);
+        free(ring);
+        return NULL;
+    }
+#endif
+    return ring;
+}
+
+void page_ring_destroy(struct PageRing* ring) {
+    if (ring != NULL) {
+#if !defined(_WIN32)
+        pthread_cond_destroy(&ring->wake);
+        pthread_mutex_destroy(&ring->lock);
+#endif
+        free(ring->slots);
+        free(ring);
+    }
+}
+
+struct PageSlot* page_ring_claim(struct PageRing* ring) {
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (ring_full(ring, head)) {
+        ring_lock(ring);
+        atomic_fetch_add(&ring->waiting, 1);
+        while (ring_full(ring, head)) {
+            ring_wait(ring);
+        }
+        atomic_fetch_sub(&ring->waiting, 1);
+        ring_unlock(ring);
+    }
+    if (atomic_load_explicit(&ring->cancelled, memory_order_acquire)) {
+        return NULL;
+    }
+    return &ring->slots[head % ring->count];
+}
+
+void page_ring_publish(struct PageRing* ring) {
+    atomic_fetch_add(&ring->head, 1);
+    ring_wake(ring);
+}
+
+void page_ring_close(struct PageRing* ring) {
+    atomic_store(&ring->closed, 1);
+    ring_wake(ring);
+}
+
+struct PageSlot* page_ring_take(struct PageRing* ring) {
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (ring_empty(ring, tail)) {
+        ring_lock(ring);
+        atomic_fetch_add(&ring->waiting, 1);
+        while (ring_empty(ring, tail)) {
+            ring_wait(ring);
+        }
+        atomic_fetch_sub(&ring->waiting, 1);
+        ring_unlock(ring);
+    }
+    // Closed, but published before it closed?
+    if (atomic_load_explicit(&ring->head, memory_order_acquire) == tail) {
+        return NULL;
+    }
+    return &ring->slots[tail % ring->count];
+}
+
+void page_ring_release(struct PageRing* ring) {
+    atomic_fetch_add(&ring->tail, 1);
+    ring_wake(ring);
+}
+
+void page_ring_cancel(struct PageRing* ring) {
+    atomic_store(&ring->cancelled, 1);
+    ring_wake(ring);
+}
+
+struct PageWorker {
+    int (*fn)(void*);
+    void* arg;
+    int result;
+    atomic_int done;
+#if defined(_WIN32)
+    HANDLE thread;
+#else
+    pthread_t thread;
+#endif
+};
+
+#if defined(_WIN32)
+static DWORD WINAPI page_worker_main(LPVOID p) {
+#else
+static void* page_worker_main(void* p) {
+#endif
+    struct PageWorker* worker = p;
+    worker->result = worker->fn(worker->arg);
+    atomic_store_explicit(&worker->done, 1, memory_order_release);
+#if defined(_WIN32)
+    return 0;
+#else
+    return NULL;
+#endif
+}
+
+struct PageWorker* page_worker_start(int (*fn)(void*), void* arg) {
+    struct PageWorker* worker = calloc(1, sizeof(struct PageWorker));
+    if (worker == NULL) {
+        return NULL;
+    }
+    worker->fn = fn;
+    worker->arg = arg;
+    atomic_init(&worker->done, 0);
+#if defined(_WIN32)
+    worker->thread = CreateThread(NULL, 0, page_worker_main, worker, 0, NULL);
+    if (worker->thread == NULL) {
+#else
+    if (pthread_create(&worker->thread, NULL, page_worker_main, worker) != 0) {
+#endif
+        free(worker);
+        return NULL;
+    }
+    return worker;
+}
+
+int page_worker_done(struct PageWorker* worker) {
+    return atomic_load_explicit(&worker->done, memory_order_acquire);
+}
+
+int page_worker_join(struct PageWorker* worker) {
+#if defined(_WIN32)
+    WaitForSingleObject(worker->thread, INFINITE);
+    CloseHandle(worker->thread);
+#else
+    pthread_join(worker->thread, NULL);
+#endif
+    int result = worker->result;
+    free(worker);
+    return result;
+}
@@ -0,0 +1,338 @@
+#include "patch-file.h"
+#include "page-codec.h"
+#include "blank-map.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+/* Patch file, little-endian throughout:
+ *   Header:
+ *   [0-3]     "MZPT"
+ *   [4-5]     format version
+ *   [6-7]     header size
+ *   [8-9]     number of pages changed
+ *   [10-11]   first page covered
+ *   [12-13]   last page covered
+ *   [14-15]   reserved
+ *   [16-23]   created (Unix time)
+ *   [24-39]   tool version, NUL padded
+ *   [40-71]   SHA-256 of the base's pages in range
+ *   [72-103]  SHA-256 of the target's pages in range
+ *   [104-111] reserved
+ *   Then the SHA-256 of each base page in range, in page order; then each
+ *   page changed, in page order, as an entry followed by its stored bytes:
+ *   as is or, if packed, coded, and none for a blank or zero page.
+ *   [0-1]   page
+ *   [2-3]   flags, as a container's
+ *   [4-7]   stored length
+ *   [8-39]  SHA-256 of the target page
+ *   Then the trailer, which ends the file:
+ *   [0-3]   "MZPE"
+ *   [4-19]  first 16 bytes of the SHA-256 of everything before it */
+#define PATCH_MAGIC "MZPT"
+#define PATCH_END_MAGIC "MZPE"
+#define PATCH_FORMAT_VERSION (1)
+#define PATCH_HEADER_SIZE (112)
+#define PATCH_ENTRY_SIZE (40)
+#define PATCH_TRAILER_SIZE (20)
+#define PATCH_CHECK_SIZE (16)
+
+/* Page flags, as in a container */
+#define PATCH_PAGE_BLANK  (1u << 0)
+#define PATCH_PAGE_PACKED (1u << 3)
+#define PATCH_PAGE_ZERO   (1u << 4)
+
+static void le64_write(unsigned char* bytes, uint64_t value) {
+    miuchiz_le32_write(bytes, (uint32_t)(value & 0xFFFFFFFF));
+    miuchiz_le32_write(bytes + 4, (uint32_t)(value >> 32));
+}
+
+static uint64_t le64_read(const unsigned char* bytes) {
+    return (uint64_t)miuchiz_le32_read(bytes) | ((uint64_t)miuchiz_le32_read(bytes + 4) << 32);
+}
+
+static const unsigned char* image_page(const unsigned char* image, int page) {
+    return image + (size_t)page * MIUCHIZ_PAGE_SIZE;
+}
+
+static void range_hash(const unsigned char* image, struct PageRange pages, unsigned char* hash) {
+    struct Sha256 ctx;
+    miuchiz_sha256_init(&ctx);
+    miuchiz_sha256_update(&ctx, image_page(image, pages.first), (size_t)page_range_count(pages) * MIUCHIZ_PAGE_SIZE);
+    miuchiz_sha256_final(&ctx, hash);
+}
+
+struct PatchWriter {
+    FILE* fp;
+    struct Sha256 ctx; /* of everything written */
+    uint64_t written;
+};
+
+static int write_all(struct PatchWriter* writer, const void* data, size_t n) {
+    if (fwrite(data, 1, n, writer->fp) != n) {
+        return -1;
+    }
+    miuchiz_sha256_update(&writer->ctx, data, n);
+    writer->written += n;
+    return 0;
+}
+
+int patch_write(FILE* fp, const struct PatchInfo* info, const unsigned char* base, const unsigned char* target,
+                uint64_t* written) {
+    struct PageRange pages = info->pages;
+    struct PatchWriter writer = { .fp = fp };
+    miuchiz_sha256_init(&writer.ctx);
+
+    int changed = 0;
+    for (int pagenum = pages.first; pagenum <= pages.last; pagenum++) {
+        if (memcmp(image_page(base, pagenum), image_page(target, pagenum), MIUCHIZ_PAGE_SIZE) != 0) {
+            changed++;
+        }
+    }
+
+    unsigned char header[PATCH_HEADER_SIZE] = { 0 };
+    memcpy(header, PATCH_MAGIC, 4);
+    miuchiz_le16_write(header + 4, PATCH_FORMAT_VERSION);
+    miuchiz_le16_write(header + 6, PATCH_HEADER_SIZE);
+    miuchiz_le16_write(header + 8, (uint16_t)changed);
+    miuchiz_le16_write(header + 10, (uint16_t)pages.first);
+    miuchiz_le16_write(header + 12, (uint16_t)pages.last);
+    le64_write(header + 16, info->created);
+    memcpy(header + 24, info->tool_version, strnlen(info->tool_version, sizeof(info->tool_version)));
+    range_hash(base, pages, header + 40);
+    range_hash(target, pages, header + 72);
+    if (write_all(&writer, header, sizeof(header)) != 0) {
+        return -1;
+    }
+
+    for (int pagenum = pages.first; pagenum <= pages.last; pagenum++) {
+        unsigned char hash[MIUCHIZ_SHA256_SIZE];
+        miuchiz_sha256(image_page(base, pagenum), MIUCHIZ_PAGE_SIZE, hash);
+        if (write_all(&writer, hash, sizeof(hash)) != 0) {
+            return -1;
+        }
+    }
+
+    for (int pagenum = pages.first; pagenum <= pages.last; pagenum++) {
+        const unsigned char* data = image_page(target, pagenum);
+        if (memcmp(image_page(base, pagenum), data, MIUCHIZ_PAGE_SIZE) == 0) {
+            continue;
+        }
+
+        // Blank pages store nothing; others are coded where that is smaller
+        unsigned char coded[PAGE_CODEC_BOUND];
+        const unsigned char* stored = data;
+        unsigned int flags = 0;
+        size_t length = MIUCHIZ_PAGE_SIZE;
+        int fill = blank_page_fill(data);
+        if (fill != BLANK_PAGE_MIXED) {
+            flags = fill == 0xFF ? PATCH_PAGE_BLANK : PATCH_PAGE_ZERO;
+            length = 0;
+        }
+        else {
+            size_t coded_length = page_codec_encode(data, coded);
+            if (coded_length < MIUCHIZ_PAGE_SIZE) {
+                flags = PATCH_PAGE_PACKED;
+                stored = coded;
+                length = coded_length;
+            }
+        }
+
+        unsigned char entry[PATCH_ENTRY_SIZE];
+        miuchiz_le16_write(entry, (uint16_t)pagenum);
+        miuchiz_le16_write(entry + 2, (uint16_t)flags);
+        miuchiz_le32_write(entry + 4, (uint32_t)length);
+        miuchiz_sha256(data, MIUCHIZ_PAGE_SIZE, entry + 8);
+        if (write_all(&writer, entry, sizeof(entry)) != 0 || write_all(&writer, stored, length) != 0) {
+            return -1;
+        }
+    }
+
+    unsigned char digest[MIUCHIZ_SHA256_SIZE];
+    miuchiz_sha256_final(&writer.ctx, digest);
+    unsigned char trailer[PATCH_TRAILER_SIZE];
+    memcpy(trailer, PATCH_END_MAGIC, 4);
+    memcpy(trailer + 4, digest, PATCH_CHECK_SIZE);
+    if (fwrite(trailer, 1, sizeof(trailer), fp) != sizeof(trailer) || fflush(fp) != 0) {
+        return -1;
+    }
+    if (written != NULL) {
+        *written = writer.written + sizeof(trailer);
+    }
+    return changed;
+}
+
+struct Patch {
+    struct PatchInfo info;
+    int count;
+    unsigned char* data; /* the pages changed, decoded, one after another */
+    unsigned char base_hashes[MIUCHIZ_PAGE_COUNT][MIUCHIZ_SHA256_SIZE];
+    struct PatchPage pages[MIUCHIZ_PAGE_COUNT];
+};
+
+int patch_detect(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    unsigned char magic[4];
+    int result = 0;
+    if (fp != NULL) {
+        result = fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && memcmp(magic, PATCH_MAGIC, 4) == 0;
+        fclose(fp);
+    }
+    return result;
+}
+
+static int read_all(FILE* fp, struct Sha256* ctx, void* data, size_t n) {
+    if (fread(data, 1, n, fp) != n) {
+        return -1;
+    }
+    miuchiz_sha256_update(ctx, data, n);
+    return 0;
+}
+
+/* Reads the patch from its header to its trailer.
+ * @return 0 on success, -1 if it is not a patch or is damaged, -2 if a page
+ *         does not match its hash, -3 if memory runs out. */
+static int patch_load(struct Patch* patch, FILE* fp) {
+    struct Sha256 ctx;
+    miuchiz_sha256_init(&ctx);
+
+    unsigned char header[PATCH_HEADER_SIZE];
+    if (read_all(fp, &ctx, header, sizeof(header)) != 0
+        || memcmp(header, PATCH_MAGIC, 4) != 0
+        || miuchiz_le16_read(header + 4) != PATCH_FORMAT_VERSION
+        || miuchiz_le16_read(header + 6) != PATCH_HEADER_SIZE) {
+        return -1;
+    }
+    struct PatchInfo* info = &patch->info;
+    int count = miuchiz_le16_read(header + 8);
+    info->pages.first = miuchiz_le16_read(header + 10);
+    info->pages.last = miuchiz_le16_read(header + 12);
+    info->created = le64_read(header + 16);
+    memcpy(info->tool_version, header + 24, sizeof(info->tool_version) - 1);
+    memcpy(info->base_hash, header + 40, MIUCHIZ_SHA256_SIZE);
+    memcpy(info->target_hash, header + 72, MIUCHIZ_SHA256_SIZE);
+    if (info->pages.first > info->pages.last || info->pages.last >= MIUCHIZ_PAGE_COUNT
+        || count > page_range_count(info->pages)) {
+        return -1;
+    }
+
+    if (read_all(fp, &ctx, patch->base_hashes[info->pages.first],
+                 (size_t)page_range_count(info->pages) * MIUCHIZ_SHA256_SIZE) != 0) {
+        return -1;
+    }
+
+    if (count > 0) {
+        patch->data = malloc((size_t)count * MIUCHIZ_PAGE_SIZE);
+        if (patch->data == NULL) {
+            return -3;
+        }
+    }
+    int previous = info->pages.first - 1;
+    for (int i = 0; i < count; i++) {
+        unsigned char entry[PATCH_ENTRY_SIZE];
+        if (read_all(fp, &ctx, entry, sizeof(entry)) != 0) {
+            return -1;
+        }
+        struct PatchPage* page = &patch->pages[i];
+        unsigned char* data = patch->data + (size_t)i * MIUCHIZ_PAGE_SIZE;
+        page->page = miuchiz_le16_read(entry);
+        page->data = data;
+        unsigned int flags = miuchiz_le16_read(entry + 2);
+        uint32_t length = miuchiz_le32_read(entry + 4);
+        memcpy(page->hash, entry + 8, MIUCHIZ_SHA256_SIZE);
+        int packed = (flags & PATCH_PAGE_PACKED) != 0;
+        int blank = (flags & (PATCH_PAGE_BLANK | PATCH_PAGE_ZERO)) != 0;
+        if (page->page <= previous || page->page > info->pages.last
+            || (length == 0 ? !blank || packed
+                : packed ? length > MIUCHIZ_PAGE_SIZE : length != MIUCHIZ_PAGE_SIZE)) {
+            return -1;
+        }
+        previous = page->page;
+
+        // A packed page is read into the stack and decoded into place
+        unsigned char coded[MIUCHIZ_PAGE_SIZE];
+        if (length == 0) {
+            memset(data, (flags & PATCH_PAGE_BLANK) ? 0xFF : 0x00, MIUCHIZ_PAGE_SIZE);
+        }
+        else if (read_all(fp, &ctx, packed ? coded : data, length) != 0) {
+            return -1;
+        }
+        if (packed && page_codec_decode(coded, length, data) != 0) {
+            return -2;
+        }
+        unsigned char hash[MIUCHIZ_SHA256_SIZE];
+        miuchiz_sha256(data, MIUCHIZ_PAGE_SIZE, hash);
+        if (memcmp(hash, page->hash, sizeof(hash)) != 0) {
+            return -2;
+        }
+    }
+
+    unsigned char digest[MIUCHIZ_SHA256_SIZE];
+    miuchiz_sha256_final(&ctx, digest);
+    unsigned char trailer[PATCH_TRAILER_SIZE];
+    if (fread(trailer, 1, sizeof(trailer), fp) != sizeof(trailer)
+        || memcmp(trailer, PATCH_END_MAGIC, 4) != 0
+        || memcmp(trailer + 4, digest, PATCH_CHECK_SIZE) != 0
+        || fgetc(fp) != EOF) {
+        return -1;
+    }
+    patch->count = count;
+    return 0;
+}
+
+struct Patch* patch_read(FILE* fp) {
+    struct Patch* patch = calloc(1, sizeof(struct Patch));
+    if (patch == NULL) {
+        return NULL;
+    }
+    int result = patch_load(patch, fp);
+    if (result != 0) {
+        patch_close(patch);
+        errno = result == -2 ? EILSEQ : result == -3 ? ENOMEM : EINVAL;
+        return NULL;
+    }
+    return patch;
+}
+
+const struct PatchInfo* patch_info(struct Patch* patch) {
+    return &patch->info;
+}
+
+const unsigned char* patch_base_hash(struct Patch* patch, int page) {
+    return patch->base_hashes[page];
+}
+
+int patch_page_count(struct Patch* patch) {
+    return patch->count;
+}
+
+const struct PatchPage* patch_page(struct Patch* patch, int n) {
+    return &patch->pages[n];
+}
+
+const struct PatchPage* patch_find(struct Patch* patch, int page) {
+    // The pages are in page order
+    int low = 0;
+    int high = patch->count - 1;
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        if (patch->pages[mid].page == page) {
+            return &patch->pages[mid];
+        }
+        if (patch->pages[mid].page < page) {
+            low = mid + 1;
+        }
+        else {
+            high = mid - 1;
+        }
+    }
+    return NULL;
+}
+
+void patch_close(struct Patch* patch) {
+    if (patch != NULL) {
+        free(patch->data);
+        free(patch);
+    }
+}
@@ -0,0 +1,521 @@
+#include "snapshot-store.h"
+#include "page-codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#if defined(_WIN32)
+    #include <windows.h>
+    #include <direct.h>
+#else
+    #include <dirent.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/file.h>
+    #include <sys/stat.h>
+    #include <sys/types.h>
+#endif
+
+/* A page file holds the page as is, or coded (page-codec.h) when that is
+ * smaller; its size tells which. Files are written under a temporary name
+ * and renamed into place, so a page file is either whole or absent.
+ * <store>/lock is held shared by every snapshot being taken and exclusively
+ * while collecting, so pages put for a manifest not yet in place are never
+ * collected from under it. */
+#define STORE_APP "miuchiz"
+#define STORE_PATH_MAX (1024)
+#define HASH_HEX_LENGTH (2 * MIUCHIZ_SHA256_SIZE)
+#define STORE_TMP_SUFFIX ".tmp"
+#define STORE_PART_SUFFIX CONTAINER_EXTENSION ".part"
+
+struct SnapshotStore {
+    char dir[STORE_PATH_MAX];
+#if defined(_WIN32)
+    HANDLE lock; /* INVALID_HANDLE_VALUE until the store is locked */
+#else
+    int lock;    /* -1 until the store is locked */
+#endif
+};
+
+static int make_dir(const char* path) {
+#if defined(_WIN32)
+    int result = _mkdir(path);
+#else
+    int result = mkdir(path, 0777);
+#endif
+    return (result == 0 || errno == EEXIST) ? 0 : -1;
+}
+
+/* Calls `each` with every entry of a directory but "." and "..". */
+static int list_dir(const char* path, int (*each)(void* context, const char* name), void* context) {
+#if defined(_WIN32)
+    char pattern[STORE_PATH_MAX];
+    WIN32_FIND_DATAA found;
+    if (snprintf(pattern, sizeof(pattern), "%s\\*", path) >= (int)sizeof(pattern)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    HANDLE find = FindFirstFileA(pattern, &found);
+    if (find == INVALID_HANDLE_VALUE) {
+        errno = ENOENT;
+        return -1;
+    }
+    int stop = 0;
+    do {
+        if (strcmp(found.cFileName, ".") != 0 && strcmp(found.cFileName, "..") != 0) {
+            stop = each(context, found.cFileName);
+        }
+    } while (!stop && FindNextFileA(find, &found));
+    FindClose(find);
+    return 0;
+#else
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+    struct dirent* entry;
+    int stop = 0;
+    while (!stop && (entry = readdir(dir)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+            stop = each(context, entry->d_name);
+        }
+    }
+    closedir(dir);
+    return 0;
+#endif
+}
+
+static int has_suffix(const char* name, const char* suffix) {
+    size_t length = strlen(name);
+    size_t suffix_length = strlen(suffix);
+    return length > suffix_length && strcmp(name + length - suffix_length, suffix) == 0;
+}
+
+static int hex_decode(const char* text, unsigned char* bytes, size_t n) {
+    for (size_t i = 0; i < 2 * n; i++) {
+        char c = text[i];
+        int value = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+        if (value < 0) {
+            return -1;
+        }
+        bytes[i / 2] = (unsigned char)(i % 2 == 0 ? value << 4 : bytes[i / 2] | value);
+    }
+    return text[2 * n] == '\0' ? 0 : -1;
+}
+
+/* The file of a page, and optionally the directory it goes in. */
+static int page_path(struct SnapshotStore* store, const unsigned char hash[MIUCHIZ_SHA256_SIZE],
+                     char* buf, char* dir) {
+    char hex[HASH_HEX_LENGTH + 1];
+    miuchiz_hex_encode(hash, MIUCHIZ_SHA256_SIZE, hex);
+    int n = snprintf(buf, STORE_PATH_MAX, "%s/pages/%.2s/%s", store->dir, hex, hex);
+    if (n < 0 || n >= STORE_PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (dir != NULL) {
+        n = snprintf(dir, STORE_PATH_MAX, "%s/pages/%.2s", store->dir, hex);
+        if (n < 0 || n >= STORE_PATH_MAX) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int snapshot_store_default_dir(char* buf, size_t nbuf) {
+    if (miuchiz_app_dir("data", STORE_APP, buf, nbuf) != 0 || strlen(buf) + sizeof("/store") > nbuf) {
+        return -1;
+    }
+    strcat(buf, "/store");
+    return 0;
+}
+
+struct SnapshotStore* snapshot_store_open(const char* dir) {
+    struct SnapshotStore* store = calloc(1, sizeof(struct SnapshotStore));
+    if (store == NULL) {
+        return NULL;
+    }
+    if (dir == NULL) {
+        if (snapshot_store_default_dir(store->dir, sizeof(store->dir)) != 0) {
+            free(store);
+            errno = ENOENT;
+            return NULL;
+        }
+    }
+    else if (strlen(dir) + sizeof("/pages/00/.tmp") + HASH_HEX_LENGTH > sizeof(store->dir)) {
+        free(store);
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    else {
+        strcpy(store->dir, dir);
+    }
+#if defined(_WIN32)
+    store->lock = INVALID_HANDLE_VALUE;
+#else
+    store->lock = -1;
+#endif
+
+    char pages[STORE_PATH_MAX];
+    char snapshots[STORE_PATH_MAX];
+    int n = snprintf(pages, sizeof(pages), "%s/pages", store->dir);
+    int m = snprintf(snapshots, sizeof(snapshots), "%s/snapshots", store->dir);
+    if (n < 0 || n >= (int)sizeof(pages) || m < 0 || m >= (int)sizeof(snapshots)) {
+        free(store);
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    int ok = make_dir(store->dir) == 0 && make_dir(pages) == 0 && make_dir(snapshots) == 0;
+    if (!ok) {
+        int saved = errno;
+        free(store);
+        errno = saved;
+        return NULL;
+    }
+    return store;
+}
+
+const char* snapshot_store_dir(struct SnapshotStore* store) {
+    return store->dir;
+}
+
+int snapshot_store_put(struct SnapshotStore* store, const unsigned char* data,
+                       const unsigned char hash[MIUCHIZ_SHA256_SIZE]) {
+    char path[STORE_PATH_MAX];
+    char dir[STORE_PATH_MAX];
+    if (page_path(store, hash, path, dir) != 0) {
+        return -1;
+    }
+    FILE* fp = fopen(path, "rb");
+    if (fp != NULL) {
+        fclose(fp);
+        return 0;
+    }
+
+    unsigned char coded[PAGE_CODEC_BOUND];
+    size_t length = page_codec_encode(data, coded);
+    const unsigned char* bytes = length < MIUCHIZ_PAGE_SIZE ? coded : data;
+    if (bytes == data) {
+        length = MIUCHIZ_PAGE_SIZE;
+    }
+
+    char tmp[STORE_PATH_MAX + sizeof(STORE_TMP_SUFFIX)];
+    snprintf(tmp, sizeof(tmp), "%s" STORE_TMP_SUFFIX, path);
+    if (make_dir(dir) != 0 || (fp = fopen(tmp, "wb")) == NULL) {
+        return -1;
+    }
+    int ok = fwrite(bytes, 1, length, fp) == length;
+    if (fclose(fp) != 0) {
+        ok = 0;
+    }
+    if (!ok || rename(tmp, path) != 0) {
+        int saved = errno;
+        remove(tmp);
+        errno = saved;
+        return -1;
+    }
+    return 1;
+}
+
+int snapshot_store_get(void* context, const unsigned char hash[MIUCHIZ_SHA256_SIZE], unsigned char* data) {
+    struct SnapshotStore* store = context;
+    char path[STORE_PATH_MAX];
+    if (page_path(store, hash, path, NULL) != 0) {
+        return -1;
+    }
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    unsigned char bytes[MIUCHIZ_PAGE_SIZE + 1];
+    size_t length = fread(bytes, 1, sizeof(bytes), fp);
+    int failed = ferror(fp);
+    fclose(fp);
+    if (failed) {
+        errno = EIO;
+        return -1;
+    }
+
+    if (length == MIUCHIZ_PAGE_SIZE) {
+        memcpy(data, bytes, MIUCHIZ_PAGE_SIZE);
+    }
+    else if (length > MIUCHIZ_PAGE_SIZE || page_codec_decode(bytes, length, data) != 0) {
+        errno = EILSEQ;
+        return -1;
+    }
+    unsigned char check[MIUCHIZ_SHA256_SIZE];
+    miuchiz_sha256(data, MIUCHIZ_PAGE_SIZE, check);
+    if (memcmp(check, hash, sizeof(check)) != 0) {
+        errno = EILSEQ;
+        return -1;
+    }
+    return 0;
+}
+
+int snapshot_store_name_valid(const char* name) {
+    return name[0] != '\0' && name[0] != '.' && strpbrk(name, "/\\:") == NULL
+           && strlen(name) < STORE_PATH_MAX / 4;
+}
+
+char* snapshot_store_manifest_path(struct SnapshotStore* store, const char* name) {
+    size_t size = strlen(store->dir) + sizeof("/snapshots/") + strlen(name) + sizeof(CONTAINER_EXTENSION);
+    char* path = malloc(size);
+    if (path != NULL) {
+        snprintf(path, size, "%s/snapshots/%s" CONTAINER_EXTENSION, store->dir, name);
+    }
+    return path;
+}
+
+struct Container* snapshot_store_open_manifest(struct SnapshotStore* store, const char* path) {
+    struct Container* container = container_open(path);
+    if (container != NULL) {
+        container_set_source(container, snapshot_store_get, store);
+    }
+    return container;
+}
+
+struct SnapshotList {
+    int (*each)(void* context, const char* name);
+    void* context;
+};
+
+static int list_snapshot(void* context, const char* file) {
+    struct SnapshotList* list = context;
+    if (!has_suffix(file, CONTAINER_EXTENSION)) {
+        return 0;
+    }
+    char name[STORE_PATH_MAX];
+    size_t length = strlen(file) - strlen(CONTAINER_EXTENSION);
+    if (length >= sizeof(name)) {
+        return 0;
+    }
+    memcpy(name, file, length);
+    name[length] = '\0';
+    return list->each(list->context, name);
+}
+
+int snapshot_store_list(struct SnapshotStore* store, int (*each)(void* context, const char* name), void* context) {
+    char path[STORE_PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/snapshots", store->dir);
+    if (n < 0 || n >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    struct SnapshotList list = { each, context };
+    return list_dir(path, list_snapshot, &list);
+}
+
+/* Takes <store>/lock, shared or exclusive; waits for it only if shared. */
+static int store_lock(struct SnapshotStore* store, int exclusive) {
+    char path[STORE_PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/lock", store->dir);
+    if (n < 0 || n >= (int)sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+#if defined(_WIN32)
+    HANDLE lock = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                              NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (lock == INVALID_HANDLE_VALUE) {
+        errno = EACCES;
+        return -1;
+    }
+    OVERLAPPED at = { 0 };
+    DWORD flags = exclusive ? LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY : 0;
+    if (!LockFileEx(lock, flags, 0, 1, 0, &at)) {
+        CloseHandle(lock);
+        errno = exclusive ? EBUSY : EACCES;
+        return -1;
+    }
+#else
+    int lock = open(path, O_RDWR | O_CREAT, 0666);
+    if (lock < 0) {
+        return -1;
+    }
+    int result;
+    while ((result = flock(lock, exclusive ? LOCK_EX | LOCK_NB : LOCK_SH)) != 0 && errno == EINTR) {
+    }
+    if (result != 0) {
+        int saved = errno;
+        close(lock);
+        errno = saved == EWOULDBLOCK ? EBUSY : saved;
+        return -1;
+    }
+#endif
+    store->lock = lock;
+    return 0;
+}
+
+static void store_unlock(struct SnapshotStore* store) {
+#if defined(_WIN32)
+    if (store->lock != INVALID_HANDLE_VALUE) {
+        CloseHandle(store->lock);
+        store->lock = INVALID_HANDLE_VALUE;
+    }
+#else
+    if (store->lock >= 0) {
+        close(store->lock);
+        store->lock = -1;
+    }
+#endif
+}
+
+int snapshot_store_hold(struct SnapshotStore* store) {
+    return store_lock(store, 0);
+}
+
+/* What collecting has found so far. */
+struct Collection {
+    struct SnapshotStore* store;
+    unsigned char (*hashes)[MIUCHIZ_SHA256_SIZE]; /* referred to; sorted once all are in */
+    size_t count;
+    size_t capacity;
+    int failed;
+    const char* subdir; /* the pages directory being swept */
+    int removed;
+    uint64_t freed;
+};
+
+static int compare_hashes(const void* a, const void* b) {
+    return memcmp(a, b, MIUCHIZ_SHA256_SIZE);
+}
+
+static int collect_references(void* context, const char* name) {
+    struct Collection* collection = context;
+    char* path = snapshot_store_manifest_path(collection->store, name);
+    struct Container* container = path != NULL ? container_open(path) : NULL;
+    free(path);
+    if (container == NULL) {
+        collection->failed = 1;
+        return 1;
+    }
+    int count = container_page_count(container);
+    if (collection->count + (size_t)count > collection->capacity) {
+        size_t capacity = collection->capacity * 2 + (size_t)count;
+        void* grown = realloc(collection->hashes, capacity * MIUCHIZ_SHA256_SIZE);
+        if (grown == NULL) {
+            container_close(container);
+            collection->failed = 1;
+            return 1;
+        }
+        collection->hashes = grown;
+        collection->capacity = capacity;
+    }
+    for (int i = 0; i < count; i++) {
+        const struct ContainerPage* page = container_page(container, i);
+        if (page->flags & CONTAINER_PAGE_STORED) {
+            memcpy(collection->hashes[collection->count++], page->hash, MIUCHIZ_SHA256_SIZE);
+        }
+    }
+    container_close(container);
+    return 0;
+}
+
+/* Removes a file, counting the bytes it took up. */
+static int sweep_file(struct Collection* collection, const char* dir, const char* name) {
+    char path[STORE_PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/%s", dir, name);
+    if (n < 0 || n >= (int)sizeof(path)) {
+        return -1;
+    }
+    FILE* fp = fopen(path, "rb");
+    long size = 0;
+    if (fp != NULL) {
+        if (fseek(fp, 0, SEEK_END) == 0) {
+            size = ftell(fp);
+        }
+        fclose(fp);
+    }
+    if (remove(path) != 0) {
+        return -1;
+    }
+    collection->freed += size > 0 ? (uint64_t)size : 0;
+    return 0;
+}
+
+/* Pages no manifest refers to go, as do pages a snapshot that never
+ * finished left half written: with the store locked, none is in use. */
+static int sweep_page(void* context, const char* name) {
+    struct Collection* collection = context;
+    unsigned char hash[MIUCHIZ_SHA256_SIZE];
+    if (hex_decode(name, hash, sizeof(hash)) != 0) {
+        if (has_suffix(name, STORE_TMP_SUFFIX)) {
+            sweep_file(collection, collection->subdir, name);
+        }
+        return 0;
+    }
+    if (bsearch(hash, collection->hashes, collection->count, MIUCHIZ_SHA256_SIZE, compare_hashes) == NULL
+        && sweep_file(collection, collection->subdir, name) == 0) {
+        collection->removed++;
+    }
+    return 0;
+}
+
+static int sweep_subdir(void* context, const char* name) {
+    struct Collection* collection = context;
+    char path[STORE_PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/pages/%s", collection->store->dir, name);
+    if (n < 0 || n >= (int)sizeof(path)) {
+        return 0;
+    }
+    collection->subdir = path;
+    list_dir(path, sweep_page, collection);
+    return 0;
+}
+
+/* Manifests of snapshots that never finished. */
+static int sweep_manifest(void* context, const char* name) {
+    struct Collection* collection = context;
+    if (has_suffix(name, STORE_PART_SUFFIX)) {
+        sweep_file(collection, collection->subdir, name);
+    }
+    return 0;
+}
+
+int snapshot_store_collect(struct SnapshotStore* store, int* removed, uint64_t* freed) {
+    struct Collection collection;
+    memset(&collection, 0, sizeof(collection));
+    collection.store = store;
+
+    char pages[STORE_PATH_MAX];
+    char snapshots[STORE_PATH_MAX];
+    int n = snprintf(pages, sizeof(pages), "%s/pages", store->dir);
+    int m = snprintf(snapshots, sizeof(snapshots), "%s/snapshots", store->dir);
+    if (n < 0 || n >= (int)sizeof(pages) || m < 0 || m >= (int)sizeof(snapshots)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    if (store_lock(store, 1) != 0) {
+        return -1;
+    }
+
+    // Every page any manifest refers to is kept, so a manifest that cannot
+    // be read stops everything
+    if (snapshot_store_list(store, collect_references, &collection) != 0 || collection.failed) {
+        int saved = collection.failed ? EINVAL : errno;
+        free(collection.hashes);
+        store_unlock(store);
+        errno = saved;
+        return -1;
+    }
+    qsort(collection.hashes, collection.count, MIUCHIZ_SHA256_SIZE, compare_hashes);
+
+    int result = list_dir(pages, sweep_subdir, &collection);
+    collection.subdir = snapshots;
+    list_dir(snapshots, sweep_manifest, &collection);
+    free(collection.hashes);
+    store_unlock(store);
+    *removed = collection.removed;
+    *freed = collection.freed;
+    return result;
+}
+
+void snapshot_store_close(struct SnapshotStore* store) {
+    if (store != NULL) {
+        store_unlock(store);
+        free(store);
+    }
+}
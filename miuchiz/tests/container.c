@@ -0,0 +1,297 @@
+/*
+ * Checks the dump container: pages written raw, packed, sparse, kept in a
+ * store by their hashes, and repeated (so stored once) all read back as
+ * written, with the flags the index gives them; and a container whose
+ * index or trailer is not whole - a trailer hash that does not match, an
+ * index out of page order, an entry pointing past the index, a page that no
+ * longer matches its hash - is refused rather than half read.
+ *
+ * Usage: container
+ */
+
+#include "container.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* The layout container.c writes, for damaging containers by hand. */
+#define HEADER_SIZE (64)
+#define ENTRY_SIZE (48)
+#define TRAILER_SIZE (32)
+#define INDEX_HASH_SIZE (16)
+
+#define FIRST_PAGE (0x10)
+#define PAGES (8)
+
+/* The pages written: a random page, an erased one, a zeroed one, one that
+ * codes small, the random page again, and three more random. */
+static void make_pages(unsigned char pages[PAGES][MIUCHIZ_PAGE_SIZE]) {
+    test_fill_random(pages[0], MIUCHIZ_PAGE_SIZE, 0xC0DE);
+    memset(pages[1], 0xFF, MIUCHIZ_PAGE_SIZE);
+    memset(pages[2], 0x00, MIUCHIZ_PAGE_SIZE);
+    for (int i = 0; i < MIUCHIZ_PAGE_SIZE; i++) {
+        pages[3][i] = (unsigned char)(i / 64);
+    }
+    memcpy(pages[4], pages[0], MIUCHIZ_PAGE_SIZE);
+    for (int p = 5; p < PAGES; p++) {
+        test_fill_random(pages[p], MIUCHIZ_PAGE_SIZE, 0xBEEF + (uint32_t)p);
+    }
+}
+
+static int write_container(const char* path, unsigned char pages[PAGES][MIUCHIZ_PAGE_SIZE],
+                           unsigned int options, unsigned int stored_flags) {
+    struct ContainerInfo info;
+    memset(&info, 0, sizeof(info));
+    strcpy(info.fingerprint, "0123456789abcdef");
+    info.has_identity = 1;
+    info.firmware_version = 0x0203;
+    info.character = 5;
+    info.created = 1700000000;
+    strcpy(info.tool_version, "test");
+    info.pages.first = FIRST_PAGE;
+    info.pages.last = FIRST_PAGE + PAGES - 1;
+
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+    struct ContainerWriter* writer = container_writer_open(fp, &info, options);
+    int result = writer != NULL ? 0 : -1;
+    for (int p = 0; result == 0 && p < PAGES; p++) {
+        result = container_writer_page(writer, FIRST_PAGE + p, pages[p], stored_flags);
+    }
+    if (writer != NULL && container_writer_finish(writer) != 0) {
+        result = -1;
+    }
+    if (fclose(fp) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+/* Stands in for a snapshot store: finds a page of the test by its hash. */
+static int test_source(void* context, const unsigned char hash[MIUCHIZ_SHA256_SIZE], unsigned char* data) {
+    unsigned char (*pages)[MIUCHIZ_PAGE_SIZE] = context;
+    for (int p = 0; p < PAGES; p++) {
+        unsigned char page_hash[MIUCHIZ_SHA256_SIZE];
+        miuchiz_sha256(pages[p], MIUCHIZ_PAGE_SIZE, page_hash);
+        if (memcmp(page_hash, hash, sizeof(page_hash)) == 0) {
+            memcpy(data, pages[p], MIUCHIZ_PAGE_SIZE);
+            return 0;
+        }
+    }
+    errno = ENOENT;
+    return -1;
+}
+
+/* Writes a container with `options`, reads every page back and checks the
+ * header. Returns the container, still open, for more checks. */
+static struct Container* round_trip(const char* path, const char* label,
+                                    unsigned char pages[PAGES][MIUCHIZ_PAGE_SIZE],
+                                    unsigned int options, unsigned int stored_flags) {
+    CHECK(write_container(path, pages, options, stored_flags) == 0, "%s: writing failed", label);
+    CHECK(container_detect(path), "%s: not detected as a container", label);
+    struct Container* container = container_open(path);
+    CHECK(container != NULL, "%s: opening failed [%d] %s", label, errno, strerror(errno));
+    if (container == NULL) {
+        return NULL;
+    }
+    if (stored_flags & CONTAINER_PAGE_STORED) {
+        container_set_source(container, test_source, pages);
+    }
+
+    const struct ContainerInfo* info = container_info(container);
+    CHECK(strcmp(info->fingerprint, "0123456789abcdef") == 0 && info->has_identity
+          && info->firmware_version == 0x0203 && info->character == 5 && info->created == 1700000000
+          && strcmp(info->tool_version, "test") == 0
+          && info->pages.first == FIRST_PAGE && info->pages.last == FIRST_PAGE + PAGES - 1,
+          "%s: the header did not read back", label);
+    CHECK(container_page_count(container) == PAGES, "%s: %d pages indexed", label, container_page_count(container));
+
+    unsigned char page[MIUCHIZ_PAGE_SIZE];
+    for (int p = 0; p < PAGES; p++) {
+        CHECK(container_read_page(container, FIRST_PAGE + p, page) == 0
+              && memcmp(page, pages[p], sizeof(page)) == 0,
+              "%s: page %d did not read back", label, FIRST_PAGE + p);
+    }
+    CHECK(container_read_page(container, FIRST_PAGE - 1, page) != 0 && errno == ENOENT,
+          "%s: a page outside the dump was read", label);
+    CHECK(container_find(container, FIRST_PAGE + 1) != NULL
+          && (container_find(container, FIRST_PAGE + 1)->flags & CONTAINER_PAGE_BLANK)
+          && (container_find(container, FIRST_PAGE + 2)->flags & CONTAINER_PAGE_ZERO),
+          "%s: blank pages are not flagged", label);
+    return container;
+}
+
+/* Reads a whole file into memory. */
+static int read_file(const char* path, unsigned char** data, long* size) {
+    *size = test_file_size(path);
+    *data = *size > 0 ? malloc((size_t)*size) : NULL;
+    return *data != NULL && test_read_file(path, *data, (size_t)*size) == *size ? 0 : -1;
+}
+
+/* Rehashes the index into the trailer, so damage to the index itself is
+ * what a reader has to catch. */
+static void rehash_index(unsigned char* data, long size) {
+    unsigned char* trailer = data + size - TRAILER_SIZE;
+    uint32_t count = miuchiz_le32_read(trailer + 4);
+    uint32_t index_offset = miuchiz_le32_read(trailer + 8);
+    unsigned char digest[MIUCHIZ_SHA256_SIZE];
+    miuchiz_sha256(data + index_offset, (size_t)count * ENTRY_SIZE, digest);
+    memcpy(trailer + 16, digest, INDEX_HASH_SIZE);
+}
+
+/* Damages a copy of a good container with `damage`, and checks it is refused. */
+static void check_refused(const char* good, const char* bad, const char* label,
+                          void (*damage)(unsigned char* data, long size)) {
+    unsigned char* data;
+    long size;
+    CHECK(read_file(good, &data, &size) == 0, "%s: could not read %s", label, good);
+    if (data == NULL) {
+        return;
+    }
+    damage(data, size);
+    CHECK(test_write_file(bad, data, (size_t)size) == 0, "%s: could not write %s", label, bad);
+    free(data);
+    struct Container* container = container_open(bad);
+    CHECK(container == NULL && errno == EINVAL, "%s: the container was opened", label);
+    container_close(container);
+}
+
+static void damage_trailer_hash(unsigned char* data, long size) {
+    data[size - 1] ^= 0x01;
+}
+
+static void damage_index_hash(unsigned char* data, long size) {
+    uint32_t index_offset = miuchiz_le32_read(data + size - TRAILER_SIZE + 8);
+    data[index_offset + 16] ^= 0x01;
+}
+
+static void damage_index_order(unsigned char* data, long size) {
+    uint32_t index_offset = miuchiz_le32_read(data + size - TRAILER_SIZE + 8);
+    unsigned char entry[ENTRY_SIZE];
+    memcpy(entry, data + index_offset, ENTRY_SIZE);
+    memcpy(data + index_offset, data + index_offset + ENTRY_SIZE, ENTRY_SIZE);
+    memcpy(data + index_offset + ENTRY_SIZE, entry, ENTRY_SIZE);
+    rehash_index(data, size);
+}
+
+static void damage_offset_past_index(unsigned char* data, long size) {
+    uint32_t index_offset = miuchiz_le32_read(data + size - TRAILER_SIZE + 8);
+    miuchiz_le32_write(data + index_offset + 8, index_offset - MIUCHIZ_PAGE_SIZE / 2);
+    rehash_index(data, size);
+}
+
+static void damage_magic(unsigned char* data, long size) {
+    (void)size;
+    data[0] = 'X';
+}
+
+static void damage_count(unsigned char* data, long size) {
+    miuchiz_le32_write(data + size - TRAILER_SIZE + 4, miuchiz_le32_read(data + size - TRAILER_SIZE + 4) - 1);
+}
+
+int main(void) {
+    char dir[64];
+    if (test_scratch_dir("container", dir, sizeof(dir)) != 0) {
+        return 1;
+    }
+    char path[256];
+    char bad[256];
+    snprintf(path, sizeof(path), "%s/dump" CONTAINER_EXTENSION, dir);
+    snprintf(bad, sizeof(bad), "%s/bad" CONTAINER_EXTENSION, dir);
+
+    static unsigned char pages[PAGES][MIUCHIZ_PAGE_SIZE];
+    make_pages(pages);
+    unsigned char page[MIUCHIZ_PAGE_SIZE];
+
+    /* Raw: every page stored as is. */
+    struct Container* container = round_trip(path, "raw", pages, 0, CONTAINER_PAGE_VERIFIED);
+    if (container != NULL) {
+        CHECK(container_data_size(container) == (uint64_t)PAGES * MIUCHIZ_PAGE_SIZE,
+              "raw: %llu bytes stored", (unsigned long long)container_data_size(container));
+        CHECK(container_find(container, FIRST_PAGE)->flags & CONTAINER_PAGE_VERIFIED,
+              "raw: the caller's flags were lost");
+        container_close(container);
+    }
+
+    /* Packed: pages that code small are coded, a repeated page is stored
+     * once, and a random page is left as is. */
+    container = round_trip(path, "packed", pages, CONTAINER_WRITE_PACK, 0);
+    if (container != NULL) {
+        const struct ContainerPage* first = container_find(container, FIRST_PAGE);
+        const struct ContainerPage* again = container_find(container, FIRST_PAGE + 4);
+        CHECK(again->offset == first->offset && again->length == first->length,
+              "packed: a repeated page was stored twice");
+        CHECK(!(first->flags & CONTAINER_PAGE_PACKED) && first->length == MIUCHIZ_PAGE_SIZE,
+              "packed: a random page was coded");
+        CHECK((container_find(container, FIRST_PAGE + 3)->flags & CONTAINER_PAGE_PACKED)
+              && container_find(container, FIRST_PAGE + 3)->length < MIUCHIZ_PAGE_SIZE,
+              "packed: a page that codes small was not coded");
+        CHECK(container_data_size(container) < (uint64_t)(PAGES - 2) * MIUCHIZ_PAGE_SIZE,
+              "packed: %llu bytes stored", (unsigned long long)container_data_size(container));
+        container_close(container);
+    }
+
+    /* Sparse: blank pages store nothing. */
+    container = round_trip(path, "sparse", pages, CONTAINER_WRITE_SPARSE, 0);
+    if (container != NULL) {
+        CHECK(container_find(container, FIRST_PAGE + 1)->length == 0
+              && container_find(container, FIRST_PAGE + 2)->length == 0,
+              "sparse: a blank page was stored");
+        CHECK(container_data_size(container) == (uint64_t)(PAGES - 2) * MIUCHIZ_PAGE_SIZE,
+              "sparse: %llu bytes stored", (unsigned long long)container_data_size(container));
+        container_close(container);
+    }
+
+    /* Stored: nothing but the index, the pages coming from their source. */
+    container = round_trip(path, "stored", pages, CONTAINER_WRITE_PACK, CONTAINER_PAGE_STORED);
+    if (container != NULL) {
+        CHECK(container_has_stored_pages(container) && container_data_size(container) == 0,
+              "stored: %llu bytes stored", (unsigned long long)container_data_size(container));
+        container_set_source(container, NULL, NULL);
+        CHECK(container_read_page(container, FIRST_PAGE, page) != 0 && errno == ENOENT,
+              "stored: a page was read without a source");
+        container_close(container);
+    }
+
+    /* A stored page that no longer matches its hash is refused on reading. */
+    CHECK(write_container(path, pages, 0, 0) == 0, "writing failed");
+    unsigned char* data;
+    long size;
+    if (read_file(path, &data, &size) == 0) {
+        data[HEADER_SIZE + 5 * MIUCHIZ_PAGE_SIZE + 100] ^= 0x01;
+        test_write_file(bad, data, (size_t)size);
+        container = container_open(bad);
+        CHECK(container != NULL, "a container with a damaged page was not opened");
+        if (container != NULL) {
+            CHECK(container_read_page(container, FIRST_PAGE + 5, page) != 0 && errno == EILSEQ,
+                  "a page that does not match its hash was read");
+            CHECK(container_read_page(container, FIRST_PAGE + 6, page) == 0,
+                  "the page after a damaged one was not read");
+            container_close(container);
+        }
+    }
+    free(data);
+
+    /* Containers whose index or trailer is not whole are refused. */
+    CHECK(write_container(path, pages, CONTAINER_WRITE_PACK, 0) == 0, "writing failed");
+    check_refused(path, bad, "bad trailer hash", damage_trailer_hash);
+    check_refused(path, bad, "index entry not matching its hash", damage_index_hash);
+    check_refused(path, bad, "index out of page order", damage_index_order);
+    check_refused(path, bad, "offset past the index", damage_offset_past_index);
+    check_refused(path, bad, "another magic", damage_magic);
+    check_refused(path, bad, "index count not fitting the trailer", damage_count);
+    CHECK(truncate(bad, HEADER_SIZE + TRAILER_SIZE / 2) == 0, "could not truncate %s", bad);
+    container = container_open(bad);
+    CHECK(container == NULL && errno == EINVAL, "a truncated container was opened");
+    container_close(container);
+
+    test_remove_tree(dir);
+
+    return test_finish();
+}
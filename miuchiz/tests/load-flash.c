@@ -0,0 +1,90 @@
+/*
+ * Checks that load-flash never skips a page on the flash state's word alone.
+ * An image is loaded onto an "img:" handheld, which is then changed behind
+ * the tool's back - zeroed whole, then a few pages only; loading the image
+ * again must leave the handheld holding it each time, not skip the pages
+ * the flash state remembers.
+ *
+ * Usage: load-flash
+ */
+
+#include "libmiuchiz-usb.h"
+#include "actions/load-flash.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define FLASH_SIZE ((size_t)MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT)
+#define CHANGED_FIRST (0x40)
+#define CHANGED_PAGES (3)
+
+/* The pages of two images that differ. */
+static int pages_differing(const unsigned char* a, const unsigned char* b) {
+    int differing = 0;
+    for (int page = 0; page < MIUCHIZ_PAGE_COUNT; page++) {
+        size_t at = (size_t)page * MIUCHIZ_PAGE_SIZE;
+        differing += memcmp(a + at, b + at, MIUCHIZ_PAGE_SIZE) != 0;
+    }
+    return differing;
+}
+
+static int load(const char* device, const char* infile) {
+    char* argv[] = { "load-flash", "-d", (char*)device, (char*)infile, NULL };
+    optind = 1;
+    return load_flash_main(4, argv);
+}
+
+int main(void) {
+    char dir[64];
+    if (test_scratch_home("load-flash", dir, sizeof(dir)) != 0) {
+        return 1;
+    }
+    char src_path[256];
+    char target_path[256];
+    char device[300];
+    snprintf(src_path, sizeof(src_path), "%s/src.bin", dir);
+    snprintf(target_path, sizeof(target_path), "%s/target.bin", dir);
+    snprintf(device, sizeof(device), "img:%s?mode=write", target_path);
+
+    unsigned char* src = malloc(FLASH_SIZE);
+    unsigned char* zeros = calloc(1, FLASH_SIZE);
+    unsigned char* held = malloc(FLASH_SIZE);
+    if (src == NULL || zeros == NULL || held == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    test_fill_random(src, FLASH_SIZE, 0x10AD);
+    CHECK(test_write_file(src_path, src, FLASH_SIZE) == 0 && test_write_file(target_path, zeros, FLASH_SIZE) == 0,
+          "could not write the images");
+
+    /* Loaded once, the handheld holds the image, and its state says so. */
+    CHECK(load(device, src_path) == 0, "loading the image failed");
+    CHECK(test_read_file(target_path, held, FLASH_SIZE) == (long)FLASH_SIZE && pages_differing(held, src) == 0,
+          "the handheld does not hold the image loaded");
+
+    /* Zeroed behind the tool's back, it is written whole again. */
+    CHECK(test_write_file(target_path, zeros, FLASH_SIZE) == 0, "could not zero the handheld");
+    CHECK(load(device, src_path) == 0, "loading the image again failed");
+    int differing = test_read_file(target_path, held, FLASH_SIZE) == (long)FLASH_SIZE
+                    ? pages_differing(held, src) : MIUCHIZ_PAGE_COUNT;
+    CHECK(differing == 0, "%d pages were skipped as in place though the handheld was zeroed", differing);
+
+    /* As are a few pages changed, however few. */
+    memcpy(held, src, FLASH_SIZE);
+    memset(held + (size_t)CHANGED_FIRST * MIUCHIZ_PAGE_SIZE, 0, (size_t)CHANGED_PAGES * MIUCHIZ_PAGE_SIZE);
+    CHECK(test_write_file(target_path, held, FLASH_SIZE) == 0, "could not change the handheld");
+    CHECK(load(device, src_path) == 0, "loading the image over a few changed pages failed");
+    differing = test_read_file(target_path, held, FLASH_SIZE) == (long)FLASH_SIZE
+                ? pages_differing(held, src) : MIUCHIZ_PAGE_COUNT;
+    CHECK(differing == 0, "%d pages were skipped as in place though they had changed", differing);
+
+    free(src);
+    free(zeros);
+    free(held);
+    test_remove_tree(dir);
+
+    return test_finish();
+}
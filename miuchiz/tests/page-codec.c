@@ -0,0 +1,159 @@
+/*
+ * Checks the page codec: pages of every shape a dump holds - random, erased,
+ * zeroed, few distinct bytes, ramps, repeats near and far - code within
+ * PAGE_CODEC_BOUND and decode to themselves; and coded bytes that are not a
+ * page - made up, damaged, cut short, running long, reaching back before
+ * the page starts - are refused without writing past the page.
+ *
+ * Usage: page-codec
+ */
+
+#include "page-codec.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUND_TRIPS (4000)
+#define GARBAGE_DECODES (20000)
+#define GUARD (64)
+
+static uint32_t next_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/* Fills a page of one of the shapes flash dumps are made of. */
+static void make_page(unsigned char* page, int shape, uint32_t* rng) {
+    switch (shape) {
+        case 0: // random
+            for (int i = 0; i < MIUCHIZ_PAGE_SIZE; i++) {
+                page[i] = (unsigned char)next_random(rng);
+            }
+            break;
+        case 1: // erased
+            memset(page, 0xFF, MIUCHIZ_PAGE_SIZE);
+            break;
+        case 2: // zeroed
+            memset(page, 0x00, MIUCHIZ_PAGE_SIZE);
+            break;
+        case 3: // few distinct bytes
+            for (int i = 0; i < MIUCHIZ_PAGE_SIZE; i++) {
+                page[i] = (unsigned char)(next_random(rng) % 3);
+            }
+            break;
+        case 4: { // ramps of varying steps
+            int step = (int)(next_random(rng) % 50) + 1;
+            for (int i = 0; i < MIUCHIZ_PAGE_SIZE; i++) {
+                page[i] = (unsigned char)(i / step);
+            }
+            break;
+        }
+        case 5: // copies of what came before, near and far
+            for (int i = 0; i < MIUCHIZ_PAGE_SIZE; i++) {
+                if (i > 0 && next_random(rng) % 10 != 0) {
+                    int back = 1 + (int)(next_random(rng) % (uint32_t)(i < 3000 ? i : 3000));
+                    page[i] = page[i - back];
+                }
+                else {
+                    page[i] = (unsigned char)next_random(rng);
+                }
+            }
+            break;
+        default: // erased, with a few islands of data
+            memset(page, 0xFF, MIUCHIZ_PAGE_SIZE);
+            for (int island = 0; island < 4; island++) {
+                int at = (int)(next_random(rng) % (MIUCHIZ_PAGE_SIZE - 200));
+                for (int i = 0; i < 200; i++) {
+                    page[at + i] = (unsigned char)next_random(rng);
+                }
+            }
+            break;
+    }
+}
+
+/* Decodes into a page followed by a guard, and checks the guard is intact. */
+static int guarded_decode(const unsigned char* in, size_t length, unsigned char* page, const char* label) {
+    static unsigned char out[MIUCHIZ_PAGE_SIZE + GUARD];
+    memset(out + MIUCHIZ_PAGE_SIZE, 0xA5, GUARD);
+    int result = page_codec_decode(in, length, out);
+    for (int i = 0; i < GUARD; i++) {
+        if (out[MIUCHIZ_PAGE_SIZE + i] != 0xA5) {
+            CHECK(0, "%s: decoding wrote past the page", label);
+            break;
+        }
+    }
+    if (page != NULL) {
+        memcpy(page, out, MIUCHIZ_PAGE_SIZE);
+    }
+    return result;
+}
+
+int main(void) {
+    static unsigned char page[MIUCHIZ_PAGE_SIZE];
+    static unsigned char decoded[MIUCHIZ_PAGE_SIZE];
+    static unsigned char coded[PAGE_CODEC_BOUND];
+    static unsigned char damaged[PAGE_CODEC_BOUND + 16];
+    uint32_t rng = 0x5EED;
+
+    /* Every shape round-trips within the bound. */
+    for (int t = 0; t < ROUND_TRIPS; t++) {
+        int shape = t % 7;
+        make_page(page, shape, &rng);
+        size_t length = page_codec_encode(page, coded);
+        CHECK(length > 0 && length <= PAGE_CODEC_BOUND, "shape %d: coded to %zu bytes", shape, length);
+        if (length == 0 || length > PAGE_CODEC_BOUND) {
+            continue;
+        }
+        CHECK(guarded_decode(coded, length, decoded, "round trip") == 0
+              && memcmp(decoded, page, sizeof(page)) == 0,
+              "shape %d, round %d: the page did not decode to itself", shape, t);
+
+        /* The same bytes, damaged or cut short, never decode past the
+         * page; cut short, they are never a page at all. */
+        memcpy(damaged, coded, length);
+        damaged[next_random(&rng) % length] ^= (unsigned char)(1u << (next_random(&rng) % 8));
+        guarded_decode(damaged, length, NULL, "damaged");
+        CHECK(guarded_decode(coded, length - 1, NULL, "cut short") != 0,
+              "shape %d: a page cut short decoded", shape);
+        memcpy(damaged, coded, length);
+        damaged[length] = 0x00;
+        damaged[length + 1] = 0x00;
+        CHECK(guarded_decode(damaged, length + 2, NULL, "running long") != 0,
+              "shape %d: a page with bytes after it decoded", shape);
+    }
+
+    /* Erased and zeroed pages, the most common, cost a few bytes. */
+    memset(page, 0xFF, sizeof(page));
+    CHECK(page_codec_encode(page, coded) < 16, "an erased page coded to %zu bytes", page_codec_encode(page, coded));
+    memset(page, 0x00, sizeof(page));
+    CHECK(page_codec_encode(page, coded) < 16, "a zeroed page coded to %zu bytes", page_codec_encode(page, coded));
+
+    /* Made-up bytes never decode past the page. */
+    for (int t = 0; t < GARBAGE_DECODES; t++) {
+        size_t length = next_random(&rng) % sizeof(damaged);
+        for (size_t i = 0; i < length; i++) {
+            damaged[i] = (unsigned char)next_random(&rng);
+        }
+        guarded_decode(damaged, length, NULL, "garbage");
+    }
+
+    /* Matches reaching back before the page starts, or nowhere. */
+    const unsigned char before_start[] = { 0x00, 'a', 0x80, 0x05, 0x00 };
+    CHECK(guarded_decode(before_start, sizeof(before_start), NULL, "before the start") != 0,
+          "a match reaching before the page decoded");
+    const unsigned char no_distance[] = { 0x00, 'a', 0x80, 0x00, 0x00 };
+    CHECK(guarded_decode(no_distance, sizeof(no_distance), NULL, "no distance") != 0,
+          "a match of distance 0 decoded");
+    const unsigned char missing_literals[] = { 0x7F, 'a', 'b' };
+    CHECK(guarded_decode(missing_literals, sizeof(missing_literals), NULL, "missing literals") != 0,
+          "a run of literals cut short decoded");
+    CHECK(guarded_decode(NULL, 0, NULL, "empty") != 0, "nothing decoded as a page");
+
+    return test_finish();
+}
@@ -0,0 +1,260 @@
+/*
+ * Checks patches and applying them. A patch written between two images
+ * reads back with every page it changes - blank, zeroed, coded and as is -
+ * and a patch that is not whole is refused. Applied to an "img:" handheld
+ * through apply-patch, a patch brings the base up to the target and touches
+ * nothing else; a handheld holding anything but the base - a changed page
+ * or an unchanged one differing - is refused before a page is written,
+ * though its save page may have moved on with play; one already holding
+ * the target is not written at all; and a patch applied
+ * after an interrupted apply finishes it.
+ *
+ * Usage: patch
+ */
+
+#include "patch-file.h"
+#include "actions/apply-patch.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <utime.h>
+#include <sys/stat.h>
+
+#define FLASH_SIZE ((size_t)MIUCHIZ_PAGE_SIZE * MIUCHIZ_PAGE_COUNT)
+#define FIRST_PAGE (0x20)
+#define LAST_PAGE (0x3F)
+#define UNCHANGED_PAGE (0x28)
+
+/* The pages the target changes: to blank, to zero, to random bytes, to a
+ * ramp that codes small, and to random bytes again. */
+static const int changed_pages[] = { 0x21, 0x22, 0x23, 0x25, 0x30 };
+#define CHANGED (int)(sizeof(changed_pages) / sizeof(changed_pages[0]))
+
+static unsigned char* page_of(unsigned char* image, int page) {
+    return image + (size_t)page * MIUCHIZ_PAGE_SIZE;
+}
+
+static struct Patch* read_patch(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return NULL;
+    }
+    struct Patch* patch = patch_read(fp);
+    int saved = errno;
+    fclose(fp);
+    errno = saved;
+    return patch;
+}
+
+/* Writes a patch of pages `first`-`last` from `base` to `target`.
+ * @return The pages it changes, or -1. */
+static int write_patch(const char* path, int first, int last, const unsigned char* base, const unsigned char* target) {
+    struct PatchInfo info;
+    memset(&info, 0, sizeof(info));
+    info.created = 1700000000;
+    strcpy(info.tool_version, "test");
+    info.pages.first = first;
+    info.pages.last = last;
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+    uint64_t written = 0;
+    int changed = patch_write(fp, &info, base, target, &written);
+    return fclose(fp) == 0 ? changed : -1;
+}
+
+/* Runs apply-patch on an image holding `image`, checking every unchanged
+ * page if `all`, and leaves what the image holds afterwards in `after`.
+ * @param untouched If not NULL, receives whether the image file was not
+ *        written at all. */
+static int apply(const char* image_path, const unsigned char* image, const char* patch_path,
+                 int all, unsigned char* after, int* untouched) {
+    char device[600];
+    snprintf(device, sizeof(device), "img:%s?mode=write", image_path);
+    CHECK(test_write_file(image_path, image, FLASH_SIZE) == 0, "could not write the image");
+    struct utimbuf long_ago = { 1, 1 };
+    CHECK(utime(image_path, &long_ago) == 0, "could not date the image");
+
+    char sample[16];
+    snprintf(sample, sizeof(sample), "%d", all ? MIUCHIZ_PAGE_COUNT : 0);
+    char* argv[] = { "apply-patch", "-d", device, "-n", sample, (char*)patch_path, NULL };
+    optind = 1;
+    int result = apply_patch_main(6, argv);
+
+    struct stat st;
+    if (untouched != NULL) {
+        *untouched = stat(image_path, &st) == 0 && st.st_mtime == long_ago.modtime;
+    }
+    CHECK(test_read_file(image_path, after, FLASH_SIZE) == (long)FLASH_SIZE, "could not read the image back");
+    return result;
+}
+
+int main(void) {
+    char dir[64];
+    if (test_scratch_home("patch", dir, sizeof(dir)) != 0) {
+        return 1;
+    }
+    char patch_path[256];
+    char image_path[256];
+    char damaged_path[256];
+    snprintf(patch_path, sizeof(patch_path), "%s/update" PATCH_EXTENSION, dir);
+    snprintf(image_path, sizeof(image_path), "%s/flash.bin", dir);
+    snprintf(damaged_path, sizeof(damaged_path), "%s/damaged" PATCH_EXTENSION, dir);
+
+    unsigned char* base = malloc(FLASH_SIZE);
+    unsigned char* target = malloc(FLASH_SIZE);
+    unsigned char* device = malloc(FLASH_SIZE);
+    unsigned char* after = malloc(FLASH_SIZE);
+    unsigned char* bytes = malloc(2 * FLASH_SIZE);
+    if (base == NULL || target == NULL || device == NULL || after == NULL || bytes == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        return 1;
+    }
+    test_fill_random(base, FLASH_SIZE, 0xBA5E);
+    memcpy(target, base, FLASH_SIZE);
+    memset(page_of(target, changed_pages[0]), 0xFF, MIUCHIZ_PAGE_SIZE);
+    memset(page_of(target, changed_pages[1]), 0x00, MIUCHIZ_PAGE_SIZE);
+    test_fill_random(page_of(target, changed_pages[2]), MIUCHIZ_PAGE_SIZE, 0x7A26);
+    for (int i = 0; i < MIUCHIZ_PAGE_SIZE; i++) {
+        page_of(target, changed_pages[3])[i] = (unsigned char)(i / 64);
+    }
+    test_fill_random(page_of(target, changed_pages[4]), MIUCHIZ_PAGE_SIZE, 0x3030);
+
+    /* A patch reads back with the pages it changes and the base's hashes. */
+    struct PatchInfo info;
+    memset(&info, 0, sizeof(info));
+    info.created = 1700000000;
+    strcpy(info.tool_version, "test");
+    info.pages.first = FIRST_PAGE;
+    info.pages.last = LAST_PAGE;
+    FILE* fp = fopen(patch_path, "wb");
+    uint64_t written = 0;
+    CHECK(fp != NULL && patch_write(fp, &info, base, target, &written) == CHANGED,
+          "writing the patch did not change %d pages", CHANGED);
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    long length = test_read_file(patch_path, bytes, 2 * FLASH_SIZE);
+    CHECK(length > 0 && (uint64_t)length == written, "the patch is %ld bytes, not %llu",
+          length, (unsigned long long)written);
+    CHECK(patch_detect(patch_path), "the patch was not detected as one");
+
+    struct Patch* patch = read_patch(patch_path);
+    CHECK(patch != NULL, "reading the patch failed [%d] %s", errno, strerror(errno));
+    if (patch != NULL) {
+        const struct PatchInfo* got = patch_info(patch);
+        unsigned char hash[MIUCHIZ_SHA256_SIZE];
+        CHECK(got->created == info.created && strcmp(got->tool_version, "test") == 0
+              && got->pages.first == FIRST_PAGE && got->pages.last == LAST_PAGE,
+              "the header did not read back");
+        miuchiz_sha256(page_of(base, FIRST_PAGE), (size_t)(LAST_PAGE - FIRST_PAGE + 1) * MIUCHIZ_PAGE_SIZE, hash);
+        CHECK(memcmp(got->base_hash, hash, sizeof(hash)) == 0, "the base's hash did not read back");
+        miuchiz_sha256(page_of(target, FIRST_PAGE), (size_t)(LAST_PAGE - FIRST_PAGE + 1) * MIUCHIZ_PAGE_SIZE, hash);
+        CHECK(memcmp(got->target_hash, hash, sizeof(hash)) == 0, "the target's hash did not read back");
+        CHECK(patch_page_count(patch) == CHANGED, "%d pages changed, not %d", patch_page_count(patch), CHANGED);
+        for (int i = 0; i < CHANGED && i < patch_page_count(patch); i++) {
+            const struct PatchPage* page = patch_page(patch, i);
+            CHECK(page->page == changed_pages[i] && patch_find(patch, changed_pages[i]) == page
+                  && memcmp(page->data, page_of(target, page->page), MIUCHIZ_PAGE_SIZE) == 0,
+                  "changed page %d did not read back", changed_pages[i]);
+        }
+        for (int pagenum = FIRST_PAGE; pagenum <= LAST_PAGE; pagenum++) {
+            miuchiz_sha256(page_of(base, pagenum), MIUCHIZ_PAGE_SIZE, hash);
+            CHECK(memcmp(patch_base_hash(patch, pagenum), hash, sizeof(hash)) == 0,
+                  "the base's hash of page %d did not read back", pagenum);
+        }
+        CHECK(patch_find(patch, UNCHANGED_PAGE) == NULL, "an unchanged page was found among the changed");
+        patch_close(patch);
+    }
+
+    /* A patch that is not whole is refused: damaged anywhere, cut short,
+     * running long, or not a patch at all. */
+    if (length > 0) {
+        long at[] = { 8, 200, length - 600, length - 1 };
+        for (size_t i = 0; i < sizeof(at) / sizeof(at[0]); i++) {
+            bytes[at[i]] ^= 0x01;
+            CHECK(test_write_file(damaged_path, bytes, (size_t)length) == 0, "could not write the patch");
+            CHECK(read_patch(damaged_path) == NULL && (errno == EINVAL || errno == EILSEQ),
+                  "a patch damaged at byte %ld was read", at[i]);
+            bytes[at[i]] ^= 0x01;
+        }
+        test_write_file(damaged_path, bytes, (size_t)length - 1);
+        CHECK(read_patch(damaged_path) == NULL && errno == EINVAL, "a patch cut short was read");
+        bytes[length] = 0;
+        test_write_file(damaged_path, bytes, (size_t)length + 1);
+        CHECK(read_patch(damaged_path) == NULL && errno == EINVAL, "a patch with bytes after it was read");
+        test_write_file(damaged_path, target, 4096);
+        CHECK(!patch_detect(damaged_path) && read_patch(damaged_path) == NULL && errno == EINVAL,
+              "an image was read as a patch");
+    }
+
+    /* Applied to the base, a patch leaves the target. */
+    int untouched = 0;
+    CHECK(apply(image_path, base, patch_path, 1, after, NULL) == 0, "applying the patch to its base failed");
+    CHECK(memcmp(after, target, FLASH_SIZE) == 0, "applying the patch did not leave the target");
+
+    /* A handheld that does not hold the base is refused, and left as it is. */
+    memcpy(device, base, FLASH_SIZE);
+    test_fill_random(page_of(device, changed_pages[2]), MIUCHIZ_PAGE_SIZE, 0xF0F0);
+    CHECK(apply(image_path, device, patch_path, 0, after, &untouched) != 0,
+          "a patch was applied over a changed page holding neither base nor target");
+    CHECK(untouched && memcmp(after, device, FLASH_SIZE) == 0, "a refused patch wrote to the handheld");
+
+    memcpy(device, base, FLASH_SIZE);
+    page_of(device, UNCHANGED_PAGE)[100] ^= 0x01;
+    CHECK(apply(image_path, device, patch_path, 1, after, &untouched) != 0,
+          "a patch was applied over an unchanged page differing from the base");
+    CHECK(untouched && memcmp(after, device, FLASH_SIZE) == 0, "a refused patch wrote to the handheld");
+
+    /* A handheld whose save page moved on with play still holds the base:
+     * a patch reaching the save page leaves it be if it does not change it,
+     * and overwrites it if it does. */
+    char save_patch_path[300];
+    snprintf(save_patch_path, sizeof(save_patch_path), "%s/save.mzp", dir);
+    memcpy(device, base, FLASH_SIZE);
+    page_of(device, MIUCHIZ_SAVE_PAGE)[100] ^= 0x01;
+    CHECK(write_patch(save_patch_path, FIRST_PAGE, MIUCHIZ_SAVE_PAGE, base, target) == CHANGED,
+          "writing a patch to the save page failed");
+    CHECK(apply(image_path, device, save_patch_path, 1, after, NULL) == 0,
+          "a patch was refused over a handheld whose save page was played on");
+    CHECK(memcmp(after, target, (size_t)MIUCHIZ_SAVE_PAGE * MIUCHIZ_PAGE_SIZE) == 0
+          && memcmp(page_of(after, MIUCHIZ_SAVE_PAGE), page_of(device, MIUCHIZ_SAVE_PAGE), MIUCHIZ_PAGE_SIZE) == 0,
+          "applying over a played save page did not keep it");
+    memcpy(after, target, FLASH_SIZE);
+    memset(page_of(after, MIUCHIZ_SAVE_PAGE), 0x5A, MIUCHIZ_PAGE_SIZE);
+    CHECK(write_patch(save_patch_path, FIRST_PAGE, MIUCHIZ_SAVE_PAGE, base, after) == CHANGED + 1,
+          "writing a patch changing the save page failed");
+    CHECK(apply(image_path, device, save_patch_path, 1, after, NULL) == 0,
+          "a patch changing the save page was refused over a played one");
+    CHECK(memcmp(after, target, (size_t)MIUCHIZ_SAVE_PAGE * MIUCHIZ_PAGE_SIZE) == 0
+          && page_of(after, MIUCHIZ_SAVE_PAGE)[0] == 0x5A,
+          "a patch changing the save page did not overwrite it");
+
+    /* A handheld already holding the target is not written to at all. */
+    CHECK(apply(image_path, target, patch_path, 1, after, &untouched) == 0,
+          "applying a patch already applied failed");
+    CHECK(untouched && memcmp(after, target, FLASH_SIZE) == 0, "a patch already applied was written again");
+
+    /* An apply cut off after its first pages is finished by applying again,
+     * which writes the rest and leaves those be. */
+    memcpy(device, base, FLASH_SIZE);
+    memcpy(page_of(device, changed_pages[0]), page_of(target, changed_pages[0]), MIUCHIZ_PAGE_SIZE);
+    memcpy(page_of(device, changed_pages[1]), page_of(target, changed_pages[1]), MIUCHIZ_PAGE_SIZE);
+    CHECK(apply(image_path, device, patch_path, 1, after, NULL) == 0,
+          "applying again after an interrupted apply failed");
+    CHECK(memcmp(after, target, FLASH_SIZE) == 0, "applying again did not leave the target");
+
+    free(base);
+    free(target);
+    free(device);
+    free(after);
+    free(bytes);
+    test_remove_tree(dir);
+
+    return test_finish();
+}
@@ -0,0 +1,143 @@
+/*
+ * Checks collecting the snapshot store: pages a manifest refers to stay and
+ * the rest go; nothing goes while a snapshot holds the store, whose pages
+ * have no manifest yet; and what a snapshot that never finished left behind
+ * - pages half written, a manifest never put in place - goes with the
+ * pages no manifest refers to.
+ *
+ * Usage: snapshot-store
+ */
+
+#include "snapshot-store.h"
+#include "test-util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define PAGES (4)
+
+static int file_exists(const char* path) {
+    return access(path, F_OK) == 0;
+}
+
+static void page_file(const char* dir, const unsigned char hash[MIUCHIZ_SHA256_SIZE], char* path, size_t n) {
+    char hex[2 * MIUCHIZ_SHA256_SIZE + 1];
+    miuchiz_hex_encode(hash, MIUCHIZ_SHA256_SIZE, hex);
+    snprintf(path, n, "%s/pages/%.2s/%s", dir, hex, hex);
+}
+
+static void touch(const char* path) {
+    FILE* fp = fopen(path, "wb");
+    CHECK(fp != NULL && fputs("left behind", fp) >= 0, "could not write %s", path);
+    if (fp != NULL) {
+        fclose(fp);
+    }
+}
+
+/* Writes a manifest of the first `count` pages, kept in the store. */
+static int write_manifest(struct SnapshotStore* store, const char* name,
+                          unsigned char pages[PAGES][MIUCHIZ_PAGE_SIZE], int count) {
+    struct ContainerInfo info;
+    memset(&info, 0, sizeof(info));
+    strcpy(info.fingerprint, "0123456789abcdef");
+    strcpy(info.tool_version, "test");
+    info.pages.first = 0;
+    info.pages.last = count - 1;
+
+    char* path = snapshot_store_manifest_path(store, name);
+    FILE* fp = path != NULL ? fopen(path, "wb") : NULL;
+    free(path);
+    if (fp == NULL) {
+        return -1;
+    }
+    struct ContainerWriter* writer = container_writer_open(fp, &info, 0);
+    int result = writer != NULL ? 0 : -1;
+    for (int p = 0; result == 0 && p < count; p++) {
+        result = container_writer_page(writer, p, pages[p], CONTAINER_PAGE_STORED);
+    }
+    if (writer != NULL && container_writer_finish(writer) != 0) {
+        result = -1;
+    }
+    if (fclose(fp) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+int main(void) {
+    char dir[64];
+    if (test_scratch_dir("store", dir, sizeof(dir)) != 0) {
+        return 1;
+    }
+
+    static unsigned char pages[PAGES][MIUCHIZ_PAGE_SIZE];
+    unsigned char hashes[PAGES][MIUCHIZ_SHA256_SIZE];
+    char paths[PAGES][512];
+    for (int p = 0; p < PAGES; p++) {
+        for (int i = 0; i < MIUCHIZ_PAGE_SIZE; i++) {
+            pages[p][i] = (unsigned char)(i * (p + 3) + p);
+        }
+        miuchiz_sha256(pages[p], MIUCHIZ_PAGE_SIZE, hashes[p]);
+        page_file(dir, hashes[p], paths[p], sizeof(paths[p]));
+    }
+
+    struct SnapshotStore* store = snapshot_store_open(dir);
+    CHECK(store != NULL, "opening the store failed [%d] %s", errno, strerror(errno));
+    if (store == NULL) {
+        rmdir(dir);
+        return 1;
+    }
+    for (int p = 0; p < PAGES; p++) {
+        CHECK(snapshot_store_put(store, pages[p], hashes[p]) == 1, "putting page %d failed", p);
+    }
+    CHECK(snapshot_store_put(store, pages[0], hashes[0]) == 0, "a page was put twice");
+    CHECK(write_manifest(store, "kept", pages, 2) == 0, "writing the manifest failed");
+
+    /* While a snapshot holds the store, its pages are not collected. */
+    struct SnapshotStore* snapshot = snapshot_store_open(dir);
+    CHECK(snapshot != NULL && snapshot_store_hold(snapshot) == 0, "holding the store failed");
+    int removed = -1;
+    uint64_t freed = 0;
+    CHECK(snapshot_store_collect(store, &removed, &freed) != 0 && errno == EBUSY,
+          "the store was collected while a snapshot held it");
+    for (int p = 0; p < PAGES; p++) {
+        CHECK(file_exists(paths[p]), "page %d was collected while a snapshot held the store", p);
+    }
+
+    /* A snapshot that never finished leaves pages half written and its
+     * manifest; both go once it no longer holds the store. */
+    char tmp[600];
+    char part[600];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", paths[0]);
+    snprintf(part, sizeof(part), "%s/snapshots/unfinished" CONTAINER_EXTENSION ".part", dir);
+    touch(tmp);
+    touch(part);
+    snapshot_store_close(snapshot);
+
+    CHECK(snapshot_store_collect(store, &removed, &freed) == 0, "collecting failed [%d] %s", errno, strerror(errno));
+    CHECK(removed == PAGES - 2, "%d pages collected, not %d", removed, PAGES - 2);
+    CHECK(file_exists(paths[0]) && file_exists(paths[1]), "a page the manifest refers to was collected");
+    CHECK(!file_exists(paths[2]) && !file_exists(paths[3]), "a page no manifest refers to stayed");
+    CHECK(!file_exists(tmp), "a page half written stayed");
+    CHECK(!file_exists(part), "an unfinished manifest stayed");
+
+    /* The store still reads whole. */
+    char* manifest = snapshot_store_manifest_path(store, "kept");
+    struct Container* container = manifest != NULL ? snapshot_store_open_manifest(store, manifest) : NULL;
+    unsigned char page[MIUCHIZ_PAGE_SIZE];
+    CHECK(container != NULL && container_read_page(container, 1, page) == 0
+          && memcmp(page, pages[1], sizeof(page)) == 0,
+          "the kept snapshot did not read back");
+    if (container != NULL) {
+        container_close(container);
+    }
+
+    free(manifest);
+    snapshot_store_close(store);
+    test_remove_tree(dir);
+
+    return test_finish();
+}
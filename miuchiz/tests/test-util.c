@@ -0,0 +1,103 @@
+#include "test-util.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+    #include <dirent.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+#endif
+
+int test_failures = 0;
+
+int test_finish(void) {
+    if (test_failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", test_failures);
+        return 1;
+    }
+    return 0;
+}
+
+#if !defined(_WIN32)
+int test_scratch_dir(const char* name, char* dir, size_t ndir) {
+    int n = snprintf(dir, ndir, "/tmp/miuchiz-%s-XXXXXX", name);
+    if (n < 0 || (size_t)n >= ndir || mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return -1;
+    }
+    return 0;
+}
+
+int test_scratch_home(const char* name, char* dir, size_t ndir) {
+    if (test_scratch_dir(name, dir, ndir) != 0) {
+        return -1;
+    }
+    setenv("MIUCHIZ_REBORN_HOME", dir, 1);
+    return 0;
+}
+
+void test_remove_tree(const char* path) {
+    DIR* dir = opendir(path);
+    if (dir != NULL) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            char child[1024];
+            int n = snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+            struct stat st;
+            if (n < 0 || (size_t)n >= sizeof(child) || lstat(child, &st) != 0) {
+                continue;
+            }
+            if (S_ISDIR(st.st_mode)) {
+                test_remove_tree(child);
+            }
+            else {
+                unlink(child);
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(path);
+}
+#endif
+
+void test_fill_random(unsigned char* data, size_t n, uint32_t seed) {
+    for (size_t i = 0; i < n; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        data[i] = (unsigned char)seed;
+    }
+}
+
+int test_write_file(const char* path, const void* data, size_t n) {
+    FILE* fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+    int ok = fwrite(data, 1, n, fp) == n;
+    return fclose(fp) == 0 && ok ? 0 : -1;
+}
+
+long test_read_file(const char* path, void* data, size_t n) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    size_t length = fread(data, 1, n, fp);
+    fclose(fp);
+    return (long)length;
+}
+
+long test_file_size(const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return -1;
+    }
+    long size = fseek(fp, 0, SEEK_END) == 0 ? ftell(fp) : -1;
+    fclose(fp);
+    return size;
+}